@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "batch.h"
+#include "debug.h"
+#include "peer.h"
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+INTERNAL_LINKAGE
+void
+rx_batch_init(struct rx_batch *rx)
+{
+  int i;
+
+  memset(rx->msgs, 0, sizeof(rx->msgs));
+  for (i = 0; i < BATCH_SIZE; i++) {
+    rx->iov[i].iov_base = rx->buf[i];
+    rx->iov[i].iov_len = BUFSIZE;
+    rx->msgs[i].msg_hdr.msg_iov = &rx->iov[i];
+    rx->msgs[i].msg_hdr.msg_iovlen = 1;
+    rx->msgs[i].msg_hdr.msg_name = &rx->addr[i];
+  }
+  rx->num = 0;
+}
+
+/*
+ * receive up to BATCH_SIZE datagrams in one syscall
+ * returns number of received datagrams, "rx->msgs[i].msg_len" holds length of i-th one
+ */
+INTERNAL_LINKAGE
+int
+rx_batch_recv(struct rx_batch *rx, int sockfd, int flags)
+{
+  int i;
+  int n;
+
+  for (i = 0; i < BATCH_SIZE; i++) {
+    rx->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  }
+
+  n = recvmmsg(sockfd, rx->msgs, BATCH_SIZE, flags, NULL);
+  rx->num = (n > 0) ? n : 0;
+
+  return n;
+}
+
+/*
+ * enable MSG_ZEROCOPY on socket "sockfd"
+ * returns 0 on success or -1 if kernel doesn't support it
+ */
+INTERNAL_LINKAGE
+int
+zc_init(struct zc_state *zc, int sockfd)
+{
+  int optval;
+
+  optval = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &optval, sizeof(optval)) < 0) {
+    d_printf("cannot enable MSG_ZEROCOPY: %s\n", strerror(errno));
+    return -1;
+  }
+
+  memset(zc, 0, sizeof(struct zc_state));
+  pthread_mutex_init(&zc->mutex, NULL);
+  zc->sockfd = sockfd;
+  zc->enabled = 1;
+
+  return 0;
+}
+
+/* read completion notifications from socket's error queue - called with zc->mutex locked */
+INTERNAL_LINKAGE
+void
+zc_reap_locked(struct zc_state *zc)
+{
+  char control[128];
+  uint32_t id;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct sock_extended_err *serr;
+
+  while (1) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(zc->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      break;
+    }
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if ((cm->cmsg_level != SOL_IP) || (cm->cmsg_type != IP_RECVERR)) {
+	continue;
+      }
+      serr = (struct sock_extended_err *)CMSG_DATA(cm);
+      if ((serr->ee_errno != 0) || (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)) {
+	continue;
+      }
+      /* datagrams from ee_info to ee_data (inclusive) are completed */
+      for (id = serr->ee_info;; id++) {
+	if (id - zc->lo < ZC_RING) {
+	  zc->done[id % ZC_RING] = 1;
+	}
+	if (id == serr->ee_data) {
+	  break;
+	}
+      }
+      /* data was copied anyway (e.g. loopback) so zerocopy only costs us the notifications */
+      if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && (zc->enabled != 0)) {
+	d_printf("%s", "kernel copied MSG_ZEROCOPY data - disabling zerocopy\n");
+	zc->enabled = 0;
+      }
+    }
+  }
+
+  while ((zc->lo != zc->next_id) && (zc->done[zc->lo % ZC_RING] != 0)) {
+    zc->done[zc->lo % ZC_RING] = 0;
+    zc->lo++;
+  }
+}
+
+INTERNAL_LINKAGE
+void
+zc_reap(struct zc_state *zc)
+{
+  pthread_mutex_lock(&zc->mutex);
+  zc_reap_locked(zc);
+  pthread_mutex_unlock(&zc->mutex);
+}
+
+/* wait for new completion notifications - called with zc->mutex locked */
+INTERNAL_LINKAGE
+void
+zc_wait_locked(struct zc_state *zc)
+{
+  struct pollfd pfd;
+
+  pthread_mutex_unlock(&zc->mutex);
+  pfd.fd = zc->sockfd;
+  pfd.events = 0; /* POLLERR is always reported */
+  poll(&pfd, 1, 1);
+  pthread_mutex_lock(&zc->mutex);
+  zc_reap_locked(zc);
+}
+
+/* wait until kernel releases buffers of datagrams sent by the last zerocopy flush of "tx" */
+INTERNAL_LINKAGE
+void
+tx_batch_zc_wait(struct tx_batch *tx)
+{
+  uint32_t i;
+  uint32_t id;
+  struct zc_state *zc;
+
+  zc = tx->zc;
+  pthread_mutex_lock(&zc->mutex);
+  zc_reap_locked(zc);
+  i = 0;
+  while (i < tx->zc_count) {
+    id = tx->zc_first + i;
+    if ((id - zc->lo < ZC_RING) && (zc->done[id % ZC_RING] == 0)) {
+      zc_wait_locked(zc);
+      continue;
+    }
+    i++;
+  }
+  tx->zc_count = 0;
+  pthread_mutex_unlock(&zc->mutex);
+}
+
+INTERNAL_LINKAGE
+void
+tx_batch_init(struct tx_batch *tx, int sockfd, struct zc_state *zc)
+{
+  int i;
+
+  memset(tx->msgs, 0, sizeof(tx->msgs));
+  memset(tx->files, 0, sizeof(tx->files));
+  for (i = 0; i < BATCH_SIZE; i++) {
+    tx->iov[i][0].iov_base = tx->buf[i];
+    tx->msgs[i].msg_hdr.msg_iov = tx->iov[i];
+    tx->msgs[i].msg_hdr.msg_iovlen = 1;
+    tx->msgs[i].msg_hdr.msg_name = &tx->addr[i];
+    tx->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  }
+  tx->sockfd = sockfd;
+  tx->num = 0;
+  tx->zc = zc;
+  tx->zc_first = 0;
+  tx->zc_count = 0;
+}
+
+/* return buffer for the next datagram - send all the queued ones first if there is no free slot */
+INTERNAL_LINKAGE
+char *
+tx_batch_slot(struct tx_batch *tx)
+{
+  if (tx->num == BATCH_SIZE) {
+    tx_batch_flush(tx);
+  }
+
+  /* buffers may be still used by kernel if they were sent with MSG_ZEROCOPY */
+  if ((tx->num == 0) && (tx->zc_count > 0)) {
+    tx_batch_zc_wait(tx);
+  }
+
+  return tx->buf[tx->num];
+}
+
+/* queue datagram of "len" bytes prepared in buffer returned by tx_batch_slot() */
+INTERNAL_LINKAGE
+void
+tx_batch_commit(struct tx_batch *tx, int len, struct sockaddr_in *addr)
+{
+  _assert(len <= BUFSIZE, "%s but len has value: %d and BUFSIZE: %d\n", "len should be <= BUFSIZE", len, BUFSIZE);
+
+  tx->iov[tx->num][0].iov_len = len;
+  tx->msgs[tx->num].msg_hdr.msg_iovlen = 1;
+  memcpy(&tx->addr[tx->num], addr, sizeof(struct sockaddr_in));
+  tx->num++;
+}
+
+/*
+ * queue datagram of "len" bytes of headers prepared in buffer returned by tx_batch_slot() followed by
+ * "payload" pointing to mapping of file "f" - the file is referenced until the datagram is sent
+ */
+INTERNAL_LINKAGE
+void
+tx_batch_commit_data(struct tx_batch *tx, int len, struct iovec *payload, struct file_list_entry *f,
+                     struct sockaddr_in *addr)
+{
+  _assert(len + payload->iov_len <= BUFSIZE, "%s but len has value: %zu and BUFSIZE: %d\n",
+          "len should be <= BUFSIZE", len + payload->iov_len, BUFSIZE);
+
+  tx->iov[tx->num][0].iov_len = len;
+  tx->iov[tx->num][1] = *payload;
+  tx->msgs[tx->num].msg_hdr.msg_iovlen = 2;
+  file_entry_get(f);
+  tx->files[tx->num] = f;
+  memcpy(&tx->addr[tx->num], addr, sizeof(struct sockaddr_in));
+  tx->num++;
+}
+
+/*
+ * send queued datagrams with MSG_ZEROCOPY - returns number of datagrams sent,
+ * the rest must be sent without zerocopy: all of them if zerocopy has been
+ * disabled meanwhile, those after ENOBUFS if kernel has too many
+ * notifications not read yet
+ */
+INTERNAL_LINKAGE
+int
+tx_batch_flush_zc(struct tx_batch *tx)
+{
+  int off;
+  int n;
+  struct zc_state *zc;
+
+  zc = tx->zc;
+  pthread_mutex_lock(&zc->mutex);
+  if (zc->enabled == 0) {
+    pthread_mutex_unlock(&zc->mutex);
+    return 0;
+  }
+
+  while (zc->next_id - zc->lo + tx->num > ZC_RING) {
+    zc_wait_locked(zc);
+  }
+
+  /*
+   * ids are given in order of sending so the mutex must be held until all the
+   * datagrams are sent - waiting for notifications would release it and
+   * another batch could take ids in the middle of ours
+   */
+  tx->zc_first = zc->next_id;
+  off = 0;
+  while (off < tx->num) {
+    n = sendmmsg(tx->sockfd, tx->msgs + off, tx->num - off, MSG_ZEROCOPY);
+    if (n < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      if (errno == ENOBUFS) { /* too many notifications not read yet - the rest goes without zerocopy */
+	break;
+      }
+      d_printf("ERROR in sendmmsg: %s\n", strerror(errno));
+      abort();
+    }
+    off += n;
+    zc->next_id += n;
+  }
+  tx->zc_count = off;
+  pthread_mutex_unlock(&zc->mutex);
+
+  return off;
+}
+
+/* send all the queued datagrams */
+INTERNAL_LINKAGE
+void
+tx_batch_flush(struct tx_batch *tx)
+{
+  int off;
+  int n;
+
+  if (tx->num == 0) {
+    return;
+  }
+
+  off = (tx->zc != NULL) ? tx_batch_flush_zc(tx) : 0;
+  while (off < tx->num) {
+    n = sendmmsg(tx->sockfd, tx->msgs + off, tx->num - off, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      d_printf("ERROR in sendmmsg: %s\n", strerror(errno));
+      abort();
+    }
+    off += n;
+  }
+
+  /* kernel holds its own references to pages sent with MSG_ZEROCOPY so the file may be unmapped now */
+  for (n = 0; n < tx->num; n++) {
+    if (tx->files[n] != NULL) {
+      file_entry_put(tx->files[n]);
+      tx->files[n] = NULL;
+    }
+  }
+  tx->num = 0;
+}
+
+/*
+ * check if kernel can segment UDP datagrams on socket "sockfd" (UDP GSO)
+ * returns 1 if it can, 0 otherwise
+ */
+INTERNAL_LINKAGE
+int
+gso_probe(int sockfd)
+{
+  int optval;
+
+  optval = 0; /* don't set default segment size - it is given with every send */
+  if (setsockopt(sockfd, IPPROTO_UDP, UDP_SEGMENT, &optval, sizeof(optval)) < 0) {
+    d_printf("UDP GSO not supported: %s\n", strerror(errno));
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * send buffers "iov" to "addr" with one syscall - kernel cuts them into
+ * datagrams of "seg_size" bytes, only the last one can be shorter
+ * returns result of sendmsg()
+ */
+INTERNAL_LINKAGE
+int
+gso_send(int sockfd, struct sockaddr_in *addr, struct iovec *iov, int iovcnt, uint16_t seg_size)
+{
+  union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  msg.msg_name = addr;
+  msg.msg_namelen = sizeof(struct sockaddr_in);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = IPPROTO_UDP;
+  cm->cmsg_type = UDP_SEGMENT;
+  cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  *(uint16_t *)CMSG_DATA(cm) = seg_size;
+
+  return sendmsg(sockfd, &msg, 0);
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include "net.h"
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define BATCH_SIZE 32  /* max number of datagrams received or sent by one syscall */
+#define ZC_RING    4096 /* max number of MSG_ZEROCOPY datagrams waiting for completion */
+
+#define GSO_MAX_SEGS 64    /* max number of datagrams in one UDP_SEGMENT send - UDP_MAX_SEGMENTS of linux */
+#define GSO_MAX_SIZE 65000 /* max length of all the datagrams in one UDP_SEGMENT send */
+
+struct file_list_entry;
+
+/* datagrams received by one recvmmsg() call */
+struct rx_batch {
+  int num; /* number of received datagrams */
+  struct mmsghdr msgs[BATCH_SIZE];
+  struct iovec iov[BATCH_SIZE];
+  struct sockaddr_in addr[BATCH_SIZE];
+  char buf[BATCH_SIZE][BUFSIZE];
+};
+
+/*
+ * MSG_ZEROCOPY bookkeeping of one socket, shared by all the tx batches sending through it
+ * kernel numbers every datagram sent with MSG_ZEROCOPY and reports ranges of completed ones
+ * on socket's error queue - until then the datagram's buffers must not be modified
+ */
+struct zc_state {
+  pthread_mutex_t mutex;
+  int sockfd;
+  int enabled;      /* cleared when kernel reports that it had to copy the data anyway */
+  uint32_t next_id; /* id of the next datagram sent */
+  uint32_t lo;      /* all the datagrams with id < lo are completed */
+  uint8_t done[ZC_RING];
+};
+
+/* datagrams (possibly for different peers) waiting to be sent by one sendmmsg() call */
+struct tx_batch {
+  int sockfd;
+  int num; /* number of queued datagrams */
+  struct mmsghdr msgs[BATCH_SIZE];
+  struct iovec iov[BATCH_SIZE][2]; /* [0]: headers in "buf", [1]: optional chunk contents */
+  struct file_list_entry *files[BATCH_SIZE]; /* files referenced by iov[i][1], released after sending */
+  struct sockaddr_in addr[BATCH_SIZE];
+  char buf[BATCH_SIZE][BUFSIZE];
+  struct zc_state *zc; /* NULL if MSG_ZEROCOPY is not used */
+  uint32_t zc_first;   /* id of first datagram of the last zerocopy flush */
+  uint32_t zc_count;   /* number of datagrams of the last zerocopy flush which may be still in use */
+};
+
+void rx_batch_init(struct rx_batch * /*rx*/);
+int rx_batch_recv(struct rx_batch * /*rx*/, int /*sockfd*/, int /*flags*/);
+void tx_batch_init(struct tx_batch * /*tx*/, int /*sockfd*/, struct zc_state * /*zc*/);
+char *tx_batch_slot(struct tx_batch * /*tx*/);
+void tx_batch_commit(struct tx_batch * /*tx*/, int /*len*/, struct sockaddr_in * /*addr*/);
+void tx_batch_commit_data(struct tx_batch * /*tx*/, int /*len*/, struct iovec * /*payload*/,
+                          struct file_list_entry * /*f*/, struct sockaddr_in * /*addr*/);
+void tx_batch_flush(struct tx_batch * /*tx*/);
+int zc_init(struct zc_state * /*zc*/, int /*sockfd*/);
+void zc_reap(struct zc_state * /*zc*/);
+int gso_probe(int /*sockfd*/);
+int gso_send(int /*sockfd*/, struct sockaddr_in * /*addr*/, struct iovec * /*iov*/, int /*iovcnt*/,
+             uint16_t /*seg_size*/);
+
+#endif /* _BATCH_H_ */
@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * BLAKE3 with 32-byte output, for Merkle trees negotiated between Peregrine
+ * peers
+ *
+ * BLAKE3 splits the message into 1024-byte chunks, every chunk is hashed
+ * on its own and the chaining values are combined in a binary tree. With
+ * the default chunk size every Merkle tree leaf is exactly one BLAKE3 chunk
+ * and every parent node (64 bytes) is a single block, so like multi-buffer
+ * SHA-1 the messages are hashed one per 32-bit vector lane. Messages longer
+ * than a chunk are hashed one after another, with their chunks spread over
+ * the lanes instead.
+ *
+ * The kernels are instances of one template (blake3_kernel.h) built for
+ * 16 (AVX-512), 8 (AVX2) and 4 lanes. The widest kernel the CPU supports
+ * and which passes the self-test is used, the 4-lane one always works.
+ */
+
+#include "blake3.h"
+#include "debug.h"
+#include "peer.h"
+#include "sha1_backend.h"
+#include <endian.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BLAKE3_X86 1
+#endif
+
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END   2
+#define BLAKE3_PARENT      4
+#define BLAKE3_ROOT        8
+
+/* deep enough for 2^54 chunks */
+#define BLAKE3_MAX_DEPTH 54
+
+#define BLAKE3_SELFTEST_LEN 2049
+
+static const uint32_t blake3_iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+/* message word order for each of the 7 rounds */
+static const uint8_t blake3_schedule[7][16] = {
+  {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+  {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+  {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+  {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+  {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+  {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+  {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+#define BLAKE3_NAME  blake3_x4
+#define BLAKE3_LANES 4
+#define BLAKE3_ATTR
+#include "blake3_kernel.h"
+#undef BLAKE3_NAME
+#undef BLAKE3_LANES
+#undef BLAKE3_ATTR
+
+#if BLAKE3_X86
+#define BLAKE3_NAME  blake3_avx2
+#define BLAKE3_LANES 8
+#define BLAKE3_ATTR  __attribute__((target("avx2")))
+#include "blake3_kernel.h"
+#undef BLAKE3_NAME
+#undef BLAKE3_LANES
+#undef BLAKE3_ATTR
+
+#define BLAKE3_NAME  blake3_avx512
+#define BLAKE3_LANES 16
+#define BLAKE3_ATTR  __attribute__((target("avx512f")))
+#include "blake3_kernel.h"
+#undef BLAKE3_NAME
+#undef BLAKE3_LANES
+#undef BLAKE3_ATTR
+#endif
+
+/* candidates in order of preference */
+static const struct blake3_backend blake3_backends[] = {
+#if BLAKE3_X86
+  {"avx512", 16, cpu_avx512, blake3_avx512},
+  {"avx2", 8, cpu_avx2, blake3_avx2},
+#endif
+  {"x4", 4, cpu_any, blake3_x4},
+};
+
+static const struct blake3_backend *blake3_backend = &blake3_backends[sizeof(blake3_backends) /
+								      sizeof(blake3_backends[0]) - 1];
+static pthread_once_t blake3_once = PTHREAD_ONCE_INIT;
+
+/*
+ * single block compression for parent nodes and for a lone chunk, the same
+ * arithmetic as the kernels without the vector registers
+ */
+INTERNAL_LINKAGE
+void
+blake3_compress(const uint32_t *cv, const uint8_t *block, size_t block_len, uint64_t counter, uint32_t flags,
+                uint32_t *out)
+{
+  int i;
+  int r;
+  uint32_t m[16];
+  uint32_t v[16];
+  uint8_t buf[64];
+
+#define B3_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define B3_G(a, b, c, d, x, y)                                                                                 \
+  do {                                                                                                         \
+    v[a] = v[a] + v[b] + m[blake3_schedule[r][x]];                                                             \
+    v[d] = B3_ROR(v[d] ^ v[a], 16);                                                                            \
+    v[c] = v[c] + v[d];                                                                                        \
+    v[b] = B3_ROR(v[b] ^ v[c], 12);                                                                            \
+    v[a] = v[a] + v[b] + m[blake3_schedule[r][y]];                                                             \
+    v[d] = B3_ROR(v[d] ^ v[a], 8);                                                                             \
+    v[c] = v[c] + v[d];                                                                                        \
+    v[b] = B3_ROR(v[b] ^ v[c], 7);                                                                             \
+  } while (0)
+
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, block, block_len);
+  for (i = 0; i < 16; i++) {
+    memcpy(&m[i], buf + 4 * i, 4);
+    m[i] = le32toh(m[i]);
+  }
+
+  for (i = 0; i < 8; i++) {
+    v[i] = cv[i];
+  }
+  for (i = 0; i < 4; i++) {
+    v[8 + i] = blake3_iv[i];
+  }
+  v[12] = (uint32_t)counter;
+  v[13] = (uint32_t)(counter >> 32);
+  v[14] = (uint32_t)block_len;
+  v[15] = flags;
+
+  for (r = 0; r < 7; r++) {
+    B3_G(0, 4, 8, 12, 0, 1);
+    B3_G(1, 5, 9, 13, 2, 3);
+    B3_G(2, 6, 10, 14, 4, 5);
+    B3_G(3, 7, 11, 15, 6, 7);
+    B3_G(0, 5, 10, 15, 8, 9);
+    B3_G(1, 6, 11, 12, 10, 11);
+    B3_G(2, 7, 8, 13, 12, 13);
+    B3_G(3, 4, 9, 14, 14, 15);
+  }
+
+  for (i = 0; i < 8; i++) {
+    out[i] = v[i] ^ v[i + 8];
+  }
+
+#undef B3_G
+#undef B3_ROR
+}
+
+/*
+ * chaining value (or the root hash, with BLAKE3_ROOT in "flags") of parent
+ * node with children "left" and "right", 32 bytes each
+ */
+INTERNAL_LINKAGE
+void
+blake3_parent(const uint8_t *left, const uint8_t *right, uint32_t flags, uint8_t *out)
+{
+  int i;
+  uint8_t block[64];
+  uint32_t cv[8];
+
+  memcpy(block, left, 32);
+  memcpy(block + 32, right, 32);
+  blake3_compress(blake3_iv, block, 64, 0, BLAKE3_PARENT | flags, cv);
+  for (i = 0; i < 8; i++) {
+    cv[i] = htole32(cv[i]);
+  }
+  memcpy(out, cv, 32);
+}
+
+/*
+ * hash message longer than one chunk - full chunks go through the kernel
+ * "lanes" at a time, their chaining values are merged on a stack as soon as
+ * a subtree is complete, like the reference implementation does
+ */
+INTERNAL_LINKAGE
+void
+blake3_tree(const struct blake3_backend *be, const uint8_t *msg, size_t len, uint8_t *digest)
+{
+  int j;
+  int k;
+  int depth;
+  uint64_t c;
+  uint64_t i;
+  uint64_t total;
+  uint8_t cv[32];
+  uint8_t cvs[BLAKE3_MAX_LANES * 32];
+  uint8_t stack[BLAKE3_MAX_DEPTH][32];
+  const uint8_t *ptr[BLAKE3_MAX_LANES];
+
+  c = (len + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN;
+  depth = 0;
+
+  /* all the chunks but the last one are full */
+  for (i = 0; i < c - 1; i += k) {
+    k = c - 1 - i > (uint64_t)be->lanes ? be->lanes : (int)(c - 1 - i);
+    for (j = 0; j < be->lanes; j++) {
+      ptr[j] = msg + BLAKE3_CHUNK_LEN * (i + (j < k ? j : 0));
+    }
+    be->hash_many(ptr, BLAKE3_CHUNK_LEN, i, 1, 0, BLAKE3_CHUNK_START, BLAKE3_CHUNK_END, cvs);
+    for (j = 0; j < k; j++) {
+      memcpy(cv, cvs + 32 * j, 32);
+      for (total = i + j + 1; (total & 1) == 0; total >>= 1) {
+	blake3_parent(stack[--depth], cv, 0, cv);
+      }
+      memcpy(stack[depth++], cv, 32);
+    }
+  }
+
+  for (j = 0; j < BLAKE3_MAX_LANES; j++) {
+    ptr[j] = msg + BLAKE3_CHUNK_LEN * (c - 1);
+  }
+  be->hash_many(ptr, len - BLAKE3_CHUNK_LEN * (c - 1), c - 1, 0, 0, BLAKE3_CHUNK_START, BLAKE3_CHUNK_END, cvs);
+  memcpy(cv, cvs, 32);
+
+  while (depth > 1) {
+    blake3_parent(stack[--depth], cv, 0, cv);
+  }
+  blake3_parent(stack[0], cv, BLAKE3_ROOT, digest);
+}
+
+/*
+ * hash messages with given backend, "n" can be anything
+ */
+INTERNAL_LINKAGE
+void
+blake3_hash(const struct blake3_backend *be, const uint8_t *const *msgs, size_t len, int n, uint8_t *digests)
+{
+  int i;
+  int j;
+  int k;
+  uint8_t out[BLAKE3_MAX_LANES * 32];
+  const uint8_t *ptr[BLAKE3_MAX_LANES];
+
+  if (len > BLAKE3_CHUNK_LEN) {
+    for (i = 0; i < n; i++) {
+      blake3_tree(be, msgs[i], len, digests + BLAKE3_HASH_SIZE * i);
+    }
+    return;
+  }
+
+  /* every message is a single chunk - one message per lane, unused lanes repeat the first one */
+  for (i = 0; i < n; i += k) {
+    k = n - i > be->lanes ? be->lanes : n - i;
+    for (j = 0; j < be->lanes; j++) {
+      ptr[j] = msgs[i + (j < k ? j : 0)];
+    }
+    be->hash_many(ptr, len, 0, 0, 0, BLAKE3_CHUNK_START, BLAKE3_CHUNK_END | BLAKE3_ROOT, out);
+    memcpy(digests + BLAKE3_HASH_SIZE * i, out, BLAKE3_HASH_SIZE * k);
+  }
+}
+
+/*
+ * compare results of the backend with the official test vectors (input
+ * byte i is i % 251) for lengths around the chunk boundaries
+ *
+ * returns 0 if the backend gives correct results
+ */
+INTERNAL_LINKAGE
+int
+blake3_selftest(const struct blake3_backend *be)
+{
+  int i;
+  int l;
+  uint8_t msg[BLAKE3_SELFTEST_LEN];
+  uint8_t digests[BLAKE3_MAX_LANES * BLAKE3_HASH_SIZE];
+  const uint8_t *msgs[BLAKE3_MAX_LANES];
+  static const struct {
+    size_t len;
+    uint8_t digest[BLAKE3_HASH_SIZE];
+  } vectors[] = {
+    {0,
+     {0xaf, 0x13, 0x49, 0xb9, 0xf5, 0xf9, 0xa1, 0xa6, 0xa0, 0x40, 0x4d, 0xea, 0x36, 0xdc, 0xc9, 0x49,
+      0x9b, 0xcb, 0x25, 0xc9, 0xad, 0xc1, 0x12, 0xb7, 0xcc, 0x9a, 0x93, 0xca, 0xe4, 0x1f, 0x32, 0x62}},
+    {1,
+     {0x2d, 0x3a, 0xde, 0xdf, 0xf1, 0x1b, 0x61, 0xf1, 0x4c, 0x88, 0x6e, 0x35, 0xaf, 0xa0, 0x36, 0x73,
+      0x6d, 0xcd, 0x87, 0xa7, 0x4d, 0x27, 0xb5, 0xc1, 0x51, 0x02, 0x25, 0xd0, 0xf5, 0x92, 0xe2, 0x13}},
+    {1023,
+     {0x10, 0x10, 0x89, 0x70, 0xee, 0xda, 0x3e, 0xb9, 0x32, 0xba, 0xac, 0x14, 0x28, 0xc7, 0xa2, 0x16,
+      0x3b, 0x0e, 0x92, 0x4c, 0x9a, 0x9e, 0x25, 0xb3, 0x5b, 0xba, 0x72, 0xb2, 0x8f, 0x70, 0xbd, 0x11}},
+    {1024,
+     {0x42, 0x21, 0x47, 0x39, 0xf0, 0x95, 0xa4, 0x06, 0xf3, 0xfc, 0x83, 0xde, 0xb8, 0x89, 0x74, 0x4a,
+      0xc0, 0x0d, 0xf8, 0x31, 0xc1, 0x0d, 0xaa, 0x55, 0x18, 0x9b, 0x5d, 0x12, 0x1c, 0x85, 0x5a, 0xf7}},
+    {1025,
+     {0xd0, 0x02, 0x78, 0xae, 0x47, 0xeb, 0x27, 0xb3, 0x4f, 0xae, 0xcf, 0x67, 0xb4, 0xfe, 0x26, 0x3f,
+      0x82, 0xd5, 0x41, 0x29, 0x16, 0xc1, 0xff, 0xd9, 0x7c, 0x8c, 0xb7, 0xfb, 0x81, 0x4b, 0x84, 0x44}},
+    {2049,
+     {0x5f, 0x4d, 0x72, 0xf4, 0x0d, 0x7a, 0x5f, 0x82, 0xb1, 0x5c, 0xa2, 0xb2, 0xe4, 0x4b, 0x1d, 0xe3,
+      0xc2, 0xef, 0x86, 0xc4, 0x26, 0xc9, 0x5c, 0x1a, 0xf0, 0xb6, 0x87, 0x95, 0x22, 0x56, 0x30, 0x30}},
+  };
+
+  for (i = 0; i < (int)sizeof(msg); i++) {
+    msg[i] = i % 251;
+  }
+  for (i = 0; i < BLAKE3_MAX_LANES; i++) {
+    msgs[i] = msg;
+  }
+
+  for (l = 0; l < (int)(sizeof(vectors) / sizeof(vectors[0])); l++) {
+    /* one lane less than the kernel has checks handling of unused lanes */
+    blake3_hash(be, msgs, vectors[l].len, be->lanes - (l & 1), digests);
+    for (i = 0; i < be->lanes - (l & 1); i++) {
+      if (memcmp(vectors[l].digest, digests + BLAKE3_HASH_SIZE * i, BLAKE3_HASH_SIZE) != 0) {
+	return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+INTERNAL_LINKAGE
+void
+blake3_select(void)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(blake3_backends) / sizeof(blake3_backends[0]); i++) {
+    if (!blake3_backends[i].supported()) {
+      continue;
+    }
+    if (blake3_selftest(&blake3_backends[i]) != 0) {
+      d_printf("BLAKE3 backend %s failed self-test, skipping it\n", blake3_backends[i].name);
+      continue;
+    }
+    blake3_backend = &blake3_backends[i];
+    break;
+  }
+  d_printf("using BLAKE3 backend: %s\n", blake3_backend->name);
+}
+
+/*
+ * select BLAKE3 kernel for this CPU, only the first call does the work
+ */
+INTERNAL_LINKAGE
+void
+blake3_init(void)
+{
+  pthread_once(&blake3_once, blake3_select);
+}
+
+/*
+ * returns number of messages hashed at once - callers should batch at least
+ * that many messages for blake3_mb()
+ */
+INTERNAL_LINKAGE
+int
+blake3_lanes(void)
+{
+  blake3_init();
+  return blake3_backend->lanes;
+}
+
+/*
+ * compute BLAKE3 digests of "n" messages, all of them "len" bytes long
+ * digest of msgs[i] is stored at digests + 32 * i
+ */
+INTERNAL_LINKAGE
+void
+blake3_mb(const uint8_t *const *msgs, size_t len, int n, uint8_t *digests)
+{
+  blake3_init();
+  blake3_hash(blake3_backend, msgs, len, n, digests);
+}
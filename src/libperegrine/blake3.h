@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BLAKE3_H_
+#define _BLAKE3_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_HASH_SIZE 32
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_LANES 16
+
+/* multi-lane BLAKE3 kernel, see blake3_kernel.h */
+typedef void (*blake3_kernel_fn)(const uint8_t *const * /*inputs*/, size_t /*len*/, uint64_t /*counter*/,
+                                 int /*increment*/, uint8_t /*flags*/, uint8_t /*flags_start*/,
+                                 uint8_t /*flags_end*/, uint8_t * /*out*/);
+
+struct blake3_backend {
+  const char *name;
+  int lanes;
+  int (*supported)(void); /* returns 1 if the CPU can run this backend */
+  blake3_kernel_fn hash_many;
+};
+
+void blake3_init(void);
+int blake3_lanes(void);
+void blake3_mb(const uint8_t *const * /*msgs*/, size_t /*len*/, int /*n*/, uint8_t * /*digests*/);
+
+#endif /* _BLAKE3_H_ */
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * multi-lane BLAKE3 kernel template, included by blake3.c once for every
+ * vector width - before including define:
+ *
+ * BLAKE3_NAME  - name of the generated function
+ * BLAKE3_LANES - number of 32-bit lanes, it is also number of inputs
+ *                hashed at once
+ * BLAKE3_ATTR  - function attributes selecting instruction set
+ *
+ * Generated function compresses BLAKE3_LANES inputs, "len" bytes each (at
+ * most one BLAKE3 chunk - 1024 bytes), starting with the IV as the key.
+ * Input "j" gets block counter "counter + j" when "increment" is set and
+ * "counter" otherwise. Every block carries "flags", the first one also
+ * "flags_start" and the last one "flags_end". 32-byte output of input "j"
+ * is stored at out + 32 * j.
+ */
+
+BLAKE3_ATTR INTERNAL_LINKAGE
+void
+BLAKE3_NAME(const uint8_t *const *inputs, size_t len, uint64_t counter, int increment, uint8_t flags,
+            uint8_t flags_start, uint8_t flags_end, uint8_t *out)
+{
+  typedef uint32_t vec_t __attribute__((vector_size(BLAKE3_LANES * 4)));
+  int i;
+  int j;
+  int r;
+  size_t b;
+  size_t nblocks;
+  size_t block_len;
+  uint32_t word[BLAKE3_LANES];
+  uint8_t tail[BLAKE3_LANES][64];
+  const uint8_t *src[BLAKE3_LANES];
+  uint32_t block_flags;
+  vec_t h[8];
+  vec_t m[16];
+  vec_t v[16];
+  vec_t ctr_lo;
+  vec_t ctr_hi;
+  vec_t zero = {0};
+
+#define B3_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define B3_G(a, b, c, d, x, y)                                                                                 \
+  do {                                                                                                         \
+    v[a] = v[a] + v[b] + m[blake3_schedule[r][x]];                                                             \
+    v[d] = B3_ROR(v[d] ^ v[a], 16);                                                                            \
+    v[c] = v[c] + v[d];                                                                                        \
+    v[b] = B3_ROR(v[b] ^ v[c], 12);                                                                            \
+    v[a] = v[a] + v[b] + m[blake3_schedule[r][y]];                                                             \
+    v[d] = B3_ROR(v[d] ^ v[a], 8);                                                                             \
+    v[c] = v[c] + v[d];                                                                                        \
+    v[b] = B3_ROR(v[b] ^ v[c], 7);                                                                             \
+  } while (0)
+
+  for (i = 0; i < 8; i++) {
+    for (j = 0; j < BLAKE3_LANES; j++) {
+      word[j] = blake3_iv[i];
+    }
+    memcpy(&h[i], word, sizeof(word));
+  }
+  for (j = 0; j < BLAKE3_LANES; j++) {
+    word[j] = (uint32_t)(counter + (increment ? j : 0));
+  }
+  memcpy(&ctr_lo, word, sizeof(word));
+  for (j = 0; j < BLAKE3_LANES; j++) {
+    word[j] = (uint32_t)((counter + (increment ? j : 0)) >> 32);
+  }
+  memcpy(&ctr_hi, word, sizeof(word));
+
+  nblocks = len == 0 ? 1 : (len + 63) / 64;
+  for (b = 0; b < nblocks; b++) {
+    block_len = len - b * 64 < 64 ? len - b * 64 : 64;
+    block_flags = flags;
+    if (b == 0) {
+      block_flags |= flags_start;
+    }
+    if (b == nblocks - 1) {
+      block_flags |= flags_end;
+    }
+
+    /* transpose the message words, the last block is padded with zeros */
+    for (j = 0; j < BLAKE3_LANES; j++) {
+      src[j] = inputs[j] + b * 64;
+      if (block_len < 64) {
+	memset(tail[j], 0, sizeof(tail[j]));
+	memcpy(tail[j], src[j], block_len);
+	src[j] = tail[j];
+      }
+    }
+    for (i = 0; i < 16; i++) {
+      for (j = 0; j < BLAKE3_LANES; j++) {
+	memcpy(&word[j], src[j] + 4 * i, 4);
+	word[j] = le32toh(word[j]);
+      }
+      memcpy(&m[i], word, sizeof(word));
+    }
+
+    for (i = 0; i < 8; i++) {
+      v[i] = h[i];
+    }
+    for (i = 0; i < 4; i++) {
+      v[8 + i] = zero + blake3_iv[i];
+    }
+    v[12] = ctr_lo;
+    v[13] = ctr_hi;
+    v[14] = zero + (uint32_t)block_len;
+    v[15] = zero + block_flags;
+
+    for (r = 0; r < 7; r++) {
+      B3_G(0, 4, 8, 12, 0, 1);
+      B3_G(1, 5, 9, 13, 2, 3);
+      B3_G(2, 6, 10, 14, 4, 5);
+      B3_G(3, 7, 11, 15, 6, 7);
+      B3_G(0, 5, 10, 15, 8, 9);
+      B3_G(1, 6, 11, 12, 10, 11);
+      B3_G(2, 7, 8, 13, 12, 13);
+      B3_G(3, 4, 9, 14, 14, 15);
+    }
+
+    for (i = 0; i < 8; i++) {
+      h[i] = v[i] ^ v[i + 8];
+    }
+  }
+
+  for (i = 0; i < 8; i++) {
+    memcpy(word, &h[i], sizeof(word));
+    for (j = 0; j < BLAKE3_LANES; j++) {
+      word[j] = htole32(word[j]);
+      memcpy(out + 32 * j + 4 * i, &word[j], 4);
+    }
+  }
+
+#undef B3_G
+#undef B3_ROR
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cc.h"
+#include "debug.h"
+#include "peer.h"
+#include "peregrine_seeder.h"
+#include "window.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * no congestion control - window is always as large as set in seeder
+ * parameters
+ */
+INTERNAL_LINKAGE
+void
+cc_none_init(struct peer *p)
+{
+  p->cwnd = p->win_size * CC_SCALE;
+}
+
+INTERNAL_LINKAGE
+void
+cc_none_on_delay(struct peer *p, int64_t delay_us)
+{
+  (void)p;
+  (void)delay_us;
+}
+
+INTERNAL_LINKAGE
+void
+cc_none_on_ack(struct peer *p, uint32_t acked)
+{
+  (void)p;
+  (void)acked;
+}
+
+INTERNAL_LINKAGE
+void
+cc_none_on_loss(struct peer *p)
+{
+  (void)p;
+}
+
+/*
+ * LEDBAT, RFC 6817
+ *
+ * Delay samples reported by leecher include difference between clocks of both
+ * hosts, so the lowest sample seen in last LEDBAT_BASE_HISTORY minutes is
+ * taken as base delay and everything above it as queuing delay caused by our
+ * own traffic (or others sharing the bottleneck). The window grows while the
+ * queuing delay is below LEDBAT_TARGET_US and shrinks above it, so bulk
+ * transfer yields to interactive traffic as soon as it starts to fill queues.
+ */
+INTERNAL_LINKAGE
+void
+ledbat_init(struct peer *p)
+{
+  int i;
+
+  for (i = 0; i < LEDBAT_BASE_HISTORY; i++) {
+    p->ledbat.base_history[i] = INT64_MAX;
+  }
+  for (i = 0; i < LEDBAT_CURRENT_FILTER; i++) {
+    p->ledbat.cur_delays[i] = INT64_MAX;
+  }
+  p->ledbat.base_idx = 0;
+  p->ledbat.cur_idx = 0;
+  p->ledbat.base_minute = window_now_us() / LEDBAT_BASE_MINUTE_US;
+  p->cwnd = LEDBAT_INIT_CWND * CC_SCALE;
+}
+
+INTERNAL_LINKAGE
+void
+ledbat_on_delay(struct peer *p, int64_t delay_us)
+{
+  uint64_t minute;
+  struct ledbat_state *l;
+
+  l = &p->ledbat;
+
+  /* base delay - minimum of one minute long intervals */
+  minute = window_now_us() / LEDBAT_BASE_MINUTE_US;
+  if (minute != l->base_minute) {
+    l->base_minute = minute;
+    l->base_idx = (l->base_idx + 1) % LEDBAT_BASE_HISTORY;
+    l->base_history[l->base_idx] = delay_us;
+  } else if (delay_us < l->base_history[l->base_idx]) {
+    l->base_history[l->base_idx] = delay_us;
+  }
+
+  /* current delay - filtered with minimum of last samples */
+  l->cur_delays[l->cur_idx] = delay_us;
+  l->cur_idx = (l->cur_idx + 1) % LEDBAT_CURRENT_FILTER;
+}
+
+/* current queuing delay or -1 if there are no delay samples yet */
+INTERNAL_LINKAGE
+int64_t
+ledbat_queuing_delay(struct peer *p)
+{
+  int i;
+  int64_t base;
+  int64_t cur;
+
+  base = INT64_MAX;
+  for (i = 0; i < LEDBAT_BASE_HISTORY; i++) {
+    if (p->ledbat.base_history[i] < base) {
+      base = p->ledbat.base_history[i];
+    }
+  }
+  cur = INT64_MAX;
+  for (i = 0; i < LEDBAT_CURRENT_FILTER; i++) {
+    if (p->ledbat.cur_delays[i] < cur) {
+      cur = p->ledbat.cur_delays[i];
+    }
+  }
+
+  if ((base == INT64_MAX) || (cur == INT64_MAX)) {
+    return -1;
+  }
+
+  return cur - base;
+}
+
+INTERNAL_LINKAGE
+void
+ledbat_on_ack(struct peer *p, uint32_t acked)
+{
+  int64_t cwnd;
+  int64_t max_cwnd;
+  int64_t off_target;
+  int64_t queuing_delay;
+
+  queuing_delay = ledbat_queuing_delay(p);
+  if (queuing_delay < 0) {
+    queuing_delay = 0;
+  }
+
+  /* off_target is in <-TARGET, TARGET> - don't shrink faster than by GAIN chunks per RTT */
+  off_target = LEDBAT_TARGET_US - queuing_delay;
+  if (off_target < -LEDBAT_TARGET_US) {
+    off_target = -LEDBAT_TARGET_US;
+  }
+
+  /* cwnd += GAIN * off_target / TARGET * acked / cwnd, everything in 1/CC_SCALE of chunk */
+  cwnd = p->cwnd;
+  cwnd += LEDBAT_GAIN * off_target * acked * CC_SCALE * CC_SCALE / (LEDBAT_TARGET_US * cwnd);
+
+  /* don't let window grow while we don't use it */
+  max_cwnd = (int64_t)(p->win_next - p->win_base + LEDBAT_ALLOWED_INC) * CC_SCALE;
+  if (cwnd > max_cwnd) {
+    cwnd = max_cwnd;
+  }
+  if (cwnd < LEDBAT_MIN_CWND * CC_SCALE) {
+    cwnd = LEDBAT_MIN_CWND * CC_SCALE;
+  }
+  if (cwnd > (int64_t)p->win_size * CC_SCALE) {
+    cwnd = (int64_t)p->win_size * CC_SCALE;
+  }
+
+  p->cwnd = cwnd;
+}
+
+INTERNAL_LINKAGE
+void
+ledbat_on_loss(struct peer *p)
+{
+  p->cwnd /= 2;
+  if (p->cwnd < LEDBAT_MIN_CWND * CC_SCALE) {
+    p->cwnd = LEDBAT_MIN_CWND * CC_SCALE;
+  }
+  d_printf("loss - cwnd reduced to %u/%u chunks\n", p->cwnd, CC_SCALE);
+}
+
+/* indexed by peregrine_cc_t */
+static const struct cc_ops cc_table[] = {
+  {"none", cc_none_init, cc_none_on_delay, cc_none_on_ack, cc_none_on_loss},
+  {"ledbat", ledbat_init, ledbat_on_delay, ledbat_on_ack, ledbat_on_loss},
+};
+
+INTERNAL_LINKAGE
+const struct cc_ops *
+cc_get(uint8_t type)
+{
+  if (type >= sizeof(cc_table) / sizeof(cc_table[0])) {
+    type = PEREGRINE_CC_NONE;
+  }
+
+  return &cc_table[type];
+}
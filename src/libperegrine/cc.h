@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _CC_H_
+#define _CC_H_
+
+#include "peer.h"
+#include <stdint.h>
+
+#define CC_SCALE 256 /* peer.cwnd is kept in 1/CC_SCALE of chunk */
+
+/* LEDBAT parameters, RFC 6817 */
+#define LEDBAT_TARGET_US      100000 /* target queuing delay, the RFC allows at most 100 ms */
+#define LEDBAT_GAIN           1      /* cwnd grows by at most GAIN chunks per RTT */
+#define LEDBAT_INIT_CWND      2      /* [chunks] */
+#define LEDBAT_MIN_CWND       2      /* [chunks] */
+#define LEDBAT_ALLOWED_INC    1      /* cwnd may exceed chunks in flight by this number of chunks */
+#define LEDBAT_BASE_MINUTE_US 60000000
+
+/*
+ * congestion controller of seeder's send window
+ * all the callbacks are called with the peer (leecher) locked, they size p->cwnd
+ */
+struct cc_ops {
+  const char *name;
+  void (*init)(struct peer * /*p*/);
+  void (*on_delay)(struct peer * /*p*/, int64_t /*delay_us*/); /* one-way delay sample taken from ACK */
+  void (*on_ack)(struct peer * /*p*/, uint32_t /*acked*/);      /* "acked" chunks confirmed for the first time */
+  void (*on_loss)(struct peer * /*p*/);                         /* retransmission timeout */
+};
+
+const struct cc_ops *cc_get(uint8_t /*type*/);
+
+#endif /* _CC_H_ */
@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "download_sched.h"
+#include "debug.h"
+#include "peer.h"
+#include "peregrine_leecher.h"
+#include "window.h"
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* chunk "c" is still free and seeder "p" has it */
+INTERNAL_LINKAGE
+int
+sched_wanted(struct peer *local_peer, struct peer *p, uint64_t c)
+{
+  int i;
+
+  if (local_peer->sched_map[c] != SCHED_FREE) {
+    return 0;
+  }
+  if ((p->num_have_cache == 0) || local_peer->sched_any_have) { /* seeder hasn't told what it has - try anyway */
+    return 1;
+  }
+  for (i = 0; i < p->num_have_cache; i++) {
+    if ((c >= p->have_cache[i].start_chunk) && (c <= p->have_cache[i].end_chunk)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* first chunk from "c" on which seeder "p" has */
+INTERNAL_LINKAGE
+uint64_t
+sched_have_next(struct peer *local_peer, struct peer *p, uint64_t c)
+{
+  int i;
+  uint64_t next;
+
+  if ((p->num_have_cache == 0) || local_peer->sched_any_have) {
+    return c;
+  }
+  next = local_peer->nc;
+  for (i = 0; i < p->num_have_cache; i++) {
+    if ((c >= p->have_cache[i].start_chunk) && (c <= p->have_cache[i].end_chunk)) {
+      return c;
+    }
+    if ((p->have_cache[i].start_chunk > c) && (p->have_cache[i].start_chunk < next)) {
+      next = p->have_cache[i].start_chunk;
+    }
+  }
+
+  return next;
+}
+
+/* move "sched_first" to the first free chunk - chunks before it are all taken */
+INTERNAL_LINKAGE
+void
+sched_skip_taken(struct peer *local_peer)
+{
+  while ((local_peer->sched_first < local_peer->nc)
+         && (local_peer->sched_map[local_peer->sched_first] != SCHED_FREE)) {
+    local_peer->sched_first++;
+  }
+}
+
+/* range which seeder "p" should download in SCHED_RANGE_US at its measured rate */
+INTERNAL_LINKAGE
+uint64_t
+sched_rate_len(struct peer *p)
+{
+  uint64_t len;
+
+  if (p->rate == 0) {
+    return SCHED_INIT_RANGE;
+  }
+  len = p->rate * SCHED_RANGE_US / 1000000;
+  if (len < SCHED_MIN_RANGE) {
+    len = SCHED_MIN_RANGE;
+  }
+  if (len > SCHED_MAX_RANGE) {
+    len = SCHED_MAX_RANGE;
+  }
+
+  return len;
+}
+
+/* take up to "len" free chunks of seeder "p" following each other from chunk "first" */
+INTERNAL_LINKAGE
+int
+sched_take(struct peer *local_peer, struct peer *p, uint64_t first, uint64_t len, struct schedule_entry *range)
+{
+  uint64_t c;
+
+  c = first;
+  while ((c < local_peer->nc) && (c - first < len) && sched_wanted(local_peer, p, c)) {
+    local_peer->sched_map[c] = SCHED_TAKEN;
+    c++;
+  }
+  local_peer->sched_free -= c - first;
+
+  /* seeder is busy from now on - its rate is measured */
+  if (p->rate_us == 0) {
+    p->rate_us = window_now_us();
+    p->rate_chunks = p->rx_chunks;
+  }
+
+  range->begin = first;
+  range->end = c - 1;
+  d_printf("range %lu..%lu for seeder %s:%d (%lu chunks/s)\n", range->begin, range->end,
+           inet_ntoa(p->leecher_addr.sin_addr), ntohs(p->leecher_addr.sin_port), p->rate);
+
+  return 0;
+}
+
+/* sequential - chunks in file order, the range lasts SCHED_RANGE_US */
+INTERNAL_LINKAGE
+int
+sched_sequential_next(struct peer *local_peer, struct peer *p, struct schedule_entry *range)
+{
+  uint64_t c;
+
+  sched_skip_taken(local_peer);
+  for (c = local_peer->sched_first; (c < local_peer->nc) && (local_peer->sched_free > 0); c++) {
+    if (sched_wanted(local_peer, p, c)) {
+      return sched_take(local_peer, p, c, sched_rate_len(p), range);
+    }
+  }
+
+  return -1;
+}
+
+/* number of known seeders having chunk "c", all above SCHED_LEVELS count as SCHED_LEVELS */
+INTERNAL_LINKAGE
+int
+sched_level(struct peer *local_peer, uint64_t c)
+{
+  if (local_peer->sched_avail == NULL) {
+    return 0;
+  }
+
+  return (local_peer->sched_avail[c] < SCHED_LEVELS) ? local_peer->sched_avail[c] : SCHED_LEVELS;
+}
+
+/* availability of chunks from "first" on has changed - rarest has to look at them again */
+INTERNAL_LINKAGE
+void
+sched_level_rewind(struct peer *local_peer, uint64_t first)
+{
+  int l;
+
+  for (l = 0; l <= SCHED_LEVELS; l++) {
+    if (local_peer->sched_level_first[l] > first) {
+      local_peer->sched_level_first[l] = first;
+    }
+  }
+}
+
+/*
+ * rarest-first - range is made of chunks which the fewest known seeders
+ * have, so the chunks that only one seeder has are fetched while it's still
+ * there and the others are left for the rest
+ *
+ * every level of availability has its own position, chunks before it are
+ * never looked at again until availability changes, so the whole download
+ * costs one pass over the chunks per level in the usual case when seeders
+ * have the whole file
+ */
+INTERNAL_LINKAGE
+int
+sched_rarest_next(struct peer *local_peer, struct peer *p, struct schedule_entry *range)
+{
+  int l;
+  uint64_t c;
+  uint64_t first;
+  uint64_t len;
+  uint64_t n;
+
+  sched_skip_taken(local_peer);
+  if (local_peer->sched_free == 0) {
+    return -1;
+  }
+
+  /* chunks which no seeder announces are taken only when HAVE doesn't matter */
+  l = ((p->num_have_cache == 0) || local_peer->sched_any_have) ? 0 : 1;
+  for (; l <= SCHED_LEVELS; l++) {
+    c = local_peer->sched_level_first[l];
+    if (c < local_peer->sched_first) {
+      c = local_peer->sched_first;
+    }
+    while ((c < local_peer->nc)
+	   && ((local_peer->sched_map[c] != SCHED_FREE) || (sched_level(local_peer, c) != l))) {
+      c++;
+    }
+    local_peer->sched_level_first[l] = c;
+
+    /* first free chunk of this level which the seeder has - parts of file it doesn't have are skipped at once */
+    first = c;
+    while (first < local_peer->nc) {
+      first = sched_have_next(local_peer, p, first);
+      if ((first < local_peer->nc) && (sched_level(local_peer, first) == l)
+	  && (local_peer->sched_map[first] == SCHED_FREE)) {
+	break;
+      }
+      first++;
+    }
+    if (first >= local_peer->nc) {
+      continue;
+    }
+
+    /* range ends where availability changes */
+    len = sched_rate_len(p);
+    n = 0;
+    while ((first + n < local_peer->nc) && (n < len) && (sched_level(local_peer, first + n) == l)
+	   && sched_wanted(local_peer, p, first + n)) {
+      n++;
+    }
+
+    return sched_take(local_peer, p, first, n, range);
+  }
+
+  return -1;
+}
+
+/*
+ * throughput-weighted - every seeder gets the share of free chunks
+ * proportional to its measured rate, spread over its max_requests ranges,
+ * so all the seeders finish at the same time - ranges shrink towards the
+ * end of the download
+ */
+INTERNAL_LINKAGE
+int
+sched_throughput_next(struct peer *local_peer, struct peer *p, struct schedule_entry *range)
+{
+  uint64_t c;
+  uint64_t len;
+
+  if ((p->rate == 0) || (local_peer->sched_rate_sum == 0)) {
+    len = SCHED_INIT_RANGE;
+  } else {
+    len = local_peer->sched_free * p->rate / local_peer->sched_rate_sum / local_peer->max_requests;
+  }
+  if (len < SCHED_MIN_RANGE) {
+    len = SCHED_MIN_RANGE;
+  }
+  if (len > SCHED_MAX_RANGE) {
+    len = SCHED_MAX_RANGE;
+  }
+
+  sched_skip_taken(local_peer);
+  for (c = local_peer->sched_first; (c < local_peer->nc) && (local_peer->sched_free > 0); c++) {
+    if (sched_wanted(local_peer, p, c)) {
+      return sched_take(local_peer, p, c, len, range);
+    }
+  }
+
+  return -1;
+}
+
+/* indexed by peregrine_sched_t */
+static const struct sched_ops sched_table[] = {
+  {"sequential", sched_sequential_next},
+  {"rarest", sched_rarest_next},
+  {"throughput", sched_throughput_next},
+};
+
+INTERNAL_LINKAGE
+const struct sched_ops *
+sched_get(uint8_t type)
+{
+  if (type >= sizeof(sched_table) / sizeof(sched_table[0])) {
+    type = PEREGRINE_SCHED_SEQUENTIAL;
+  }
+
+  return &sched_table[type];
+}
+
+/*
+ * give next range for seeder "p" - returns -1 if nothing is left
+ *
+ * when none of the free chunks is in HAVE of the seeder, they are requested
+ * from it anyway - otherwise chunks which no connected seeder announces
+ * would never be taken and the fetch would wait for them forever
+ */
+INTERNAL_LINKAGE
+int
+sched_next(struct peer *local_peer, struct peer *p, struct schedule_entry *range)
+{
+  int r;
+
+  if (local_peer->sched->next(local_peer, p, range) == 0) {
+    return 0;
+  }
+  if (local_peer->sched_free == 0) {
+    return -1;
+  }
+
+  d_printf("%lu free chunks aren't in HAVE of seeder %s:%d - requesting them anyway\n", local_peer->sched_free,
+           inet_ntoa(p->leecher_addr.sin_addr), ntohs(p->leecher_addr.sin_port));
+  local_peer->sched_any_have = 1;
+  r = local_peer->sched->next(local_peer, p, range);
+  local_peer->sched_any_have = 0;
+
+  return r;
+}
+
+/* make all the chunks of download_schedule free for the seeders - called after the schedule is created */
+INTERNAL_LINKAGE
+void
+sched_reset(struct peer *local_peer)
+{
+  uint64_t c;
+  uint64_t i;
+
+  if (local_peer->sched_map == NULL) {
+    local_peer->sched_map = malloc(local_peer->nl);
+    _assert(local_peer->sched_map != NULL, "%s\n", "local_peer->sched_map should be != NULL");
+  }
+  memset(local_peer->sched_map, SCHED_NONE, local_peer->nl);
+
+  local_peer->sched_free = 0;
+  for (i = 0; i < local_peer->download_schedule_len; i++) {
+    for (c = local_peer->download_schedule[i].begin; c <= local_peer->download_schedule[i].end; c++) {
+      local_peer->sched_map[c] = SCHED_FREE;
+      local_peer->sched_free++;
+    }
+  }
+  local_peer->sched_first = (local_peer->download_schedule_len > 0) ? local_peer->download_schedule[0].begin : 0;
+  for (i = 0; i <= SCHED_LEVELS; i++) {
+    local_peer->sched_level_first[i] = local_peer->sched_first;
+  }
+
+  d_printf("%lu chunks scheduled for download\n", local_peer->sched_free);
+}
+
+/* count chunks of seeder "p" in availability of chunks - called after HANDSHAKE with HAVE is received from it */
+INTERNAL_LINKAGE
+void
+sched_have(struct peer *local_peer, struct peer *p)
+{
+  int i;
+  uint64_t c;
+
+  if (local_peer->sched_avail == NULL) {
+    local_peer->sched_avail = malloc(local_peer->nl * sizeof(uint16_t));
+    _assert(local_peer->sched_avail != NULL, "%s\n", "local_peer->sched_avail should be != NULL");
+    memset(local_peer->sched_avail, 0, local_peer->nl * sizeof(uint16_t));
+  }
+
+  for (i = 0; i < p->num_have_cache; i++) {
+    for (c = p->have_cache[i].start_chunk; (c <= p->have_cache[i].end_chunk) && (c < local_peer->nl); c++) {
+      local_peer->sched_avail[c]++;
+    }
+    sched_level_rewind(local_peer, p->have_cache[i].start_chunk);
+  }
+  p->have_counted = 1;
+}
+
+/* seeder "p" is left - its chunks and rate don't count anymore */
+INTERNAL_LINKAGE
+void
+sched_forget(struct peer *local_peer, struct peer *p)
+{
+  int i;
+  uint64_t c;
+
+  if (p->have_counted) {
+    for (i = 0; i < p->num_have_cache; i++) {
+      for (c = p->have_cache[i].start_chunk; (c <= p->have_cache[i].end_chunk) && (c < local_peer->nl); c++) {
+	local_peer->sched_avail[c]--;
+      }
+      sched_level_rewind(local_peer, p->have_cache[i].start_chunk);
+    }
+    p->have_counted = 0;
+  }
+
+  local_peer->sched_rate_sum -= p->rate;
+  p->rate = 0;
+  p->rate_us = 0;
+}
+
+/* range of seeder "p" is downloaded - update its rate */
+INTERNAL_LINKAGE
+void
+sched_range_done(struct peer *local_peer, struct peer *p)
+{
+  uint64_t now;
+  uint64_t old;
+  uint64_t sample;
+
+  now = window_now_us();
+  if ((p->rate_us == 0) || (now - p->rate_us < SCHED_SAMPLE_US)) {
+    return;
+  }
+
+  sample = (p->rx_chunks - p->rate_chunks) * 1000000 / (now - p->rate_us);
+  old = p->rate;
+  if (old == 0) {
+    p->rate = sample;
+  } else {
+    p->rate = old - (old >> SCHED_RATE_SHIFT) + (sample >> SCHED_RATE_SHIFT);
+  }
+  if (p->rate == 0) { /* 0 means not measured yet */
+    p->rate = 1;
+  }
+  local_peer->sched_rate_sum += p->rate - old;
+
+  p->rate_us = now;
+  p->rate_chunks = p->rx_chunks;
+}
+
+/* seeder "p" has nothing to download - its rate isn't measured until it gets next range */
+INTERNAL_LINKAGE
+void
+sched_idle(struct peer *local_peer, struct peer *p)
+{
+  (void)local_peer;
+  p->rate_us = 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _DOWNLOAD_SCHED_H_
+#define _DOWNLOAD_SCHED_H_
+
+#include "peer.h"
+#include <stdint.h>
+
+#define SCHED_MIN_RANGE  16     /* [chunks] */
+#define SCHED_MAX_RANGE  1024   /* [chunks] */
+#define SCHED_INIT_RANGE 64     /* range for seeder whose rate isn't measured yet [chunks] */
+#define SCHED_RANGE_US   250000 /* sequential and rarest: seeder should download one range in this time */
+#define SCHED_SAMPLE_US  100000 /* rate of seeder is sampled at most this often */
+#define SCHED_RATE_SHIFT 2      /* new sample weighs 1/4 in the moving average of the rate */
+
+/* state of chunk in local_leecher->sched_map */
+enum sched_chunk { SCHED_NONE = 0, SCHED_FREE, SCHED_TAKEN };
+
+/*
+ * download scheduler of leecher - chooses the ranges of chunks requested
+ * from seeders, all the callbacks are called with download_schedule_mutex
+ * locked
+ */
+struct sched_ops {
+  const char *name;
+  /* give next range for seeder "p", returns -1 if nothing is left for it */
+  int (*next)(struct peer * /*local_peer*/, struct peer * /*p*/, struct schedule_entry * /*range*/);
+};
+
+const struct sched_ops *sched_get(uint8_t /*type*/);
+int sched_next(struct peer * /*local_peer*/, struct peer * /*p*/, struct schedule_entry * /*range*/);
+void sched_reset(struct peer * /*local_peer*/);
+void sched_have(struct peer * /*local_peer*/, struct peer * /*p*/);
+void sched_forget(struct peer * /*local_peer*/, struct peer * /*p*/);
+void sched_range_done(struct peer * /*local_peer*/, struct peer * /*p*/);
+void sched_idle(struct peer * /*local_peer*/, struct peer * /*p*/);
+
+#endif /* _DOWNLOAD_SCHED_H_ */
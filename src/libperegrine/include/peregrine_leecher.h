@@ -29,12 +29,28 @@
 #include <netinet/in.h>
 #include <stdint.h>
 
+#include "peregrine_hash.h"
+
 typedef int64_t peregrine_handle_t;
+
+typedef enum {
+  PEREGRINE_SCHED_SEQUENTIAL = 0, /**< Chunks in file order */
+  PEREGRINE_SCHED_RAREST,         /**< Chunks which the fewest known seeders have go first */
+  PEREGRINE_SCHED_THROUGHPUT      /**< Every seeder gets share of remaining chunks proportional to its rate */
+} peregrine_sched_t;
+
 typedef struct {
   uint32_t timeout;               /**< Timeout for network communication */
-  uint8_t sha_demanded[20];       /**< SHA1 of demanded file */
+  uint8_t sha_demanded[32];       /**< Root hash of demanded file, 20 bytes for SHA-1, 32 for the others */
+  uint8_t merkle_hash_func;       /**< Hash function of the tree, one of PEREGRINE_HASH_*, the seeder must use it
+                                     too */
   struct sockaddr_in seeder_addr; /**< Primary seeder IP/PORT address from
                                      leecher point of view */
+  uint8_t preallocate;            /**< Reserve space for the whole file with fallocate() before chunks are written
+                                     to file descriptor */
+  uint8_t requests;               /**< Number of ranges of chunks requested from one seeder at once, 0 = default (4) */
+  peregrine_sched_t scheduler;    /**< Scheduler choosing ranges of chunks requested from seeders, length of the
+                                     ranges follows measured rate of every seeder */
 } peregrine_leecher_params_t;
 typedef struct {
   char file_name[256];  /**< File name for demanded SHA1 hash */
@@ -50,6 +66,7 @@ uint32_t peregrine_prepare_chunk_range(peregrine_handle_t handle, uint32_t start
 void peregrine_leecher_fetch_chunk_to_fd(peregrine_handle_t handle, int fd);
 int32_t peregrine_leecher_fetch_chunk_to_buf(peregrine_handle_t handle, uint8_t *transfer_buf);
 void peregrine_leecher_close(peregrine_handle_t handle);
+int peregrine_leecher_add_seeder(peregrine_handle_t handle, struct sockaddr_in *sa);
 void peregrine_leecher_run(peregrine_handle_t handle);
 
 #endif
@@ -29,11 +29,37 @@
 #include <netinet/in.h>
 #include <stdint.h>
 
+#include "peregrine_hash.h"
+
 typedef int64_t peregrine_handle_t;
+
+typedef enum {
+  PEREGRINE_ENGINE_THREADED = 0, /**< One worker thread per connected leecher */
+  PEREGRINE_ENGINE_REACTOR       /**< Fixed set of event loop threads serving all the leechers */
+} peregrine_engine_t;
+
+typedef enum {
+  PEREGRINE_CC_NONE = 0, /**< Send window is always as large as "window" */
+  PEREGRINE_CC_LEDBAT    /**< Delay based congestion control yielding to other traffic, RFC 6817 */
+} peregrine_cc_t;
+
 typedef struct {
-  uint32_t chunk_size; /**< Size of the chunk for seeded files */
-  uint32_t timeout;    /**< Timeout for network communication */
-  uint16_t port;       /**< UDP port number to bind to */
+  uint32_t chunk_size;       /**< Size of the chunk for seeded files */
+  uint32_t timeout;          /**< Timeout for network communication */
+  uint16_t port;             /**< UDP port number to bind to */
+  peregrine_engine_t engine; /**< Engine used for serving leechers */
+  uint16_t reactor_threads;  /**< Number of event loop threads for PEREGRINE_ENGINE_REACTOR, 0 = one per CPU */
+  uint8_t zerocopy;          /**< Send DATA with MSG_ZEROCOPY in PEREGRINE_ENGINE_REACTOR */
+  uint16_t window;           /**< Max number of chunks in flight to one leecher, 0 = default */
+  peregrine_cc_t congestion; /**< Congestion control of the send window */
+  uint16_t sockets;          /**< Number of SO_REUSEPORT sockets with own router thread for PEREGRINE_ENGINE_THREADED,
+                                  0 = one socket */
+  uint8_t gso;               /**< Send trains of DATA to one leecher with UDP generic segmentation offload */
+  uint16_t index_threads;    /**< Number of threads hashing seeded files, 0 = one per CPU */
+  const char *cache_dir;     /**< Directory keeping hash trees of seeded files between runs, NULL = no cache */
+  uint32_t follow_ms;        /**< Check seeded files for changes every follow_ms milliseconds and index again those
+                                  which changed, appended files get only new chunks hashed, 0 = files are static */
+  uint8_t merkle_hash_func;  /**< Hash function of trees of seeded files, one of PEREGRINE_HASH_* */
 } peregrine_seeder_params_t;
 
 peregrine_handle_t peregrine_seeder_create(peregrine_seeder_params_t *params);
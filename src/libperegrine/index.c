@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * indexing of seeded files
+ *
+ * Every file is cut into jobs - ranges of chunks of at most INDEX_JOB_BYTES
+ * bytes - and the jobs of all the files are hashed by a pool of worker
+ * threads, so a directory of many files as well as one big file keeps all the
+ * CPUs busy. Jobs write hashes into disjoint leaves of the file's tree. The
+ * worker finishing the last job of a file computes the rest of its tree.
+ */
+
+#include "index.h"
+#include "debug.h"
+#include "peer.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+INTERNAL_LINKAGE
+void *
+index_worker(void *data)
+{
+  char *buf;
+  uint64_t j;
+  uint64_t bytes;
+  struct index_job *job;
+  struct index_pool *pool;
+
+  pool = (struct index_pool *)data;
+  buf = malloc((size_t)pool->seeder->chunk_size * pool->seeder->merkle_hash->lanes());
+
+  while ((j = __atomic_fetch_add(&pool->next_job, 1, __ATOMIC_RELAXED)) < pool->num_jobs) {
+    job = &pool->jobs[j];
+    process_file_hash(job->file, pool->seeder, job->first, job->last, buf);
+
+    bytes = (job->last - job->first + 1) * pool->seeder->chunk_size;
+    if (job->first * pool->seeder->chunk_size + bytes > job->file->file_size) {
+      bytes = job->file->file_size - job->first * pool->seeder->chunk_size;
+    }
+    __atomic_add_fetch(&pool->bytes_done, bytes, __ATOMIC_RELAXED);
+
+    /* all the leaves of the file are ready - build the rest of its tree */
+    if (__atomic_sub_fetch(&job->file->index_jobs, 1, __ATOMIC_ACQ_REL) == 0) {
+      process_file_end(job->file, pool->seeder);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->jobs_done++;
+    if (pool->jobs_done == pool->num_jobs) {
+      pthread_cond_signal(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+/*
+ * compute hash trees of given files using seeder->index_threads threads
+ * returns when all the files are ready for sharing
+ */
+INTERNAL_LINKAGE
+void
+index_files(struct peer *seeder, struct file_list_entry **files, int num_files)
+{
+  int i;
+  int s;
+  int num_threads;
+  uint64_t c;
+  uint64_t job_chunks;
+  struct timespec ts;
+  struct index_pool pool;
+  pthread_t *threads;
+
+  memset(&pool, 0, sizeof(pool));
+  pool.seeder = seeder;
+  pthread_mutex_init(&pool.mutex, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+
+  job_chunks = INDEX_JOB_BYTES / seeder->chunk_size;
+  if (job_chunks < (uint64_t)seeder->merkle_hash->lanes()) {
+    job_chunks = seeder->merkle_hash->lanes();
+  }
+
+  /* open the files and cut them into jobs */
+  for (i = 0; i < num_files; i++) {
+    process_file_begin(files[i], seeder);
+    if (files[i]->cached) { /* tree loaded from the cache - nothing to hash */
+      continue;
+    }
+    pool.num_jobs += (files[i]->nc + job_chunks - 1) / job_chunks;
+    pool.bytes_total += files[i]->file_size;
+  }
+  pool.jobs = malloc(pool.num_jobs * sizeof(struct index_job));
+  for (i = 0; i < num_files; i++) {
+    files[i]->index_jobs = 0;
+    for (c = 0; (c < files[i]->nc) && !files[i]->cached; c += job_chunks) {
+      pool.jobs[pool.jobs_done].file = files[i];
+      pool.jobs[pool.jobs_done].first = c;
+      pool.jobs[pool.jobs_done].last = c + job_chunks - 1 < files[i]->nc - 1 ? c + job_chunks - 1 : files[i]->nc - 1;
+      pool.jobs_done++;
+      files[i]->index_jobs++;
+    }
+    if (files[i]->index_jobs == 0) { /* empty or cached file - nothing to hash */
+      process_file_end(files[i], seeder);
+    }
+  }
+  pool.jobs_done = 0;
+
+  num_threads = seeder->index_threads;
+  if (num_threads == 0) {
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if ((uint64_t)num_threads > pool.num_jobs) {
+    num_threads = pool.num_jobs;
+  }
+  d_printf("indexing %d files, %lu bytes in %lu jobs with %d threads\n", num_files, pool.bytes_total, pool.num_jobs,
+           num_threads);
+
+  threads = malloc(num_threads * sizeof(pthread_t));
+  for (i = 0; i < num_threads; i++) {
+    s = pthread_create(&threads[i], NULL, index_worker, &pool);
+    if (s != 0) {
+      printf("error creating indexing thread: %s\n", strerror(s));
+      exit(1);
+    }
+  }
+
+  /* wait for the workers and report progress if it takes longer */
+  pthread_mutex_lock(&pool.mutex);
+  while (pool.jobs_done < pool.num_jobs) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += INDEX_PROGRESS_MS / 1000;
+    ts.tv_nsec += (INDEX_PROGRESS_MS % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    if (pthread_cond_timedwait(&pool.cond, &pool.mutex, &ts) == ETIMEDOUT) {
+      printf("indexing: %lu of %lu MiB (%lu%%)\n", __atomic_load_n(&pool.bytes_done, __ATOMIC_RELAXED) >> 20,
+             pool.bytes_total >> 20, __atomic_load_n(&pool.bytes_done, __ATOMIC_RELAXED) * 100 / pool.bytes_total);
+      fflush(stdout);
+    }
+  }
+  pthread_mutex_unlock(&pool.mutex);
+
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  free(pool.jobs);
+  pthread_cond_destroy(&pool.cond);
+  pthread_mutex_destroy(&pool.mutex);
+}
+
+/*
+ * index again the seeded file "f" which has changed on disk and replace it in
+ * the seeded files list, leechers which already use "f" keep using it
+ */
+INTERNAL_LINKAGE
+void
+index_replace_file(struct peer *seeder, struct file_list_entry *f, struct stat *st)
+{
+  char sha[2 * MT_HASH_MAX_LEN + 1];
+  struct file_list_entry *e;
+  struct file_list_entry *nf;
+
+  nf = malloc(sizeof(struct file_list_entry));
+  memset(nf, 0, sizeof(struct file_list_entry));
+  nf->fd = -1;
+  strcpy(nf->path, f->path);
+
+  if ((uint64_t)st->st_size > f->file_size) { /* appended - reuse what has been hashed already */
+    process_file_extend(nf, f, seeder);
+  } else {
+    process_file(nf, seeder);
+  }
+
+  pthread_mutex_lock(&seeder->file_list_head_mutex);
+  SLIST_FOREACH(e, &seeder->file_list_head, next)
+  {
+    if (e == f) {
+      break;
+    }
+  }
+  if (e == NULL) { /* removed meanwhile */
+    pthread_mutex_unlock(&seeder->file_list_head_mutex);
+    file_entry_put(nf);
+    return;
+  }
+  SLIST_REMOVE(&seeder->file_list_head, f, file_list_entry, next);
+  SLIST_INSERT_HEAD(&seeder->file_list_head, nf, next);
+  pthread_mutex_unlock(&seeder->file_list_head_mutex);
+  file_entry_put(f); /* reference of the seeded files list */
+
+  mt_hash_hex(seeder->merkle_hash, nf->tree_root, sha);
+  printf("updated: %s %lu bytes\n", nf->path, nf->file_size);
+  printf("%s: %s\n", seeder->merkle_hash->name, sha);
+  fflush(stdout);
+}
+
+/*
+ * watch seeded files every seeder->follow_ms milliseconds and index again
+ * those which have changed - files growing while being seeded (recordings,
+ * logs) get only their new chunks hashed
+ */
+INTERNAL_LINKAGE
+void *
+index_watch_worker(void *data)
+{
+  int i;
+  int n;
+  int max;
+  struct stat st;
+  struct peer *seeder;
+  struct file_list_entry *f;
+  struct file_list_entry **changed;
+
+  seeder = (struct peer *)data;
+  max = 0;
+  changed = NULL;
+
+  while (1) {
+    usleep(seeder->follow_ms * 1000);
+
+    /* collect changed files with a reference, so they can't disappear while indexed */
+    n = 0;
+    pthread_mutex_lock(&seeder->file_list_head_mutex);
+    SLIST_FOREACH(f, &seeder->file_list_head, next)
+    {
+      if ((f->tree_root == NULL) || (stat(f->path, &st) != 0)) {
+	continue;
+      }
+      if (((uint64_t)st.st_size == f->cache_id.file_size) && ((uint64_t)st.st_mtim.tv_sec == f->cache_id.mtime_sec)
+	  && ((uint64_t)st.st_mtim.tv_nsec == f->cache_id.mtime_nsec)) {
+	continue;
+      }
+      if (n == max) {
+	max = max ? 2 * max : 16;
+	changed = realloc(changed, max * sizeof(struct file_list_entry *));
+      }
+      file_entry_get(f);
+      changed[n++] = f;
+    }
+    pthread_mutex_unlock(&seeder->file_list_head_mutex);
+
+    for (i = 0; i < n; i++) {
+      if (stat(changed[i]->path, &st) == 0) {
+	d_printf("%s changed: %lu -> %lu bytes\n", changed[i]->path, changed[i]->file_size, st.st_size);
+	index_replace_file(seeder, changed[i], &st);
+      }
+      file_entry_put(changed[i]);
+    }
+  }
+
+  return NULL;
+}
+
+/* start watching seeded files for changes if seeder->follow_ms is set */
+INTERNAL_LINKAGE
+void
+index_watch_start(struct peer *seeder)
+{
+  int s;
+  pthread_t thread;
+
+  if (seeder->follow_ms == 0) {
+    return;
+  }
+
+  s = pthread_create(&thread, NULL, index_watch_worker, seeder);
+  if (s != 0) {
+    printf("error creating file watching thread: %s\n", strerror(s));
+    exit(1);
+  }
+  pthread_detach(thread);
+}
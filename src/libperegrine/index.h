@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include "peer.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define INDEX_JOB_BYTES   (16 * 1024 * 1024) /* one job hashes at most this many bytes of one file */
+#define INDEX_PROGRESS_MS 1000               /* how often the progress of indexing is printed */
+
+/* range of chunks of one file hashed by one worker */
+struct index_job {
+  struct file_list_entry *file;
+  uint64_t first;
+  uint64_t last;
+};
+
+struct index_pool {
+  struct peer *seeder;
+  struct index_job *jobs;
+  uint64_t num_jobs;
+  uint64_t next_job;   /* next job to take, workers take jobs with atomic increment */
+  uint64_t jobs_done;  /* protected by "mutex" */
+  uint64_t bytes_total;
+  uint64_t bytes_done; /* updated atomically */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond; /* signalled when the last job is done */
+};
+
+void index_files(struct peer * /*seeder*/, struct file_list_entry ** /*files*/, int /*num_files*/);
+void index_watch_start(struct peer * /*seeder*/);
+
+#endif /* _INDEX_H_ */
@@ -25,10 +25,10 @@
 #include "mt.h"
 #include "debug.h"
 #include "peer.h"
-#include "sha1.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 /*
  * returns rounded order of 32-bit variable
@@ -62,32 +62,28 @@ order2(uint32_t val)
 }
 
 /*
- * builds tree with "num_chunks" number of chunks
+ * builds tree with "num_chunks" number of chunks hashed with "hash"
  * returns:
- * 	pointer to root node of the new created tree
- * 	as "**ret" parameter - pointer to new created tree - 0 index of the leaf
+ * 	number of the root node of the new created tree
+ * 	as "*t" parameter - new created tree with all the hashes zeroed
  *
  */
 INTERNAL_LINKAGE
-struct node *
-build_tree(int num_chunks, struct node **ret)
+uint32_t
+build_tree(int num_chunks, const struct mt_hash *hash, struct mt_tree *t)
 {
-  int x;
   int l;
   int si;
   int h;
   int first_idx;
   int nc;
-  int left;
-  int right;
-  int parent;
-  int root_idx;
-  struct node *rot;
-  struct node *tt;
 
   d_printf("num_chunks: %d\n", num_chunks);
 
   h = order2(num_chunks); /* "h" - height of the tree */
+  if (h < 0) {
+    h = 0;
+  }
   nc = 1 << h;            /* if there are for example only 7 chunks - create tree with 8
                              leaves */
   d_printf("order2(%d): %d\n", num_chunks, h);
@@ -95,59 +91,73 @@ build_tree(int num_chunks, struct node **ret)
 
   /* list the tree */
 #if 1
-  for (l = 1; l <= h + 1; l++) {                        /* goes level by level from bottom up to highest level */
-    first_idx = (1 << (l - 1)) - 1;                     /* first index on the given level starting
-                                                           from left: 0, 1, 3, 7, 15, etc */
-    for (si = first_idx; si < 2 * nc; si += (1 << l)) { /* si - sibling index */
-      d_printf("%d ", si);
+  if (debug) {
+    for (l = 1; l <= h + 1; l++) {                        /* goes level by level from bottom up to highest level */
+      first_idx = (1 << (l - 1)) - 1;                     /* first index on the given level starting
+                                                             from left: 0, 1, 3, 7, 15, etc */
+      for (si = first_idx; si < 2 * nc; si += (1 << l)) { /* si - sibling index */
+	d_printf("%d ", si);
+      }
+      d_printf("%s", "\n");
     }
-    d_printf("%s", "\n");
   }
 #endif
 
-  /* allocate array of "struct node" */
-  tt = malloc(2 * nc * sizeof(struct node));
+  /* nodes are not linked - relations between them follow from their numbers */
+  t->hash = hash;
+  t->sha = malloc(2 * (uint64_t)nc * hash->len);
+  memset(t->sha, 0, 2 * (uint64_t)nc * hash->len); /* hashes of padding nodes must be zero */
+  t->active = malloc((2 * (uint64_t)nc + 7) / 8);
+  memset(t->active, 0, (2 * (uint64_t)nc + 7) / 8);
+  t->nl = nc;
+  t->root = nc - 1;
+  t->map = NULL;
+  t->map_size = 0;
 
-  /* initialize array of struct node */
-  for (x = 0; x < 2 * nc; x++) {
-    tt[x].number = x;
-    tt[x].chunk = NULL;
-    tt[x].left = tt[x].right = tt[x].parent = NULL;
-    tt[x].state = INITIALIZED;
-  }
+  d_printf("root node: %u\n", t->root);
 
-  d_printf("%s", "\nbuilding tree - linking nodes\n\n");
-  /* build the tree by linking nodes */
-  for (l = 1; l <= h; l++) {
-    first_idx = (1 << (l - 1)) - 1;
-    for (si = first_idx; si < 2 * nc; si += (2 << l)) {
-      left = si;
-      right = (si | (1 << l));
-      parent = (left + right) / 2;
-      /* d_printf("pair %d-%d will have parent: %d\n", left, right, parent); */
-      tt[left].parent = &tt[parent];  /* parent for left node */
-      tt[right].parent = &tt[parent]; /* parent for right node */
+  return t->root;
+}
 
-      tt[parent].left = &tt[left];   /* left child of the parent */
-      tt[parent].right = &tt[right]; /* right child of the parent */
-    }
-    /* d_printf("%s", "\n"); */
+INTERNAL_LINKAGE
+void
+free_tree(struct mt_tree *t)
+{
+  if (t->map != NULL) {
+    munmap(t->map, t->map_size);
+  } else {
+    free(t->sha);
   }
+  free(t->active);
+  t->sha = NULL;
+  t->active = NULL;
+}
 
-  *ret = tt; /* return just created tree */
-
-  root_idx = (1 << h) - 1;
-  d_printf("root node: %d\n", root_idx);
-
-  rot = &tt[root_idx];
-  return rot;
+/* mark node "n" as having proper SHA-1, nodes sharing one byte of the bitmap
+ * may be set by different threads */
+INTERNAL_LINKAGE
+void
+mt_set_active(struct mt_tree *t, uint32_t n)
+{
+  __atomic_fetch_or(&t->active[n / 8], 1 << (n % 8), __ATOMIC_RELAXED);
 }
 
+/* level of the node: 0 for leaves, number of lowest bits set */
 INTERNAL_LINKAGE
 int
-update_chunk(struct node *t, unsigned int cn, struct chunk *c)
+mt_level(uint32_t n)
+{
+  return __builtin_ctz(~n);
+}
+
+INTERNAL_LINKAGE
+uint32_t
+mt_parent(uint32_t n)
 {
-  return 0;
+  int l;
+
+  l = mt_level(n);
+  return (n & ~(2U << l)) | (1U << l);
 }
 
 /*
@@ -155,28 +165,30 @@ update_chunk(struct node *t, unsigned int cn, struct chunk *c)
  */
 INTERNAL_LINKAGE
 void
-show_tree_root_based(struct node *t)
+show_tree_root_based(uint32_t n)
 {
   int l;
   int si;
   int nl;
   int h;
-  int ti;
   int first_idx;
   int center;
   int sp;
-  struct node min;
-  struct node max;
+  uint32_t min;
+  uint32_t max;
+
+  if (!debug) {
+    return;
+  }
 
-  d_printf("print the tree starting from root node: %d\n", t->number);
+  d_printf("print the tree starting from root node: %u\n", n);
 
-  ti = t->number;
-  interval_min_max(t, &min, &max);
-  d_printf("min: %d   max: %d\n", min.number, max.number);
-  nl = (max.number - min.number) / 2 + 1; /* number of leaves in given subtree */
+  interval_min_max(n, &min, &max);
+  d_printf("min: %u   max: %u\n", min, max);
+  nl = (max - min) / 2 + 1; /* number of leaves in given subtree */
   h = order2(nl) + 1;
 
-  first_idx = ti;
+  first_idx = n;
 
   /* justification */
 #if 1
@@ -190,7 +202,7 @@ show_tree_root_based(struct node *t)
     for (sp = 0; sp < (center - m / 2); sp++) {
       d_printf("%s", " "); /* insert (center - m/2) spaces first */
     }
-    for (si = first_idx; si <= max.number; si += (1 << l)) {
+    for (si = first_idx; si <= (int)max; si += (1 << l)) {
       d_printf("%2d", si);
       for (sp = 0; sp < is; sp++) {
 	d_printf("%s", " "); /* add a few spaces */
@@ -202,28 +214,16 @@ show_tree_root_based(struct node *t)
 #endif
 }
 
+/* sibling of node "n" - the other child of its parent */
 INTERNAL_LINKAGE
-struct node *
-find_sibling(struct node *n)
+uint32_t
+find_sibling(uint32_t n)
 {
-  struct node *p;
-  struct node *s;
+  uint32_t s;
 
-  p = n->parent;
-  if (p == NULL) {
-    return NULL;
-  }
-
-  if (n == p->left) { /* if node 'n' is left child of parent - then sibling is
-                       right child of parent */
-    s = p->right;
-  }
-  if (n == p->right) { /* if node 'n' is right child of parent - then sibling is
-                        left child of parent */
-    s = p->left;
-  }
+  s = n ^ (2U << mt_level(n));
 
-  d_printf("node: %d   parent: %d  sibling: %d\n", n->number, p->number, s->number);
+  d_printf("node: %u   parent: %u  sibling: %u\n", n, mt_parent(n), s);
 
   return s;
 }
@@ -233,53 +233,37 @@ find_sibling(struct node *n)
  */
 INTERNAL_LINKAGE
 void
-interval_min_max(struct node *i, struct node *min, struct node *max)
+interval_min_max(uint32_t n, uint32_t *min, uint32_t *max)
 {
-  struct node *c;
-
-  if (i == NULL) {
-    abort();
-  }
-  c = i;
-  while (c->left != NULL) {
-    c = c->left;
-  }
+  uint32_t w;
 
-  memcpy(min, c, sizeof(struct node));
+  w = (1U << mt_level(n)) - 1; /* distance from the node to its outermost leaves */
+  *min = n - w;
+  *max = n + w;
 
-  c = i;
-  while (c->right != NULL) {
-    c = c->right;
-  }
-
-  memcpy(max, c, sizeof(struct node));
-
-  d_printf("root: %d  interval  min: %d  max: %d\n", i->number, min->number, max->number);
+  d_printf("root: %u  interval  min: %u  max: %u\n", n, *min, *max);
 }
 
 /*
  * dump array of tree
  * in params:
- * 	t - pointer to array of tree
- * 	l - number of leaves
+ * 	t - tree
  */
 INTERNAL_LINKAGE
 void
-dump_tree(struct node *t, int l)
+dump_tree(struct mt_tree *t)
 {
-  char shas[40 + 1];
-  int x;
-  int y;
-  int s;
+  char shas[2 * MT_HASH_MAX_LEN + 1];
+  uint64_t x;
+
+  if (!debug) {
+    return;
+  }
 
-  memset(shas, 0, sizeof(shas));
   d_printf("%s", "dump tree\n");
-  for (x = 0; x < 2 * l; x++) {
-    s = 0;
-    for (y = 0; y < 20; y++) {
-      s += sprintf(shas + s, "%02x", t[x].sha[y] & 0xff);
-    }
-    d_printf("[%3d]  %d  %s\n", t[x].number, t[x].state, shas);
+  for (x = 0; x < 2 * (uint64_t)t->nl; x++) {
+    mt_hash_hex(t->hash, MT_SHA(t, x), shas);
+    d_printf("[%3lu]  %d  %s\n", x, MT_IS_ACTIVE(t, x) ? 1 : 0, shas);
   }
   d_printf("%s", "\n");
 }
@@ -287,89 +271,230 @@ dump_tree(struct node *t, int l)
 /*
  * dump array of chunks
  * in params:
- * 	t - pointer to array of tree
+ * 	c - pointer to array of chunks
  * 	l - number of leaves
+ * 	hash - hash function of the chunks
  *
  */
 INTERNAL_LINKAGE
 void
-dump_chunk_tab(struct chunk *c, int l)
+dump_chunk_tab(struct chunk *c, int l, const struct mt_hash *hash)
 {
-  char buf[40 + 1];
+  char buf[2 * MT_HASH_MAX_LEN + 1];
   int x;
-  int y;
+
+  if (!debug) {
+    return;
+  }
 
   d_printf("%s l: %d\n", __func__, l);
   for (x = 0; x < l; x++) {
-    int s = 0;
-    for (y = 0; y < 20; y++) {
-      s += sprintf(buf + s, "%02x", c[x].sha[y] & 0xff);
-    }
-    buf[40] = '\0';
+    mt_hash_hex(hash, c[x].sha, buf);
     d_printf("chunk[%3d]  off: %8lu  len: %8u  sha: %s  state: %s\n", x, c[x].offset, c[x].len, buf,
              c[x].state == CH_EMPTY ? "EMPTY" : "ACTIVE");
   }
 }
 
+/*
+ * hash the batch of concatenated sibling hashes collected by update_sha() and
+ * store the digests in parent nodes
+ */
 INTERNAL_LINKAGE
 void
-update_sha(struct node *t, int num_chunks)
+update_sha_batch(struct mt_tree *t, const uint8_t **msgs, uint32_t *parents, int n)
 {
-  char sha_parent[40 + 1];
-  char zero[20];
-  uint8_t concat[80 + 1];
-  unsigned char digest[20 + 1];
-  int h;
-  int nc;
+  char sha_parent[2 * MT_HASH_MAX_LEN + 1];
+  uint8_t digests[MT_HASH_MAX_LANES * MT_HASH_MAX_LEN];
+  int i;
+  int len;
+
+  len = t->hash->len;
+  t->hash->digest_mb(msgs, 2 * len, n, digests);
+
+  for (i = 0; i < n; i++) {
+    /* copy generated hash to parent node */
+    memcpy(MT_SHA(t, parents[i]), digests + len * i, len);
+    mt_set_active(t, parents[i]);
+
+    /* generate ASCII hash for parent node */
+    if (debug) {
+      mt_hash_hex(t->hash, MT_SHA(t, parents[i]), sha_parent);
+      d_printf(" p[%u]: %s\n", parents[i], sha_parent);
+    }
+  }
+}
+
+/*
+ * compute parents on levels "l_first" to "l_last" of the part of the tree
+ * with node numbers from "lo" to "hi - 1", "lo" must be a multiple of
+ * 2^(l_last + 1)
+ */
+INTERNAL_LINKAGE
+void
+update_sha_levels(struct mt_tree *t, uint64_t lo, uint64_t hi, int l_first, int l_last)
+{
+  char zero[MT_HASH_MAX_LEN];
+  uint8_t concat[MT_HASH_MAX_LANES][2 * MT_HASH_MAX_LEN];
+  const uint8_t *msgs[MT_HASH_MAX_LANES];
+  uint32_t parents[MT_HASH_MAX_LANES];
   int l;
-  int si;
-  int y;
-  int s;
-  int left;
-  int right;
-  int parent;
-  SHA1Context context;
+  int n;
+  int len;
+  int lanes;
+  uint64_t si;
+  uint32_t left;
+  uint32_t right;
+  uint32_t parent;
 
   memset(zero, 0, sizeof(zero));
-
-  h = order2(num_chunks); /* "h" - height of the tree */
-  nc = 1 << h;
-
-  for (l = 1; l <= h; l++) {                            /* go through levels of the tree starting from
-                                                           bottom of the tree */
-    int first_idx = (1 << (l - 1)) - 1;                 /* first index on given level starting
-                                                           from left: 0, 1, 3, 7, 15, etc */
-    for (si = first_idx; si < 2 * nc; si += (2 << l)) { /* si - sibling index */
+  len = t->hash->len;
+  lanes = t->hash->lanes();
+
+  for (l = l_first; l <= l_last; l++) {                   /* go through levels of the tree starting from
+                                                             bottom of the tree */
+    uint64_t first_idx = lo + (1 << (l - 1)) - 1;         /* first index on given level starting
+                                                             from left: 0, 1, 3, 7, 15, etc */
+    /* parents on one level don't depend on each other - hash them in batches */
+    n = 0;
+    for (si = first_idx; si < hi; si += (2 << l)) { /* si - sibling index */
       left = si;
       right = (si | (1 << l));
       parent = (left + right) / 2;
 
       /* check if both children are empty */
-      if ((memcmp(zero, t[left].sha, sizeof(zero)) == 0) && (memcmp(zero, t[right].sha, sizeof(zero)) == 0)) {
-	memcpy(t[parent].sha, zero, 20);
-      } else {
-	memcpy(concat, t[left].sha, 20);
-	memcpy(concat + 20, t[right].sha, 20);
-
-	/* calculate SHA1 for concatenated both SHA (left and right) */
-	SHA1Reset(&context);
-	SHA1Input(&context, concat, 40);
-	SHA1Result(&context, digest);
-
-	/* copy generated SHA hash to parent node */
-	memcpy(t[parent].sha, digest, 20);
+      if ((memcmp(zero, MT_SHA(t, left), len) == 0) && (memcmp(zero, MT_SHA(t, right), len) == 0)) {
+	memset(MT_SHA(t, parent), 0, len);
+	mt_set_active(t, parent);
+	continue;
       }
-      /* generate ASCII SHA for parent node */
-      if (debug) {
-	s = 0;
-	for (y = 0; y < 20; y++) {
-	  s += sprintf(sha_parent + s, "%02x", digest[y] & 0xff);
-	}
-	sha_parent[40] = '\0';
-	d_printf(" p[%d]: %s\n", t[parent].number, sha_parent);
+
+      /* hash of parent is computed from concatenated both hashes (left and right) */
+      memcpy(concat[n], MT_SHA(t, left), len);
+      memcpy(concat[n] + len, MT_SHA(t, right), len);
+      msgs[n] = concat[n];
+      parents[n] = parent;
+      n++;
+      if (n == lanes) {
+	update_sha_batch(t, msgs, parents, n);
+	n = 0;
       }
-      t[parent].state = ACTIVE;
     }
-    d_printf("%s", "\n");
+    if (n > 0) {
+      update_sha_batch(t, msgs, parents, n);
+    }
+  }
+}
+
+/*
+ * one pass of update_sha(): levels "l_first" to "l_last" of all the blocks,
+ * block "b" is the subtree rooted on level "l_last" covering nodes from
+ * b * 2^(l_last + 1) to (b + 1) * 2^(l_last + 1) - 1
+ */
+INTERNAL_LINKAGE
+void
+update_sha_pass(struct mt_sha_work *w, int l_first, int l_last)
+{
+  uint64_t b;
+  uint64_t bs;
+
+  bs = 2ULL << l_last; /* number of nodes covered by one block */
+  while ((b = __atomic_fetch_add(&w->next_block, 1, __ATOMIC_RELAXED)) < 2 * (uint64_t)w->nc / bs) {
+    update_sha_levels(w->t, b * bs, (b + 1) * bs, l_first, l_last);
+  }
+}
+
+INTERNAL_LINKAGE
+void *
+update_sha_worker(void *data)
+{
+  int l;
+  struct mt_sha_work *w;
+
+  w = (struct mt_sha_work *)data;
+  for (l = 1; l <= w->h; l += MT_BLOCK_LEVELS) {
+    update_sha_pass(w, l, l + MT_BLOCK_LEVELS - 1 < w->h ? l + MT_BLOCK_LEVELS - 1 : w->h);
+    /* next pass hashes roots of the blocks of this one - wait for all of them */
+    if (pthread_barrier_wait(&w->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+      w->next_block = 0;
+    }
+    pthread_barrier_wait(&w->barrier);
+  }
+
+  return NULL;
+}
+
+/*
+ * compute SHAs of all the non-leaf nodes of the tree
+ *
+ * The tree is hashed in passes of MT_BLOCK_LEVELS levels. Every pass splits
+ * the tree into blocks - subtrees small enough to stay in the CPU cache - and
+ * hashes each block bottom-up, so upper levels of a block are computed while
+ * its lower levels are still hot. Blocks of one pass are independent and are
+ * distributed among "threads" threads.
+ */
+INTERNAL_LINKAGE
+void
+update_sha(struct mt_tree *t, int num_chunks, int threads)
+{
+  int i;
+  int s;
+  struct mt_sha_work w;
+  pthread_t *tid;
+
+  memset(&w, 0, sizeof(w));
+  w.t = t;
+  w.h = order2(num_chunks); /* "h" - height of the tree */
+  w.nc = w.h >= 0 ? 1 << w.h : 0;
+
+  /* with only one block in the first pass there is nothing to share */
+  if (w.h <= MT_BLOCK_LEVELS) {
+    threads = 1;
+  } else if (threads > (w.nc >> MT_BLOCK_LEVELS)) {
+    threads = w.nc >> MT_BLOCK_LEVELS;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  d_printf("hashing tree of %d leaves with %d threads\n", w.nc, threads);
+
+  pthread_barrier_init(&w.barrier, NULL, threads);
+  tid = malloc(threads * sizeof(pthread_t));
+  for (i = 1; i < threads; i++) {
+    s = pthread_create(&tid[i], NULL, update_sha_worker, &w);
+    if (s != 0) {
+      printf("error creating tree hashing thread: %s\n", strerror(s));
+      exit(1);
+    }
+  }
+  update_sha_worker(&w);
+  for (i = 1; i < threads; i++) {
+    pthread_join(tid[i], NULL);
+  }
+  free(tid);
+  pthread_barrier_destroy(&w.barrier);
+}
+
+/*
+ * compute again SHAs of ancestors of leaves "first_chunk".."num_chunks - 1"
+ * after they have been appended to the tree or changed, the rest of the tree
+ * must be valid already - parents covering only padding leaves stay zero
+ */
+INTERNAL_LINKAGE
+void
+update_sha_tail(struct mt_tree *t, int num_chunks, uint32_t first_chunk)
+{
+  int l;
+  int h;
+  uint64_t lo;
+  uint64_t hi;
+
+  h = order2(num_chunks);
+  d_printf("updating tree of %d leaves from chunk %u\n", num_chunks, first_chunk);
+
+  for (l = 1; l <= h; l++) {
+    /* blocks of level "l" holding the changed leaves */
+    lo = (2 * (uint64_t)first_chunk) & ~((2ULL << l) - 1);
+    hi = ((2 * (uint64_t)(num_chunks - 1)) | ((2ULL << l) - 1)) + 1;
+    update_sha_levels(t, lo, hi, l, l);
   }
 }
@@ -26,8 +26,12 @@
 #ifndef _MT_H_
 #define _MT_H_
 
+#include "mt_hash.h"
+#include <pthread.h>
 #include <stdint.h>
 
+#define MT_BLOCK_LEVELS 10 /* levels hashed in one block by update_sha(), 2^10 leaves fit in L2 cache */
+
 enum chunk_state { CH_EMPTY = 0, CH_ACTIVE };
 
 enum chunk_downloaded { CH_NO = 0, CH_YES };
@@ -35,33 +39,50 @@ enum chunk_downloaded { CH_NO = 0, CH_YES };
 struct chunk {
   uint64_t offset; /* offset in file where chunk begins [bytes] */
   uint32_t len;    /* length of the chunk */
-  char sha[20 + 1];
-  struct node *node;
+  uint8_t sha[MT_HASH_MAX_LEN];
   enum chunk_state state;
   enum chunk_downloaded downloaded;
 };
 
-enum node_state {
-  EMPTY = 0,
-  INITIALIZED,
-  ACTIVE,
-  SENT /* seeder already sent this sha to leecher */
+/*
+ * Merkle tree stored as flat arrays indexed by bin number of the node:
+ * leaves have even numbers, node on level "l" has "l" lowest bits set and
+ * its parent, sibling and children are computed from the number itself
+ */
+struct mt_tree {
+  const struct mt_hash *hash; /* hash function of the tree */
+  uint8_t *sha;    /* hash of node "n" is at sha + hash->len * n, zero for padding nodes */
+  uint8_t *active; /* bitmap - bit "n" is set when node "n" has proper hash */
+  uint32_t nl;     /* number of leaves - power of 2 */
+  uint32_t root;   /* number of the root node */
+  void *map;       /* mapping of on-disk cache holding "sha" or NULL if "sha" is allocated */
+  uint64_t map_size;
 };
-struct node {
-  int number;                         /* number of the node */
-  struct node *left, *right, *parent; /* if parent == NULL - it is root node of the tree */
-  struct chunk *chunk;                /* pointer to chunk */
-  char sha[20 + 1];
-  enum node_state state;
+
+#define MT_SHA(t, n)       ((t)->sha + (t)->hash->len * (uint64_t)(n))
+#define MT_IS_ACTIVE(t, n) ((t)->active[(n) / 8] & (1 << ((n) % 8)))
+
+/* state shared by threads of update_sha() */
+struct mt_sha_work {
+  struct mt_tree *t;
+  int h;
+  int nc;
+  int next_block; /* next block of current pass to hash, taken with atomic increment */
+  pthread_barrier_t barrier;
 };
 
 int order2(uint32_t /*val*/);
-struct node *build_tree(int /*num_chunks*/, struct node ** /*ret*/);
-void show_tree_root_based(struct node * /*t*/);
-struct node *find_sibling(struct node * /*n*/);
-void interval_min_max(struct node * /*i*/, struct node * /*min*/, struct node * /*max*/);
-void dump_tree(struct node * /*t*/, int /*l*/);
-void dump_chunk_tab(struct chunk * /*c*/, int /*l*/);
-void update_sha(struct node * /*t*/, int /*num_chunks*/);
+uint32_t build_tree(int /*num_chunks*/, const struct mt_hash * /*hash*/, struct mt_tree * /*t*/);
+void free_tree(struct mt_tree * /*t*/);
+void mt_set_active(struct mt_tree * /*t*/, uint32_t /*n*/);
+int mt_level(uint32_t /*n*/);
+uint32_t mt_parent(uint32_t /*n*/);
+void show_tree_root_based(uint32_t /*n*/);
+uint32_t find_sibling(uint32_t /*n*/);
+void interval_min_max(uint32_t /*n*/, uint32_t * /*min*/, uint32_t * /*max*/);
+void dump_tree(struct mt_tree * /*t*/);
+void dump_chunk_tab(struct chunk * /*c*/, int /*l*/, const struct mt_hash * /*hash*/);
+void update_sha(struct mt_tree * /*t*/, int /*num_chunks*/, int /*threads*/);
+void update_sha_tail(struct mt_tree * /*t*/, int /*num_chunks*/, uint32_t /*first_chunk*/);
 
 #endif /* _MT_H_ */
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * persistent cache of Merkle trees of seeded files
+ *
+ * Every seeded file has one cache file in seeder->cache_dir named after
+ * SHA-1 of the file's real path. It keeps identity of the file (size, mtime,
+ * inode, chunk size) and the whole hash tree, so after restart the tree of an
+ * unchanged file is just mapped instead of hashing the file again.
+ */
+
+#include "mt_cache.h"
+#include "debug.h"
+#include "mt.h"
+#include "peer.h"
+#include "sha1.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* full path of cache file of the seeded file "f" */
+INTERNAL_LINKAGE
+void
+mt_cache_path(struct peer *seeder, struct file_list_entry *f, char *path, size_t len)
+{
+  char real[PATH_MAX];
+  char hex[40 + 1];
+  uint8_t digest[20];
+  int y;
+  SHA1Context context;
+
+  if (realpath(f->path, real) == NULL) {
+    snprintf(real, sizeof(real), "%s", f->path);
+  }
+
+  SHA1Reset(&context);
+  SHA1Input(&context, (uint8_t *)real, strlen(real));
+  SHA1Result(&context, digest);
+  for (y = 0; y < 20; y++) {
+    sprintf(hex + 2 * y, "%02x", digest[y]);
+  }
+
+  snprintf(path, len, "%s/%s.mt", seeder->cache_dir, hex);
+}
+
+/*
+ * map cached tree of file "f" opened by process_file_begin()
+ * returns 0 if the tree is valid for the current contents of the file and has
+ * been set as f->tree, -1 if the file has to be hashed
+ */
+INTERNAL_LINKAGE
+int
+mt_cache_load(struct peer *seeder, struct file_list_entry *f)
+{
+  char path[PATH_MAX];
+  int fd;
+  uint64_t size;
+  uint8_t *map;
+  struct stat st;
+  struct mt_cache_header *h;
+
+  if ((seeder->cache_dir == NULL) || (f->nc == 0)) {
+    return -1;
+  }
+
+  mt_cache_path(seeder, f, path, sizeof(path));
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    d_printf("no cached tree for %s: %s\n", f->path, strerror(errno));
+    return -1;
+  }
+
+  size = sizeof(struct mt_cache_header) + 2 * (uint64_t)f->nl * seeder->merkle_hash->len;
+  if ((fstat(fd, &st) != 0) || ((uint64_t)st.st_size != size)) {
+    d_printf("cached tree %s of %s has wrong size\n", path, f->path);
+    close(fd);
+    return -1;
+  }
+
+  map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    d_printf("cannot map cached tree %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  h = (struct mt_cache_header *)map;
+  if ((memcmp(h->magic, MT_CACHE_MAGIC, sizeof(h->magic)) != 0) || (h->version != MT_CACHE_VERSION)
+      || (h->nl != f->nl) || (memcmp(&h->id, &f->cache_id, sizeof(h->id)) != 0)) {
+    d_printf("cached tree of %s is stale\n", f->path);
+    munmap(map, size);
+    return -1;
+  }
+
+  /* the seeder never modifies the tree so hashes are used right from the mapping */
+  memset(&f->tree, 0, sizeof(f->tree));
+  f->tree.hash = seeder->merkle_hash;
+  f->tree.sha = map + sizeof(struct mt_cache_header);
+  f->tree.active = malloc((2 * (uint64_t)f->nl + 7) / 8);
+  memset(f->tree.active, 0xff, (2 * (uint64_t)f->nl + 7) / 8);
+  f->tree.nl = f->nl;
+  f->tree.root = f->nl - 1;
+  f->tree.map = map;
+  f->tree.map_size = size;
+
+  d_printf("tree of %s loaded from %s\n", f->path, path);
+  return 0;
+}
+
+/*
+ * save just computed tree of file "f", unless the file has changed while it
+ * was being hashed
+ */
+INTERNAL_LINKAGE
+void
+mt_cache_store(struct peer *seeder, struct file_list_entry *f)
+{
+  char path[PATH_MAX];
+  char tmp[PATH_MAX + 16];
+  int fd;
+  ssize_t n;
+  uint64_t off;
+  uint64_t len;
+  struct stat st;
+  struct mt_cache_header h;
+
+  if ((seeder->cache_dir == NULL) || (f->nc == 0)) {
+    return;
+  }
+
+  if ((fstat(f->fd, &st) != 0) || ((uint64_t)st.st_size != f->cache_id.file_size)
+      || ((uint64_t)st.st_mtim.tv_sec != f->cache_id.mtime_sec)
+      || ((uint64_t)st.st_mtim.tv_nsec != f->cache_id.mtime_nsec)) {
+    d_printf("%s changed during hashing - not caching its tree\n", f->path);
+    return;
+  }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MT_CACHE_MAGIC, sizeof(h.magic));
+  h.version = MT_CACHE_VERSION;
+  h.nl = f->nl;
+  h.id = f->cache_id;
+
+  /* write to temporary file and rename it, so readers see either old or complete new cache file */
+  mt_cache_path(seeder, f, path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    printf("cannot create tree cache file %s: %s\n", tmp, strerror(errno));
+    return;
+  }
+
+  off = 0;
+  len = 2 * (uint64_t)f->nl * f->tree.hash->len;
+  if (write(fd, &h, sizeof(h)) != sizeof(h)) {
+    len = 1; /* fail below */
+  }
+  while (off < len) {
+    n = write(fd, f->tree.sha + off, len - off);
+    if (n <= 0) {
+      break;
+    }
+    off += n;
+  }
+  close(fd);
+
+  if ((off != len) || (rename(tmp, path) != 0)) {
+    printf("cannot write tree cache file %s: %s\n", path, strerror(errno));
+    unlink(tmp);
+    return;
+  }
+
+  d_printf("tree of %s saved to %s\n", f->path, path);
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MT_CACHE_H_
+#define _MT_CACHE_H_
+
+#include <stdint.h>
+
+#define MT_CACHE_MAGIC   "PPSPPMT"
+#define MT_CACHE_VERSION 2
+
+struct peer;
+struct file_list_entry;
+
+/* identity of the seeded file - the cached tree is valid only if all of it matches */
+struct mt_cache_id {
+  uint64_t file_size;
+  uint64_t mtime_sec;
+  uint64_t mtime_nsec;
+  uint64_t ino;
+  uint64_t dev;
+  uint32_t chunk_size;
+  uint32_t hash_func; /* MERKLE_HASH_FUNC of the tree */
+};
+
+/*
+ * on-disk format of one cache file, stored in host byte order:
+ * header followed by hashes of all 2 * nl nodes of the tree in bin order
+ */
+struct mt_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nl; /* number of leaves of the tree */
+  struct mt_cache_id id;
+};
+
+int mt_cache_load(struct peer * /*seeder*/, struct file_list_entry * /*f*/);
+void mt_cache_store(struct peer * /*seeder*/, struct file_list_entry * /*f*/);
+
+#endif /* _MT_CACHE_H_ */
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * hash functions of Merkle trees
+ *
+ * SHA-1 is the only one libswift understands and stays the default,
+ * SHA-256 and BLAKE3 are negotiated with MERKLE_HASH_FUNC option of the
+ * handshake. Tree, INTEGRITY messages and chunk verification take the
+ * digest length and the hashing routine from "struct mt_hash".
+ */
+
+#include "mt_hash.h"
+#include "blake3.h"
+#include "peer.h"
+#include "sha1_mb.h"
+#include "sha256.h"
+#include <stdio.h>
+#include <string.h>
+
+INTERNAL_LINKAGE
+int
+mt_hash_one_lane(void)
+{
+  return 1;
+}
+
+static const struct mt_hash mt_hashes[] = {
+  {MT_HASH_SHA1, 20, "sha1", sha1_mb_lanes, sha1_mb},
+  {MT_HASH_SHA256, SHA256_HASH_SIZE, "sha256", mt_hash_one_lane, sha256_mb},
+  {MT_HASH_BLAKE3, BLAKE3_HASH_SIZE, "blake3", blake3_lanes, blake3_mb},
+};
+
+/*
+ * returns hash function with given MERKLE_HASH_FUNC value or NULL if it is
+ * not supported
+ */
+INTERNAL_LINKAGE
+const struct mt_hash *
+mt_hash_by_func(uint8_t func)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(mt_hashes) / sizeof(mt_hashes[0]); i++) {
+    if (mt_hashes[i].func == func) {
+      return &mt_hashes[i];
+    }
+  }
+  return NULL;
+}
+
+INTERNAL_LINKAGE
+const struct mt_hash *
+mt_hash_by_name(const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(mt_hashes) / sizeof(mt_hashes[0]); i++) {
+    if (strcmp(mt_hashes[i].name, name) == 0) {
+      return &mt_hashes[i];
+    }
+  }
+  return NULL;
+}
+
+INTERNAL_LINKAGE
+void
+mt_hash_digest(const struct mt_hash *h, const uint8_t *msg, size_t len, uint8_t *digest)
+{
+  h->digest_mb(&msg, len, 1, digest);
+}
+
+/*
+ * print the digest as hex string, "hex" must have room for
+ * 2 * MT_HASH_MAX_LEN + 1 characters
+ */
+INTERNAL_LINKAGE
+void
+mt_hash_hex(const struct mt_hash *h, const uint8_t *digest, char *hex)
+{
+  int i;
+
+  for (i = 0; i < h->len; i++) {
+    sprintf(hex + 2 * i, "%02x", digest[i] & 0xff);
+  }
+  hex[2 * h->len] = '\0';
+}
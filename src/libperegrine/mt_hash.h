@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MT_HASH_H_
+#define _MT_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * values of the MERKLE_HASH_FUNC handshake option, RFC 7574 section 7.5 -
+ * BLAKE3 has no number assigned, it is taken from the unassigned range and
+ * offered only between Peregrine peers
+ */
+#define MT_HASH_SHA1   0
+#define MT_HASH_SHA256 2
+#define MT_HASH_BLAKE3 128
+
+#define MT_HASH_MAX_LEN   32 /* longest digest of all the supported functions */
+#define MT_HASH_MAX_LANES 16 /* largest number of messages hashed at once by "digest_mb" */
+
+struct mt_hash {
+  uint8_t func; /* MERKLE_HASH_FUNC value */
+  uint8_t len;  /* length of the digest [bytes] */
+  const char *name;
+  int (*lanes)(void); /* number of messages "digest_mb" hashes at once */
+  /* digests of "n" messages of "len" bytes each, digest of msgs[i] is stored at digests + len * i */
+  void (*digest_mb)(const uint8_t *const * /*msgs*/, size_t /*len*/, int /*n*/, uint8_t * /*digests*/);
+};
+
+const struct mt_hash *mt_hash_by_func(uint8_t /*func*/);
+const struct mt_hash *mt_hash_by_name(const char * /*name*/);
+void mt_hash_digest(const struct mt_hash * /*h*/, const uint8_t * /*msg*/, size_t /*len*/, uint8_t * /*digest*/);
+void mt_hash_hex(const struct mt_hash * /*h*/, const uint8_t * /*digest*/, char * /*hex*/);
+
+#endif /* _MT_HASH_H_ */
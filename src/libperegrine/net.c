@@ -24,18 +24,24 @@
  */
 
 #include "net.h"
+#include "batch.h"
 #include "config.h"
 #include "debug.h"
+#include "download_sched.h"
 #include "mt.h"
 #include "peer.h"
+#include "peer_hash.h"
 #include "ppspp_protocol.h"
-#include "sha1.h"
-#include "wqueue.h"
+#include "proto_helper.h"
+#include "ring.h"
+#include "sink.h"
+#include "window.h"
 #include <arpa/inet.h>
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
 #include <mqueue.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -45,6 +51,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/queue.h>
 #include <sys/select.h>
 #include <sys/socket.h>
@@ -229,6 +236,10 @@ swift_leecher_cond_lock_init(struct peer *p)
   return 0;
 }
 
+/*
+ * wait for command from the main leecher process - the wake up is consumed,
+ * so a command sent while the worker was busy isn't lost
+ */
 INTERNAL_LINKAGE
 int
 swift_leecher_cond_sleep(struct peer *p)
@@ -243,6 +254,7 @@ swift_leecher_cond_sleep(struct peer *p)
     }
 
   } while (1);
+  p->leecher_cond = L_SLEEP;
   pthread_mutex_unlock(&p->leecher_mutex);
 
   return 0;
@@ -432,10 +444,8 @@ swift_seeder_worker(void *data)
   int data_payload_len;
   int h_resp_len;
   int opts_len;
-  int s;
-  int y;
   char *bn;
-  char buf[40 + 1];
+  char buf[2 * MT_HASH_MAX_LEN + 1];
   uint8_t opts[1024]; /* buffer for encoded options */
   char swarm_id[] = "swarm_id";
   char handshake_resp[256];
@@ -466,8 +476,8 @@ swift_seeder_worker(void *data)
   pos.minimum_version = 1;
   pos.swarm_id_len = strlen(swarm_id);
   pos.swarm_id = (uint8_t *)swarm_id;
-  pos.content_prot_method = 1; /* merkle hash tree */
-  pos.merkle_hash_func = 0;    /* 0 = sha-1 */
+  pos.content_prot_method = 1;                   /* merkle hash tree */
+  pos.merkle_hash_func = we->merkle_hash->func; /* hash function of all the seeded files */
   pos.live_signature_alg = 5;  /* should be taken from DNSSEC */
   pos.chunk_addr_method = 2;   /* 2 = 32 bit chunk ranges */
   *(unsigned int *)pos.live_disc_wind = 0x12345678;
@@ -550,7 +560,7 @@ swift_seeder_worker(void *data)
       _assert((unsigned long int)opts_len <= sizeof(opts), "%s but has value: %d\n", "opts_len should be <= 1024",
               opts_len);
 
-      h_resp_len = make_handshake_have(handshake_resp, p->dest_chan_id, 0xfeedbabe, opts, opts_len, p);
+      h_resp_len = make_handshake_have(handshake_resp, p->dest_chan_id, p->src_chan_id, opts, opts_len, p);
 
       _assert((unsigned long int)h_resp_len <= sizeof(handshake_resp), "%s but has value: %d\n",
               "h_resp_len should be <= 256", h_resp_len);
@@ -576,11 +586,7 @@ swift_seeder_worker(void *data)
          thread
       */
       if (p->file_list_entry == NULL) {
-	s = 0;
-	for (y = 0; y < 20; y++) {
-	  s += sprintf(buf + s, "%02x", p->sha_demanded[y] & 0xff);
-	}
-	buf[40] = '\0';
+	mt_hash_hex(we->merkle_hash, p->sha_demanded, buf);
 	d_printf("Error: there is no file with hash %s for %s:%d. Closing "
 	         "connection.\n",
 	         buf, inet_ntoa(p->leecher_addr.sin_addr), ntohs(p->leecher_addr.sin_port));
@@ -774,12 +780,17 @@ net_seeder(struct peer *seeder)
 
   SLIST_INIT(&seeder->peers_list_head);
   pthread_mutex_init(&seeder->peers_list_head_mutex, NULL);
+  seeder->peers_hash = peer_hash_create();
+  if (seeder->peers_hash == NULL) {
+    d_printf("%s", "cannot allocate memory for peers hash\n");
+    abort();
+  }
 
   while (1) {
     /* invoke garbage collector */
     if (remove_dead_peers == 1) {
       pthread_mutex_lock(&seeder->peers_list_head_mutex);
-      cleanup_all_dead_peers(&seeder->peers_list_head);
+      cleanup_all_dead_peers(&seeder->peers_list_head, seeder->peers_hash);
       pthread_mutex_unlock(&seeder->peers_list_head_mutex);
     }
 
@@ -789,10 +800,8 @@ net_seeder(struct peer *seeder)
       d_printf("%s", "ERROR in recvfrom\n");
     }
 
-    /* locate peer basing on IP address and UDP port */
-    pthread_mutex_lock(&seeder->peers_list_head_mutex);
-    struct peer *p = ip_port_to_peer(seeder, &seeder->peers_list_head, &clientaddr);
-    pthread_mutex_unlock(&seeder->peers_list_head_mutex);
+    /* locate peer basing on channel id or IP address and UDP port */
+    struct peer *p = seeder_find_peer(seeder->peers_hash, buf, n, &clientaddr);
 
     if ((p == NULL) && (message_type(buf) != HANDSHAKE)) {
       continue;
@@ -803,7 +812,7 @@ net_seeder(struct peer *seeder)
       if (handshake_type(buf) == HANDSHAKE_INIT) {
 	p = new_peer(&clientaddr, BUFSIZE, sockfd);
 	pthread_mutex_lock(&seeder->peers_list_head_mutex);
-	add_peer_to_list(&seeder->peers_list_head, p);
+	seeder_add_peer(seeder, seeder->peers_hash, p);
 	pthread_mutex_unlock(&seeder->peers_list_head_mutex);
 
 	_assert(n <= BUFSIZE, "%s but n has value: %d and BUFSIZE: %d\n", "n should be <= BUFSIZE", n, BUFSIZE);
@@ -912,18 +921,24 @@ net_seeder(struct peer *seeder)
   }
 }
 
+/*
+ * seeder side: parse HANDSHAKE received from leecher and send him HANDSHAKE +
+ * HAVE response
+ *
+ * returns 0 on success or -1 if we don't have the file demanded by leecher -
+ * in this case the leecher has just been sent the special empty HAVE response
+ * and the caller should close the connection
+ */
 INTERNAL_LINKAGE
-void *
-on_handshake(struct peer *p, void *recv_buf, uint16_t recv_len)
+int
+seeder_handshake_have(struct peer *p, void *recv_buf, uint16_t recv_len)
 {
   int n;
   int clientlen;
-  int sockfd;
   int h_resp_len;
   int opts_len;
-  int y;
   char *bn;
-  char buf[40 + 1];
+  char buf[2 * MT_HASH_MAX_LEN + 1];
   uint8_t opts[1024]; /* buffer for encoded options */
   char swarm_id[] = "swarm_id";
   char handshake_resp[256];
@@ -932,7 +947,6 @@ on_handshake(struct peer *p, void *recv_buf, uint16_t recv_len)
 
   clientlen = sizeof(struct sockaddr_in);
   we = p->seeder; /* our data (seeder) */
-  sockfd = p->sockfd;
 
   memset(&pos, 0, sizeof(struct proto_config));
   memset(&opts, 0, sizeof(opts));
@@ -943,8 +957,8 @@ on_handshake(struct peer *p, void *recv_buf, uint16_t recv_len)
   pos.minimum_version = 1;
   pos.swarm_id_len = strlen(swarm_id);
   pos.swarm_id = (uint8_t *)swarm_id;
-  pos.content_prot_method = 1; /* merkle hash tree */
-  pos.merkle_hash_func = 0;    /* 0 = sha-1 */
+  pos.content_prot_method = 1;                   /* merkle hash tree */
+  pos.merkle_hash_func = we->merkle_hash->func; /* hash function of all the seeded files */
   pos.live_signature_alg = 5;  /* should be taken from DNSSEC */
   pos.chunk_addr_method = 2;   /* 2 = 32 bit chunk ranges */
   *(unsigned int *)pos.live_disc_wind = 0x12345678;
@@ -975,31 +989,24 @@ on_handshake(struct peer *p, void *recv_buf, uint16_t recv_len)
   _assert((unsigned long int)opts_len <= sizeof(opts), "%s but has value: %d\n", "opts_len should be <= 1024",
           opts_len);
 
-  h_resp_len = make_handshake_have(handshake_resp, p->dest_chan_id, 0xfeedbabe, opts, opts_len, p);
+  h_resp_len = make_handshake_have(handshake_resp, p->dest_chan_id, p->src_chan_id, opts, opts_len, p);
 
   _assert((unsigned long int)h_resp_len <= sizeof(handshake_resp), "%s but has value: %d\n",
           "h_resp_len should be <= 256", h_resp_len);
   _assert(recv_len != 0, "%s but has value: %d\n", "recv_len should be != 0", recv_len);
 
   /* send HANDSHAKE + HAVE */
-  n = sendto(sockfd, handshake_resp, h_resp_len, 0, (struct sockaddr *)&p->leecher_addr, clientlen);
+  n = sendto(p->sockfd, handshake_resp, h_resp_len, 0, (struct sockaddr *)&p->leecher_addr, clientlen);
   if (n < 0) {
     d_printf("%s", "ERROR in sendto\n");
     abort();
   }
 
   if (p->file_list_entry == NULL) {
-    int s = 0;
-    for (y = 0; y < 20; y++) {
-      s += sprintf(buf + s, "%02x", p->sha_demanded[y] & 0xff);
-    }
-    buf[40] = '\0';
+    mt_hash_hex(we->merkle_hash, p->sha_demanded, buf);
     d_printf("Error: there is no file with hash %s for %s:%d. Closing connection.\n", buf,
              inet_ntoa(p->leecher_addr.sin_addr), ntohs(p->leecher_addr.sin_port));
-    p->finishing = 1;
-    p->to_remove = 1;      /* mark this particular peer to remove by GC */
-    remove_dead_peers = 1; /* set global flag for removing dead peers by garbage collector */
-    swift_seeder_cond_unlock(p);
+    return -1;
   }
 
   clock_gettime(CLOCK_MONOTONIC, &p->ts_last_send);
@@ -1010,127 +1017,363 @@ on_handshake(struct peer *p, void *recv_buf, uint16_t recv_len)
   p->chunk_size = we->chunk_size;
   p->recv_len = 0;
   p->sm_seeder = SM_WAIT_REQUEST;
-  swift_seeder_cond_unlock(p);
 
   return 0;
 }
 
 INTERNAL_LINKAGE
 void *
-on_request(struct peer *p, void *recv_buf, uint16_t recv_len)
+on_handshake(struct peer *p, void *recv_buf, uint16_t recv_len)
+{
+  if (seeder_handshake_have(p, recv_buf, recv_len) < 0) {
+    p->finishing = 1;
+    p->to_remove = 1;      /* mark this particular peer to remove by GC */
+    remove_dead_peers = 1; /* set global flag for removing dead peers by garbage collector */
+  }
+  swift_seeder_cond_unlock(p);
+
+  return 0;
+}
+
+/*
+ * seeder side: find leecher which sent datagram "buf" of "n" bytes - by our
+ * channel id at the beginning of the datagram, or by IP/PORT address for
+ * initial HANDSHAKE (channel 0) and for leechers not using our channel id
+ * doesn't take peers_list_head_mutex
+ */
+INTERNAL_LINKAGE
+struct peer *
+seeder_find_peer(struct peer_hash *hash, char *buf, int n, struct sockaddr_in *clientaddr)
+{
+  uint32_t chan_id;
+  struct peer *p;
+
+  p = NULL;
+  if (n >= (int)sizeof(uint32_t)) {
+    chan_id = be32toh(*(uint32_t *)buf);
+    if (chan_id != 0) {
+      p = chan_id_to_peer(hash, chan_id, clientaddr);
+    }
+  }
+
+  if (p == NULL) {
+    p = ip_port_to_peer(hash, clientaddr);
+  }
+
+  return p;
+}
+
+/*
+ * seeder side: send datagram prepared in "buf" to leecher "p" - immediately or
+ * by queueing it in "tx" batch if given
+ */
+INTERNAL_LINKAGE
+void
+seeder_send(struct peer *p, struct tx_batch *tx, char *buf, int len)
 {
-  int clientlen;
-  int data_payload_len;
   int n;
-  char mq_buf[BUFSIZE + 1];
-  ssize_t st;
 
-  clientlen = sizeof(struct sockaddr_in);
+  if (tx != NULL) {
+    tx_batch_commit(tx, len, &p->leecher_addr);
+    return;
+  }
 
-  dump_request(recv_buf, recv_len, p);
+  n = sendto(p->sockfd, buf, len, 0, (struct sockaddr *)&p->leecher_addr, sizeof(struct sockaddr_in));
+  if (n < 0) {
+    d_printf("%s", "ERROR in sendto\n");
+    abort();
+  }
+}
+
+/*
+ * seeder side: send datagram consisting of "len" bytes of headers prepared in "buf" followed
+ * by chunk contents "payload" pointing to file mapping - the chunk is never copied to "buf",
+ * kernel gathers both parts of the datagram itself
+ */
+INTERNAL_LINKAGE
+void
+seeder_send_data(struct peer *p, struct tx_batch *tx, char *buf, int len, struct iovec *payload)
+{
+  struct iovec iov[2];
+  struct msghdr msg;
 
-  p->curr_chunk = p->start_chunk; /* set beginning number of chunk for DATA0 */
+  if (tx != NULL) {
+    tx_batch_commit_data(tx, len, payload, p->file_list_entry, &p->leecher_addr);
+    return;
+  }
 
-  do {
-    /* shouldn't be here a loop? */
-    if (p->data_bmp[p->curr_chunk / 8] & (1 << (p->curr_chunk % 8))) {
-      d_printf("DATA %lu already sent - skipping\n", p->curr_chunk);
-      p->curr_chunk++;
-    }
+  iov[0].iov_base = buf;
+  iov[0].iov_len = len;
+  iov[1] = *payload;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &p->leecher_addr;
+  msg.msg_namelen = sizeof(struct sockaddr_in);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  if (sendmsg(p->sockfd, &msg, 0) < 0) {
+    d_printf("%s", "ERROR in sendmsg\n");
+    abort();
+  }
+}
+
+/*
+ * seeder side: send INTEGRITY and DATA of chunk p->curr_chunk to leecher
+ * both messages are sent in one datagram if they fit in MTU, otherwise
+ * INTEGRITY and DATA go in two separate datagrams
+ * if "tx" is not NULL datagrams are only queued in it and sent when the batch
+ * is flushed
+ */
+INTERNAL_LINKAGE
+void
+send_integrity_data(struct peer *p, struct tx_batch *tx)
+{
+  char *buf;
+  int data_hdr_len;
+  int l;
+  int n;
+  struct iovec payload;
 
-    n = make_integrity_reverse(p->send_buf, p, p->seeder);
+  buf = (tx != NULL) ? tx_batch_slot(tx) : p->send_buf;
 
-    _assert(n <= BUFSIZE, "%s but n has value: %d and BUFSIZE: %d\n", "n should be <= BUFSIZE", n, BUFSIZE);
+  n = make_integrity_reverse(buf, p, p->seeder);
 
-    /* check if there is enough space in MTU to send all the INTEGRITY messages
-     * and DATA in one packet */
-    if (n + 4 + 1 + 4 + 4 + 8 + 20 + 8 + p->seeder->chunk_size
-        <= BUFSIZE) { /* 4:chan_id, 1: DATA message id=1, 4:start, 4:end,
-                         8:timestamp, 20: ip, 8: udp */
+  _assert(n <= BUFSIZE, "%s but n has value: %d and BUFSIZE: %d\n", "n should be <= BUFSIZE", n, BUFSIZE);
 
-      /* yes there is enough space so we can send INTEGRITY and DATA together in
-       * one frame */
-      data_payload_len = make_data_no_chanid(p->send_buf + n, p);
+  /* check if there is enough space in MTU to send all the INTEGRITY messages
+   * and DATA in one packet */
+  if (n + 4 + 1 + 4 + 4 + 8 + 20 + 8 + p->seeder->chunk_size
+      > BUFSIZE) { /* 4:chan_id, 1: DATA message id=1, 4:start, 4:end,
+                      8:timestamp, 20: ip, 8: udp */
 
-      _assert((uint32_t)data_payload_len <= p->seeder->chunk_size + 4 + 1 + 4 + 4 + 8,
-              "%s but data_payload_len has value: %d and we->chunk_size: %u\n",
-              "data_payload_len should be <= we->chunk_size", data_payload_len, p->seeder->chunk_size);
+    /* no - there is not enough space in MTU so we need to send INTEGRITY and
+     * DATA in separate frames */
 
-      _assert(n + data_payload_len <= BUFSIZE, "we're trying to send too long UDP datagram: %d, should be <= %d\n",
-              n + data_payload_len, BUFSIZE);
+    /* first - send frame with INTEGRITY messages */
+    seeder_send(p, tx, buf, n);
 
-      /* send DATA datagram with contents of the chunk */
-      n = sendto(p->sockfd, p->send_buf, n + data_payload_len, 0, (struct sockaddr *)&p->leecher_addr, clientlen);
-      if (n < 0) {
-	d_printf("%s", "ERROR in sendto\n");
-	abort();
-      }
+    /* next DATA message goes in its own datagram */
+    buf = (tx != NULL) ? tx_batch_slot(tx) : p->send_buf;
+    n = pack_dest_chan(buf, p->dest_chan_id);
+  }
+
+  data_hdr_len = make_data_hdr_no_chanid(buf + n, p);
+  n += data_hdr_len;
+
+  if (file_entry_chunk_iov(p->file_list_entry, p->curr_chunk, p->chunk_size, &payload) == 0) {
+    _assert(n + payload.iov_len <= BUFSIZE, "we're trying to send too long UDP datagram: %zu, should be <= %d\n",
+            n + payload.iov_len, BUFSIZE);
+
+    /* send DATA datagram with contents of the chunk taken directly from file mapping */
+    seeder_send_data(p, tx, buf, n, &payload);
+  } else {
+    /* file is not mapped - read the chunk after DATA header */
+    l = file_entry_read_chunk(p->file_list_entry, p->curr_chunk, p->chunk_size, buf + n);
+    if (l < 0) {
+      d_printf("error reading file: %s\n", p->fname);
+      return;
+    }
+
+    _assert(n + l <= BUFSIZE, "we're trying to send too long UDP datagram: %d, should be <= %d\n", n + l, BUFSIZE);
+
+    /* send DATA datagram with contents of the chunk */
+    seeder_send(p, tx, buf, n + l);
+  }
+  p->data_bmp[p->curr_chunk / 8] |= 1 << (p->curr_chunk % 8);
+
+  clock_gettime(CLOCK_MONOTONIC, &p->ts_last_send);
+  p->d_last_send = DATA;
+}
+
+/*
+ * seeder side: send INTEGRITY and DATA of chunks first..last to leecher with
+ * UDP GSO - hashes needed for verification of all the chunks go ahead in as few
+ * datagrams as possible, then DATA messages of equal size are cut into
+ * datagrams by kernel from one send
+ * returns 0 on success or -1 if the chunks can't be sent this way - no DATA
+ * has been sent then and the caller should send the chunks one by one
+ */
+INTERNAL_LINKAGE
+int
+send_integrity_data_train(struct peer *p, struct tx_batch *tx, uint64_t first, uint64_t last)
+{
+  char *buf;
+  char ibuf[BUFSIZE];
+  char hdr[GSO_MAX_SEGS][4 + 1 + 4 + 4 + 8]; /* 4:chan_id, 1: DATA message id=1, 4:start, 4:end, 8:timestamp */
+  int i;
+  int l;
+  int n;
+  int num;
+  int seg_size;
+  uint64_t c;
+  struct iovec iov[2 * GSO_MAX_SEGS];
+
+  num = last - first + 1;
+  seg_size = sizeof(hdr[0]) + p->chunk_size;
+  if ((__atomic_load_n(&p->seeder->gso, __ATOMIC_RELAXED) == 0) || (num < 2) || (num > GSO_MAX_SEGS)
+      || (num * seg_size > GSO_MAX_SIZE)) {
+    return -1;
+  }
+
+  /* all the chunks must be in file mapping and only the last one may be shorter */
+  for (i = 0; i < num; i++) {
+    if (file_entry_chunk_iov(p->file_list_entry, first + i, p->chunk_size, &iov[2 * i + 1]) != 0) {
+      return -1;
+    }
+    if ((i < num - 1) && (iov[2 * i + 1].iov_len != p->chunk_size)) {
+      return -1;
+    }
+  }
 
-      p->data_bmp[p->curr_chunk / 8] |= 1 << (p->curr_chunk % 8);
+  /* INTEGRITY messages of all the chunks - each make_integrity_reverse() result starts with dest_chan_id */
+  buf = NULL;
+  n = 0;
+  for (c = first; c <= last; c++) {
+    p->curr_chunk = c;
+    l = make_integrity_reverse(ibuf, p, p->seeder);
+    if (l <= (int)sizeof(uint32_t)) { /* leecher already has all the hashes for this chunk */
+      continue;
+    }
+    if ((buf != NULL) && (n + l - (int)sizeof(uint32_t) > BUFSIZE)) {
+      seeder_send(p, tx, buf, n);
+      buf = NULL;
+    }
+    if (buf == NULL) {
+      buf = (tx != NULL) ? tx_batch_slot(tx) : p->send_buf;
+      memcpy(buf, ibuf, l);
+      n = l;
     } else {
-      /* no - there is not enough space in MTU so we need to send INTEGRITY and
-       * DATA in separate frames */
+      memcpy(buf + n, ibuf + sizeof(uint32_t), l - sizeof(uint32_t));
+      n += l - sizeof(uint32_t);
+    }
+  }
+  if (buf != NULL) {
+    seeder_send(p, tx, buf, n);
+  }
+  if (tx != NULL) { /* hashes must reach leecher before DATA */
+    tx_batch_flush(tx);
+  }
 
-      /* first - send frame with INTEGRITY messages */
-      n = sendto(p->sockfd, p->send_buf, n, 0, (struct sockaddr *)&p->leecher_addr, clientlen);
-      if (n < 0) {
-	d_printf("%s", "ERROR in sendto\n");
-	abort();
-      }
+  for (i = 0; i < num; i++) {
+    p->curr_chunk = first + i;
+    l = pack_dest_chan(hdr[i], p->dest_chan_id);
+    l += make_data_hdr_no_chanid(hdr[i] + l, p);
+    iov[2 * i].iov_base = hdr[i];
+    iov[2 * i].iov_len = l;
+  }
+
+  if (gso_send(p->sockfd, &p->leecher_addr, iov, 2 * num, seg_size) < 0) {
+    if ((errno == EIO) || (errno == EINVAL) || (errno == ENOPROTOOPT) || (errno == EOPNOTSUPP)) {
+      d_printf("UDP GSO send failed: %s - disabling it\n", strerror(errno));
+      __atomic_store_n(&p->seeder->gso, 0, __ATOMIC_RELAXED);
+    }
+    return -1;
+  }
 
-      /* next send DATA message with chunk's data */
-      data_payload_len = make_data(p->send_buf, p);
+  d_printf("DATA %lu..%lu sent in one GSO train\n", first, last);
+  for (c = first; c <= last; c++) {
+    p->data_bmp[c / 8] |= 1 << (c % 8);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &p->ts_last_send);
+  p->d_last_send = DATA;
 
-      _assert((uint32_t)data_payload_len <= p->seeder->chunk_size + 4 + 1 + 4 + 4 + 8,
-              "%s but data_payload_len has value: %d and we->chunk_size: %u\n",
-              "data_payload_len should be <= we->chunk_size", data_payload_len, p->seeder->chunk_size);
+  return 0;
+}
 
-      _assert(data_payload_len <= BUFSIZE, "we're trying to send too long UDP datagram: %d, should be <= %d\n",
-              data_payload_len, BUFSIZE);
+/*
+ * seeder side: take next message for worker of leecher "p" from ring "r" -
+ * sleep until it arrives, the peer is finishing or communication times out
+ * if "peek" is 1 the message is left in the ring
+ * returns length of the message or -1
+ */
+INTERNAL_LINKAGE
+int
+seeder_wait_msg(struct peer *p, struct ring *r, char *buf, int peek)
+{
+  int st;
+  int timeout_ms;
 
-      /* send DATA datagram with contents of the chunk */
-      n = sendto(p->sockfd, p->send_buf, data_payload_len, 0, (struct sockaddr *)&p->leecher_addr, clientlen);
-      if (n < 0) {
-	d_printf("%s", "ERROR in sendto\n");
-	abort();
-      }
-      p->data_bmp[p->curr_chunk / 8] |= 1 << (p->curr_chunk % 8);
+  timeout_ms = -1;
+  if ((p->seeder->timeout > 0) && (p->seeder->timeout < INT_MAX / 1000)) {
+    timeout_ms = p->seeder->timeout * 1000;
+  }
+
+  while (1) {
+    st = (peek != 0) ? ring_peek(r, buf, BUFSIZE) : ring_pop(r, buf, BUFSIZE);
+    if (st > 0) {
+      return st;
+    }
+    if (p->finishing != 0) {
+      return -1;
+    }
+    if (ring_wait(r, timeout_ms) < 0) {
+      d_printf("finishing thread due to timeout in communication: %#lx\n", (uint64_t)p);
+      p->finishing = 1;
+      p->to_remove = 1;      /* mark this particular peer to remove by GC */
+      remove_dead_peers = 1; /* set global flag for removing dead peers by garbage collector */
+      return -1;
     }
+  }
+}
 
-    /* libswift sends HAVE first - so get it from our high priority queue */
-    do {
-      pthread_mutex_lock(&p->hi_mutex);
-      st = wq_receive(&p->hi_wqueue, mq_buf, BUFSIZE);
-      pthread_mutex_unlock(&p->hi_mutex);
-      if (st <= 0) {
-	usleep(1000);
-      }
-    } while (st <= 0);
-
-    /* next libswift sends *sometimes* ACK - check if there is any in our
-     * high-prio queue, if yes - get it from queue */
-    do {
-      pthread_mutex_lock(&p->hi_mutex);
-      st = wq_peek(&p->hi_wqueue, mq_buf, BUFSIZE);
-      pthread_mutex_unlock(&p->hi_mutex);
-      if (st <= 0) {
-	usleep(1000);
+/*
+ * seeder side: send requested range of chunks keeping up to p->win_size of
+ * them in flight - every HAVE or ACK from leecher moves the window forward,
+ * chunks not confirmed in time are sent again
+ * next REQUESTs coming meanwhile are queued in the window and served in the
+ * same loop
+ */
+INTERNAL_LINKAGE
+void *
+on_request(struct peer *p, void *recv_buf, uint16_t recv_len)
+{
+  char mq_buf[BUFSIZE + 1];
+  int st;
+  int64_t left_us;
+  struct timespec ts;
+
+  dump_request(recv_buf, recv_len, p);
+
+  window_start(p);
+  window_fill(p, NULL);
+
+  while (window_done(p) == 0) {
+    /* take all the queued HAVE/ACK messages first - chunks freed by them are sent together then */
+    while (ring_pop(p->hi_ring, mq_buf, BUFSIZE) > 0) {
+      if ((mq_buf[0] == HAVE) || (mq_buf[0] == ACK)) {
+	window_on_msg(p, mq_buf);
       }
-    } while (st <= 0);
-
-    if (mq_buf[0] == ACK) {
-      do {
-	pthread_mutex_lock(&p->hi_mutex);
-	st = wq_receive(&p->hi_wqueue, mq_buf, BUFSIZE);
-	pthread_mutex_unlock(&p->hi_mutex);
-	if (st <= 0) {
-	  usleep(1000);
-	}
-      } while (st <= 0);
+    }
+    while (((st = ring_peek(p->low_ring, mq_buf, BUFSIZE)) > 0) && (mq_buf[0] == REQUEST)) {
+      ring_pop(p->low_ring, mq_buf, BUFSIZE);
+      dump_request(mq_buf, st, p);
+      window_start(p);
+    }
+    window_fill(p, NULL);
+    if (window_done(p) != 0) {
+      break;
+    }
+    if (p->finishing != 0) {
+      break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if ((p->seeder->timeout > 0) && (ts.tv_sec - p->ts_last_recv.tv_sec > p->seeder->timeout)) {
+      d_printf("finishing thread due to timeout in communication: %#lx\n", (uint64_t)p);
+      p->finishing = 1;
+      p->to_remove = 1;      /* mark this particular peer to remove by GC */
+      remove_dead_peers = 1; /* set global flag for removing dead peers by garbage collector */
+      break;
     }
 
-    p->curr_chunk++;
-  } while (p->curr_chunk <= p->end_chunk);
+    left_us = window_rto_left_us(p);
+    if (left_us == 0) {
+      window_on_timeout(p, NULL);
+      continue;
+    }
+    (void)ring_wait(p->hi_ring, (left_us < 0) ? 1000 : (int)((left_us + 999) / 1000));
+  }
 
   return 0;
 }
@@ -1154,22 +1397,11 @@ swift_seeder_worker_mq(void *data)
   memset(&opts, 0, sizeof(opts));
 
   while (p->finishing == 0) {
-    do {
-      pthread_mutex_lock(&p->low_mutex);
-      st = wq_receive(&p->low_wqueue, mq_buf, BUFSIZE);
-      pthread_mutex_unlock(&p->low_mutex);
-      if (st <= 0) {
-	usleep(1000);
-      }
-    } while ((st <= 0) && (p->finishing == 0));
-    if (p->finishing) {
+    st = seeder_wait_msg(p, p->low_ring, mq_buf, 0);
+    if (st < 0) {
       continue;
     }
 
-    if (st <= 0) {
-      abort();
-    }
-
     switch (mq_buf[0]) {
     case HANDSHAKE:
       on_handshake(p, mq_buf, st);
@@ -1192,33 +1424,140 @@ swift_seeder_worker_mq(void *data)
   abort();
 }
 
-/* UDP datagram server (SEEDER) */
+/*
+ * seeder side: pass messages from datagram received by shard "sh" from
+ * "clientaddr" to worker of that leecher
+ */
 INTERNAL_LINKAGE
-int
-net_seeder_mq(struct peer *seeder)
+void
+seeder_route_datagram(struct seeder_shard *sh, char *buf, int n, struct sockaddr_in *clientaddr)
 {
-  int sockfd;
-  int optval;
-  int n;
   int st;
   int off;
   int size;
   int skip_hdr;
-  char buf[BUFSIZE];
-  socklen_t clientlen;
-  struct sockaddr_in serveraddr;
-  struct sockaddr_in clientaddr;
   struct peer *p;
+  struct peer *seeder;
   pthread_t thread;
   unsigned int prio;
 
+  seeder = sh->seeder;
+
+  /* locate peer basing on channel id or IP address and UDP port */
+  p = seeder_find_peer(sh->peers_hash, buf, n, clientaddr);
+
+  if ((message_type(buf) == HANDSHAKE) && (n > 4)) { /* n > 4 to skip keepalive messages */
+    d_printf("%s", "OK HANDSHAKE\n");
+    if (handshake_type(buf) == HANDSHAKE_INIT) {
+      p = new_peer(clientaddr, BUFSIZE, sh->sockfd);
+      pthread_mutex_lock(&seeder->peers_list_head_mutex);
+      seeder_add_peer(seeder, sh->peers_hash, p);
+      pthread_mutex_unlock(&seeder->peers_list_head_mutex);
+
+      _assert(n <= BUFSIZE, "%s but n has value: %d and BUFSIZE: %d\n", "n should be <= BUFSIZE", n, BUFSIZE);
+
+      p->seeder = seeder;
+      p->hi_ring = ring_create(2 * window_max(seeder)); /* HAVE + ACK of every chunk of the send window */
+      p->low_ring = ring_create(RING_SLOTS);
+      if ((p->hi_ring == NULL) || (p->low_ring == NULL)) {
+	d_printf("%s", "cannot allocate message rings for new peer\n");
+	abort();
+      }
+
+      /* create worker thread for this client (leecher) */
+      st = pthread_create(&thread, NULL, &swift_seeder_worker_mq, p);
+      if (st != 0) {
+	d_printf("cannot create new thread: %s\n", strerror(errno));
+	abort();
+      }
+
+      d_printf("new pthread created: %#lx\n", (uint64_t)thread);
+
+      p->thread = thread;
+    } else if (handshake_type(buf) == HANDSHAKE_FINISH) {
+      /* does the seeder want to close connection? */
+      d_printf("%s", "FINISH\n");
+
+      if (p == NULL) {
+	d_printf("searched IP: %s:%d  n: %d\n", inet_ntoa(clientaddr->sin_addr), ntohs(clientaddr->sin_port), n);
+	pthread_mutex_lock(&seeder->peers_list_head_mutex);
+	SLIST_FOREACH(p, &seeder->peers_list_head, snext)
+	{
+	  d_printf("    IP: %s:%d\n", inet_ntoa(p->leecher_addr.sin_addr), ntohs(p->leecher_addr.sin_port));
+	}
+	pthread_mutex_unlock(&seeder->peers_list_head_mutex);
+      }
+
+      if (p != NULL) {
+	p->finishing = 1; /* set the flag for finishing the thread */
+	p->to_remove = 1;
+	/* worker may sleep waiting for a message */
+	ring_wake(p->low_ring);
+	ring_wake(p->hi_ring);
+	pthread_mutex_lock(&seeder->peers_list_head_mutex);
+	cleanup_peer(p);
+	pthread_mutex_unlock(&seeder->peers_list_head_mutex);
+      }
+      return;
+    }
+  }
+
+  if (n <= 4) { /* keep-alive? keep-alive has only dest_chan_id - and it takes
+                   4 bytes */
+    d_printf("%s", "KEEP-ALIVE?\n");
+    return;
+  }
+
+  if (p == NULL) {
+    d_printf("datagram from unknown peer %s:%u - dropping\n", inet_ntoa(clientaddr->sin_addr),
+             ntohs(clientaddr->sin_port));
+    return;
+  }
+
+  skip_hdr = 1; /* first message in udp payload always has dest_chan_id at
+                   offset [0] so skip it in interpretation  */
+  off = 0;
+  while (off < n) {
+    /* parse payload to separate messages */
+    size = count_message(buf + off, n - off, skip_hdr);
+    if (size <= 0) {
+      break;
+    }
+    prio = ((buf[off + skip_hdr * 4] == HAVE) || (buf[off + skip_hdr * 4] == ACK)) ? 1 : 0;
+
+    /* send the message to proper queue */
+    if (ring_push((prio == 0) ? p->low_ring : p->hi_ring, buf + skip_hdr * 4 + off, size - skip_hdr * 4) < 0) {
+      d_printf("queue of peer %s:%u is full or message is too long - dropping\n", inet_ntoa(clientaddr->sin_addr),
+               ntohs(clientaddr->sin_port));
+    }
+
+    off += size;
+    skip_hdr = 0;
+  }
+}
+
+/* UDP datagram server (SEEDER) */
+/* open UDP socket of seeder - several of them can share the port if "reuseport" is 1 */
+INTERNAL_LINKAGE
+int
+seeder_open_socket(struct peer *seeder, int reuseport)
+{
+  int sockfd;
+  int optval;
+  struct sockaddr_in serveraddr;
+
   sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   if (sockfd < 0) {
     d_printf("%s", "ERROR opening socket\n");
+    abort();
   }
 
   optval = 1;
   setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval, sizeof(int));
+  if ((reuseport != 0) && (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (const void *)&optval, sizeof(int)) < 0)) {
+    d_printf("cannot set SO_REUSEPORT: %s\n", strerror(errno));
+    abort();
+  }
 
   memset((char *)&serveraddr, 0, sizeof(serveraddr));
   serveraddr.sin_family = AF_INET;
@@ -1229,151 +1568,117 @@ net_seeder_mq(struct peer *seeder)
     d_printf("%s", "ERROR on binding\n");
   }
 
-  clientlen = sizeof(clientaddr);
-  remove_dead_peers = 0;
+  if ((seeder->gso != 0) && (gso_probe(sockfd) == 0)) {
+    seeder->gso = 0;
+  }
 
-  SLIST_INIT(&seeder->peers_list_head);
-  pthread_mutex_init(&seeder->peers_list_head_mutex, NULL);
+  return sockfd;
+}
+
+/*
+ * thread - router of one seeder's socket: receive datagrams and pass them to
+ * workers of leechers served by this shard
+ */
+INTERNAL_LINKAGE
+void *
+seeder_router(void *data)
+{
+  int i;
+  int n;
+  struct peer *seeder;
+  struct rx_batch *rx;
+  struct seeder_shard *sh;
+
+  sh = (struct seeder_shard *)data;
+  seeder = sh->seeder;
+
+  d_printf("router %d started\n", sh->idx);
+
+  rx = malloc(sizeof(struct rx_batch));
+  if (rx == NULL) {
+    d_printf("%s", "cannot allocate memory for receive batch\n");
+    abort();
+  }
+  rx_batch_init(rx);
 
   while (1) {
-    /* invoke garbage collector */
+    /* invoke garbage collector - each router frees only its own leechers, the others may be looked up
+     * by their routers in the meantime */
     if (remove_dead_peers == 1) {
       pthread_mutex_lock(&seeder->peers_list_head_mutex);
-      cleanup_all_dead_peers(&seeder->peers_list_head);
+      cleanup_all_dead_peers(&seeder->peers_list_head, sh->peers_hash);
       pthread_mutex_unlock(&seeder->peers_list_head_mutex);
     }
 
-    memset(buf, 0, BUFSIZE);
-    n = recvfrom(sockfd, buf, BUFSIZE, 0, (struct sockaddr *)&clientaddr, &clientlen);
+    /* wait for at least one datagram and take all the others already queued in the socket */
+    n = rx_batch_recv(rx, sh->sockfd, MSG_WAITFORONE);
     if (n < 0) {
-      d_printf("%s", "ERROR in recvfrom\n");
+      d_printf("ERROR in recvmmsg: %s\n", strerror(errno));
+      continue;
     }
 
-    /* locate peer basing on IP address and UDP port */
-    pthread_mutex_lock(&seeder->peers_list_head_mutex);
-    p = ip_port_to_peer(seeder, &seeder->peers_list_head, &clientaddr);
-    pthread_mutex_unlock(&seeder->peers_list_head_mutex);
-
-    if ((message_type(buf) == HANDSHAKE) && (n > 4)) { /* n > 4 to skip keepalive messages */
-      d_printf("%s", "OK HANDSHAKE\n");
-      if (handshake_type(buf) == HANDSHAKE_INIT) {
-	p = new_peer(&clientaddr, BUFSIZE, sockfd);
-	pthread_mutex_lock(&seeder->peers_list_head_mutex);
-	add_peer_to_list(&seeder->peers_list_head, p);
-	pthread_mutex_unlock(&seeder->peers_list_head_mutex);
-
-	_assert(n <= BUFSIZE, "%s but n has value: %d and BUFSIZE: %d\n", "n should be <= BUFSIZE", n, BUFSIZE);
-
-	p->seeder = seeder;
-	wq_init(&p->hi_wqueue);
-	wq_init(&p->low_wqueue);
-	pthread_mutex_init(&p->hi_mutex, NULL);
-	pthread_mutex_init(&p->low_mutex, NULL);
-
-	/* create worker thread for this client (leecher) */
-	st = pthread_create(&thread, NULL, &swift_seeder_worker_mq, p);
-	if (st != 0) {
-	  d_printf("cannot create new thread: %s\n", strerror(errno));
-	  abort();
-	}
-
-	d_printf("new pthread created: %#lx\n", (uint64_t)thread);
+    for (i = 0; i < n; i++) {
+      seeder_route_datagram(sh, rx->buf[i], rx->msgs[i].msg_len, &rx->addr[i]);
+    }
+  }
 
-	p->thread = thread;
-      } else if (handshake_type(buf) == HANDSHAKE_FINISH) {
-	/* does the seeder want to close connection? */
-	d_printf("%s", "FINISH\n");
+  return NULL;
+}
 
-	if (p == NULL) {
-	  d_printf("searched IP: %s:%d  n: %d\n", inet_ntoa(clientaddr.sin_addr), ntohs(clientaddr.sin_port), n);
-	  pthread_mutex_lock(&seeder->peers_list_head_mutex);
-	  SLIST_FOREACH(p, &seeder->peers_list_head, snext)
-	  {
-	    d_printf("    IP: %s:%d\n", inet_ntoa(p->leecher_addr.sin_addr), ntohs(p->leecher_addr.sin_port));
-	  }
-	  pthread_mutex_unlock(&seeder->peers_list_head_mutex);
-	}
+/*
+ * UDP datagram server (SEEDER)
+ *
+ * With seeder->sockets > 1 that many sockets are bound to the same port with
+ * SO_REUSEPORT. Kernel spreads leechers among them by hash of their address,
+ * so each socket gets its own router thread and its own table of leechers.
+ */
+INTERNAL_LINKAGE
+int
+net_seeder_mq(struct peer *seeder)
+{
+  int i;
+  int st;
+  int num_shards;
+  struct seeder_shard *sh;
 
-	if (p != NULL) {
-#if MQ_SYNC
-	  sm = mq_send(p->mq, buf, n, 0); /* send finishing message */
-#else
-	  /* swift_semaph_post(p->sem);	*/ /* wake up seeder worker and allow
-	                                      him finish his work */
-#endif
+  remove_dead_peers = 0;
 
-	  p->finishing = 1; /* set the flag for finishing the thread */
-	  p->to_remove = 1;
-	  pthread_mutex_lock(&seeder->peers_list_head_mutex);
-	  cleanup_peer(p);
-	  pthread_mutex_unlock(&seeder->peers_list_head_mutex);
+  SLIST_INIT(&seeder->peers_list_head);
+  pthread_mutex_init(&seeder->peers_list_head_mutex, NULL);
 
-	  free(p->integrity_bmp);
-	  free(p->data_bmp);
-	}
-	continue; // uncomment this for demonized operation
-	          // break;
-      }
+  num_shards = (seeder->sockets > 0) ? seeder->sockets : 1;
+  seeder->shards = malloc(num_shards * sizeof(struct seeder_shard));
+  if (seeder->shards == NULL) {
+    d_printf("%s", "cannot allocate memory for seeder sockets\n");
+    abort();
+  }
+  memset(seeder->shards, 0, num_shards * sizeof(struct seeder_shard));
+  seeder->num_shards = num_shards;
+
+  for (i = 0; i < num_shards; i++) {
+    sh = &seeder->shards[i];
+    sh->seeder = seeder;
+    sh->idx = i;
+    sh->sockfd = seeder_open_socket(seeder, (num_shards > 1) ? 1 : 0);
+    sh->peers_hash = peer_hash_create();
+    if (sh->peers_hash == NULL) {
+      d_printf("%s", "cannot allocate memory for peers hash\n");
+      abort();
     }
+  }
 
-    skip_hdr = 1; /* first message in udp payload always has dest_chan_id at
-                     offset [0] so skip it in interpretation  */
-    off = 0;
-    size = 0;
-    if (n > 4) { /* keep-alive? keep-alive has only dest_chan_id - and it takes
-                    4 bytes */
-      while (off < n) {
-	/* parse payload to separate messages */
-	switch (buf[off + skip_hdr * 4]) {
-	case HANDSHAKE:
-	  size = count_handshake(buf + off, n, skip_hdr);
-	  prio = 0;
-	  break;
-	case REQUEST:
-	  size = skip_hdr * 4 + 1 + 4 + 4;
-	  prio = 0;
-	  break;
-	case PEX_REQ:
-	  size = skip_hdr * 4 + 1;
-	  prio = 0;
-	  break;
-	case HAVE:
-	  size = skip_hdr * 4 + 1 + 4 + 4;
-	  prio = 1;
-	  break;
-	case ACK:
-	  size = skip_hdr * 4 + 1 + 4 + 4 + 8;
-	  prio = 1;
-	  break;
-	default:
-	  d_printf("another message: %d\n", buf[off + skip_hdr * 4]);
-	}
-
-	/* send the message to proper queue */
-	if (prio == 0) {
-	  pthread_mutex_lock(&p->low_mutex);
-	  wq_send(&p->low_wqueue, buf + skip_hdr * 4 + off, size);
-	  pthread_mutex_unlock(&p->low_mutex);
-	} else {
-	  pthread_mutex_lock(&p->hi_mutex);
-	  wq_send(&p->hi_wqueue, buf + skip_hdr * 4 + off, size);
-	  pthread_mutex_unlock(&p->hi_mutex);
-	}
-
-	off += size;
-	skip_hdr = 0;
-      }
-    } else {
-      d_printf("%s", "KEEP-ALIVE?\n");
+  /* shard 0 is served by the calling thread */
+  for (i = 1; i < num_shards; i++) {
+    st = pthread_create(&seeder->shards[i].thread, NULL, &seeder_router, &seeder->shards[i]);
+    if (st != 0) {
+      d_printf("cannot create router thread: %s\n", strerror(st));
+      abort();
     }
   }
-}
+  seeder->shards[0].thread = pthread_self();
+  seeder_router(&seeder->shards[0]);
 
-INTERNAL_LINKAGE
-void
-node_cache_init(struct peer *local_peer)
-{
-  SLIST_INIT(&local_peer->cache);
+  return 0;
 }
 
 INTERNAL_LINKAGE
@@ -1415,35 +1720,44 @@ print_sha2(const char *s1, const char *s2, int num)
   printf("%s\n", bufs);
 }
 
+/*
+ * verify hash "digest" of chunk "cn" (node number) just received in DATA
+ *
+ * Hashes of the siblings come from INTEGRITY and can be trusted only together
+ * with a node which has been verified before, so the walk from the leaf to the
+ * root stops at the first node set in verified_bmp or at the subroot of HAVE
+ * range, sent by the seeder as peak hash. Usually the leaf itself or its parent
+ * has already been verified by the previous chunk, so only the payload hash and
+ * at most one parent hash are calculated. On success hashes of the walked
+ * nodes are stored in the tree and they are marked verified together with their
+ * siblings.
+ *
+ * returns 0 if the chunk is correct, -EAGAIN if some hash needed for
+ * verification hasn't arrived in INTEGRITY yet
+ */
 INTERNAL_LINKAGE
 int
-swift_verify_chunk(struct peer *local_peer, struct node *cn)
+swift_verify_chunk(struct peer *local_peer, uint32_t cn, const uint8_t *digest)
 {
-  char buf[40 + 1];
-  char bufs[80 + 1];
-  char zero[20];
-  uint8_t sha_buf[40 + 1];
-  uint8_t cmp;
+  uint8_t buf[2 * MT_HASH_MAX_LEN];
+  uint8_t path[32][MT_HASH_MAX_LEN]; /* path[l] - hash of the node on level "l" above "cn" */
+  char sha_buf[2 * MT_HASH_MAX_LEN + 1];
+  int cmp;
+  int len;
+  int l;
+  int x;
   uint8_t f;
-  int y;
-  int s;
+  uint8_t *expected;
   uint32_t hci;
-  uint32_t subroot_idx;
-  unsigned char digest_sib[20];
-  unsigned char c_digest_sib[20];
-  struct node *si;
-  struct node *p;
-  struct node *left;
-  struct node *right;
-  struct node *curr;
-  struct node *subroot;
-  struct node_cache_entry *nc;
-  struct node_cache_entry *ci;
-  SHA1Context context;
-
-  memset(zero, 0, sizeof(zero));
-
-  d_printf("\nverification of node: %d\n", cn->number);
+  uint32_t subroot;
+  uint32_t n;
+  uint32_t si;
+  struct mt_tree *t;
+
+  t = &local_peer->tree;
+  len = t->hash->len;
+
+  d_printf("\nverification of node: %u\n", cn);
 
   _assert(local_peer->num_have_cache > 0, "%s\n", "local_peer->num_have_cache should be > 0");
 
@@ -1452,258 +1766,242 @@ swift_verify_chunk(struct peer *local_peer, struct node *cn)
   hci = 0;
   f = 0;
   while (hci < local_peer->num_have_cache) {
-    if ((local_peer->have_cache[hci].start_chunk <= cn->number / 2)
-        && (local_peer->have_cache[hci].end_chunk >= cn->number / 2)) {
+    if ((local_peer->have_cache[hci].start_chunk <= cn / 2) && (local_peer->have_cache[hci].end_chunk >= cn / 2)) {
       f = 1;
       break;
     }
     hci++;
   }
 
-  _assert(f == 1, "current node %d hasn't been found in any range in HAVE cache\n", cn->number);
-
-  /* subroot will be needed further in this procedure */
-  subroot_idx = local_peer->have_cache[hci].start_chunk + local_peer->have_cache[hci].end_chunk;
-  subroot = &local_peer->tree[subroot_idx];
-  d_printf("subroot found: %d in have cache entry, range: %u..%u\n", subroot->number,
-           local_peer->have_cache[hci].start_chunk, local_peer->have_cache[hci].end_chunk);
-
-  /* find sibling for just received DATA message's node - needed to calculate
-   * sum of SHA-1 hashes */
-  si = find_sibling(cn);
-
-  _assert(si != NULL, "%s\n", "s should be != NULL - sibling must exist");
-  d_printf("sibling for: %d is: %d\n", cn->number, si->number);
-
-  /* check if found sibling "si" is in ACTIVE state - it means if he has SHA-1
-   * hash */
-  _assert(si->state == ACTIVE,
-          "si %d should be in ACTIVE state (and should have SHA1 hash), but "
-          "has: %d\n",
-          si->number, si->state);
+  _assert(f == 1, "current node %u hasn't been found in any range in HAVE cache\n", cn);
+
+  subroot = local_peer->have_cache[hci].start_chunk + local_peer->have_cache[hci].end_chunk;
+  d_printf("subroot found: %u in have cache entry, range: %u..%u\n", subroot, local_peer->have_cache[hci].start_chunk,
+           local_peer->have_cache[hci].end_chunk);
+
+  /* go up until trusted node is reached - left child has lower number than its
+   * parent, so the hashes are concatenated as left_hash + right_hash */
+  memcpy(path[0], digest, len);
+  n = cn;
+  l = 0;
+  while (!(local_peer->verified_bmp[n / 8] & (1 << (n % 8))) && (n != subroot)) {
+    si = find_sibling(n);
+    if (!MT_IS_ACTIVE(t, si)) {
+      d_printf("hash of sibling %u hasn't arrived\n", si);
+      return -EAGAIN;
+    }
+    if (n < si) {
+      memcpy(buf, path[l], len);
+      memcpy(buf + len, MT_SHA(t, si), len);
+    } else {
+      memcpy(buf, MT_SHA(t, si), len);
+      memcpy(buf + len, path[l], len);
+    }
+    if (debug) {
+      printf("siblings[%u][%u]: ", n, si);
+      print_sha1((char *)buf, 2 * len);
+      printf("\n");
+    }
+    l++;
+    mt_hash_digest(t->hash, buf, 2 * len, path[l]);
+    n = mt_parent(n);
+  }
 
-  /* SHA-1 hash of the siblings always has to be linked like this: left_hash +
-   * right_hash */
-  if (cn == cn->parent->left) {
-    left = cn;
-    right = si;
+  /* hash of the root is the one demanded by user, INTEGRITY can't change it */
+  if (n == t->root) {
+    expected = local_peer->sha_demanded;
   } else {
-    left = si;
-    right = cn;
+    expected = MT_SHA(t, n);
   }
-
-  if ((memcmp(left->sha, zero, sizeof(zero)) == 0) && (memcmp(right->sha, zero, sizeof(zero)) == 0)) {
-    abort(); /* todo */
+  d_printf("walk ended on node %u after %d level(s)\n", n, l);
+
+  cmp = memcmp(expected, path[l], len);
+  if (cmp != 0) {
+    printf("error - hashes are different: ");
+    printf("node (from INTEGRITY) %u: ", n);
+    print_sha1((char *)expected, len);
+    printf(" vs calculated locally: ");
+    print_sha1((char *)path[l], len);
+    printf("\n");
+    return cmp;
   }
 
-  /* concatenate both SHA-1 hashes: just calculated from DATA payload and from
-   * sibling */
-  memset(buf, 0, sizeof(buf));
-  memcpy(buf, left->sha, 20);       /* ??? just calculated SHA-1 hash of just received DATA payload */
-  memcpy(buf + 20, right->sha, 20); /* SHA-1 of sibling */
-
-  /* print sum of concatenated hashes */
-  if (debug) {
-    s = 0;
-    for (y = 0; y < 40; y++) {
-      s += sprintf((char *)(bufs + s), "%02x", buf[y] & 0xff);
-    }
-    bufs[80] = '\0';
-    printf("siblings: %s\n", bufs);
+  /* whole path is proven now - remember it together with siblings */
+  n = cn;
+  for (x = 0; x < l; x++) {
+    if (debug) {
+      mt_hash_hex(t->hash, path[x], sha_buf);
+      d_printf("node %u verified: %s\n", n, sha_buf);
+    }
+    memcpy(MT_SHA(t, n), path[x], len);
+    mt_set_active(t, n);
+    si = find_sibling(n);
+    local_peer->verified_bmp[n / 8] |= 1 << (n % 8);
+    local_peer->verified_bmp[si / 8] |= 1 << (si % 8);
+    n = mt_parent(n);
   }
+  local_peer->verified_bmp[n / 8] |= 1 << (n % 8);
 
-  /* calculate SHA hash of sum of both siblings */
-  SHA1Reset(&context);
-  SHA1Input(&context, (uint8_t *)buf, 40);
-  SHA1Result(&context, digest_sib);
-
-  /* SHA-1 hash has been calculated for parent */
+  return 0;
+}
 
-  /* print SHA-1 of concatenated sibling's hashes
-   * this value will be assigned to parent SHA-1 hash
-   * if the parent is not in ACTIVE state
-   */
-  if (debug) {
-    s = 0;
-    for (y = 0; y < 20; y++) {
-      s += sprintf((char *)(sha_buf + s), "%02x", digest_sib[y] & 0xff);
-    }
-    sha_buf[40] = '\0';
-    d_printf("siblings digest: %s\n", sha_buf);
+/*
+ * prepare the leecher's receive queue for socket "sockfd"
+ * datagrams are taken from the socket with recvmmsg() and epoll tells when there is something to read
+ */
+INTERNAL_LINKAGE
+void
+leecher_rxq_init(struct leecher_rxq *q, int sockfd)
+{
+  struct epoll_event ev;
+
+  memset(q, 0, sizeof(struct leecher_rxq));
+  q->rx = malloc(sizeof(struct rx_batch));
+  q->digest = malloc(BATCH_SIZE * MT_HASH_MAX_LEN);
+  q->hashed = malloc(BATCH_SIZE);
+  _assert((q->rx != NULL) && (q->digest != NULL) && (q->hashed != NULL), "%s\n", "cannot allocate receive queue");
+  rx_batch_init(q->rx);
+
+  q->epfd = epoll_create1(0);
+  if (q->epfd < 0) {
+    perror("epoll_create1");
+    abort();
   }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = sockfd;
+  if (epoll_ctl(q->epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
+    perror("epoll_ctl");
+    abort();
+  }
+}
 
-  _assert(cn->parent != NULL, "parent for node %d doesn't exist\n", cn->number);
-  /* _assert(cn->parent->state == ACTIVE, "parent %d of node %d should be in
-   * ACTIVE state, but is: %d\n", cn->parent->number, cn->number,
-   * cn->parent->state); */
+INTERNAL_LINKAGE
+void
+leecher_rxq_free(struct leecher_rxq *q)
+{
+  close(q->epfd);
+  free(q->hashed);
+  free(q->digest);
+  free(q->rx);
+}
 
-  node_cache_init(local_peer);
+/* drop datagrams received but not processed yet */
+INTERNAL_LINKAGE
+void
+leecher_rxq_drop(struct leecher_rxq *q)
+{
+  q->head = q->rx->num;
+}
 
-  /* example tree with 4 nodes: 0,2,4,6 - indexes 0,1,2,3
-   * received hashes from libswift seeder for node 0 are: 3,5,2
-   * so we need to calculate SHA-1 hash for parent node 1
-   * as a sum of hashes of this parent (1) childrens: 0 and 2
-   */
-  curr = cn; /* working copy of cn */
+/* move all the datagrams waiting in the socket to the queue - only when the queue is empty */
+INTERNAL_LINKAGE
+int
+leecher_rxq_fill(struct leecher_rxq *q, int sockfd)
+{
+  int i;
 
-  if (curr == curr->parent->left) {
-    left = curr;
-    right = si;
-  } else {
-    left = si;
-    right = curr;
+  if (rx_batch_recv(q->rx, sockfd, MSG_DONTWAIT) <= 0) {
+    q->head = 0;
+    return 0;
   }
 
-  /* check if parent has SHA-1 hash - if it is in ACTIVE state */
-  if (cn->parent->state != ACTIVE) { /* enter here when paren has not SHA-1 yet */
-    p = curr->parent;                /* go to up - to the subroot of the subtree */
-    si = find_sibling(curr);
-    do {
-      if ((memcmp(left->sha, zero, sizeof(zero)) == 0) && (memcmp(right->sha, zero, sizeof(zero)) == 0)) {
-	abort(); /* todo */
-      }
+  q->head = 0;
+  for (i = 0; i < q->rx->num; i++) {
+    _assert((q->rx->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) == 0,
+            "error: too long udp datagram: %u - problem with seeder?\n", q->rx->msgs[i].msg_len);
+    q->hashed[i] = 0;
+  }
 
-      /* concatenate both SHA-1 hashes: just calculated from DATA payload and
-       * from sibling */
-      memset(buf, 0, sizeof(buf));
-      memcpy(buf, left->sha, 20);       /* ??? just calculated SHA-1 hash of just
-                                           received DATA payload */
-      memcpy(buf + 20, right->sha, 20); /* SHA-1 of sibling */
-
-      /* print sum of concatenated hashes */
-      if (debug) {
-	printf("siblings[%d][%d]: ", left->number, right->number);
-	print_sha1(buf, 40);
-	printf("\n");
-      }
+  return q->rx->num;
+}
 
-      /* calculate SHA hash of sum of both siblings */
-      SHA1Reset(&context);
-      SHA1Input(&context, (uint8_t *)buf, 40);
-      SHA1Result(&context, digest_sib);
+/*
+ * take next datagram from the leecher's queue, waiting up to "timeout" seconds
+ * for the socket to become readable if the queue is empty
+ *
+ * returns length of the datagram copied to "buf" or 0 on timeout,
+ * "ready" is set to 1 if "digest" already holds hash of DATA payload
+ */
+INTERNAL_LINKAGE
+int
+leecher_rxq_recv(struct leecher_rxq *q, int sockfd, int timeout, char *buf, struct sockaddr_in *from,
+                 uint8_t *digest, int *ready)
+{
+  struct epoll_event ev;
+  int n;
 
-      if (debug) {
-	printf("sibling SHA-1: ");
-	print_sha1((char *)digest_sib, 20);
-	printf("\n");
+  *ready = 0;
+  if (q->head == q->rx->num) {
+    while (leecher_rxq_fill(q, sockfd) == 0) {
+      n = epoll_wait(q->epfd, &ev, 1, timeout * 1000);
+      if ((n < 0) && (errno == EINTR)) {
+	continue;
       }
-
-      nc = malloc(sizeof(struct node_cache_entry)); /* create node cache entry */
-      nc->node.number = p->number;                  /* remember node number */
-      memcpy(nc->node.sha, digest_sib, 20);         /* copy SHA-1 to cache node */
-      SLIST_INSERT_HEAD(&local_peer->cache, nc, next);
-      d_printf("new cache node: %d\n", nc->node.number);
-
-      curr = curr->parent;
-      p = curr->parent;
-      si = find_sibling(curr);
-
-      if (curr == curr->parent->left) {
-	left = &nc->node;
-	right = si;
-      } else {
-	left = si;
-	right = &nc->node;
+      if (n <= 0) {
+	return 0;
       }
-    } while ((curr->parent != subroot) && (curr->parent->parent != NULL));
-
-    si = find_sibling(curr); /* find sibling for node "curr" */
-
-    d_printf("while loop ended with curr: %d  p: %d  nc: %d  si: %d\n", curr->number, p->number, nc->node.number,
-             si->number);
-
-    /* _assert(p_si != NULL, "sibling %d of parent %d must be ACTIVE\n",
-     * p_si->number, p->number); */
-
-    if ((memcmp(nc->node.sha, zero, sizeof(zero)) == 0) && (memcmp(si->sha, zero, sizeof(zero)) == 0)) {
-      abort(); /* todo */
-    }
-
-    if (curr->parent->left == curr) { /* left side of the tree */
-      memcpy(buf, nc->node.sha, 20);
-      memcpy(buf + 20, si->sha, 20);
-    } else { /* for verification of node 8 of 8-th nodes tree: 0,2,4,6,8,12,14 -
-                right side of the tree */
-      memcpy(buf, si->sha, 20);
-      memcpy(buf + 20, nc->node.sha, 20);
     }
-    SHA1Reset(&context);
-    SHA1Input(&context, (uint8_t *)buf, 40);
-    SHA1Result(&context, c_digest_sib); /* calculated hash of node 3 */
-
-    /* is this the case when shared file (plik6k10) INTEGRITY doesn't return
-     * SHA-1 hash of the whole tree (node 7) and we are forced to take it from
-     * peer->sha_demanded?
-     */
-    if (p == local_peer->tree_root) {
-      cmp = memcmp(local_peer->sha_demanded, c_digest_sib, 20);
-    } else {
-      /* compare just calculated above SHA-1 hash and from parent one */
-      cmp = memcmp(p->sha, c_digest_sib, 20);
-    }
-    if (cmp != 0) {
-      printf("error - hashes are different: ");
-      printf("parent (from INTEGRITY) %d: ", p->number);
-      print_sha1(p->sha, 20);
-      printf(" vs calculated locally: ");
-      print_sha1((char *)c_digest_sib, 20);
-      printf("\n");
+  }
 
-      printf("left[%d]: ", nc->node.number);
-      print_sha1(nc->node.sha, 20);
-      printf(" right[%d]: ", si->number);
-      print_sha1(si->sha, 20);
-      printf("\n");
-      abort();
-    }
-  } else { /* enter here when parent has his own SHA-1 hash */
-    if (cn == cn->parent->left) {
-      left = cn;
-      right = si;
-    } else {
-      left = si;
-      right = cn;
-    }
+  n = q->rx->msgs[q->head].msg_len;
+  memcpy(buf, q->rx->buf[q->head], n);
+  memcpy(from, &q->rx->addr[q->head], sizeof(struct sockaddr_in));
+  if (q->hashed[q->head]) {
+    memcpy(digest, q->digest[q->head], MT_HASH_MAX_LEN);
+    *ready = 1;
+  }
+  q->head++;
 
-    if ((memcmp(left->sha, zero, sizeof(zero)) == 0) && (memcmp(right->sha, zero, sizeof(zero)) == 0)) {
-      abort(); /* todo */
-    }
+  return n;
+}
 
-    memcpy(buf, left->sha, 20);       /* SHA-1 of current node "cn" (node 4) */
-    memcpy(buf + 20, right->sha, 20); /* SHA-1 of sibling (node 6) */
+/*
+ * compute hash of DATA payload together with payloads of next DATA
+ * messages - those already waiting in the socket are moved to the queue
+ * first, so a train of chunks from seeder is hashed in one multi-buffer pass
+ */
+INTERNAL_LINKAGE
+void
+leecher_rxq_hash(struct leecher_rxq *q, int sockfd, const struct mt_hash *hash, const uint8_t *payload, int plen,
+                 uint8_t *digest)
+{
+  uint8_t digests[MT_HASH_MAX_LANES * MT_HASH_MAX_LEN];
+  const uint8_t *msgs[MT_HASH_MAX_LANES];
+  int idx[MT_HASH_MAX_LANES];
+  int i;
+  int k;
+  int lanes;
 
-    SHA1Reset(&context);
-    SHA1Input(&context, (uint8_t *)buf, 40);
-    SHA1Result(&context, c_digest_sib); /* calculated hash fo node 3 */
+  lanes = hash->lanes();
 
-    cmp = memcmp(cn->parent->sha, c_digest_sib, 20);
+  if (q->head == q->rx->num) {
+    (void)leecher_rxq_fill(q, sockfd);
+  }
 
-    if (cmp != 0) {
-      printf("error - hashes are different: ");
-      printf("parent (from INTEGRITY) %d: ", cn->parent->number);
-      print_sha1(cn->parent->sha, 20);
-      printf(" vs calculated locally: ");
-      print_sha1((char *)c_digest_sib, 20);
-      printf("\n");
+  /* only payloads of the same length can share the pass */
+  msgs[0] = payload;
+  k = 1;
+  for (i = q->head; (i < q->rx->num) && (k < lanes); i++) {
+    if (q->hashed[i] || ((int)q->rx->msgs[i].msg_len != plen + 1 + 4 + 4 + 8 + 4) ||
+        (message_type(q->rx->buf[i]) != DATA)) {
+      continue;
     }
+    msgs[k] = (uint8_t *)q->rx->buf[i] + 1 + 4 + 4 + 8 + 4; /* skip the headers */
+    idx[k] = i;
+    k++;
   }
 
-  /* if both SHA-1 hashes are equal, dump node cache to tree */
-  /* in other words - copy all the SHA-1 hashes from cache to the tree because
-   * we will need those SHA-1 later */
-  /* after copying of given hash - remove given cache entry from the list */
-  if (cmp == 0) {
-    SLIST_FOREACH(ci, &local_peer->cache, next)
-    {
-      d_printf("copying SHA-1 of node %d from cache to tree\n", ci->node.number);
-      memcpy(local_peer->tree[ci->node.number].sha, ci->node.sha, 20);
-      local_peer->tree[ci->node.number].state = ACTIVE;
-      SLIST_REMOVE(&local_peer->cache, ci, node_cache_entry, next);
-      free(ci);
-    }
+  hash->digest_mb(msgs, plen, k, digests);
+  if (k > 1) {
+    d_printf("%d DATA payloads hashed in one pass\n", k);
   }
 
-  return cmp;
+  memcpy(digest, digests, hash->len);
+  for (i = 1; i < k; i++) {
+    memcpy(q->digest[idx[i]], digests + hash->len * i, hash->len);
+    q->hashed[idx[i]] = 1;
+  }
 }
 
 /* leecher worker in step-by-step version */
@@ -1715,9 +2013,9 @@ swift_leecher_worker_sbs(void *data)
   uint8_t opts[1024]; /* buffer for encoded options */
   char handshake_req[256];
   char request[256];
-  unsigned char digest[20];
+  unsigned char digest[MT_HASH_MAX_LEN];
   uint8_t *data_buffer;
-  uint8_t cmp;
+  int cmp;
   int sockfd;
   int n;
   int nr;
@@ -1730,20 +2028,23 @@ swift_leecher_worker_sbs(void *data)
   uint32_t data_buffer_len;
   uint32_t prev_chunk_size;
   uint32_t first_chunk;
+  uint32_t max_requests;
   uint64_t ack_len;
-  uint64_t cc;
-  uint64_t begin;
-  uint64_t end;
   uint64_t offset;
   struct sockaddr_in servaddr;
   struct peer *p;
   struct peer *local_peer;
-  struct node *cn;
-  socklen_t len;
-  SHA1Context context;
+  uint32_t cn;
+  int digest_ready;
+  int nreq;
+  int ri;
+  int k;
+  uint64_t chunks;
+  struct leecher_request req[REQUEST_QUEUE_LEN];
+  struct schedule_entry range;
+  struct leecher_rxq rxq;
+  struct file_sink sink;
   struct proto_config pos;
-  struct timeval tv;
-  fd_set fs;
 
   memset(&pos, 0, sizeof(struct proto_config));
   memset(&opts, 0, sizeof(opts));
@@ -1757,9 +2058,9 @@ swift_leecher_worker_sbs(void *data)
   pos.version = 1;
   pos.minimum_version = 1;
   pos.swarm_id = local_peer->sha_demanded;
-  pos.swarm_id_len = 20;
-  pos.content_prot_method = 1; /* merkle hash tree */
-  pos.merkle_hash_func = 0;    /* 0 = sha-1 */
+  pos.swarm_id_len = local_peer->merkle_hash->len;
+  pos.content_prot_method = 1;                           /* merkle hash tree */
+  pos.merkle_hash_func = local_peer->merkle_hash->func; /* 0 = sha-1 */
   pos.live_signature_alg = 5;  /* number from dnssec */
   pos.chunk_addr_method = 2;   /* 2 = 32 bit chunk ranges */
   *(unsigned int *)pos.live_disc_wind = 0x12345678;
@@ -1774,8 +2075,8 @@ swift_leecher_worker_sbs(void *data)
   memset(pos.file_name, 0, sizeof(pos.file_name));
   memcpy(pos.file_name, local_peer->fname, local_peer->fname_len);
 #endif
-  memcpy(pos.sha_demanded, local_peer->sha_demanded, 20); /* leecher demands file with hash given in "-s" command line
-                                                             parameter */
+  /* leecher demands file with hash given in "-s" command line parameter */
+  memcpy(pos.sha_demanded, local_peer->sha_demanded, MT_HASH_MAX_LEN);
 
   /* mark the options we want to pass to make_handshake_options() (which ones
    * are valid) */
@@ -1806,8 +2107,6 @@ swift_leecher_worker_sbs(void *data)
   h_req_len = make_handshake_request(handshake_req, 0, 0xfeedbabe, opts, opts_len);
   dump_handshake_request(handshake_req, h_req_len, p);
 
-  len = sizeof(servaddr);
-
   p->sm_leecher = SW_SEND_HANDSHAKE_INIT;
 
   if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
@@ -1820,6 +2119,16 @@ swift_leecher_worker_sbs(void *data)
   data_buffer_len = local_peer->chunk_size + 4 + 1 + 4 + 4 + 8;
   data_buffer = malloc(data_buffer_len);
 
+  /* datagrams are received in batches, several DATA payloads of a batch are hashed at once */
+  leecher_rxq_init(&rxq, sockfd);
+  digest_ready = 0;
+
+  /* verified chunks are written to the file in batches */
+  if (sink_init(&sink, local_peer->chunk_size) < 0) {
+    d_printf("%s", "cannot allocate memory for file sink\n");
+    abort();
+  }
+
   /* set primary seeder IP:port as a initial default values */
   memset(&servaddr, 0, sizeof(servaddr));
   servaddr.sin_family = AF_INET;
@@ -1832,9 +2141,18 @@ swift_leecher_worker_sbs(void *data)
                                  switched to another seeder at least once */
   p->pex_required = 0;        /* unmark flag that we want list of other seeders form
                                  primary seeder */
-  p->fetch_schedule = 1;      /* allow to fetch series of chunks from download_schedule[] */
   prev_chunk_size = 0;
 
+  /* ranges requested from seeder at once - the next ones are being sent while the first is completed */
+  nreq = 0;
+  ri = 0;
+  max_requests = local_peer->max_requests;
+  if (max_requests == 0) {
+    max_requests = 1;
+  } else if (max_requests > REQUEST_QUEUE_LEN) {
+    max_requests = REQUEST_QUEUE_LEN;
+  }
+
   /* leecher's state machine */
   while (p->finishing == 0) {
 
@@ -1851,20 +2169,11 @@ swift_leecher_worker_sbs(void *data)
     }
 
     if (p->sm_leecher == SW_WAIT_HANDSHAKE_RESP) {
-      FD_ZERO(&fs);
-      FD_SET(sockfd, &fs);
-      tv.tv_sec = p->timeout;
-      tv.tv_usec = 0;
-
-      (void)select(sockfd + 1, &fs, NULL, NULL, &tv);
-      n = 0;
-      if (FD_ISSET(sockfd, &fs)) {
-	/* receive response from SEEDER: HANDSHAKE + HAVE */
-	n = recvfrom(sockfd, (char *)buffer, BUFSIZE, 0, (struct sockaddr *)&servaddr, &len);
-      }
+      /* receive response from SEEDER: HANDSHAKE + HAVE */
+      n = leecher_rxq_recv(&rxq, sockfd, p->timeout, buffer, &servaddr, digest, &digest_ready);
 
       if (n <= 0) {
-	if (all_chunks_downloaded(local_peer) == 1) {
+	if ((all_chunks_downloaded(local_peer) == 1) || (p->cmd == CMD_FINISH)) {
 	  p->sm_leecher = SM_SEND_HANDSHAKE_FINISH;
 	  continue;
 	}
@@ -1883,14 +2192,35 @@ swift_leecher_worker_sbs(void *data)
       buffer[n] = '\0';
 
       d_printf("server replied with %d bytes\n", n);
-      dump_handshake_have(buffer, n, p);
+
+      /* scheduler learns which chunks this seeder has instead of the previous one */
+      swift_mutex_lock(&local_peer->download_schedule_mutex);
+      sched_forget(local_peer, p);
+      swift_mutex_unlock(&local_peer->download_schedule_mutex);
+      if (dump_handshake_have(buffer, n, p) < 0) {
+	/* seeder can't serve this file - try the next one or drop it if it's the first one */
+	if (p->after_seeder_switch == 0) {
+	  p->sm_leecher = SM_SEND_HANDSHAKE_FINISH;
+	} else {
+	  p->sm_leecher = SM_SWITCH_SEEDER;
+	}
+	continue;
+      }
+      swift_mutex_lock(&local_peer->download_schedule_mutex);
+      sched_have(local_peer, p);
+      swift_mutex_unlock(&local_peer->download_schedule_mutex);
 
       if ((p->after_seeder_switch == 1) && (prev_chunk_size != local_peer->chunk_size)) {
 	d_printf("previous and current seeder have different chunk size: %u vs %u\n", prev_chunk_size,
 	         local_peer->chunk_size);
 	abort();
       }
-      p->sm_leecher = SM_SYNC_REQUEST;
+      /* ranges interrupted by lost seeder are requested from this one at once */
+      if (nreq > 0) {
+	p->sm_leecher = SM_SEND_REQUEST;
+      } else {
+	p->sm_leecher = SM_SYNC_REQUEST;
+      }
     }
 
     if (p->sm_leecher == SM_SYNC_REQUEST) {
@@ -1912,58 +2242,64 @@ swift_leecher_worker_sbs(void *data)
       }
     }
 
-    /* external "while" loop, iterator "z" */
+    /* external "while" loop - keep up to max_requests ranges requested */
     if (p->sm_leecher == SM_WHILE_REQUEST) {
       d_printf("local_peer->end_chunk: %u\n", local_peer->end_chunk);
 
-      if (p->fetch_schedule == 1) {
-	/* lock "download_schedule" array and "download_schedule_idx" index */
-	swift_mutex_lock(&local_peer->download_schedule_mutex);
-	/* take begin/end from schedule array */
-	begin = local_peer->download_schedule[local_peer->download_schedule_idx].begin;
-	end = local_peer->download_schedule[local_peer->download_schedule_idx].end;
-	local_peer->download_schedule_idx++;
-	swift_mutex_unlock(&local_peer->download_schedule_mutex);
+      /* scheduler gives us ranges - other seeders' workers take ranges from
+       * the same schedule */
+      swift_mutex_lock(&local_peer->download_schedule_mutex);
+      while ((nreq < (int)max_requests) && (sched_next(local_peer, p, &range) == 0)) {
+	/* range is ours until it is downloaded */
+	req[nreq].begin = range.begin;
+	req[nreq].end = range.end;
+	req[nreq].left = range.end - range.begin + 1;
+	req[nreq].chunks = req[nreq].left;
+	req[nreq].sent = 0;
+	nreq++;
       }
+      if (nreq == 0) {
+	sched_idle(local_peer, p);
+      }
+      swift_mutex_unlock(&local_peer->download_schedule_mutex);
 
-      d_printf("begin: %lu   end: %lu\n", begin, end);
-
-      /* create REQUEST  */
-      request_len = make_request(request, p->dest_chan_id, begin, end, p);
-
-      _assert((long unsigned int)request_len <= sizeof(request),
-              "%s but request_len has value: %d and sizeof(request): %zu\n",
-              "request_len should be <= sizeof(request)", request_len, sizeof(request));
+      if (nreq == 0) {
+	p->sm_leecher = SM_WAIT_FOR_NEXT_CMD; /* all the ranges are taken and downloaded */
+	continue;
+      }
       p->sm_leecher = SM_SEND_REQUEST;
     }
 
     if (p->sm_leecher == SM_SEND_REQUEST) {
-      /* send REQUEST */
-      n = sendto(sockfd, request, request_len, 0, (const struct sockaddr *)&servaddr, sizeof(servaddr));
-      if (n < 0) {
-	d_printf("error sending request: %d\n", n);
-	abort();
+      /* send REQUEST for every range which hasn't been requested yet */
+      for (k = 0; k < nreq; k++) {
+	if (req[k].sent) {
+	  continue;
+	}
+	d_printf("begin: %lu   end: %lu\n", req[k].begin, req[k].end);
+
+	request_len = make_request(request, p->dest_chan_id, req[k].begin, req[k].end, p);
+
+	_assert((long unsigned int)request_len <= sizeof(request),
+	        "%s but request_len has value: %d and sizeof(request): %zu\n",
+	        "request_len should be <= sizeof(request)", request_len, sizeof(request));
+
+	n = sendto(sockfd, request, request_len, 0, (const struct sockaddr *)&servaddr, sizeof(servaddr));
+	if (n < 0) {
+	  d_printf("error sending request: %d\n", n);
+	  abort();
+	}
+	d_printf("request sent: %d\n", n);
+	req[k].sent = 1;
       }
-      d_printf("%s", "request message 3/3 sent\n");
       p->sm_leecher = SM_WAIT_INTEGRITY; /* jump over PEX_REQ because swift
                                             doesn't send any PEX_RESP answers */
-      d_printf("request sent: %d\n", n);
-      cc = begin; /* internal "for" loop, iterator - cc */
     }
 
     /* wait for PEX_RESV4 or INTEGRITY */
     if (p->sm_leecher == SM_WAIT_PEX_RESP) {
-      FD_ZERO(&fs);
-      FD_SET(sockfd, &fs);
-      tv.tv_sec = p->timeout;
-      tv.tv_usec = 0;
-
-      (void)select(sockfd + 1, &fs, NULL, NULL, &tv);
-      n = 0;
-      if (FD_ISSET(sockfd, &fs)) {
-	/* receive PEX_RESP or INTEGRITY from SEEDER */
-	n = recvfrom(sockfd, (char *)buffer, BUFSIZE, 0, (struct sockaddr *)&servaddr, &len);
-      }
+      /* receive PEX_RESP or INTEGRITY from SEEDER */
+      n = leecher_rxq_recv(&rxq, sockfd, p->timeout, buffer, &servaddr, digest, &digest_ready);
 
       printf("PEX_RESP n: %d\n", n);
 
@@ -1987,24 +2323,9 @@ swift_leecher_worker_sbs(void *data)
 
     /* here we can receive both: INTEGRITY or DATA message */
     if (p->sm_leecher == SM_WAIT_INTEGRITY) {
-      FD_ZERO(&fs);
-      FD_SET(sockfd, &fs);
-      tv.tv_sec = p->timeout;
-      tv.tv_usec = 0;
-
-      p->curr_chunk = cc;
-
-      (void)select(sockfd + 1, &fs, NULL, NULL, &tv);
-      n = 0;
       memset(buffer, 0, BUFSIZE);
-      if (FD_ISSET(sockfd, &fs)) {
-	/* check the length of the packet in UDP/IP kernel stack queue */
-	n = recvfrom(sockfd, (char *)buffer, 65535, MSG_PEEK, (struct sockaddr *)&servaddr, &len);
-	_assert(n <= BUFSIZE, "error: too long udp datagram: %d - problem with seeder?\n", n);
-
-	/* receive INTEGRITY or DATA from SEEDER */
-	n = recvfrom(sockfd, (char *)buffer, BUFSIZE, 0, (struct sockaddr *)&servaddr, &len);
-      }
+      /* receive INTEGRITY or DATA from SEEDER */
+      n = leecher_rxq_recv(&rxq, sockfd, p->timeout, buffer, &servaddr, digest, &digest_ready);
 
       if (n <= 0) {
 	p->sm_leecher = SM_SWITCH_SEEDER;
@@ -2026,7 +2347,9 @@ swift_leecher_worker_sbs(void *data)
 
     if (p->sm_leecher == SM_INTEGRITY) {
       d_printf("server sent INTEGRITY: %d\n", n);
+      swift_mutex_lock(&local_peer->tree_mutex);
       r = dump_integrity(buffer, n, local_peer); /* copy SHA hashes to local_peer->chunk[] */
+      swift_mutex_unlock(&local_peer->tree_mutex);
       if (r != n) {
 	d_printf("there are some bytes %d remaining for further parse\n", n - r);
       }
@@ -2070,49 +2393,26 @@ swift_leecher_worker_sbs(void *data)
       /* for (cc = begin; cc <= end; cc++) */
       /* receive the whole range of chunks from SEEDER */
 
-      FD_ZERO(&fs);
-      FD_SET(sockfd, &fs);
-      tv.tv_sec = p->timeout;
-      tv.tv_usec = 0;
-
-      (void)select(sockfd + 1, &fs, NULL, NULL, &tv);
-      nr = 0;
-
-      if (FD_ISSET(sockfd, &fs)) {
-	/* receive single DATA datagram */
-	nr = recvfrom(sockfd, (char *)data_buffer, data_buffer_len, 0, (struct sockaddr *)&servaddr, &len);
-      }
-      if (nr <= 0) {
+      /* take next DATA datagram of the batch */
+      n = leecher_rxq_recv(&rxq, sockfd, p->timeout, buffer, &servaddr, digest, &digest_ready);
+      if (n <= 0) {
 	p->sm_leecher = SM_SWITCH_SEEDER;
 	continue;
       }
+      if (message_type(buffer) != DATA) {
+	/* seeder may send hashes for several chunks in more than one datagram */
+	p->sm_leecher = SM_INTEGRITY;
+	continue;
+      }
+      _assert((uint32_t)n <= data_buffer_len, "DATA too long: %d, should be <= %d\n", n, data_buffer_len);
+      nr = n;
+      memcpy(data_buffer, buffer, nr);
       p->sm_leecher = SM_DATA;
     }
 
     if (p->sm_leecher == SM_DATA) {
-      /* save received chunk to file descriptor or memory */
-
-      /* is this transferring data via file descriptor? */
-      if (local_peer->transfer_method == M_FD) {
-	d_printf("writing chunk to file: nr: %d  offset: %lu\n", nr, cc * local_peer->chunk_size);
-	swift_mutex_lock(&local_peer->fd_mutex);
-	lseek(local_peer->fd, cc * local_peer->chunk_size, SEEK_SET);
-	write(local_peer->fd, data_buffer + 1 + 4 + 4 + 8 + 4, nr - (1 + 4 + 4 + 8 + 4));
-	swift_mutex_unlock(&local_peer->fd_mutex);
-      } else if (local_peer->transfer_method == M_BUF) {
-	first_chunk = local_peer->download_schedule[0].begin;
-	offset = cc * local_peer->chunk_size - first_chunk * local_peer->chunk_size;
-	d_printf("buf offset: %lu\n", offset);
-	memcpy(local_peer->transfer_buf + offset, data_buffer + 1 + 4 + 4 + 8 + 4, nr - (1 + 4 + 4 + 8 + 4));
-	local_peer->tx_bytes += nr - (1 + 4 + 4 + 8 + 4);
-      }
-
       _assert(nr <= BUFSIZE, "nr should be <= %d but has: %d\n", BUFSIZE, nr);
       _assert(nr >= 1 + 4 + 4 + 8 + 4, "nr should be >= %d but is: %d\n", 1 + 4 + 4 + 8 + 4, nr);
-      /* calculate SHA hash of just received DATA */
-      SHA1Reset(&context);
-      SHA1Input(&context, data_buffer + 1 + 4 + 4 + 8 + 4, nr - (1 + 4 + 4 + 8 + 4)); /* skip the headers */
-      SHA1Result(&context, digest);
 
       /* verify if start and end chunk are equal in DATA message - they should
        * be */
@@ -2120,23 +2420,79 @@ swift_leecher_worker_sbs(void *data)
       ec = be32toh(*(uint32_t *)(data_buffer + 4 + 1 + 4));
       _assert(sc == ec, "sc and ec should be equal but sc: %u and ec: %u\n", sc, ec);
 
-      /* find node of tree which this DATA payload contains */
-      cn = &local_peer->tree[sc * 2];
+      /* one-way delay of this DATA - seeder's congestion controller gets it in our next ACK */
+      p->delay_sample = (int64_t)(ppspp_timestamp_us() - be64toh(*(uint64_t *)(data_buffer + 4 + 1 + 4 + 4)));
+
+      /* seeder keeps chunks of several requested ranges in flight - accept
+       * them in any order, but repeat HAVE for already received chunk because
+       * previous one could be lost */
+      for (ri = 0; ri < nreq; ri++) {
+	if ((sc >= req[ri].begin) && (sc <= req[ri].end)) {
+	  break;
+	}
+      }
+      if ((sc >= local_peer->nc) || (local_peer->chunk[sc].downloaded == CH_YES) || (ri == nreq)) {
+	d_printf("DATA[%u] not expected - dropping\n", sc);
+	if ((sc < local_peer->nc) && (local_peer->chunk[sc].downloaded == CH_YES)) {
+	  p->curr_chunk = sc;
+	  ack_len = make_have_ack(buffer, p);
+	  n = sendto(sockfd, buffer, ack_len, 0, (const struct sockaddr *)&servaddr, sizeof(servaddr));
+	  if (n < 0) {
+	    d_printf("error sending request: %d\n", n);
+	    abort();
+	  }
+	}
+	p->sm_leecher = SM_WAIT_INTEGRITY;
+	continue;
+      }
+      p->curr_chunk = sc;
+
+      /* calculate SHA hash of just received DATA, unless it was computed
+       * together with previous DATA */
+      if (!digest_ready) {
+	leecher_rxq_hash(&rxq, sockfd, local_peer->merkle_hash, data_buffer + 1 + 4 + 4 + 8 + 4,
+	                 nr - (1 + 4 + 4 + 8 + 4), digest); /* skip the headers */
+      }
+      digest_ready = 0;
 
-      /* copy just calculated SHA-1 for just received DATA into proper node */
-      memcpy(cn->sha, digest, 20);
+      /* find node of tree which this DATA payload contains */
+      cn = sc * 2;
 
-      cmp = swift_verify_chunk(local_peer, cn);
+      /* hash is stored in the tree by verification */
+      swift_mutex_lock(&local_peer->tree_mutex);
+      cmp = swift_verify_chunk(local_peer, cn, digest);
+      swift_mutex_unlock(&local_peer->tree_mutex);
 
-      if (cmp != 0) {
-	printf("error - hashes are different for node %lu\n", cc * 2);
+      if (cmp == -EAGAIN) {
+	/* INTEGRITY needed for this chunk was lost together with some earlier
+	 * DATA - seeder sends both again if we don't confirm the chunk */
+	d_printf("DATA[%u] can't be verified yet - dropping\n", sc);
+	p->sm_leecher = SM_WAIT_INTEGRITY;
+	continue;
+      } else if (cmp != 0) {
+	printf("error - hashes are different for node %u\n", sc * 2);
 	d_printf("pthread %#lx   IP: %s\n", (uint64_t)p->thread, inet_ntoa(servaddr.sin_addr));
 	abort();
       } else {
-	/* set state to ACTIVE to mark this node as having proper SHA-1 hash */
-	cn->state = ACTIVE;
+	/* save verified chunk to file descriptor or memory */
+	if (local_peer->transfer_method == M_FD) {
+	  if (sink_put(&sink, local_peer->fd, sc, (uint8_t *)data_buffer + 1 + 4 + 4 + 8 + 4, nr - (1 + 4 + 4 + 8 + 4))
+	      < 0) {
+	    printf("error writing chunk %u to file\n", sc);
+	    abort();
+	  }
+	} else if (local_peer->transfer_method == M_BUF) {
+	  first_chunk = local_peer->download_schedule[0].begin;
+	  offset = (uint64_t)sc * local_peer->chunk_size - (uint64_t)first_chunk * local_peer->chunk_size;
+	  d_printf("buf offset: %lu\n", offset);
+	  memcpy(local_peer->transfer_buf + offset, data_buffer + 1 + 4 + 4 + 8 + 4, nr - (1 + 4 + 4 + 8 + 4));
+	  __atomic_add_fetch(&local_peer->tx_bytes, nr - (1 + 4 + 4 + 8 + 4), __ATOMIC_RELAXED);
+	}
 
 	local_peer->chunk[p->curr_chunk].downloaded = CH_YES;
+	req[ri].left--;
+	p->rx_chunks++;
+	p->rx_bytes += nr - (1 + 4 + 4 + 8 + 4);
 	p->sm_leecher = SW_SEND_HAVE_ACK;
       }
     }
@@ -2155,38 +2511,45 @@ swift_leecher_worker_sbs(void *data)
 	d_printf("error sending request: %d\n", n);
 	abort();
       }
-      d_printf("ACK[%lu] sent\n", cc);
-      cc++;            /* "cc" is iterator from "for" loop */
-      if (cc <= end) { /* end condition of "for cc" loop */
+      d_printf("ACK[%lu] sent\n", p->curr_chunk);
+      if (req[ri].left > 0) { /* range isn't completed yet */
 	p->sm_leecher = SM_WAIT_INTEGRITY;
 	continue;
       }
       p->sm_leecher = SM_INC_Z;
     }
 
-    /* end of external "while" loop, iterator "z" */
+    /* range "ri" is completed - replace it with next one from the schedule */
     if (p->sm_leecher == SM_INC_Z) {
-      p->fetch_schedule = 1; /* all the current schedule is completed so allow
-                                to get next one */
+      d_printf("range %lu..%lu downloaded\n", req[ri].begin, req[ri].end);
+      chunks = req[ri].chunks;
+      memmove(&req[ri], &req[ri + 1], (nreq - ri - 1) * sizeof(struct leecher_request));
+      nreq--;
+
+      /* chunks of the range must be in the file before main process is woken */
+      if (sink_flush(&sink) < 0) {
+	printf("%s", "error writing chunks to file\n");
+	abort();
+      }
 
-      if (local_peer->download_schedule_idx < local_peer->download_schedule_len) {
-	p->sm_leecher = SM_WHILE_REQUEST;
-	continue;
-      } /* end of external "while" loop */
-      /* seems like we have just downloaded all the chunks */
-      p->sm_leecher = SM_WAIT_FOR_NEXT_CMD;
+      /* the worker completing the last range wakes the main process */
+      swift_mutex_lock(&local_peer->download_schedule_mutex);
+      sched_range_done(local_peer, p);
+      local_peer->fetch_pending -= chunks;
+      if (local_peer->fetch_pending == 0) {
+	d_printf("%s", "wakening main leecher process\n");
+	swift_semaph_post(local_peer->sem);
+      }
+      swift_mutex_unlock(&local_peer->download_schedule_mutex);
+
+      p->sm_leecher = SM_WHILE_REQUEST; /* end of external "while" loop */
+      continue;
     }
 
     /* given serie of chunks have been fetched - now wait for new command */
     if (p->sm_leecher == SM_WAIT_FOR_NEXT_CMD) {
-      d_printf("%s", "wakening main leecher process\n");
-      swift_semaph_post(p->local_leecher->sem);
-      d_printf("%s", "main leecher process awakened\n");
-
-      p->cmd = 0;
-
       d_printf("%s", "waiting for next command from main leecher process\n");
-      swift_leecher_cond_set_and_sleep(p);
+      swift_leecher_cond_sleep(p);
       d_printf("%s", "next command arrived from main leecher process\n");
       if (p->cmd == CMD_FETCH) {
 	p->sm_leecher = SM_SYNC_REQUEST;
@@ -2205,8 +2568,7 @@ swift_leecher_worker_sbs(void *data)
       }
       p->to_remove = 1; /* mark peer to be removed by garbage collector */
 
-      p->finishing = 1;
-      swift_semaph_post(p->local_leecher->sem); /* wake the main process */
+      p->finishing = 1; /* main process joins the thread */
       continue;
     }
 
@@ -2215,7 +2577,7 @@ swift_leecher_worker_sbs(void *data)
       /* finish transmission with current seeder */
 
       n = make_handshake_finish(buffer, p);
-      n = sendto(sockfd, buffer, ack_len, 0, (const struct sockaddr *)&servaddr, sizeof(servaddr));
+      n = sendto(sockfd, buffer, n, 0, (const struct sockaddr *)&servaddr, sizeof(servaddr));
       if (n < 0) {
 	d_printf("error sending request: %d\n", n);
 	abort();
@@ -2223,13 +2585,22 @@ swift_leecher_worker_sbs(void *data)
 
       prev_chunk_size = local_peer->chunk_size; /* remember chunk size from previous seeder */
       p->after_seeder_switch = 1;               /* mark that we are switching from one seeder to another */
-      p->fetch_schedule = 0;
+      leecher_rxq_drop(&rxq);                   /* drop whatever came from the old seeder */
+      digest_ready = 0;
 
-      d_printf("chunks not downloaded yet: begin: %lu  end: %lu  cc: %lu\n", begin, end, cc);
+      /* ranges requested from the old seeder are requested again from the new one */
+      for (k = 0; k < nreq; k++) {
+	while ((req[k].begin < req[k].end) && (local_peer->chunk[req[k].begin].downloaded == CH_YES)) {
+	  req[k].begin++;
+	}
+	req[k].sent = 0;
+	d_printf("chunks not downloaded yet: begin: %lu  end: %lu  left: %lu\n", req[k].begin, req[k].end,
+	         req[k].left);
+      }
 
       /* choose new seeder */
       if (SLIST_NEXT(p->current_seeder, snext) != NULL) {
-	p->current_seeder = SLIST_NEXT(p, snext); /* select next peer */
+	p->current_seeder = SLIST_NEXT(p->current_seeder, snext); /* select next peer */
       } else {
 	p->current_seeder = SLIST_FIRST(&local_peer->peers_list_head); /* select begin of the qeueue */
       }
@@ -2243,12 +2614,15 @@ swift_leecher_worker_sbs(void *data)
       servaddr.sin_port = p->current_seeder->leecher_addr.sin_port;
       servaddr.sin_addr.s_addr = p->current_seeder->leecher_addr.sin_addr.s_addr;
 
-      p->sm_leecher = SM_HANDSHAKE;
+      p->sm_leecher = SW_SEND_HANDSHAKE_INIT;
       continue;
     }
   }
   d_printf("%s", "HANDSHAKE_FINISH from thread sent\n");
 
+  sink_flush(&sink);
+  sink_free(&sink);
+  leecher_rxq_free(&rxq);
   free(data_buffer);
   close(sockfd);
   pthread_exit(NULL);
@@ -2280,9 +2654,9 @@ net_preliminary_connection_sbs(struct peer *local_peer)
   cfg.version = 1;
   cfg.minimum_version = 1;
   cfg.swarm_id = local_peer->sha_demanded;
-  cfg.swarm_id_len = 20;
-  cfg.content_prot_method = 1; /* merkle hash tree */
-  cfg.merkle_hash_func = 0;    /* 0 = sha-1 */
+  cfg.swarm_id_len = local_peer->merkle_hash->len;
+  cfg.content_prot_method = 1;                           /* merkle hash tree */
+  cfg.merkle_hash_func = local_peer->merkle_hash->func; /* 0 = sha-1 */
   cfg.live_signature_alg = 5;  /* number from dnssec - taken from file swift/livesig.h:48 */
   cfg.chunk_addr_method = 2;   /* 2 = 32 bit chunk ranges */
   *(unsigned int *)cfg.live_disc_wind = 0x12345678;
@@ -2293,8 +2667,8 @@ net_preliminary_connection_sbs(struct peer *local_peer)
   cfg.file_name_len = local_peer->fname_len;
   memset(cfg.file_name, 0, sizeof(cfg.file_name)); /* do we need this here? */
   memcpy(cfg.file_name, local_peer->fname, local_peer->fname_len);
-  memcpy(cfg.sha_demanded, local_peer->sha_demanded, 20); /* leecher demands file with hash given in "-s" command line
-                                                             parameter */
+  /* leecher demands file with hash given in "-s" command line parameter */
+  memcpy(cfg.sha_demanded, local_peer->sha_demanded, MT_HASH_MAX_LEN);
 
   /* mark the options we want to pass to make_handshake_options() (which ones
    * are valid) */
@@ -2335,7 +2709,6 @@ net_preliminary_connection_sbs(struct peer *local_peer)
 
   local_peer->download_schedule_len = 0;
   local_peer->download_schedule = NULL;
-  local_peer->download_schedule_idx = 0;
 
   /* set primary seeder IP:port as a initial default values */
   memset(&servaddr, 0, sizeof(servaddr));
@@ -2345,7 +2718,6 @@ net_preliminary_connection_sbs(struct peer *local_peer)
 
   local_peer->seeder_has_file = 0;
   local_peer->finishing = 0;
-  local_peer->download_schedule_idx = 0;
   local_peer->pex_required = 1; /* mark flag that we want list of other seeders form primary seeder */
   swift_mutex_init(&local_peer->download_schedule_mutex);
 
@@ -2389,23 +2761,29 @@ net_preliminary_connection_sbs(struct peer *local_peer)
       buffer[n] = '\0';
       d_printf("server replied with %d bytes\n", n);
 
-      /* calculate number of SHA hashes per 1500 bytes MTU */
-      /* (MTU - sizeof(iphdr) - sizeof(udphdr) - ppspp_headers) / sha_size */
-      local_peer->hashes_per_mtu = (1500 - 20 - 8 - (4 + 1 + 4 + 4 + 8)) / 20;
+      /* calculate number of hashes per 1500 bytes MTU */
+      /* (MTU - sizeof(iphdr) - sizeof(udphdr) - ppspp_headers) / hash_size */
+      local_peer->hashes_per_mtu = (1500 - 20 - 8 - (4 + 1 + 4 + 4 + 8)) / local_peer->merkle_hash->len;
       d_printf("hashes_per_mtu: %lu\n", local_peer->hashes_per_mtu);
 
-      dump_handshake_have(buffer, n, local_peer);
+      if (dump_handshake_have(buffer, n, local_peer) < 0) {
+	local_peer->sm_leecher = SM_SEND_HANDSHAKE_FINISH; /* seeder_has_file stays 0 */
+	continue;
+      }
 
       local_peer->seeder_has_file = 1; /* seeder has file for our hash stored in sha_demanded[] */
       /* build the tree */
-      local_peer->tree_root = build_tree(local_peer->nc, &local_peer->tree);
+      build_tree(local_peer->nc, local_peer->merkle_hash, &local_peer->tree);
+      free(local_peer->verified_bmp);
+      local_peer->verified_bmp = malloc((2 * (uint64_t)local_peer->tree.nl + 7) / 8);
+      memset(local_peer->verified_bmp, 0, (2 * (uint64_t)local_peer->tree.nl + 7) / 8);
 
       /* here we need to refill the tree with ACTIVE states - there where won't
        * be any chunks because file size is not power of 2 */
       /* so they will be those nodes in tree which have now chance to be in
        * ACTIVE state */
       for (int x = local_peer->nc; x < local_peer->nl; x++) {
-	local_peer->tree[x * 2].state = ACTIVE;
+	mt_set_active(&local_peer->tree, x * 2);
 	d_printf("refill[%d] ACTIVE\n", x * 2);
       }
       /* dump_tree(local_peer->tree, local_peer->nl); */
@@ -2437,11 +2815,31 @@ net_preliminary_connection_sbs(struct peer *local_peer)
   return 0;
 }
 
+/*
+ * add seeder "sa" of the demanded file - every seeder known before
+ * net_leecher_sbs() gets its own worker
+ */
+INTERNAL_LINKAGE
+struct peer *
+net_leecher_add_seeder(struct peer *local_peer, struct sockaddr_in *sa)
+{
+  struct peer *c;
+
+  c = new_seeder(sa, BUFSIZE);
+
+  pthread_mutex_lock(&local_peer->peers_list_head_mutex);
+  add_peer_to_list(&local_peer->peers_list_head, c);
+  pthread_mutex_unlock(&local_peer->peers_list_head_mutex);
+
+  d_printf("[__] %s:%d\n", inet_ntoa(sa->sin_addr), ntohs(sa->sin_port));
+
+  return c;
+}
+
 INTERNAL_LINKAGE
 void
 net_leecher_create(struct peer *local_peer)
 {
-  struct peer *c;
   struct sockaddr_in sa;
 
   SLIST_INIT(&local_peer->peers_list_head);
@@ -2449,20 +2847,19 @@ net_leecher_create(struct peer *local_peer)
 
   /* moved here from dump_pex_resp() */
   /* add primary seeder as a first entry to the peer_list_head list */
+  memset(&sa, 0, sizeof(sa));
   memcpy(&sa.sin_addr.s_addr, &local_peer->seeder_addr.sin_addr.s_addr, sizeof(sa.sin_addr.s_addr));
   sa.sin_port = local_peer->seeder_addr.sin_port;
-  c = new_seeder(&sa, BUFSIZE);
-
-  pthread_mutex_lock(&local_peer->peers_list_head_mutex);
-  add_peer_to_list(&local_peer->peers_list_head, c);
-  pthread_mutex_unlock(&local_peer->peers_list_head_mutex);
 
   /* initially set current_seeder on primary seeder */
-  local_peer->current_seeder = c;
-
-  d_printf("[__] %s:%d\n", inet_ntoa(sa.sin_addr), ntohs(sa.sin_port));
+  local_peer->current_seeder = net_leecher_add_seeder(local_peer, &sa);
 }
 
+/*
+ * start one step-by-step state machine thread per seeder - all of them take
+ * ranges of chunks from the shared download_schedule, so the file is
+ * downloaded from all the seeders at once
+ */
 INTERNAL_LINKAGE
 int
 net_leecher_sbs(struct peer *local_peer)
@@ -2473,31 +2870,31 @@ net_leecher_sbs(struct peer *local_peer)
 
   /* swift_preliminary_connection_sbs(local_peer); */
   local_peer->sem = swift_semaph_init(local_peer);
-  swift_mutex_init(&local_peer->fd_mutex);
+  swift_mutex_init(&local_peer->tree_mutex);
 
   xx = 0;
   /* create as many threads as many seeder peers are in the peer_list_head */
   pthread_mutex_lock(&local_peer->peers_list_head_mutex);
-  p = SLIST_FIRST(&local_peer->peers_list_head);
-
-  /* temporarily we're using only one thread for step-by-step state machine */
-  p->hashes_per_mtu = local_peer->hashes_per_mtu;
-  p->sbs_mode = local_peer->sbs_mode;
-  p->nc = local_peer->nc;
-  p->nl = local_peer->nl;
-  p->timeout = local_peer->timeout;
-  p->thread_num = xx + 1;
-  p->current_seeder = p; /* set current_seeder to myself */
-  p->local_leecher = local_peer;
-  swift_leecher_cond_lock_init(p);
-  swift_leecher_cond_lock_init2(p);
-
-  (void)pthread_create(&thread, NULL, swift_leecher_worker_sbs, p);
-  p->thread = thread;
-
-  p->to_remove = 1; /* mark flag that every thread created in this loop should
-                       be destroyed when his work is done */
-  xx++;
+  SLIST_FOREACH(p, &local_peer->peers_list_head, snext)
+  {
+    p->hashes_per_mtu = local_peer->hashes_per_mtu;
+    p->sbs_mode = local_peer->sbs_mode;
+    p->nc = local_peer->nc;
+    p->nl = local_peer->nl;
+    p->timeout = local_peer->timeout;
+    p->thread_num = xx + 1;
+    p->current_seeder = p; /* set current_seeder to myself */
+    p->local_leecher = local_peer;
+    swift_leecher_cond_lock_init(p);
+    swift_leecher_cond_lock_init2(p);
+
+    (void)pthread_create(&thread, NULL, swift_leecher_worker_sbs, p);
+    p->thread = thread;
+
+    p->to_remove = 1; /* mark flag that every thread created in this loop should
+                         be destroyed when his work is done */
+    xx++;
+  }
   pthread_mutex_unlock(&local_peer->peers_list_head_mutex);
 
   d_printf("created %d leecher threads\n", xx);
@@ -2505,22 +2902,41 @@ net_leecher_sbs(struct peer *local_peer)
   return 0;
 }
 
+/* pass command from local_peer->cmd to all the seeders' state machines */
 INTERNAL_LINKAGE
 void
-net_leecher_fetch_chunk(struct peer *local_peer)
+net_leecher_send_cmd(struct peer *local_peer)
 {
   struct peer *p;
 
   pthread_mutex_lock(&local_peer->peers_list_head_mutex);
-  p = SLIST_FIRST(&local_peer->peers_list_head);
+  SLIST_FOREACH(p, &local_peer->peers_list_head, snext)
+  {
+    p->cmd = local_peer->cmd;
+    swift_leecher_cond_wake(p);
+  }
   pthread_mutex_unlock(&local_peer->peers_list_head_mutex);
+}
 
-  d_printf("%s", "sending FETCH command\n");
-  p->cmd = local_peer->cmd;
+INTERNAL_LINKAGE
+void
+net_leecher_fetch_chunk(struct peer *local_peer)
+{
+  uint64_t pending;
+
+  /* the worker completing the last range of the schedule wakes us */
+  swift_mutex_lock(&local_peer->download_schedule_mutex);
+  pending = local_peer->sched_free;
+  local_peer->fetch_pending = pending;
+  swift_mutex_unlock(&local_peer->download_schedule_mutex);
+  if (pending == 0) {
+    return;
+  }
 
-  /* wake up the step-by-step state machine - she is waiting in
-   * SM_PREPARE_REQUEST state */
-  swift_leecher_cond_wake(p);
+  d_printf("%s", "sending FETCH command\n");
+  /* wake up the step-by-step state machines - they are waiting in
+   * SM_SYNC_REQUEST or SM_WAIT_FOR_NEXT_CMD state */
+  net_leecher_send_cmd(local_peer);
 
   d_printf("%s", "command FETCH sent\n");
   swift_semaph_wait(local_peer->sem);
@@ -2533,22 +2949,23 @@ net_leecher_close(struct peer *local_peer)
   uint32_t yy;
   struct peer *p;
 
-  pthread_mutex_lock(&local_peer->peers_list_head_mutex);
-  p = SLIST_FIRST(&local_peer->peers_list_head);
-  pthread_mutex_unlock(&local_peer->peers_list_head_mutex);
-
   d_printf("%s", "sending FINISH command\n");
-  p->cmd = local_peer->cmd;
-  /* wake up the step-by-step state machine */
-  swift_leecher_cond_wake(p);
-
+  net_leecher_send_cmd(local_peer);
   d_printf("%s", "command FINISH sent\n");
-  swift_semaph_wait(local_peer->sem);
 
-  /* wait for end of all of the threads and free the allocated memory for them
-   */
+  /* wait for the state machine threads before destroying their synchronization objects */
   pthread_mutex_lock(&local_peer->peers_list_head_mutex);
-  cleanup_all_dead_peers(&local_peer->peers_list_head);
+  SLIST_FOREACH(p, &local_peer->peers_list_head, snext)
+  {
+    pthread_join(p->thread, NULL);
+    p->thread = 0;
+    d_printf("seeder %s:%d: %lu chunks, %lu bytes\n", inet_ntoa(p->leecher_addr.sin_addr),
+             ntohs(p->leecher_addr.sin_port), p->rx_chunks, p->rx_bytes);
+    pthread_mutex_destroy(&p->leecher_mutex);
+    pthread_mutex_destroy(&p->leecher_mutex2);
+    pthread_cond_destroy(&p->leecher_mtx_cond);
+    pthread_cond_destroy(&p->leecher_mtx_cond2);
+  }
   pthread_mutex_unlock(&local_peer->peers_list_head_mutex);
 
   d_printf("%s", "chunks that are not downloaded yet:\n");
@@ -2560,15 +2977,20 @@ net_leecher_close(struct peer *local_peer)
     yy++;
   }
 
-  pthread_mutex_destroy(&local_peer->fd_mutex);
-  pthread_mutex_destroy(&p->leecher_mutex);
-  pthread_mutex_destroy(&p->leecher_mutex2);
-  pthread_cond_destroy(&p->leecher_mtx_cond);
-  pthread_cond_destroy(&p->leecher_mtx_cond2);
+  pthread_mutex_destroy(&local_peer->tree_mutex);
+
+  /* free the allocated memory for all of the threads */
+  pthread_mutex_lock(&local_peer->peers_list_head_mutex);
+  cleanup_all_dead_peers(&local_peer->peers_list_head, NULL);
+  pthread_mutex_unlock(&local_peer->peers_list_head_mutex);
 
   if (local_peer->download_schedule != NULL) {
     free(local_peer->download_schedule);
   }
+  free(local_peer->sched_map);
+  free(local_peer->sched_avail);
+  free(local_peer->verified_bmp);
+  local_peer->verified_bmp = NULL;
 
   close(local_peer->fd);
 }
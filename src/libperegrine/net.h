@@ -27,14 +27,55 @@
 #define _NET_H_
 
 #include "peer.h"
+#include "mt_hash.h"
 
 #define BUFSIZE 1500
 
+struct rx_batch;
+struct tx_batch;
+
+/* threaded engine: one of seeder's UDP sockets with its own router thread and table of leechers */
+struct seeder_shard {
+  struct peer *seeder;
+  int idx;
+  int sockfd;
+  struct peer_hash *peers_hash; /* leechers served through "sockfd" */
+  pthread_t thread;             /* router */
+};
+
+/*
+ * leecher side: datagrams received from seeder by one recvmmsg() call and
+ * waiting for the state machine - payloads of DATA messages among them are
+ * hashed together with the DATA being processed (multi-buffer hashing)
+ */
+struct leecher_rxq {
+  struct rx_batch *rx;
+  int head;                              /* next datagram of "rx" for the state machine */
+  int epfd;                              /* epoll instance reporting that the socket is readable */
+  uint8_t (*digest)[MT_HASH_MAX_LEN];    /* one entry per datagram of "rx" */
+  uint8_t *hashed;                       /* digest[] holds hash of the DATA payload */
+};
+
+/* leecher side: range of chunks requested from seeder and not downloaded completely yet */
+struct leecher_request {
+  uint64_t begin;
+  uint64_t end;
+  uint64_t left;   /* number of chunks of the range not received yet */
+  uint64_t chunks; /* number of chunks of the range, counted off fetch_pending when it's downloaded */
+  uint8_t sent;    /* 1 = REQUEST has been sent to current seeder */
+};
+
 int net_seeder(struct peer *seeder);
 int net_seeder_mq(struct peer *seeder);
+struct peer *seeder_find_peer(struct peer_hash * /*hash*/, char * /*buf*/, int /*n*/,
+                              struct sockaddr_in * /*clientaddr*/);
+int seeder_handshake_have(struct peer * /*p*/, void * /*recv_buf*/, uint16_t /*recv_len*/);
+void send_integrity_data(struct peer * /*p*/, struct tx_batch * /*tx*/);
+int send_integrity_data_train(struct peer * /*p*/, struct tx_batch * /*tx*/, uint64_t /*first*/, uint64_t /*last*/);
 int net_leecher_continuous(struct peer *leecher);
 int net_preliminary_connection_sbs(struct peer *leecher);
 void net_leecher_create(struct peer *leecher);
+struct peer *net_leecher_add_seeder(struct peer *leecher, struct sockaddr_in *sa);
 int net_leecher_sbs(struct peer *leecher);
 void net_leecher_fetch_chunk(struct peer *leecher);
 void net_leecher_close(struct peer *leecher);
@@ -25,15 +25,19 @@
 
 #include "peer.h"
 #include "debug.h"
-#include "sha1.h"
+#include "download_sched.h"
+#include "peer_hash.h"
+#include "ring.h"
 #include <arpa/inet.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -90,20 +94,41 @@ remove_peer_from_list(struct slist_peers *list_head, struct peer *p)
   return 0;
 }
 
+/*
+ * seeder side: register new leecher "p" - give it our channel id and make it
+ * visible in table "hash" for routing of incoming datagrams
+ * must be called with seeder->peers_list_head_mutex locked
+ */
 INTERNAL_LINKAGE
-struct peer *
-ip_port_to_peer(struct peer *seeder, struct slist_peers *list_head, struct sockaddr_in *client)
+void
+seeder_add_peer(struct peer *seeder, struct peer_hash *hash, struct peer *p)
 {
-  struct peer *p;
+  d_printf("add new peer to list: %#lx  %s:%u\n", (uint64_t)p, inet_ntoa(p->leecher_addr.sin_addr),
+           ntohs(p->leecher_addr.sin_port));
 
-  SLIST_FOREACH(p, list_head, snext)
-  {
-    if (memcmp(&p->leecher_addr, client, sizeof(struct sockaddr_in)) == 0) {
-      return p;
-    }
-  }
+  p->hash = hash;
+  p->src_chan_id = peer_hash_new_chan_id(hash);
+  SLIST_INSERT_HEAD(&seeder->peers_list_head, p, snext);
+  peer_hash_insert(hash, p);
+}
 
-  return NULL;
+/* seeder side: find leecher by its IP/PORT address - doesn't need peers_list_head_mutex */
+INTERNAL_LINKAGE
+struct peer *
+ip_port_to_peer(struct peer_hash *hash, struct sockaddr_in *client)
+{
+  return peer_hash_lookup_addr(hash, client);
+}
+
+/*
+ * seeder side: find leecher by channel id it put at the beginning of datagram
+ * received from "client" - doesn't need peers_list_head_mutex
+ */
+INTERNAL_LINKAGE
+struct peer *
+chan_id_to_peer(struct peer_hash *hash, uint32_t chan_id, struct sockaddr_in *client)
+{
+  return peer_hash_lookup_chan(hash, chan_id, client);
 }
 
 /* seeder side: create new remote peer (LEECHER) */
@@ -175,10 +200,13 @@ cleanup_peer(struct peer *p)
 
   /* method1 only - wait for pthread, destroy mutex and condition variable */
   if (p->to_remove == 1) {
-    pthread_join(p->thread, NULL);
+    if (p->thread != 0) { /* event driven engine doesn't create thread per peer */
+      pthread_join(p->thread, NULL);
+    }
 
     d_printf("cleaning up peer: %#lx\n", (uint64_t)p);
     if (p->seeder != NULL) { /* are we seeder? */
+      peer_hash_remove(p->hash, p);
       (void)remove_peer_from_list(&p->seeder->peers_list_head, p);
     } else if (p->local_leecher != NULL) { /* are we leecher? */
       (void)remove_peer_from_list(&p->local_leecher->peers_list_head, p);
@@ -197,28 +225,57 @@ cleanup_peer(struct peer *p)
     free(p->send_buf);
   }
   p->recv_buf = p->send_buf = NULL;
+  if ((p->seeder != NULL) && (p->file_list_entry != NULL)) { /* release file used by this leecher */
+    file_entry_put(p->file_list_entry);
+    p->file_list_entry = NULL;
+  }
+  ring_free(p->hi_ring);
+  ring_free(p->low_ring);
+  free(p->integrity_bmp);
+  free(p->data_bmp);
+  free(p->ack_bmp);
+  free(p->win_slots);
+  free(p->have_cache);
   d_printf("freeing peer: %#lx\n", (uint64_t)p);
   free(p);
 }
 
-/* remove all the marked peers */
+/*
+ * remove all the marked peers - if "hash" isn't NULL only the ones registered
+ * in it, the others are left for garbage collector of their own table
+ */
 INTERNAL_LINKAGE
 void
-cleanup_all_dead_peers(struct slist_peers *list_head)
+cleanup_all_dead_peers(struct slist_peers *list_head, struct peer_hash *hash)
 {
+  int pending;
   struct peer *p;
+  struct peer *next;
 
-  SLIST_FOREACH(p, list_head, snext)
-  {
-    if (p->to_remove != 0) { /* is this peer (leecher) marked to remove? */
-      cleanup_peer(p);
+  pending = 0;
+  remove_dead_peers = 0; /* cleared before scanning so peers marked meanwhile aren't missed */
+
+  p = SLIST_FIRST(list_head);
+  while (p != NULL) {
+    next = SLIST_NEXT(p, snext); /* "p" may be freed below */
+    if (p->to_remove != 0) {     /* is this peer (leecher) marked to remove? */
+      if ((hash == NULL) || (p->hash == hash)) {
+	cleanup_peer(p);
+      } else {
+	pending = 1;
+      }
     }
+    p = next;
+  }
+  if (pending != 0) {
+    remove_dead_peers = 1;
   }
-  remove_dead_peers = 0;
 }
 
 /*
- * basing on chunk array - create download schedule (array)
+ * basing on chunk array - create download schedule (array) of all the chunks
+ * not downloaded yet, every entry is the whole run of such chunks - ranges
+ * requested from seeders are cut out of it by the scheduler
  */
 INTERNAL_LINKAGE
 void
@@ -233,7 +290,7 @@ create_download_schedule(struct peer *p)
   o = 0;
   while (o < p->nc) {
     /* find first/closest not yet downloaded chunk */
-    while ((p->chunk[o].downloaded == CH_YES) && (o < p->nc)) {
+    while ((o < p->nc) && (p->chunk[o].downloaded == CH_YES)) {
       o++;
     }
     if (o >= p->nc) {
@@ -241,14 +298,8 @@ create_download_schedule(struct peer *p)
     }
 
     old_o = o;
-    uint64_t y = 0;
-    while ((y < p->hashes_per_mtu) && (o < p->nc)) {
-      if (p->chunk[o].downloaded == CH_NO) {
-	o++;
-      } else {
-	break;
-      }
-      y++;
+    while ((o < p->nc) && (p->chunk[o].downloaded == CH_NO)) {
+      o++;
     }
     d_printf("%lu-%lu   %lu\n", old_o, o - 1, o - old_o);
 
@@ -256,17 +307,18 @@ create_download_schedule(struct peer *p)
     p->download_schedule[p->download_schedule_len].end = o - 1;
     p->download_schedule_len++;
 
-    _assert((p->chunk[o].downloaded == CH_NO) || (p->chunk[o].downloaded == CH_YES),
-            "p->chunk[o].downloaded should have CH_NO or CH_YES, but have: %d\n", p->chunk[o].downloaded);
     _assert(p->download_schedule_len <= p->nc,
             "p->download_schedule_len should be <= p->nc, but "
             "p->download_schedule_len=%lu and p->nc=%u\n",
             p->download_schedule_len, p->nc);
   }
+
+  sched_reset(p);
 }
 
 /*
- * basing on chunk array - create download schedule (array)
+ * basing on chunk array - create download schedule (array) of chunks not
+ * downloaded yet in range "start_chunk".."end_chunk"
  */
 INTERNAL_LINKAGE
 int32_t
@@ -288,26 +340,18 @@ create_download_schedule_sbs(struct peer *p, uint32_t start_chunk, uint32_t end_
     return -1;
   }
 
-  p->hashes_per_mtu = 256;
-
   while ((o < p->nc) && (o <= end_chunk)) {
     /* find first/closest not yet downloaded chunk */
-    while ((p->chunk[o].downloaded == CH_YES) && (o < p->nc)) {
+    while ((o < p->nc) && (p->chunk[o].downloaded == CH_YES)) {
       o++;
     }
-    if (o >= p->nc) {
+    if ((o >= p->nc) || (o > end_chunk)) {
       break;
     }
 
     old_o = o;
-    uint64_t y = 0;
-    while ((y < p->hashes_per_mtu) && (o < p->nc) && (o <= end_chunk)) {
-      if (p->chunk[o].downloaded == CH_NO) {
-	o++;
-      } else {
-	break;
-      }
-      y++;
+    while ((o < p->nc) && (o <= end_chunk) && (p->chunk[o].downloaded == CH_NO)) {
+      o++;
     }
     d_printf("range of chunks: %lu-%lu   %lu\n", old_o, o - 1, o - old_o);
 
@@ -317,11 +361,13 @@ create_download_schedule_sbs(struct peer *p, uint32_t start_chunk, uint32_t end_
     p->download_schedule_len++;
   }
 
+  sched_reset(p);
   ret = (last_chunk - start_chunk + 1) * p->chunk_size;
 
   return ret;
 }
 
+/* like create_download_schedule_sbs() but only the chunks primary seeder has in HAVE cache are scheduled */
 INTERNAL_LINKAGE
 int32_t
 swift_create_download_schedule_sbs(struct peer *p, uint32_t start_chunk, uint32_t end_chunk)
@@ -332,7 +378,6 @@ swift_create_download_schedule_sbs(struct peer *p, uint32_t start_chunk, uint32_
   uint32_t ec;
   uint64_t o;
   uint64_t old_o;
-  uint64_t y;
 
   d_printf("creating schedule for %u chunks\n", p->nc);
   p->download_schedule_len = 0;
@@ -345,8 +390,6 @@ swift_create_download_schedule_sbs(struct peer *p, uint32_t start_chunk, uint32_
     return -1;
   }
 
-  p->hashes_per_mtu = 256;
-
   _assert(p->num_have_cache > 0, "%s\n", "peer->num_have_cache must be > 0, but it isn't");
 
   hci = 0;
@@ -354,22 +397,16 @@ swift_create_download_schedule_sbs(struct peer *p, uint32_t start_chunk, uint32_
     ec = p->have_cache[hci].end_chunk;
     while ((o < p->nc) && (o <= ec)) {
       /* find first/closest not yet downloaded chunk */
-      while ((p->chunk[o].downloaded == CH_YES) && (o < p->nc)) {
+      while ((o < p->nc) && (p->chunk[o].downloaded == CH_YES)) {
 	o++;
       }
-      if (o >= p->nc) {
+      if ((o >= p->nc) || (o > ec)) {
 	break;
       }
 
       old_o = o;
-      y = 0;
-      while ((y < p->hashes_per_mtu) && (o < p->nc) && (o <= ec)) {
-	if (p->chunk[o].downloaded == CH_NO) {
-	  o++;
-	} else {
-	  break;
-	}
-	y++;
+      while ((o < p->nc) && (o <= ec) && (p->chunk[o].downloaded == CH_NO)) {
+	o++;
       }
       d_printf("range of chunks: %lu-%lu   %lu\n", old_o, o - 1, o - old_o);
 
@@ -381,6 +418,7 @@ swift_create_download_schedule_sbs(struct peer *p, uint32_t start_chunk, uint32_
     hci++;
   }
 
+  sched_reset(p);
   ret = (last_chunk - start_chunk + 1) * p->chunk_size;
 
   return ret;
@@ -429,11 +467,14 @@ list_dir(struct peer *peer, char *dname)
 
     if (dirent->d_type == DT_REG) {
       f = malloc(sizeof(struct file_list_entry));
-      memset(f->path, 0, sizeof(f->path));
+      memset(f, 0, sizeof(struct file_list_entry));
+      f->fd = -1;
       sprintf(f->path, "%s/%s", dname, dirent->d_name);
       lstat(f->path, &stat);
       f->file_size = stat.st_size;
+      pthread_mutex_lock(&peer->file_list_head_mutex);
       SLIST_INSERT_HEAD(&peer->file_list_head, f, next);
+      pthread_mutex_unlock(&peer->file_list_head_mutex);
     }
 
     if ((dirent->d_type == DT_DIR) && (strcmp(dirent->d_name, ".") != 0) && (strcmp(dirent->d_name, "..") != 0)) {
@@ -451,34 +492,32 @@ create_file_list(struct peer *peer, char *dname)
   list_dir(peer, dname);
 }
 
+/*
+ * first step of indexing of the file: open and map it and allocate its chunk
+ * array and tree, leaves are filled by process_file_hash() and the rest of the
+ * tree by process_file_end()
+ */
 INTERNAL_LINKAGE
 void
-process_file(struct file_list_entry *file_entry, struct peer *peer)
+process_file_begin(struct file_list_entry *file_entry, struct peer *peer)
 {
-  char *buf;
-  unsigned char digest[20 + 1];
   int fd;
-  int r;
   uint64_t x;
   uint64_t nc;
   uint64_t nl;
-  uint64_t c;
-  uint64_t rd;
   struct stat stat;
-  SHA1Context context;
-  struct node *ret;
-  struct node *root8;
   uint32_t chunk_size;
 
   chunk_size = peer->chunk_size;
+  file_entry->refcnt = 1; /* reference of the seeded files list */
   fd = open(file_entry->path, O_RDONLY);
   if (fd < 0) {
     printf("error opening file: %s\n", file_entry->path);
     exit(1);
   }
   fstat(fd, &stat);
-
-  buf = malloc(chunk_size);
+  file_entry->fd = fd;
+  file_entry->file_size = stat.st_size;
 
   nc = stat.st_size / chunk_size;
   if ((stat.st_size - stat.st_size / chunk_size * chunk_size) > 0) {
@@ -504,47 +543,359 @@ process_file(struct file_list_entry *file_entry, struct peer *peer)
     file_entry->tab_chunk[x].state = CH_EMPTY;
   }
 
-  root8 = build_tree(nc, &ret);
-  file_entry->tree_root = root8;
-  file_entry->tree = ret;
+  /* identity of the file to validate on-disk tree cache against */
+  memset(&file_entry->cache_id, 0, sizeof(file_entry->cache_id));
+  file_entry->cache_id.file_size = stat.st_size;
+  file_entry->cache_id.mtime_sec = stat.st_mtim.tv_sec;
+  file_entry->cache_id.mtime_nsec = stat.st_mtim.tv_nsec;
+  file_entry->cache_id.ino = stat.st_ino;
+  file_entry->cache_id.dev = stat.st_dev;
+  file_entry->cache_id.chunk_size = chunk_size;
+  file_entry->cache_id.hash_func = peer->merkle_hash->func;
+
+  /* unchanged file - take its tree from the cache instead of hashing it again */
+  file_entry->cached = (mt_cache_load(peer, file_entry) == 0);
+  if (!file_entry->cached) {
+    build_tree(nc, peer->merkle_hash, &file_entry->tree);
+  }
+
+  /* keep the file opened for serving DATA, try to map it as well */
+  file_entry->map = NULL;
+  file_entry->map_size = file_entry->file_size;
+  if (file_entry->file_size > 0) {
+    file_entry->map = mmap(NULL, file_entry->file_size, PROT_READ, MAP_SHARED, file_entry->fd, 0);
+    if (file_entry->map == MAP_FAILED) {
+      d_printf("cannot map file %s: %s - using pread() instead\n", file_entry->path, strerror(errno));
+      file_entry->map = NULL;
+    }
+  }
 
-  /* compute SHA hash for every chunk for given file */
-  rd = 0;
-  c = 0;
-  while (rd < (uint64_t)stat.st_size) {
-    r = read(fd, buf, chunk_size);
+  /* the file is going to be read once from the beginning to the end */
+  if (!file_entry->cached) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (file_entry->map != NULL) {
+      madvise(file_entry->map, file_entry->map_size, MADV_SEQUENTIAL);
+    }
+  }
+}
 
-    SHA1Reset(&context);
-    SHA1Input(&context, (uint8_t *)buf, r);
-    SHA1Result(&context, digest);
+/*
+ * start reading window of the file which begins at "offset" in background,
+ * so it is ready when hashing of the current window finishes
+ */
+INTERNAL_LINKAGE
+void
+process_file_readahead(struct file_list_entry *file_entry, uint64_t offset)
+{
+  uint64_t page;
+  uint64_t len;
 
-    file_entry->tab_chunk[c].state = CH_ACTIVE;
-    file_entry->tab_chunk[c].offset = c * chunk_size;
-    file_entry->tab_chunk[c].len = r;
-    memcpy(file_entry->tab_chunk[c].sha, digest, 20);
-    memcpy(ret[2 * c].sha, digest, 20);
-    ret[2 * c].state = ACTIVE;
-    rd += r;
-    c++;
+  if (offset >= file_entry->file_size) {
+    return;
+  }
+  len = file_entry->file_size - offset < INDEX_READAHEAD_BYTES ? file_entry->file_size - offset
+							       : INDEX_READAHEAD_BYTES;
+  if (file_entry->map != NULL) {
+    page = offset % sysconf(_SC_PAGESIZE);
+    madvise(file_entry->map + offset - page, len + page, MADV_WILLNEED);
+  } else {
+    posix_fadvise(file_entry->fd, offset, len, POSIX_FADV_WILLNEED);
   }
-  close(fd);
+}
 
-  /* link array of chunks to leaves */
-  for (x = 0; x < nl; x++) {
-    ret[x * 2].chunk = &file_entry->tab_chunk[x];
-    file_entry->tab_chunk[x].node = &ret[x * 2];
+/*
+ * compute hashes of chunks "first".."last" of the file - several chunks at
+ * once, disjoint ranges of one file may be hashed by different threads
+ *
+ * Reading and hashing overlap: the file is walked in windows of
+ * INDEX_READAHEAD_BYTES and the kernel reads the next window in background
+ * while the current one is hashed. Chunks are hashed directly from the
+ * mapping of the file, "buf" is used only if the file couldn't be mapped and
+ * must have room for peer->merkle_hash->lanes() chunks.
+ */
+INTERNAL_LINKAGE
+void
+process_file_hash(struct file_list_entry *file_entry, struct peer *peer, uint64_t first, uint64_t last, char *buf)
+{
+  uint8_t digests[MT_HASH_MAX_LANES * MT_HASH_MAX_LEN];
+  const uint8_t *msgs[MT_HASH_MAX_LANES];
+  int lanes;
+  int len;
+  ssize_t r;
+  ssize_t n;
+  uint64_t x;
+  uint64_t k;
+  uint64_t c;
+  uint64_t want;
+  uint64_t window;
+  uint32_t chunk_size;
+  uint8_t *data;
+  struct mt_tree *t;
+
+  chunk_size = peer->chunk_size;
+  lanes = peer->merkle_hash->lanes();
+  len = peer->merkle_hash->len;
+  t = &file_entry->tree;
+
+  c = first;
+  window = c * chunk_size;
+  process_file_readahead(file_entry, window);
+  while (c <= last) {
+    want = (last - c + 1 < (uint64_t)lanes ? last - c + 1 : (uint64_t)lanes) * chunk_size;
+    if (c * chunk_size + want > file_entry->file_size) {
+      want = file_entry->file_size - c * chunk_size;
+    }
+
+    /* entering next window - ask for the one after it */
+    if (c * chunk_size >= window) {
+      window += INDEX_READAHEAD_BYTES;
+      process_file_readahead(file_entry, window);
+    }
+
+    if (file_entry->map != NULL) {
+      data = file_entry->map + c * chunk_size;
+      r = want;
+    } else {
+      data = (uint8_t *)buf;
+      r = 0;
+      while ((uint64_t)r < want) {
+	n = pread(file_entry->fd, buf + r, want - r, c * chunk_size + r);
+	if (n <= 0) {
+	  printf("error reading file: %s\n", file_entry->path);
+	  exit(1);
+	}
+	r += n;
+      }
+    }
+
+    /* full chunks are hashed all at once, the last one may be shorter */
+    k = r / chunk_size;
+    for (x = 0; x < k; x++) {
+      msgs[x] = data + x * chunk_size;
+    }
+    peer->merkle_hash->digest_mb(msgs, chunk_size, k, digests);
+    if ((uint32_t)r % chunk_size > 0) {
+      msgs[k] = data + k * chunk_size;
+      peer->merkle_hash->digest_mb(&msgs[k], r % chunk_size, 1, digests + len * k);
+      k++;
+    }
+
+    for (x = 0; x < k; x++) {
+      file_entry->tab_chunk[c].state = CH_ACTIVE;
+      file_entry->tab_chunk[c].offset = c * chunk_size;
+      file_entry->tab_chunk[c].len = x < (uint64_t)r / chunk_size ? chunk_size : r % chunk_size;
+      memcpy(file_entry->tab_chunk[c].sha, digests + len * x, len);
+      memcpy(MT_SHA(t, 2 * c), digests + len * x, len);
+      mt_set_active(t, 2 * c);
+      c++;
+    }
+  }
+}
+
+/*
+ * last step of indexing of the file: all the leaves have hashes, compute the
+ * rest of the tree and make the file visible for leechers
+ */
+INTERNAL_LINKAGE
+void
+process_file_end(struct file_list_entry *file_entry, struct peer *peer)
+{
+  int threads;
+  uint64_t x;
+  uint64_t nl;
+  struct mt_tree *t;
+
+  t = &file_entry->tree;
+  nl = file_entry->nl;
+
+  /* leechers read the file in any order */
+  if (!file_entry->cached) {
+    posix_fadvise(file_entry->fd, 0, 0, POSIX_FADV_NORMAL);
+    if (file_entry->map != NULL) {
+      madvise(file_entry->map, file_entry->map_size, MADV_NORMAL);
+    }
   }
 
-  /* print the tree for given file */
-  show_tree_root_based(&ret[root8->number]);
+  /* print the tree for given file - chunk "x" is leaf "2 * x" */
+  show_tree_root_based(t->root);
+
+  if (file_entry->cached) {
+    /* only leaves come from the cache - fill array of chunks from them */
+    for (x = 0; x < file_entry->nc; x++) {
+      file_entry->tab_chunk[x].state = CH_ACTIVE;
+      file_entry->tab_chunk[x].offset = x * peer->chunk_size;
+      file_entry->tab_chunk[x].len = x < file_entry->nc - 1 ? peer->chunk_size
+	                                                    : file_entry->file_size - x * peer->chunk_size;
+      memcpy(file_entry->tab_chunk[x].sha, MT_SHA(t, 2 * x), t->hash->len);
+    }
+  }
 
   /* print array tab_chunk */
-  dump_chunk_tab(file_entry->tab_chunk, nl);
+  dump_chunk_tab(file_entry->tab_chunk, nl, t->hash);
+
+  /* update all the hashes in the tree and save it for the next start */
+  if (!file_entry->cached) {
+    if (file_entry->rehash_from > 0) {
+      update_sha_tail(t, file_entry->nc, file_entry->rehash_from);
+    } else {
+      threads = peer->index_threads;
+      if (threads == 0) {
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+      }
+      update_sha(t, nl, threads);
+    }
+    mt_cache_store(peer, file_entry);
+  }
+
+  dump_tree(t);
+
+  /* make the file visible for leechers only when its tree is complete */
+  __atomic_store_n(&file_entry->tree_root, MT_SHA(t, t->root), __ATOMIC_RELEASE);
+}
+
+/*
+ * index file which has grown since it was indexed as "old" - the file is
+ * expected to be appended to, so hashes of full chunks of "old" are reused
+ * and only its last chunk and the new ones are hashed
+ *
+ * Nodes keep their numbers when the tree grows, so the old tree is copied to
+ * the bottom of the new one and only ancestors of the hashed chunks are
+ * computed again. "old" stays untouched for leechers still using it.
+ */
+INTERNAL_LINKAGE
+void
+process_file_extend(struct file_list_entry *file_entry, struct file_list_entry *old, struct peer *peer)
+{
+  char *buf;
+  uint64_t first;
+  struct mt_tree *t;
+
+  process_file_begin(file_entry, peer);
+  if (!file_entry->cached && (file_entry->nc > 0)) {
+    t = &file_entry->tree;
+    first = old->nc;
+    if ((old->file_size % peer->chunk_size) > 0) {
+      first--; /* the old last chunk was shorter - hash it again */
+    }
+    if (first > file_entry->nc) {
+      first = 0; /* file is shorter than before - nothing can be reused */
+    }
+    if (first > 0) {
+      memcpy(t->sha, old->tree.sha, t->hash->len * (2 * (uint64_t)old->nl - 1));
+      memcpy(t->active, old->tree.active, (2 * (uint64_t)old->nl + 7) / 8);
+      memcpy(file_entry->tab_chunk, old->tab_chunk, first * sizeof(struct chunk));
+    }
+    file_entry->rehash_from = first;
+    d_printf("extending %s: %u -> %u chunks, hashing from chunk %lu\n", file_entry->path, old->nc, file_entry->nc,
+             first);
+
+    buf = malloc((size_t)peer->chunk_size * peer->merkle_hash->lanes());
+    process_file_hash(file_entry, peer, first, file_entry->nc - 1, buf);
+    free(buf);
+  }
+  process_file_end(file_entry, peer);
+}
+
+INTERNAL_LINKAGE
+void
+process_file(struct file_list_entry *file_entry, struct peer *peer)
+{
+  char *buf;
+
+  process_file_begin(file_entry, peer);
+  if (file_entry->nc > 0) {
+    buf = malloc((size_t)peer->chunk_size * peer->merkle_hash->lanes());
+    process_file_hash(file_entry, peer, 0, file_entry->nc - 1, buf);
+    free(buf);
+  }
+  process_file_end(file_entry, peer);
+}
+
+/* take reference to file entry - it won't be freed until file_entry_put() */
+INTERNAL_LINKAGE
+void
+file_entry_get(struct file_list_entry *f)
+{
+  __atomic_add_fetch(&f->refcnt, 1, __ATOMIC_ACQ_REL);
+}
+
+/* drop reference to file entry, the last one closes the chunk store and frees the entry */
+INTERNAL_LINKAGE
+void
+file_entry_put(struct file_list_entry *f)
+{
+  if (__atomic_sub_fetch(&f->refcnt, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+
+  d_printf("freeing file entry: %s\n", f->path);
+  if (f->map != NULL) {
+    munmap(f->map, f->map_size);
+  }
+  if (f->fd >= 0) {
+    close(f->fd);
+  }
+  free(f->tab_chunk);
+  free_tree(&f->tree);
+  free(f);
+}
+
+/*
+ * copy contents of chunk number "chunk" to "buf"
+ * returns number of copied bytes (less than chunk_size for the last chunk) or -1 on error
+ */
+INTERNAL_LINKAGE
+int
+file_entry_read_chunk(struct file_list_entry *f, uint64_t chunk, uint32_t chunk_size, char *buf)
+{
+  uint64_t off;
+  uint64_t len;
+
+  off = chunk * chunk_size;
+  if (off >= f->map_size) {
+    return 0;
+  }
+  len = f->map_size - off;
+  if (len > chunk_size) {
+    len = chunk_size;
+  }
+
+  if (f->map != NULL) {
+    memcpy(buf, f->map + off, len);
+    return len;
+  }
+
+  return pread(f->fd, buf, len, off);
+}
+
+/*
+ * point "iov" at contents of chunk number "chunk" in file mapping, so the chunk can be sent without copying
+ * returns 0 or -1 if the file is not mapped and the chunk has to be read with file_entry_read_chunk()
+ */
+INTERNAL_LINKAGE
+int
+file_entry_chunk_iov(struct file_list_entry *f, uint64_t chunk, uint32_t chunk_size, struct iovec *iov)
+{
+  uint64_t off;
+  uint64_t len;
 
-  /* update all the SHAs in the tree */
-  update_sha(ret, nl);
+  if (f->map == NULL) {
+    return -1;
+  }
 
-  dump_tree(ret, nl);
+  off = chunk * chunk_size;
+  if (off >= f->map_size) {
+    iov->iov_base = f->map;
+    iov->iov_len = 0;
+    return 0;
+  }
+  len = f->map_size - off;
+  if (len > chunk_size) {
+    len = chunk_size;
+  }
 
-  free(buf);
+  iov->iov_base = f->map + off;
+  iov->iov_len = len;
+
+  return 0;
 }
@@ -27,12 +27,14 @@
 #define _PEER_H_
 
 #include "mt.h"
+#include "mt_cache.h"
 #include <mqueue.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdint.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <time.h>
 
 #define INTERNAL_LINKAGE __attribute__((__visibility__("hidden")))
@@ -50,11 +52,22 @@ struct file_list_entry {
   uint32_t nl;             /* number of leaves */
   uint32_t nc;             /* number of chunks */
   struct chunk *tab_chunk; /* array of chunks for this file */
-  struct node *tree;       /* tree of the file */
-  struct node *tree_root;  /* pointer to root node of the tree */
+  struct mt_tree tree;     /* tree of the file */
+  uint8_t *tree_root;      /* hash of root node of the tree, NULL until the tree is complete */
   uint32_t start_chunk;
   uint32_t end_chunk;
 
+  /* chunk store - opened once by process_file() and used for serving DATA */
+  int fd;              /* descriptor of the file, used with pread() if mapping failed */
+  uint8_t *map;        /* read-only mapping of the whole file or NULL */
+  uint64_t map_size;   /* length of the mapping */
+  volatile int refcnt; /* 1 for the seeded files list + 1 for every leecher using this file */
+
+  uint32_t index_jobs; /* indexing: number of not finished hashing jobs of this file */
+  uint8_t cached;      /* 1 = tree has been loaded from on-disk cache, file is not hashed */
+  uint32_t rehash_from; /* indexing: tree is valid except ancestors of chunks from this one, 0 = whole tree */
+  struct mt_cache_id cache_id; /* identity of the file at the time of indexing */
+
   SLIST_ENTRY(file_list_entry) next;
 };
 
@@ -67,23 +80,40 @@ struct other_seeders_entry {
 
 SLIST_HEAD(slist_peers, peer);
 
+struct peer_hash;
+struct seeder_shard;
+struct reactor;
+struct ring;
+
 extern uint8_t remove_dead_peers;
 
-/* node cache for verifying SHA-1 in swift compatibility mode */
-SLIST_HEAD(slist_node_cache, node_cache_entry);
-struct node_cache_entry {
-  struct node node;
-  SLIST_ENTRY(node_cache_entry) next;
-  //	struct slist_node_cache next;
+/* one chunk in flight in seeder's send window */
+struct win_slot {
+  uint64_t sent_us; /* time of last sending */
+  uint8_t retx;     /* 1 = chunk was retransmitted so its HAVE isn't used for RTT estimation */
 };
 
-STAILQ_HEAD(wqueue_head, wqueue_entry);
-struct wqueue_entry {
-  char *msg;
-  uint16_t msg_len;
-  STAILQ_ENTRY(wqueue_entry) next;
+#define REQUEST_QUEUE_LEN 16 /* max number of ranges requested at once by leecher from one seeder */
+#define REQUESTS_DEFAULT  4  /* leecher: number of ranges requested at once if not set in leecher parameters */
+#define SCHED_LEVELS      8  /* leecher: chunks which at least this number of seeders have are equally common */
+
+#define INDEX_READAHEAD_BYTES (4 * 1024 * 1024) /* indexing: file is read ahead in windows of this size */
+
+#define LEDBAT_BASE_HISTORY   10 /* [minutes] */
+#define LEDBAT_CURRENT_FILTER 4  /* [samples] */
+
+/* seeder side: state of LEDBAT congestion controller */
+struct ledbat_state {
+  int64_t base_history[LEDBAT_BASE_HISTORY]; /* minimal delay in each of last minutes */
+  int64_t cur_delays[LEDBAT_CURRENT_FILTER]; /* last delay samples */
+  uint64_t base_minute;                      /* minute of base_history[base_idx] */
+  uint8_t base_idx;
+  uint8_t cur_idx;
 };
 
+struct cc_ops;
+struct sched_ops;
+
 struct have_cache {
   uint32_t start_chunk;
   uint32_t end_chunk;
@@ -152,20 +182,18 @@ struct peer {
                                  threads */
   struct peer *local_leecher; /* pointer to local leecher peer struct - used on
                                  leecher side in threads */
-  struct node *tree;          /* pointer to beginning (index 0) array with tree nodes */
-  struct node *tree_root;     /* pointer to root of the tree */
+  struct mt_tree tree;        /* tree of the file on leecher side */
   struct chunk *chunk;        /* array of chunks */
   uint32_t nl;                /* number of leaves */
   uint32_t nc;                /* number of chunks */
   uint64_t num_series;        /* number of series */
-  uint64_t hashes_per_mtu;    /* number of hashes that fit MTU size, for example if
-                                 == 5 then series are 0..4, 5..9, 10..14 */
-  uint8_t sha_demanded[20];
+  uint64_t hashes_per_mtu;    /* number of hashes that fit MTU size */
+  uint8_t sha_demanded[MT_HASH_MAX_LEN];
+  const struct mt_hash *merkle_hash;        /* hash function of trees: seeder - of seeded files, leecher - of
+                                               demanded file */
   uint8_t seeder_has_file;                  /* flag on leecher side: 1 = seeder has file for
                                                which we have demanded in ->sha_demanded[], 0 =
                                                seeder has not file */
-  uint8_t fetch_schedule;                   /* 0 = peer is not allowed to get next schedule from
-                                               download_schedule array */
   uint8_t after_seeder_switch;              /* 0 = still downloading from primary seeder, 1 =
                                                switched to another seeder after connection
                                                lost */
@@ -174,9 +202,32 @@ struct peer {
   uint64_t download_schedule_len;           /* number of indexes of allocated array
                                                "download_schedule", 0 = all chunks
                                                downloaded */
-  volatile uint64_t download_schedule_idx;  /* index (iterator) for download_schedule array */
   pthread_mutex_t download_schedule_mutex;  /* mutex for "download_schedule"
-                                               array protection */
+                                               array protection and all the sched_* fields */
+  const struct sched_ops *sched;            /* leecher side: scheduler giving ranges to seeders */
+  uint8_t *sched_map;                       /* leecher side: enum sched_chunk state of every chunk */
+  uint16_t *sched_avail;                    /* leecher side: number of known seeders having the chunk */
+  uint64_t sched_first;                     /* leecher side: all the chunks before it are taken */
+  uint64_t sched_level_first[SCHED_LEVELS + 1]; /* leecher side: rarest - there is no free chunk with
+                                                   given availability before it */
+  uint64_t sched_free;                      /* leecher side: chunks of the schedule not taken yet */
+  uint64_t sched_rate_sum;                  /* leecher side: sum of rates of all the seeders */
+  uint8_t sched_any_have;                   /* leecher side: chunks are given to seeders regardless of HAVE */
+  uint64_t rate;                            /* leecher side: measured rate of this seeder [chunks/s],
+                                               0 = not known yet */
+  uint64_t rate_us;                         /* leecher side: start of current rate sample, 0 = seeder idle */
+  uint64_t rate_chunks;                     /* leecher side: rx_chunks at the start of current rate sample */
+  uint8_t have_counted;                     /* leecher side: HAVE of this seeder is in sched_avail */
+  uint64_t fetch_pending;                   /* leecher side: chunks of current fetch not downloaded yet,
+                                               protected by download_schedule_mutex */
+  pthread_mutex_t tree_mutex;               /* leecher side: protects tree and verified_bmp shared by
+                                               workers of all the seeders */
+  uint64_t rx_chunks;                       /* leecher side: chunks received from this seeder */
+  uint64_t rx_bytes;                        /* leecher side: bytes of DATA received from this seeder */
+  uint8_t preallocate;                      /* leecher side: reserve space for the whole file before writing
+                                               to it */
+  uint8_t max_requests;                     /* leecher side: number of ranges requested from one seeder at
+                                               once */
 
   /* for thread */
   uint8_t finishing;
@@ -201,7 +252,6 @@ struct peer {
 
   uint16_t recv_len;
   int sockfd, fd;
-  pthread_mutex_t fd_mutex;
 
   /* synchronization */
   sem_t *sem;
@@ -242,24 +292,60 @@ struct peer {
   uint8_t *integrity_bmp;  /* bitmap used by seeder for given leecher (libswift
                               compat mode) - to mark which tree node has already
                               been sent, 1-integrity node sent */
+  uint8_t *verified_bmp;   /* leecher: bitmap of tree nodes whose hashes have been proven by hashing up to
+                              already verified node, 1-hash can be trusted */
   uint8_t *data_bmp; /* */ // zwolnic pamiec podczas finish
+  uint8_t *ack_bmp;  /* seeder side: chunks confirmed by leecher with HAVE */
+
+  /* seeder side: sliding window of DATA sent to leecher - it moves over sequence of chunks of all the queued
+   * ranges, positions in the sequence are counted from the first range ever requested */
+  struct schedule_entry req_queue[REQUEST_QUEUE_LEN]; /* ranges requested by leecher and not confirmed yet */
+  uint8_t req_head;            /* index of the oldest range in req_queue */
+  uint8_t req_count;           /* number of ranges in req_queue */
+  uint64_t req_seq;            /* position of first chunk of the oldest range */
+  uint32_t win_size;           /* max number of chunks in flight */
+  uint64_t win_base;           /* position of oldest chunk not confirmed by HAVE yet */
+  uint64_t win_next;           /* position of next chunk to be sent for the first time */
+  struct win_slot *win_slots;  /* chunks in flight, indexed by position % win_size */
+  uint64_t srtt_us, rttvar_us; /* smoothed round trip time and its variation */
+  uint64_t rto_us;             /* retransmission timeout */
+  const struct cc_ops *cc;     /* congestion controller sizing the window */
+  uint32_t cwnd;               /* congestion window in 1/CC_SCALE of chunk */
+  struct ledbat_state ledbat;
+
+  int64_t delay_sample; /* leecher side: one-way delay of last received DATA [us], sent back in ACK */
 
   struct peer *current_seeder; /* leecher side: points to one element of the
                                   list seeders in ->snext */
 
-  pthread_mutex_t peers_list_head_mutex;        /* mutex for protecting peers_list_head */
+  pthread_mutex_t peers_list_head_mutex;        /* mutex for protecting peers_list_head and peers_hash */
   struct slist_peers peers_list_head;           /* seeder: list of connected leechers, leecher: ? */
+  struct peer_hash *peers_hash;                 /* seeder: connected leechers indexed by address and channel id */
   struct slist_seeders other_seeders_list_head; /* seeder: list of other (alternative) seeders
                                                    maintained by primary seeder */
   struct slisthead file_list_head;              /* seeder: head of list of files shared by seeder */
+  pthread_mutex_t file_list_head_mutex;         /* seeder: mutex for protecting file_list_head */
   struct file_list_entry *file_list_entry;      /* seeder side: pointer to file choosen by leecher using
                                                    SHA1 hash */
 
-  struct slist_node_cache cache;
-  struct wqueue_head hi_wqueue;
-  struct wqueue_head low_wqueue;
-  pthread_mutex_t hi_mutex;
-  pthread_mutex_t low_mutex;
+  struct ring *hi_ring;  /* leecher from seeder pov: HAVE and ACK messages passed by router to worker */
+  struct ring *low_ring; /* leecher from seeder pov: all the other messages passed by router to worker */
+
+  /* event driven engine (seeder side) */
+  uint8_t engine;                /* seeder: one of peregrine_engine_t values */
+  uint16_t reactor_threads;      /* seeder: number of event loops, 0 = one per CPU */
+  uint8_t zerocopy;              /* seeder: send DATA with MSG_ZEROCOPY */
+  uint16_t window;               /* seeder: max number of chunks in flight to one leecher */
+  uint8_t congestion;            /* seeder: one of peregrine_cc_t values */
+  uint16_t sockets;              /* seeder: number of SO_REUSEPORT sockets of threaded engine, 0 = one socket */
+  uint8_t gso;                   /* seeder: send trains of DATA with UDP GSO, cleared if kernel can't do it */
+  uint16_t index_threads;        /* seeder: number of threads hashing seeded files, 0 = one per CPU */
+  char *cache_dir;               /* seeder: directory of on-disk tree cache or NULL */
+  uint32_t follow_ms;            /* seeder: period of checking seeded files for changes [ms], 0 = never */
+  struct seeder_shard *shards;   /* seeder: sockets of threaded engine with their routers */
+  uint16_t num_shards;
+  struct reactor *reactor;       /* seeder: event loops serving connected leechers */
+  pthread_mutex_t reactor_mutex; /* leecher from seeder pov: protects peer while serviced by event loop */
 
   /* HAVE cache */
   struct have_cache *have_cache;
@@ -267,6 +353,13 @@ struct peer {
                                           // finish
   uint16_t num_have_cache;                /* number of entries in HAVE cache */
 
+  /* leecher from seeder pov: links in "hash" - seeder->peers_hash or table of one of router shards */
+  struct peer_hash *hash;
+  struct peer *addr_hnext;
+  struct peer *chan_hnext;
+  uint8_t hashed;        /* 1 = peer can be found in "hash" */
+  uint64_t retire_epoch; /* event driven engine: epoch in which peer was removed from "hash" */
+
   SLIST_ENTRY(peer)
   snext; /* list of peers - leechers from seeder point of view or seeders from
             leecher pov */
@@ -275,17 +368,29 @@ struct peer {
 void add_peer_to_list(struct slist_peers * /*list_head*/, struct peer * /*p*/);
 void print_peer_list(struct slist_peers *);
 int remove_peer_from_list(struct slist_peers * /*list_head*/, struct peer * /*p*/);
-struct peer *ip_port_to_peer(struct peer * /*seeder*/, struct slist_peers * /*list_head*/,
-                             struct sockaddr_in * /*client*/);
+struct peer *ip_port_to_peer(struct peer_hash * /*hash*/, struct sockaddr_in * /*client*/);
+struct peer *chan_id_to_peer(struct peer_hash * /*hash*/, uint32_t /*chan_id*/, struct sockaddr_in * /*client*/);
+void seeder_add_peer(struct peer * /*seeder*/, struct peer_hash * /*hash*/, struct peer * /*p*/);
 struct peer *new_peer(struct sockaddr_in * /*sa*/, int /*n*/, int /*sockfd*/);
 struct peer *new_seeder(struct sockaddr_in * /*sa*/, int /*n*/);
 void cleanup_peer(struct peer * /*p*/);
-void cleanup_all_dead_peers(struct slist_peers * /*list_head*/);
+void cleanup_all_dead_peers(struct slist_peers * /*list_head*/, struct peer_hash * /*hash*/);
 void create_download_schedule(struct peer * /*p*/);
 int32_t create_download_schedule_sbs(struct peer * /*p*/, uint32_t /*start_chunk*/, uint32_t /*end_chunk*/);
 int32_t swift_create_download_schedule_sbs(struct peer * /*p*/, uint32_t /*start_chunk*/, uint32_t /*end_chunk*/);
 int all_chunks_downloaded(struct peer * /*p*/);
 void create_file_list(struct peer * /*peer*/, char * /*dname*/);
 void process_file(struct file_list_entry * /*file_entry*/, struct peer * /*peer*/);
+void process_file_begin(struct file_list_entry * /*file_entry*/, struct peer * /*peer*/);
+void process_file_hash(struct file_list_entry * /*file_entry*/, struct peer * /*peer*/, uint64_t /*first*/,
+                       uint64_t /*last*/, char * /*buf*/);
+void process_file_end(struct file_list_entry * /*file_entry*/, struct peer * /*peer*/);
+void process_file_extend(struct file_list_entry * /*file_entry*/, struct file_list_entry * /*old*/,
+                         struct peer * /*peer*/);
+void file_entry_get(struct file_list_entry * /*f*/);
+void file_entry_put(struct file_list_entry * /*f*/);
+int file_entry_read_chunk(struct file_list_entry * /*f*/, uint64_t /*chunk*/, uint32_t /*chunk_size*/, char * /*buf*/);
+int file_entry_chunk_iov(struct file_list_entry * /*f*/, uint64_t /*chunk*/, uint32_t /*chunk_size*/,
+                         struct iovec * /*iov*/);
 
 #endif /* _PEER_H_ */
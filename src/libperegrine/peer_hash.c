@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "peer_hash.h"
+#include "debug.h"
+#include "peer.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+/*
+ * Readers walk the bucket chains with acquire loads only, writers publish
+ * changes with release stores. A peer is inserted at the head of the chain
+ * after its link is set, and unlinked by making its predecessor point to its
+ * successor - its own link is left intact so a reader standing on it can
+ * still walk the rest of the chain.
+ */
+
+INTERNAL_LINKAGE
+uint32_t
+peer_hash_addr_idx(struct sockaddr_in *addr)
+{
+  uint32_t k;
+
+  k = addr->sin_addr.s_addr ^ ((uint32_t)addr->sin_port << 16 | addr->sin_port);
+
+  return (k * 0x9e3779b1U) >> 20 & (PEER_HASH_SIZE - 1);
+}
+
+INTERNAL_LINKAGE
+uint32_t
+peer_hash_chan_idx(uint32_t chan_id)
+{
+  return (chan_id * 0x9e3779b1U) >> 20 & (PEER_HASH_SIZE - 1);
+}
+
+INTERNAL_LINKAGE
+int
+peer_hash_addr_eq(struct peer *p, struct sockaddr_in *addr)
+{
+  return (p->leecher_addr.sin_addr.s_addr == addr->sin_addr.s_addr) && (p->leecher_addr.sin_port == addr->sin_port);
+}
+
+INTERNAL_LINKAGE
+struct peer_hash *
+peer_hash_create(void)
+{
+  struct peer_hash *h;
+  struct timespec ts;
+
+  h = malloc(sizeof(struct peer_hash));
+  if (h == NULL) {
+    return NULL;
+  }
+  memset(h, 0, sizeof(struct peer_hash));
+
+  if (getrandom(&h->chan_salt, sizeof(h->chan_salt), GRND_NONBLOCK) != sizeof(h->chan_salt)) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    h->chan_salt = ts.tv_sec ^ ts.tv_nsec;
+  }
+
+  return h;
+}
+
+INTERNAL_LINKAGE
+void
+peer_hash_free(struct peer_hash *h)
+{
+  free(h);
+}
+
+/*
+ * give new channel id - unique among connected leechers, never 0 which is
+ * reserved for initial HANDSHAKE
+ * multiplying by odd constant is a bijection so ids don't repeat until the
+ * 32 bit counter wraps, the lookup only guards against that
+ */
+INTERNAL_LINKAGE
+uint32_t
+peer_hash_new_chan_id(struct peer_hash *h)
+{
+  uint32_t id;
+  struct peer *p;
+
+  do {
+    id = (++h->chan_seq * 0x9e3779b1U) ^ h->chan_salt;
+    for (p = h->chan_bucket[peer_hash_chan_idx(id)]; p != NULL; p = p->chan_hnext) {
+      if (p->src_chan_id == id) {
+	break;
+      }
+    }
+  } while ((id == 0) || (p != NULL));
+
+  return id;
+}
+
+/* make peer "p" visible for lookups - called with seeder->peers_list_head_mutex locked */
+INTERNAL_LINKAGE
+void
+peer_hash_insert(struct peer_hash *h, struct peer *p)
+{
+  uint32_t a;
+  uint32_t c;
+
+  a = peer_hash_addr_idx(&p->leecher_addr);
+  c = peer_hash_chan_idx(p->src_chan_id);
+
+  p->addr_hnext = h->addr_bucket[a];
+  p->chan_hnext = h->chan_bucket[c];
+  __atomic_store_n(&h->addr_bucket[a], p, __ATOMIC_RELEASE);
+  __atomic_store_n(&h->chan_bucket[c], p, __ATOMIC_RELEASE);
+  p->hashed = 1;
+}
+
+/* hide peer "p" from lookups - called with seeder->peers_list_head_mutex locked */
+INTERNAL_LINKAGE
+void
+peer_hash_remove(struct peer_hash *h, struct peer *p)
+{
+  struct peer **pp;
+
+  if (p->hashed == 0) {
+    return;
+  }
+
+  for (pp = &h->addr_bucket[peer_hash_addr_idx(&p->leecher_addr)]; *pp != NULL; pp = &(*pp)->addr_hnext) {
+    if (*pp == p) {
+      __atomic_store_n(pp, p->addr_hnext, __ATOMIC_RELEASE);
+      break;
+    }
+  }
+
+  for (pp = &h->chan_bucket[peer_hash_chan_idx(p->src_chan_id)]; *pp != NULL; pp = &(*pp)->chan_hnext) {
+    if (*pp == p) {
+      __atomic_store_n(pp, p->chan_hnext, __ATOMIC_RELEASE);
+      break;
+    }
+  }
+
+  p->hashed = 0;
+}
+
+/* find leecher with given IP/PORT address, peers marked for removal are skipped */
+INTERNAL_LINKAGE
+struct peer *
+peer_hash_lookup_addr(struct peer_hash *h, struct sockaddr_in *addr)
+{
+  struct peer *p;
+
+  p = __atomic_load_n(&h->addr_bucket[peer_hash_addr_idx(addr)], __ATOMIC_ACQUIRE);
+  while (p != NULL) {
+    if (peer_hash_addr_eq(p, addr) && (__atomic_load_n(&p->to_remove, __ATOMIC_RELAXED) == 0)) {
+      return p;
+    }
+    p = __atomic_load_n(&p->addr_hnext, __ATOMIC_ACQUIRE);
+  }
+
+  return NULL;
+}
+
+/*
+ * find leecher by channel id taken from the beginning of datagram - the
+ * datagram must also come from leecher's address
+ */
+INTERNAL_LINKAGE
+struct peer *
+peer_hash_lookup_chan(struct peer_hash *h, uint32_t chan_id, struct sockaddr_in *addr)
+{
+  struct peer *p;
+
+  p = __atomic_load_n(&h->chan_bucket[peer_hash_chan_idx(chan_id)], __ATOMIC_ACQUIRE);
+  while (p != NULL) {
+    if ((p->src_chan_id == chan_id) && peer_hash_addr_eq(p, addr)
+        && (__atomic_load_n(&p->to_remove, __ATOMIC_RELAXED) == 0)) {
+      return p;
+    }
+    p = __atomic_load_n(&p->chan_hnext, __ATOMIC_ACQUIRE);
+  }
+
+  return NULL;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PEER_HASH_H_
+#define _PEER_HASH_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#define PEER_HASH_SIZE 4096 /* number of buckets in each index, must be power of 2 */
+
+struct peer;
+
+/*
+ * seeder side: index of connected leechers by their IP/PORT address and by
+ * channel id we gave them in HANDSHAKE
+ *
+ * lookups don't take any lock - they may run concurrently with insertion and
+ * removal which are serialized by caller (seeder->peers_list_head_mutex).
+ * removed peer stays valid for readers which already found it - the caller
+ * must not free it until all the readers are done with it.
+ */
+struct peer_hash {
+  struct peer *addr_bucket[PEER_HASH_SIZE];
+  struct peer *chan_bucket[PEER_HASH_SIZE];
+  uint32_t chan_seq;  /* number of channel ids given so far */
+  uint32_t chan_salt; /* makes our channel ids unpredictable */
+};
+
+struct peer_hash *peer_hash_create(void);
+void peer_hash_free(struct peer_hash * /*h*/);
+uint32_t peer_hash_new_chan_id(struct peer_hash * /*h*/);
+void peer_hash_insert(struct peer_hash * /*h*/, struct peer * /*p*/);
+void peer_hash_remove(struct peer_hash * /*h*/, struct peer * /*p*/);
+struct peer *peer_hash_lookup_addr(struct peer_hash * /*h*/, struct sockaddr_in * /*addr*/);
+struct peer *peer_hash_lookup_chan(struct peer_hash * /*h*/, uint32_t /*chan_id*/, struct sockaddr_in * /*addr*/);
+
+#endif /* _PEER_HASH_H_ */
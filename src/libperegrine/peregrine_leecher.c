@@ -24,9 +24,12 @@
  */
 
 #include "peregrine_leecher.h"
+#include "download_sched.h"
 #include "net.h"
 #include "peer.h"
+#include "sink.h"
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -49,12 +52,18 @@ peregrine_leecher_create(peregrine_leecher_params_t *params)
 
     local_leecher->sbs_mode = 1;
     local_leecher->timeout = params->timeout;
+    local_leecher->preallocate = params->preallocate;
+    local_leecher->max_requests = (params->requests > 0) ? params->requests : REQUESTS_DEFAULT;
+    local_leecher->sched = sched_get(params->scheduler);
     local_leecher->type = LEECHER;
     local_leecher->current_seeder = NULL;
-    local_leecher->tree = NULL;
-    local_leecher->tree_root = NULL;
     memcpy(&local_leecher->seeder_addr, &params->seeder_addr, sizeof(struct sockaddr_in));
-    memcpy(&local_leecher->sha_demanded, params->sha_demanded, 20);
+    local_leecher->merkle_hash = mt_hash_by_func(params->merkle_hash_func);
+    if (local_leecher->merkle_hash == NULL) {
+      printf("unsupported Merkle hash function %u - using SHA-1\n", params->merkle_hash_func);
+      local_leecher->merkle_hash = mt_hash_by_func(MT_HASH_SHA1);
+    }
+    memcpy(&local_leecher->sha_demanded, params->sha_demanded, local_leecher->merkle_hash->len);
 
     net_leecher_create(local_leecher);
   }
@@ -63,6 +72,29 @@ peregrine_leecher_create(peregrine_leecher_params_t *params)
   return handle;
 }
 
+/**
+ * @brief Add seeder of the demanded file
+ *
+ * The file is downloaded from the primary seeder given in leecher parameters
+ * and from all the added seeders at once. Seeders must be added before
+ * peregrine_leecher_run().
+ *
+ * @param[in] handle Handle of leecher
+ * @param[in] sa Structure with IP address and UDP port number of added seeder
+ *
+ * @return Return status of adding new seeder
+ */
+int
+peregrine_leecher_add_seeder(peregrine_handle_t handle, struct sockaddr_in *sa)
+{
+  struct peer *local_leecher;
+
+  local_leecher = (struct peer *)handle;
+  net_leecher_add_seeder(local_leecher, sa);
+
+  return 0;
+}
+
 /**
  * @brief Run leecher pointed by handle parameter
  *
@@ -140,6 +172,9 @@ peregrine_prepare_chunk_range(peregrine_handle_t handle, uint32_t start_chunk, u
 
   local_leecher = (struct peer *)handle;
 
+  /* idle workers of the seeders may look into the schedule */
+  pthread_mutex_lock(&local_leecher->download_schedule_mutex);
+
   /* if download_schedule previously allocated - free it now */
   if (local_leecher->download_schedule != NULL) {
     free(local_leecher->download_schedule);
@@ -149,7 +184,7 @@ peregrine_prepare_chunk_range(peregrine_handle_t handle, uint32_t start_chunk, u
   local_leecher->download_schedule = malloc(local_leecher->nl * sizeof(struct schedule_entry));
   memset(local_leecher->download_schedule, 0, local_leecher->nl * sizeof(struct schedule_entry));
   buf_size = swift_create_download_schedule_sbs(local_leecher, start_chunk, end_chunk);
-  local_leecher->download_schedule_idx = 0;
+  pthread_mutex_unlock(&local_leecher->download_schedule_mutex);
 
   return buf_size;
 }
@@ -157,16 +192,33 @@ peregrine_prepare_chunk_range(peregrine_handle_t handle, uint32_t start_chunk, u
 /**
  * @brief Fetch range of chunks to file descriptor
  *
+ * Chunks are written with positional writes, so the file offset of the
+ * descriptor isn't changed.
+ *
  * @param[in] handle Handle of leecher
  * @param[in] fd File descriptor of opened by user file
  */
 void
 peregrine_leecher_fetch_chunk_to_fd(peregrine_handle_t handle, int fd)
 {
+  int st;
+  uint64_t size;
   struct peer *local_leecher;
 
   local_leecher = (struct peer *)handle;
 
+  if (local_leecher->preallocate) {
+    /* libswift seeder doesn't send size of the file - reserve whole chunks then */
+    size = local_leecher->file_size;
+    if (size == 0) {
+      size = (uint64_t)(local_leecher->end_chunk + 1) * local_leecher->chunk_size;
+    }
+    st = sink_preallocate(fd, size);
+    if (st < 0) {
+      printf("cannot reserve space for the file: %s\n", strerror(-st));
+    }
+  }
+
   local_leecher->cmd = CMD_FETCH;
   local_leecher->fd = fd;
   local_leecher->transfer_method = M_FD;
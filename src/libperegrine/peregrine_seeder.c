@@ -25,8 +25,12 @@
 
 #include "peregrine_seeder.h"
 #include "debug.h"
+#include "index.h"
+#include "mt_hash.h"
 #include "net.h"
 #include "peer.h"
+#include "peer_hash.h"
+#include "reactor.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <stdio.h>
@@ -54,9 +58,30 @@ peregrine_seeder_create(peregrine_seeder_params_t *params)
     local_seeder->chunk_size = params->chunk_size;
     local_seeder->timeout = params->timeout;
     local_seeder->port = params->port;
+    local_seeder->engine = params->engine;
+    local_seeder->reactor_threads = params->reactor_threads;
+    local_seeder->zerocopy = params->zerocopy;
+    local_seeder->window = params->window;
+    local_seeder->congestion = params->congestion;
+    local_seeder->sockets = params->sockets;
+    local_seeder->gso = params->gso;
+    local_seeder->index_threads = params->index_threads;
+    local_seeder->follow_ms = params->follow_ms;
+    local_seeder->merkle_hash = mt_hash_by_func(params->merkle_hash_func);
+    if (local_seeder->merkle_hash == NULL) {
+      printf("unsupported Merkle hash function %u - using SHA-1\n", params->merkle_hash_func);
+      local_seeder->merkle_hash = mt_hash_by_func(MT_HASH_SHA1);
+    }
+    if (params->cache_dir != NULL) {
+      local_seeder->cache_dir = strdup(params->cache_dir);
+      if ((mkdir(local_seeder->cache_dir, 0755) != 0) && (errno != EEXIST)) {
+	printf("cannot create tree cache directory %s: %s\n", local_seeder->cache_dir, strerror(errno));
+      }
+    }
     local_seeder->type = SEEDER;
 
     SLIST_INIT(&local_seeder->file_list_head);
+    pthread_mutex_init(&local_seeder->file_list_head_mutex, NULL);
     SLIST_INIT(&local_seeder->other_seeders_list_head);
   }
   handle = (int64_t)local_seeder;
@@ -132,12 +157,13 @@ peregrine_seeder_remove_seeder(peregrine_handle_t handle, struct sockaddr_in *sa
 void
 peregrine_seeder_add_file_or_directory(peregrine_handle_t handle, char *name)
 {
-  char sha[40 + 1];
+  char sha[2 * MT_HASH_MAX_LEN + 1];
   int st;
-  int s;
-  int y;
+  int i;
+  int n;
   struct stat stat;
   struct file_list_entry *f;
+  struct file_list_entry **files;
   struct peer *local_seeder;
 
   local_seeder = (struct peer *)handle;
@@ -154,34 +180,49 @@ peregrine_seeder_add_file_or_directory(peregrine_handle_t handle, char *name)
   } else if (stat.st_mode & S_IFREG) { /* filename */
     d_printf("adding file: %s\n", name);
     f = malloc(sizeof(struct file_list_entry));
-    memset(f->path, 0, sizeof(f->path));
+    memset(f, 0, sizeof(struct file_list_entry));
+    f->fd = -1;
     strcpy(f->path, name);
     lstat(f->path, &stat);
     f->file_size = stat.st_size;
+    pthread_mutex_lock(&local_seeder->file_list_head_mutex);
     SLIST_INSERT_HEAD(&local_seeder->file_list_head, f, next);
+    pthread_mutex_unlock(&local_seeder->file_list_head_mutex);
   }
 
+  /* hash all the files which don't have tree yet */
+  n = 0;
   SLIST_FOREACH(f, &local_seeder->file_list_head, next)
   {
-    /* does the tree already exist for given file? */
-    if (f->tree_root == NULL) { /* no - so create tree for it */
-      printf("processing: %s \n", f->path);
-      fflush(stdout);
-      process_file(f, local_seeder);
-
-      memset(sha, 0, sizeof(sha));
-      s = 0;
-      for (y = 0; y < 20; y++) {
-	s += sprintf(sha + s, "%02x", f->tree_root->sha[y] & 0xff);
-      }
-      printf("sha1: %s\n", sha);
+    if (f->tree_root == NULL) {
+      n++;
     }
   }
+  files = malloc(n * sizeof(struct file_list_entry *));
+  n = 0;
+  SLIST_FOREACH(f, &local_seeder->file_list_head, next)
+  {
+    if (f->tree_root == NULL) {
+      files[n++] = f;
+    }
+  }
+  index_files(local_seeder, files, n);
+
+  for (i = 0; i < n; i++) {
+    printf("processing: %s \n", files[i]->path);
+
+    mt_hash_hex(local_seeder->merkle_hash, files[i]->tree_root, sha);
+    printf("%s: %s\n", local_seeder->merkle_hash->name, sha);
+  }
+  free(files);
 }
 
 /*
  * @brief Remove given file entry from seeded file list
  *
+ * The entry is freed when the last leecher transferring it releases it.
+ * Must be called with file_list_head_mutex locked.
+ *
  * @param[in] f File entry to remove
  */
 INTERNAL_LINKAGE
@@ -191,13 +232,9 @@ peregrine_remove_and_free(peregrine_handle_t handle, struct file_list_entry *f)
   struct peer *local_seeder;
 
   local_seeder = (struct peer *)handle;
-  free(f->tab_chunk);
-  free(f->tree);
-  f->tab_chunk = NULL;
-  f->tree = f->tree_root = NULL;
 
   SLIST_REMOVE(&local_seeder->file_list_head, f, file_list_entry, next);
-  free(f);
+  file_entry_put(f);
 }
 
 /**
@@ -215,6 +252,7 @@ peregrine_seeder_remove_file_or_directory(peregrine_handle_t handle, char *name)
   char *buf;
   int ret;
   struct file_list_entry *f;
+  struct file_list_entry *next;
   struct stat stat;
   struct peer *local_seeder;
 
@@ -222,9 +260,10 @@ peregrine_seeder_remove_file_or_directory(peregrine_handle_t handle, char *name)
 
   ret = 0;
   lstat(name, &stat);
+  pthread_mutex_lock(&local_seeder->file_list_head_mutex);
   if (stat.st_mode & S_IFREG) { /* does the user want to remove file? */
-    SLIST_FOREACH(f, &local_seeder->file_list_head, next)
-    {
+    for (f = SLIST_FIRST(&local_seeder->file_list_head); f != NULL; f = next) {
+      next = SLIST_NEXT(f, next);
       if (strcmp(f->path, name) == 0) {
 	d_printf("file to remove found: %s\n", name);
 	peregrine_remove_and_free(handle, f);
@@ -242,8 +281,8 @@ peregrine_seeder_remove_file_or_directory(peregrine_handle_t handle, char *name)
       d_printf("adding / to dir name: %s => %s\n", name, buf);
     }
 
-    SLIST_FOREACH(f, &local_seeder->file_list_head, next)
-    {
+    for (f = SLIST_FIRST(&local_seeder->file_list_head); f != NULL; f = next) {
+      next = SLIST_NEXT(f, next);
       c = strstr(f->path, buf); /* compare current file entry with directory name to remove */
       if (c == f->path) {       /* if both matches */
 	d_printf("removing file: %s\n", f->path);
@@ -252,6 +291,7 @@ peregrine_seeder_remove_file_or_directory(peregrine_handle_t handle, char *name)
     }
     free(buf);
   }
+  pthread_mutex_unlock(&local_seeder->file_list_head_mutex);
 
   return ret;
 }
@@ -259,6 +299,9 @@ peregrine_seeder_remove_file_or_directory(peregrine_handle_t handle, char *name)
 /**
  * @brief Run seeder pointed by handle parameter
  *
+ * Leechers are served by the engine selected in seeder parameters: either
+ * one thread per leecher or a fixed set of event loop threads.
+ *
  * @param[in] handle Handle of seeder
  */
 void
@@ -267,7 +310,12 @@ peregrine_seeder_run(peregrine_handle_t handle)
   struct peer *local_seeder;
 
   local_seeder = (struct peer *)handle;
-  net_seeder_mq(local_seeder);
+  index_watch_start(local_seeder);
+  if (local_seeder->engine == PEREGRINE_ENGINE_REACTOR) {
+    net_seeder_reactor(local_seeder);
+  } else {
+    net_seeder_mq(local_seeder);
+  }
 }
 
 /**
@@ -278,9 +326,21 @@ peregrine_seeder_run(peregrine_handle_t handle)
 void
 peregrine_seeder_close(peregrine_handle_t handle)
 {
+  int i;
   struct peer *local_seeder;
 
   local_seeder = (struct peer *)handle;
 
+  if (local_seeder->reactor != NULL) {
+    free(local_seeder->reactor->loops);
+    free(local_seeder->reactor->zc);
+    free(local_seeder->reactor);
+  }
+  peer_hash_free(local_seeder->peers_hash);
+  for (i = 0; i < local_seeder->num_shards; i++) {
+    peer_hash_free(local_seeder->shards[i].peers_hash);
+  }
+  free(local_seeder->shards);
+  free(local_seeder->cache_dir);
   free(local_seeder);
 }
@@ -38,6 +38,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef __FreeBSD__
 #include <sys/endian.h>
@@ -46,6 +47,21 @@
 #include <endian.h>
 #endif
 
+/*
+ * time in microseconds since epoch - used as timestamp of DATA message and for
+ * calculation of one-way delay sample sent back in ACK
+ */
+INTERNAL_LINKAGE
+uint64_t
+ppspp_timestamp_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 /*
  * serialize handshake options in memory in form of list
  *
@@ -201,18 +217,18 @@ make_proto_config_to_opts(uint8_t *opts_ptr, const struct proto_config *cfg_ptr)
 
   /*
    * extension to original PPSPP protocol
-   * format: 1 + 20 bytes
+   * format: 1 + 20 or 32 bytes
    *
    * uint8_t = FILE_HASH marker = 12
-   * uint8_t[20] = SHA1 hash of the file the LEECHER wants to download from
-   * SEEDER
+   * uint8_t[20 or 32] = root hash of the file the LEECHER wants to download from
+   * SEEDER, length of the digest of MERKLE_HASH_FUNC
    */
 
   if (cfg_ptr->opt_map & (1 << FILE_HASH)) {
     *d = FILE_HASH;
     d++;
-    memcpy(d, cfg_ptr->sha_demanded, 20);
-    d += 20;
+    memcpy(d, cfg_ptr->sha_demanded, mt_hash_by_func(cfg_ptr->merkle_hash_func)->len);
+    d += mt_hash_by_func(cfg_ptr->merkle_hash_func)->len;
   } else {
     d_printf("%s", "no file_hash specified - it's obligatory!\n");
     /* return -1; */
@@ -279,6 +295,9 @@ make_handshake_have(char *ptr, uint32_t dest_chan_id, uint32_t src_chan_id, uint
   peer->num_have_cache = 0;
 
   d = ptr + len;
+  if (peer->file_list_entry == NULL) { /* we don't have demanded file - send HANDSHAKE without any HAVE */
+    return len;
+  }
   nc = peer->file_list_entry->end_chunk - peer->file_list_entry->start_chunk + 1;
 
   b = 31; /* starting bit for scanning of bits */
@@ -443,12 +462,12 @@ make_integrity_reverse(char *ptr, struct peer *peer, struct peer *we)
   int ret;
   int ic;
   int f;
-  struct node *n;
-  struct node *s;
-  struct node l;
-  struct node r;
-  struct node *e;
-  struct node *n_subroot;
+  uint32_t n;
+  uint32_t s;
+  uint32_t l;
+  uint32_t r;
+  uint32_t n_subroot;
+  struct mt_tree *t;
   struct integrity_temp *it;
   struct integrity_temp *it2;
   int16_t iti;
@@ -469,6 +488,7 @@ make_integrity_reverse(char *ptr, struct peer *peer, struct peer *we)
   d += sizeof(uint32_t);
 
   _assert(peer->file_list_entry != NULL, "%s", "peer->file_list_entry should be != NULL\n");
+  t = &peer->file_list_entry->tree;
   _assert(peer->integrity_bmp != NULL, "%s", "peer->integrity_bmp should be != NULL\n");
 
   it = malloc(1024 * sizeof(struct integrity_temp));
@@ -503,11 +523,10 @@ make_integrity_reverse(char *ptr, struct peer *peer, struct peer *we)
       it[itn].start_chunk = v_start; /* start of subrange */
       it[itn].end_chunk = v_end;     /* end of subrange */
 
-      v_root = v_start + v_end;
-      e = &peer->file_list_entry->tree[v_root]; /* "e" is subroot of subtree v..v+(1<<b)-1 */
+      v_root = v_start + v_end; /* subroot of subtree v..v+(1<<b)-1 */
 
       if (!(peer->integrity_bmp[v_root / 8] & (1 << (v_root % 8)))) {
-	memcpy(it[itn].sha, e->sha, 20);
+	memcpy(it[itn].sha, MT_SHA(t, v_root), t->hash->len);
 	d_printf("it[%d] %u..%u\n", itn, it[itn].start_chunk, it[itn].end_chunk);
 	itn++;
 	/* update INTEGRITY bitmap */
@@ -525,7 +544,7 @@ make_integrity_reverse(char *ptr, struct peer *peer, struct peer *we)
    * of INTEGRITY to be compatible with libswift
    */
 
-  n = &peer->file_list_entry->tree[peer->curr_chunk * 2]; /* node for given curr_chunk */
+  n = peer->curr_chunk * 2; /* node for given curr_chunk */
 
   /* looks in HAVE cache for the subrange where there is curr_chunk */
   ic = 0;
@@ -546,32 +565,27 @@ make_integrity_reverse(char *ptr, struct peer *peer, struct peer *we)
   /* determine subroot for curr_chunk and given HAVE subtree
    * "ic" is pointing to index of subrange in peer->have_cache
    */
-  n_subroot = &peer->file_list_entry->tree[peer->have_cache[ic].start_chunk + peer->have_cache[ic].end_chunk];
-  d_printf("subroot for subrange: %u..%u is: %d\n", peer->have_cache[ic].start_chunk, peer->have_cache[ic].end_chunk,
-           n_subroot->number);
+  n_subroot = peer->have_cache[ic].start_chunk + peer->have_cache[ic].end_chunk;
+  d_printf("subroot for subrange: %u..%u is: %u\n", peer->have_cache[ic].start_chunk, peer->have_cache[ic].end_chunk,
+           n_subroot);
 
-  while ((n != n_subroot) && (n->parent != NULL)) {
-    /* which children the node "n" is? left or right from paren point of view?
-     */
-    if (n == n->parent->left) {
-      s = n->parent->right; /* sibling for "n" node is right node */
-    } else {
-      s = n->parent->left; /* sibling for "n" node is left node */
-    }
+  while ((n != n_subroot) && (n != t->root)) {
+    /* sibling for "n" node - the other child of its parent */
+    s = find_sibling(n);
 
-    if (!(peer->integrity_bmp[s->number / 8] & (1 << (s->number % 8)))) {
+    if (!(peer->integrity_bmp[s / 8] & (1 << (s % 8)))) {
       interval_min_max(s, &l, &r);
-      it2[itn2].start_chunk = l.number / 2;
-      it2[itn2].end_chunk = r.number / 2;
-      memcpy(it2[itn2].sha, s->sha, 20);
+      it2[itn2].start_chunk = l / 2;
+      it2[itn2].end_chunk = r / 2;
+      memcpy(it2[itn2].sha, MT_SHA(t, s), t->hash->len);
       itn2++;
-      peer->integrity_bmp[s->number / 8] |= (1 << (s->number % 8));
+      peer->integrity_bmp[s / 8] |= (1 << (s % 8));
     } else {
-      d_printf("INTEGRITY already sent: %d skip it\n", s->number);
+      d_printf("INTEGRITY already sent: %u skip it\n", s);
     }
 
     /* go up - to parent of current "n" */
-    n = n->parent;
+    n = mt_parent(n);
   }
 
   /* here we are reversing output of above algorithm to be compatible with
@@ -582,7 +596,7 @@ make_integrity_reverse(char *ptr, struct peer *peer, struct peer *we)
       d_printf("it2[%d] %u..%u\n", iti2, it2[iti2].start_chunk, it2[iti2].end_chunk);
       it[itn].start_chunk = it2[iti2].start_chunk;
       it[itn].end_chunk = it2[iti2].end_chunk;
-      memcpy(it[itn].sha, it2[iti2].sha, 20);
+      memcpy(it[itn].sha, it2[iti2].sha, t->hash->len);
       iti2--;
       itn++;
     }
@@ -597,8 +611,8 @@ make_integrity_reverse(char *ptr, struct peer *peer, struct peer *we)
     d += sizeof(uint32_t);
     *(uint32_t *)d = htobe32(it[iti].end_chunk);
     d += sizeof(uint32_t);
-    memcpy(d, it[iti].sha, 20);
-    d += 20;
+    memcpy(d, it[iti].sha, t->hash->len);
+    d += t->hash->len;
   }
 
   free(it);
@@ -616,7 +630,6 @@ make_data(char *ptr, struct peer *peer)
 {
   char *d;
   int ret;
-  int fd;
   int l;
   uint64_t timestamp;
 
@@ -634,28 +647,16 @@ make_data(char *ptr, struct peer *peer)
 
   d += sizeof(uint32_t);
 
-  timestamp = 0x12345678f11ff00f; /* temporarily */
+  timestamp = ppspp_timestamp_us();
   *(uint64_t *)d = htobe64(timestamp);
   d += sizeof(uint64_t);
 
-  fd = open(peer->file_list_entry->path, O_RDONLY);
-  if (fd < 0) {
-    d_printf("error opening file2: %s\n", peer->file_list_entry->path);
-    abort();
-    return -1;
-  }
-
-  lseek(fd, peer->curr_chunk * peer->chunk_size, SEEK_SET);
-
-  l = read(fd, d, peer->chunk_size);
+  l = file_entry_read_chunk(peer->file_list_entry, peer->curr_chunk, peer->chunk_size, d);
   if (l < 0) {
     d_printf("error reading file: %s\n", peer->fname);
-    close(fd);
     return -1;
   }
 
-  close(fd);
-
   d += l;
 
   ret = d - ptr;
@@ -664,6 +665,16 @@ make_data(char *ptr, struct peer *peer)
   return ret;
 }
 
+/* header of DATA message without contents of the chunk - the caller sends them
+ * straight from the file mapping
+ */
+INTERNAL_LINKAGE
+int
+make_data_hdr_no_chanid(char *ptr, struct peer *peer)
+{
+  return pack_data(ptr, peer->curr_chunk, peer->curr_chunk, ppspp_timestamp_us());
+}
+
 /* this procedure is not sending dest_chan_id (4 bytes) on the beginning because
  * DATA message can be concatenated with another kind of message
  */
@@ -672,30 +683,16 @@ int
 make_data_no_chanid(char *ptr, struct peer *peer)
 {
   size_t pos = 0;
-  int fd;
   int l;
-  uint64_t timestamp = 0x12345678f11ff00f;
 
-  pos += pack_data(ptr + pos, peer->curr_chunk, peer->curr_chunk, timestamp);
+  pos += make_data_hdr_no_chanid(ptr + pos, peer);
 
-  fd = open(peer->file_list_entry->path, O_RDONLY);
-  if (fd < 0) {
-    d_printf("error opening file2: %s\n", peer->file_list_entry->path);
-    abort();
-    return -1;
-  }
-
-  lseek(fd, peer->curr_chunk * peer->chunk_size, SEEK_SET);
-
-  l = read(fd, ptr + pos, peer->chunk_size);
+  l = file_entry_read_chunk(peer->file_list_entry, peer->curr_chunk, peer->chunk_size, ptr + pos);
   if (l < 0) {
     d_printf("error reading file: %s\n", peer->fname);
-    close(fd);
     return -1;
   }
 
-  close(fd);
-
   pos += l;
 
   d_printf("returning %zu bytes\n", pos);
@@ -708,10 +705,9 @@ int
 make_have_ack(char *ptr, struct peer *peer)
 {
   size_t pos = 0;
-  uint64_t delay_sample = 0x12345678ABCDEF;
   pos += pack_dest_chan(ptr, peer->dest_chan_id);
   pos += pack_have(ptr + pos, peer->curr_chunk, peer->curr_chunk);
-  pos += pack_ack(ptr + pos, peer->curr_chunk, peer->curr_chunk, delay_sample);
+  pos += pack_ack(ptr + pos, peer->curr_chunk, peer->curr_chunk, (uint64_t)peer->delay_sample);
 
   d_printf("returning %zu bytes\n", pos);
 
@@ -724,22 +720,24 @@ make_have_ack(char *ptr, struct peer *peer)
  * in params:
  * 	peer - structure describing peer (LEECHER or SEEDER)
  * 	ptr - pointer to data buffer which should be parsed
+ *
+ * returns length of the options or -1 if leecher can't use them
  */
 INTERNAL_LINKAGE
 int
 dump_options(uint8_t *ptr, struct peer *peer)
 {
   uint8_t *d;
-  char buf[40 + 1];
+  char buf[2 * MT_HASH_MAX_LEN + 1];
   int swarm_len;
+  int hash_len;
   int x;
   int ret;
-  int s;
-  int y;
   uint8_t chunk_addr_method;
   uint8_t supported_msgs_len;
   uint32_t ldw32;
   uint64_t ldw64;
+  const struct mt_hash *hash;
   struct file_list_entry *fi;
 
   d = ptr;
@@ -793,6 +791,7 @@ dump_options(uint8_t *ptr, struct peer *peer)
     d++;
   }
 
+  hash = mt_hash_by_func(MT_HASH_SHA1); /* RFC 7574 default if the option is missing */
   if (*d == MERKLE_HASH_FUNC) {
     d++;
     d_printf("%s", "Merkle Tree Hash Function: ");
@@ -812,13 +811,23 @@ dump_options(uint8_t *ptr, struct peer *peer)
     case 4:
       d_printf("%s", "SHA-512\n");
       break;
+    case MT_HASH_BLAKE3:
+      d_printf("%s", "BLAKE3 (Peregrine)\n");
+      break;
     default:
       d_printf("%s", "Unassigned\n");
       break;
     }
+    hash = mt_hash_by_func(*d);
     d++;
   }
 
+  /* leecher: the seeder must have hashed the file with the function we asked for */
+  if ((peer->seeder == NULL) && (peer->merkle_hash != NULL) && (hash != peer->merkle_hash)) {
+    printf("error: seeder uses different Merkle hash function than %s\n", peer->merkle_hash->name);
+    return -1;
+  }
+
   if (*d == LIVE_SIGNATURE_ALG) {
     d++;
     d_printf("Live Signature Algorithm: %d\n", *d);
@@ -918,28 +927,35 @@ dump_options(uint8_t *ptr, struct peer *peer)
   if (*d == FILE_HASH) {
     d++;
 
+    hash_len = hash != NULL ? hash->len : 20;
     if (peer->seeder != NULL) { /* is this proc called by seeder? */
-      memcpy(peer->sha_demanded, d, 20);
+      memcpy(peer->sha_demanded, d, hash_len);
     }
-    s = 0;
-    for (y = 0; y < 20; y++) {
-      s += sprintf(buf + s, "%02x", peer->sha_demanded[y] & 0xff);
+    if (hash != NULL) {
+      mt_hash_hex(hash, d, buf);
+      d_printf("File hash: %s\n", buf);
     }
-    d += 20;
+    d += hash_len;
 
-    /* find file name for given received SHA1 hash from leecher */
-    if (peer->seeder != NULL) { /* is this proc called by seeder? */
+    /* find file name for given received root hash from leecher */
+    if ((peer->seeder != NULL) && (peer->file_list_entry == NULL)) { /* is this proc called by seeder? */
+      pthread_mutex_lock(&peer->seeder->file_list_head_mutex);
       SLIST_FOREACH(fi, &peer->seeder->file_list_head, next)
       {
-	if (memcmp(fi->tree_root->sha, peer->sha_demanded, 20) == 0) {
+	/* skip files which are still being processed */
+	if ((fi->tree_root != NULL) && (fi->tree.hash == hash)
+	    && (memcmp(fi->tree_root, peer->sha_demanded, hash_len) == 0)) {
 	  strcpy(peer->fname, basename(fi->path));
 	  peer->fname_len = strlen(peer->fname);
 	  peer->file_size = fi->file_size;
-	  /* set pointer to selected file by leecher using SHA1 hash */
+	  /* set pointer to selected file by leecher using SHA1 hash, file stays valid until we drop the
+	   * reference */
+	  file_entry_get(fi);
 	  peer->file_list_entry = fi;
 	  break;
 	}
       }
+      pthread_mutex_unlock(&peer->seeder->file_list_head_mutex);
     }
   }
 
@@ -968,6 +984,7 @@ int
 swift_dump_options(uint8_t *ptr, struct peer *peer)
 {
   uint8_t *d;
+  uint8_t *swarm_id;
   int swarm_len;
   int x;
   int ret;
@@ -975,6 +992,7 @@ swift_dump_options(uint8_t *ptr, struct peer *peer)
   uint8_t supported_msgs_len;
   uint32_t ldw32;
   uint64_t ldw64;
+  const struct mt_hash *hash;
   struct file_list_entry *fi;
 
   d = ptr;
@@ -995,25 +1013,15 @@ swift_dump_options(uint8_t *ptr, struct peer *peer)
     d++;
   }
 
+  swarm_id = NULL;
+  swarm_len = 0;
   if (*d == SWARM_ID) {
     d++;
     swarm_len = be16toh(*((uint16_t *)d) & 0xffff);
     d += 2;
     /* d_printf("swarm_id[%d]: %s\n", swarm_len, d); 	swarm_id are binary data
      * so don't print them */
-
-    if (1) {
-      SLIST_FOREACH(fi, &peer->seeder->file_list_head, next)
-      {
-	if (memcmp(fi->tree_root->sha, d, 20) == 0) {
-	  /* set pointer to selected file by leecher using SHA1 hash */
-	  peer->file_list_entry = fi;
-	  d_printf("leecher wants file: %s\n", fi->path);
-	  break;
-	}
-      }
-    }
-
+    swarm_id = d; /* root hash - looked up when hash function is known */
     d += swarm_len;
   }
 
@@ -1040,6 +1048,7 @@ swift_dump_options(uint8_t *ptr, struct peer *peer)
     d++;
   }
 
+  hash = mt_hash_by_func(MT_HASH_SHA1); /* RFC 7574 default if the option is missing */
   if (*d == MERKLE_HASH_FUNC) {
     d++;
     d_printf("%s", "Merkle Tree Hash Function: ");
@@ -1059,11 +1068,33 @@ swift_dump_options(uint8_t *ptr, struct peer *peer)
     case 4:
       d_printf("%s", "SHA-512\n");
       break;
+    case MT_HASH_BLAKE3:
+      d_printf("%s", "BLAKE3 (Peregrine)\n");
+      break;
     default:
       d_printf("%s", "Unassigned\n");
       break;
     }
-    d++;
+    hash = mt_hash_by_func(*d);
+    d++;
+  }
+
+  /* swarm is identified by root hash of the file together with hash function of its tree */
+  if ((swarm_id != NULL) && (hash != NULL) && (swarm_len == hash->len) && (peer->file_list_entry == NULL)) {
+    pthread_mutex_lock(&peer->seeder->file_list_head_mutex);
+    SLIST_FOREACH(fi, &peer->seeder->file_list_head, next)
+    {
+      /* skip files which are still being processed */
+      if ((fi->tree_root != NULL) && (fi->tree.hash == hash) && (memcmp(fi->tree_root, swarm_id, swarm_len) == 0)) {
+	/* set pointer to selected file by leecher using root hash, file stays valid until we drop the
+	 * reference */
+	file_entry_get(fi);
+	peer->file_list_entry = fi;
+	d_printf("leecher wants file: %s\n", fi->path);
+	break;
+      }
+    }
+    pthread_mutex_unlock(&peer->seeder->file_list_head_mutex);
   }
 
   if (*d == LIVE_SIGNATURE_ALG) {
@@ -1171,6 +1202,8 @@ swift_dump_options(uint8_t *ptr, struct peer *peer)
  * 	ptr - pointer to buffer which should be parsed
  * 	req_len - length of buffer pointed by ptr
  * 	peer - pointer to struct describing LEECHER
+ *
+ * returns length of the HANDSHAKE or -1 if its options can't be used
  */
 INTERNAL_LINKAGE
 int
@@ -1206,6 +1239,9 @@ dump_handshake_request(char *ptr, int req_len, struct peer *peer)
   d_printf("%s", "\n");
 
   opt_len = dump_options((uint8_t *)d, peer);
+  if (opt_len < 0) {
+    return -1;
+  }
 
   ret = d + opt_len - ptr;
   d_printf("%s returning: %d bytes\n", __func__, ret);
@@ -1219,6 +1255,7 @@ swift_dump_handshake_request(char *ptr, int req_len, struct peer *peer)
 {
   char *d;
   uint32_t src_chan_id;
+  uint32_t bmp_len;
   int ret;
   int opt_len;
 
@@ -1240,22 +1277,31 @@ swift_dump_handshake_request(char *ptr, int req_len, struct peer *peer)
 
   opt_len = swift_dump_options((uint8_t *)d, peer);
 
+  if (peer->file_list_entry == NULL) { /* we don't have demanded file */
+    return d + opt_len - ptr;
+  }
+
   /* allocate memory for integrity bitmap for mark which tree nodes has already
    * been sent do leecher (swift compatibility mode) it will replace
    * "peer->state == SENT"
    */
+  bmp_len = (2 * peer->file_list_entry->nl + 7) / 8; /* one bit per tree node, at least one byte */
   if (peer->integrity_bmp == NULL) {
-    peer->integrity_bmp = malloc(2 * peer->file_list_entry->nl / 8);
+    peer->integrity_bmp = malloc(bmp_len);
     _assert(peer->integrity_bmp != NULL, "%s\n", "peer->integrity_bmp should be != NULL");
-    memset(peer->integrity_bmp, 0, 2 * peer->file_list_entry->nl / 8);
+    memset(peer->integrity_bmp, 0, bmp_len);
   } else {
     d_printf("%s", "integrity_bmp already allocated\n");
     abort();
   }
 
-  peer->data_bmp = malloc(2 * peer->file_list_entry->nl / 8);
+  peer->data_bmp = malloc(bmp_len);
   _assert(peer->data_bmp != NULL, "%s\n", "peer->data_bmp should be != NULL");
-  memset(peer->data_bmp, 0, 2 * peer->file_list_entry->nl / 8);
+  memset(peer->data_bmp, 0, bmp_len);
+
+  peer->ack_bmp = malloc(bmp_len);
+  _assert(peer->ack_bmp != NULL, "%s\n", "peer->ack_bmp should be != NULL");
+  memset(peer->ack_bmp, 0, bmp_len);
 
   ret = d + opt_len - ptr;
   d_printf("%s returning: %d bytes\n", __func__, ret);
@@ -1263,7 +1309,7 @@ swift_dump_handshake_request(char *ptr, int req_len, struct peer *peer)
   return ret;
 }
 
-/* for leecher
+/* for leecher - returns -1 if seeder's HANDSHAKE can't be used
  */
 INTERNAL_LINKAGE
 int
@@ -1285,6 +1331,9 @@ dump_handshake_have(char *ptr, int resp_len, struct peer *peer)
   /* dump HANDSHAKE header and protocol options */
   d = ptr;
   req_len = dump_handshake_request(ptr, resp_len, peer);
+  if (req_len < 0) {
+    return -1;
+  }
 
   d += req_len;
 
@@ -1351,8 +1400,8 @@ dump_handshake_have(char *ptr, int resp_len, struct peer *peer)
     peer->chunk = malloc(peer->nl * sizeof(struct chunk));
     memset(peer->chunk, 0, peer->nl * sizeof(struct chunk));
 
-    /* do we really need this allocation? */
-    if (peer->local_leecher) {
+    /* array of the local leecher is shared by workers of all the seeders */
+    if ((peer->local_leecher) && (peer->local_leecher->chunk == NULL)) {
       peer->local_leecher->chunk = malloc(peer->nl * sizeof(struct chunk));
       memset(peer->local_leecher->chunk, 0, peer->nl * sizeof(struct chunk));
     }
@@ -1436,10 +1485,8 @@ int
 dump_integrity(char *ptr, int req_len, struct peer *peer)
 {
   char *d;
-  char sha_buf[40 + 1];
+  char sha_buf[2 * MT_HASH_MAX_LEN + 1];
   int ret;
-  int s;
-  int y;
   uint32_t dest_chan_id;
   uint32_t start_chunk;
   uint32_t end_chunk;
@@ -1475,20 +1522,23 @@ dump_integrity(char *ptr, int req_len, struct peer *peer)
      */
     node = start_chunk + end_chunk; /* calculate root node */
 
+    /* hash of node already verified by the leecher can't be replaced */
+    if ((peer->verified_bmp != NULL) && (peer->verified_bmp[node / 8] & (1 << (node % 8)))) {
+      d_printf("node %u already verified - skipping\n", node);
+      d += peer->tree.hash->len;
+      continue;
+    }
+
     d_printf("setting up node: %u\n", node);
 
-    memcpy(peer->tree[node].sha, d, 20);
-    peer->tree[node].state = ACTIVE;
+    memcpy(MT_SHA(&peer->tree, node), d, peer->tree.hash->len);
+    mt_set_active(&peer->tree, node);
 
     if (debug) {
-      s = 0;
-      for (y = 0; y < 20; y++) {
-	s += sprintf(sha_buf + s, "%02x", peer->tree[node].sha[y] & 0xff);
-      }
-      sha_buf[40] = '\0';
+      mt_hash_hex(peer->tree.hash, MT_SHA(&peer->tree, node), sha_buf);
       d_printf("dumping node %u: %s\n", node, sha_buf);
     }
-    d += 20; /* jump over SHA-1 hash */
+    d += peer->tree.hash->len; /* jump over the hash */
   }
 
   if (req_len - (d - ptr) > 0) {
@@ -1551,7 +1601,7 @@ dump_have_ack(char *ptr, int ack_len, struct peer *peer)
 
     delay_sample = be64toh(*(uint64_t *)d);
     d += sizeof(uint64_t);
-    d_printf("delay_sample: %#lx\n", delay_sample);
+    d_printf("delay_sample: %ld us\n", (int64_t)delay_sample);
   } else {
     d_printf("error, should be ACK header but is: %d\n", *d);
   }
@@ -1729,3 +1779,37 @@ count_handshake(char *ptr, uint16_t n, uint8_t skip_hdr)
 
   return d - ptr;
 }
+
+/*
+ * return length of the message pointed by "ptr" (including dest_chan_id if
+ * skip_hdr is set) or 0 if the message type is not supported
+ */
+INTERNAL_LINKAGE
+int
+count_message(char *ptr, uint16_t n, uint8_t skip_hdr)
+{
+  int size;
+
+  switch (ptr[skip_hdr * 4]) {
+  case HANDSHAKE:
+    size = count_handshake(ptr, n, skip_hdr);
+    break;
+  case REQUEST:
+    size = skip_hdr * 4 + 1 + 4 + 4;
+    break;
+  case PEX_REQ:
+    size = skip_hdr * 4 + 1;
+    break;
+  case HAVE:
+    size = skip_hdr * 4 + 1 + 4 + 4;
+    break;
+  case ACK:
+    size = skip_hdr * 4 + 1 + 4 + 4 + 8;
+    break;
+  default:
+    d_printf("another message: %d\n", ptr[skip_hdr * 4]);
+    size = 0;
+  }
+
+  return size;
+}
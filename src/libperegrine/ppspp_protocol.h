@@ -26,6 +26,7 @@
 #ifndef _PPSPP_PROTOCOL_H_
 #define _PPSPP_PROTOCOL_H_
 
+#include "mt_hash.h"
 #include <netinet/in.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -86,7 +87,7 @@ struct proto_config {
   uint64_t file_size;
   uint8_t file_name[256];
   uint8_t file_name_len;
-  uint8_t sha_demanded[20];
+  uint8_t sha_demanded[MT_HASH_MAX_LEN];
   uint32_t opt_map; /* bitmap - which of the fields above have any data */
 };
 
@@ -160,7 +161,7 @@ struct msg {
 struct integrity_temp {
   uint32_t start_chunk;
   uint32_t end_chunk;
-  uint8_t sha[20];
+  uint8_t sha[MT_HASH_MAX_LEN];
 };
 
 int make_proto_config_to_opts(uint8_t *ptr, const struct proto_config *cfg_ptr);
@@ -173,8 +174,10 @@ int make_request(char * /*ptr*/, uint32_t /*dest_chan_id*/, uint32_t /*start_chu
                  struct peer * /*peer*/);
 int make_pex_resp(char * /*ptr*/, struct peer * /*peer*/, struct peer * /*we*/);
 int make_integrity_reverse(char * /*ptr*/, struct peer * /*peer*/, struct peer * /*we*/);
+uint64_t ppspp_timestamp_us(void);
 int make_data(char * /*ptr*/, struct peer * /*peer*/);
 int make_data_no_chanid(char * /*ptr*/, struct peer * /*peer*/);
+int make_data_hdr_no_chanid(char * /*ptr*/, struct peer * /*peer*/);
 int make_have_ack(char * /*ptr*/, struct peer * /*peer*/);
 int dump_options(uint8_t *ptr, struct peer * /*peer*/);
 int swift_dump_options(uint8_t *ptr, struct peer * /*peer*/);
@@ -188,5 +191,6 @@ uint8_t message_type(const char * /*ptr*/);
 uint8_t handshake_type(char * /*ptr*/);
 
 uint16_t count_handshake(char * /*ptr*/, uint16_t /*n*/, uint8_t /*skip_hdr*/);
+int count_message(char * /*ptr*/, uint16_t /*n*/, uint8_t /*skip_hdr*/);
 
 #endif /* _PPSPP_PROTOCOL_H_ */
@@ -47,7 +47,7 @@ pack_ack(void *dptr, uint32_t start_chunk, uint32_t end_chunk, uint64_t sample)
   msg->message_type = ACK;
   msg->ack.start_chunk = htobe32(start_chunk);
   msg->ack.end_chunk = htobe32(end_chunk);
-  msg->ack.sample = sample;
+  msg->ack.sample = htobe64(sample);
 
   return (sizeof(uint8_t) + sizeof(msg->ack));
 }
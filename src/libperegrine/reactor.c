@@ -0,0 +1,530 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "reactor.h"
+#include "debug.h"
+#include "net.h"
+#include "peer.h"
+#include "peer_hash.h"
+#include "ppspp_protocol.h"
+#include "window.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Event driven seeder engine.
+ *
+ * Instead of creating one worker thread per connected leecher, a fixed number
+ * of event loops (threads) wait on the shared UDP socket using epoll. Each
+ * datagram is dispatched to the peer (leecher) it came from and the message
+ * is handled in place by advancing the peer's "sm_seeder" state machine, so
+ * the per-connection cost is only the "struct peer" itself.
+ *
+ * Locking: event loops find peers in seeder->peers_hash without taking any
+ * lock and then lock the peer's own p->reactor_mutex. The peers list and the
+ * hash are modified only with seeder->peers_list_head_mutex held.
+ *
+ * Peers marked for removal are freed in two steps by the garbage collector:
+ * first they are removed from the hash and stamped with a new epoch, then
+ * they are freed once every loop has passed a quiescent state (a point where
+ * it holds no peer pointer) in that epoch or later. A loop sleeping in
+ * epoll_wait() is always quiescent.
+ */
+
+/* oldest epoch still seen by any of the loops */
+INTERNAL_LINKAGE
+uint64_t
+reactor_min_qs(struct reactor *r)
+{
+  int l;
+  uint64_t qs;
+  uint64_t min;
+
+  min = REACTOR_QS_OFFLINE;
+  for (l = 0; l < r->num_loops; l++) {
+    qs = __atomic_load_n(&r->loops[l].qs, __ATOMIC_SEQ_CST);
+    if (qs < min) {
+      min = qs;
+    }
+  }
+
+  return min;
+}
+
+/* free all the peers marked for removal which can't be used by any event loop any more */
+INTERNAL_LINKAGE
+void
+reactor_gc(struct reactor_loop *l)
+{
+  int pending;
+  uint64_t epoch;
+  uint64_t min;
+  struct peer *p;
+  struct peer *next;
+  struct peer *seeder;
+  struct reactor *r;
+
+  r = l->reactor;
+  seeder = r->seeder;
+  epoch = 0;
+  pending = 0;
+
+  pthread_mutex_lock(&seeder->peers_list_head_mutex);
+  remove_dead_peers = 0; /* cleared before scanning so peers marked meanwhile aren't missed */
+
+  /* hide newly marked peers from the loops */
+  SLIST_FOREACH(p, &seeder->peers_list_head, snext)
+  {
+    if ((p->to_remove != 0) && (p->retire_epoch == 0)) {
+      peer_hash_remove(p->hash, p);
+      if (epoch == 0) {
+	epoch = __atomic_add_fetch(&r->epoch, 1, __ATOMIC_SEQ_CST);
+      }
+      p->retire_epoch = epoch;
+    }
+  }
+
+  /* this loop doesn't hold any peer now */
+  __atomic_store_n(&l->qs, __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  min = reactor_min_qs(r);
+
+  p = SLIST_FIRST(&seeder->peers_list_head);
+  while (p != NULL) {
+    next = SLIST_NEXT(p, snext);
+    if (p->retire_epoch != 0) {
+      if (p->retire_epoch <= min) {
+	pthread_mutex_destroy(&p->reactor_mutex);
+	cleanup_peer(p);
+      } else {
+	pending = 1; /* try again on next tick */
+      }
+    }
+    p = next;
+  }
+  if (pending != 0) {
+    remove_dead_peers = 1;
+  }
+  pthread_mutex_unlock(&seeder->peers_list_head_mutex);
+}
+
+/*
+ * mark peers which haven't sent anything for "timeout" seconds for removal and
+ * retransmit chunks not confirmed in time by leechers
+ */
+INTERNAL_LINKAGE
+void
+reactor_timeouts(struct reactor_loop *l)
+{
+  struct peer *p;
+  struct peer *seeder;
+  struct timespec ts;
+
+  seeder = l->reactor->seeder;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  pthread_mutex_lock(&seeder->peers_list_head_mutex);
+  SLIST_FOREACH(p, &seeder->peers_list_head, snext)
+  {
+    pthread_mutex_lock(&p->reactor_mutex);
+    if ((p->to_remove == 0) && (seeder->timeout > 0) && (ts.tv_sec - p->ts_last_recv.tv_sec > seeder->timeout)) {
+      d_printf("removing peer %s:%u due to timeout in communication\n", inet_ntoa(p->leecher_addr.sin_addr),
+               ntohs(p->leecher_addr.sin_port));
+      p->finishing = 1;
+      p->to_remove = 1;
+      remove_dead_peers = 1;
+    }
+    if ((p->to_remove == 0) && (p->sm_seeder == SW_WAIT_HAVE_ACK) && (window_rto_left_us(p) == 0)) {
+      window_on_timeout(p, &l->tx);
+      tx_batch_flush(&l->tx);
+    }
+    pthread_mutex_unlock(&p->reactor_mutex);
+  }
+  pthread_mutex_unlock(&seeder->peers_list_head_mutex);
+}
+
+/* handle one message received from leecher "p" - called with p->reactor_mutex locked */
+INTERNAL_LINKAGE
+void
+reactor_on_message(struct peer *p, struct tx_batch *tx, char *msg, uint16_t msg_len)
+{
+  switch (msg[0]) {
+  case HANDSHAKE:
+    if (p->sm_seeder != SM_NONE) {
+      d_printf("%s", "HANDSHAKE already serviced - ignoring\n");
+      break;
+    }
+    if (seeder_handshake_have(p, msg, msg_len) < 0) {
+      p->finishing = 1;
+      p->to_remove = 1;
+      remove_dead_peers = 1;
+    }
+    break;
+  case REQUEST:
+    if (p->sm_seeder == SM_NONE) {
+      break;
+    }
+    dump_request(msg, msg_len, p);
+    window_start(p);
+    window_fill(p, tx);
+    p->sm_seeder = (window_done(p) != 0) ? SM_WAIT_REQUEST : SW_WAIT_HAVE_ACK;
+    break;
+  case PEX_REQ:
+    break;
+  case HAVE:
+  case ACK:
+    if (p->sm_seeder != SW_WAIT_HAVE_ACK) {
+      break;
+    }
+    window_on_msg(p, msg);
+    window_fill(p, tx);
+    if (window_done(p) != 0) {
+      p->sm_seeder = SM_WAIT_REQUEST;
+    }
+    break;
+  default:
+    d_printf("another msg: %d\n", msg[0]);
+  }
+}
+
+/* locate (or create for HANDSHAKE_INIT) the peer which sent datagram "buf" and handle all its messages */
+INTERNAL_LINKAGE
+void
+reactor_dispatch(struct reactor *r, struct tx_batch *tx, char *buf, int n, struct sockaddr_in *clientaddr)
+{
+  int off;
+  int size;
+  uint8_t htype;
+  struct peer *p;
+  struct peer *seeder;
+
+  seeder = r->seeder;
+
+  if (n <= 4) { /* keep-alive has only dest_chan_id - and it takes 4 bytes */
+    d_printf("%s", "KEEP-ALIVE?\n");
+    return;
+  }
+
+  htype = HANDSHAKE_ERROR;
+  if (message_type(buf) == HANDSHAKE) {
+    htype = handshake_type(buf);
+  }
+
+  p = seeder_find_peer(seeder->peers_hash, buf, n, clientaddr);
+
+  if ((p == NULL) && (htype == HANDSHAKE_INIT)) {
+    pthread_mutex_lock(&seeder->peers_list_head_mutex);
+    /* another loop may have created it in the meantime */
+    p = ip_port_to_peer(seeder->peers_hash, clientaddr);
+    if (p == NULL) {
+      p = new_peer(clientaddr, BUFSIZE, r->sockfd);
+      if (p == NULL) {
+	pthread_mutex_unlock(&seeder->peers_list_head_mutex);
+	d_printf("%s", "cannot allocate memory for new peer\n");
+	return;
+      }
+      p->seeder = seeder;
+      p->sm_seeder = SM_NONE;
+      pthread_mutex_init(&p->reactor_mutex, NULL);
+      seeder_add_peer(seeder, seeder->peers_hash, p);
+    }
+    pthread_mutex_unlock(&seeder->peers_list_head_mutex);
+  }
+
+  if (p == NULL) {
+    d_printf("datagram from unknown peer %s:%u - dropping\n", inet_ntoa(clientaddr->sin_addr),
+             ntohs(clientaddr->sin_port));
+    return;
+  }
+
+  /* the peer can't be freed before this loop reaches quiescent state but it may have been marked for removal */
+  pthread_mutex_lock(&p->reactor_mutex);
+  if (p->to_remove != 0) {
+    pthread_mutex_unlock(&p->reactor_mutex);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &p->ts_last_recv);
+
+  if (htype == HANDSHAKE_FINISH) {
+    d_printf("%s", "FINISH\n");
+    p->finishing = 1;
+    p->to_remove = 1;
+    remove_dead_peers = 1;
+    pthread_mutex_unlock(&p->reactor_mutex);
+    return;
+  }
+
+  /* first message in udp payload always has dest_chan_id at offset [0] so skip it */
+  off = sizeof(uint32_t);
+  while ((off < n) && (p->to_remove == 0)) {
+    size = count_message(buf + off, n - off, 0);
+    if ((size <= 0) || (off + size > n)) {
+      d_printf("malformed or unsupported message at offset %d - dropping rest of datagram\n", off);
+      break;
+    }
+    reactor_on_message(p, tx, buf + off, size);
+    off += size;
+  }
+
+  /* with several loops DATA for the same leecher queued by two of them could overtake each other - the leecher
+   * accepts DATA only in order, so send them before the peer is released */
+  if (r->num_loops > 1) {
+    tx_batch_flush(tx);
+  }
+
+  pthread_mutex_unlock(&p->reactor_mutex);
+}
+
+/* thread - one event loop */
+INTERNAL_LINKAGE
+void *
+reactor_loop_run(void *data)
+{
+  int e;
+  int i;
+  int n;
+  int nev;
+  int budget;
+  uint64_t expirations;
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  struct reactor_loop *l;
+  struct reactor *r;
+
+  l = (struct reactor_loop *)data;
+  r = l->reactor;
+
+  d_printf("event loop %d started\n", l->idx);
+
+  while (1) {
+    /* no peer pointers are held while sleeping */
+    __atomic_store_n(&l->qs, REACTOR_QS_OFFLINE, __ATOMIC_SEQ_CST);
+    nev = epoll_wait(l->epfd, events, REACTOR_MAX_EVENTS, -1);
+    __atomic_store_n(&l->qs, __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    if (nev < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      d_printf("epoll_wait error: %s\n", strerror(errno));
+      abort();
+    }
+
+    for (e = 0; e < nev; e++) {
+      if (events[e].data.fd == l->timerfd) {
+	if (read(l->timerfd, &expirations, sizeof(expirations)) < 0) {
+	  continue;
+	}
+	reactor_timeouts(l);
+	if (remove_dead_peers == 1) {
+	  reactor_gc(l);
+	}
+	continue;
+      }
+
+      /* completions of MSG_ZEROCOPY sends are reported on socket's error queue */
+      if ((events[e].events & EPOLLERR) && (r->zc != NULL)) {
+	zc_reap(r->zc);
+      }
+
+      /* read batches of datagrams until the socket is empty or the budget is used, datagrams generated
+       * while servicing one batch are sent together */
+      for (budget = 0; budget < REACTOR_RECV_BUDGET; budget++) {
+	n = rx_batch_recv(&l->rx, r->sockfd, MSG_DONTWAIT);
+	if (n <= 0) {
+	  if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+	    d_printf("ERROR in recvmmsg: %s\n", strerror(errno));
+	  }
+	  break;
+	}
+	for (i = 0; i < n; i++) {
+	  reactor_dispatch(r, &l->tx, l->rx.buf[i], l->rx.msgs[i].msg_len, &l->rx.addr[i]);
+	}
+	tx_batch_flush(&l->tx);
+	if (n < BATCH_SIZE) {
+	  break;
+	}
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* UDP datagram server (SEEDER) - event driven version */
+INTERNAL_LINKAGE
+int
+net_seeder_reactor(struct peer *seeder)
+{
+  int l;
+  int st;
+  int optval;
+  long ncpu;
+  struct sockaddr_in serveraddr;
+  struct epoll_event ev;
+  struct itimerspec its;
+  struct reactor *r;
+  struct reactor_loop *loop;
+
+  r = malloc(sizeof(struct reactor));
+  if (r == NULL) {
+    d_printf("%s", "cannot allocate memory for reactor\n");
+    abort();
+  }
+  memset(r, 0, sizeof(struct reactor));
+
+  r->seeder = seeder;
+  seeder->reactor = r;
+
+  r->num_loops = seeder->reactor_threads;
+  if (r->num_loops == 0) {
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    r->num_loops = (ncpu > 0) ? ncpu : 1;
+  }
+
+  /* the socket stays in blocking mode so sendto() waits for space in socket buffer, receiving is done with
+   * MSG_DONTWAIT */
+  r->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (r->sockfd < 0) {
+    d_printf("%s", "ERROR opening socket\n");
+    abort();
+  }
+
+  optval = 1;
+  setsockopt(r->sockfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval, sizeof(int));
+
+  memset((char *)&serveraddr, 0, sizeof(serveraddr));
+  serveraddr.sin_family = AF_INET;
+  serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  serveraddr.sin_port = htons((unsigned short)seeder->port);
+
+  if (bind(r->sockfd, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
+    d_printf("%s", "ERROR on binding\n");
+    abort();
+  }
+
+  if (seeder->zerocopy != 0) {
+    r->zc = malloc(sizeof(struct zc_state));
+    if (r->zc == NULL) {
+      d_printf("%s", "cannot allocate memory for zerocopy state\n");
+      abort();
+    }
+    if (zc_init(r->zc, r->sockfd) < 0) {
+      free(r->zc);
+      r->zc = NULL;
+    }
+  }
+
+  if ((seeder->gso != 0) && (gso_probe(r->sockfd) == 0)) {
+    seeder->gso = 0;
+  }
+
+  remove_dead_peers = 0;
+  SLIST_INIT(&seeder->peers_list_head);
+  pthread_mutex_init(&seeder->peers_list_head_mutex, NULL);
+  seeder->peers_hash = peer_hash_create();
+  if (seeder->peers_hash == NULL) {
+    d_printf("%s", "cannot allocate memory for peers hash\n");
+    abort();
+  }
+
+  r->loops = malloc(r->num_loops * sizeof(struct reactor_loop));
+  if (r->loops == NULL) {
+    d_printf("%s", "cannot allocate memory for event loops\n");
+    abort();
+  }
+  memset(r->loops, 0, r->num_loops * sizeof(struct reactor_loop));
+
+  d_printf("starting %d event loops\n", r->num_loops);
+
+  for (l = 0; l < r->num_loops; l++) {
+    loop = &r->loops[l];
+    loop->reactor = r;
+    loop->idx = l;
+    loop->timerfd = -1;
+    rx_batch_init(&loop->rx);
+    tx_batch_init(&loop->tx, r->sockfd, r->zc);
+
+    loop->epfd = epoll_create1(0);
+    if (loop->epfd < 0) {
+      d_printf("epoll_create1 error: %s\n", strerror(errno));
+      abort();
+    }
+
+    /* wake up only one of the loops waiting for incoming datagram */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.fd = r->sockfd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, r->sockfd, &ev) < 0) {
+      d_printf("epoll_ctl error: %s\n", strerror(errno));
+      abort();
+    }
+
+    /* first loop handles timeouts and garbage collector */
+    if (l == 0) {
+      loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+      if (loop->timerfd < 0) {
+	d_printf("timerfd_create error: %s\n", strerror(errno));
+	abort();
+      }
+      memset(&its, 0, sizeof(its));
+      its.it_value.tv_nsec = REACTOR_TICK_MS * 1000000L;
+      its.it_interval.tv_nsec = REACTOR_TICK_MS * 1000000L;
+      timerfd_settime(loop->timerfd, 0, &its, NULL);
+
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.fd = loop->timerfd;
+      if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev) < 0) {
+	d_printf("epoll_ctl error: %s\n", strerror(errno));
+	abort();
+      }
+    }
+
+    st = pthread_create(&loop->thread, NULL, &reactor_loop_run, loop);
+    if (st != 0) {
+      d_printf("cannot create new thread: %s\n", strerror(errno));
+      abort();
+    }
+  }
+
+  for (l = 0; l < r->num_loops; l++) {
+    pthread_join(r->loops[l].thread, NULL);
+  }
+
+  return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include "batch.h"
+#include "net.h"
+#include "peer.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define REACTOR_MAX_EVENTS   64
+#define REACTOR_RECV_BUDGET  4   /* max number of recvmmsg() calls made by one loop in one pass */
+#define REACTOR_TICK_MS      50  /* period of timer used for timeouts, retransmissions and garbage collection */
+#define REACTOR_QS_OFFLINE   UINT64_MAX /* reactor_loop.qs of loop sleeping in epoll_wait() */
+
+struct reactor;
+
+/* one event loop - thread with its own epoll instance */
+struct reactor_loop {
+  struct reactor *reactor;
+  int idx;
+  int epfd;
+  int timerfd; /* only loop 0 owns timer, -1 for the others */
+  pthread_t thread;
+  uint64_t qs; /* value of reactor.epoch seen when loop held no peer pointers last time */
+  struct rx_batch rx;
+  struct tx_batch tx; /* datagrams generated while servicing "rx" batch */
+};
+
+/* seeder side: fixed set of event loops serving all the connected leechers */
+struct reactor {
+  struct peer *seeder;
+  int sockfd;
+  int num_loops;
+  uint64_t epoch; /* incremented each time garbage collector removes peers from seeder->peers_hash */
+  struct reactor_loop *loops;
+  struct zc_state *zc; /* MSG_ZEROCOPY state of "sockfd", NULL if zerocopy is disabled */
+};
+
+int net_seeder_reactor(struct peer * /*seeder*/);
+
+#endif /* _REACTOR_H_ */
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "ring.h"
+#include "debug.h"
+#include "peer.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* create ring holding at least "slots" messages - the number is rounded up to power of 2, RING_SLOTS at least */
+INTERNAL_LINKAGE
+struct ring *
+ring_create(uint32_t slots)
+{
+  size_t size;
+  uint32_t n;
+  struct ring *r;
+
+  n = RING_SLOTS;
+  while (n < slots) {
+    n <<= 1;
+  }
+  size = sizeof(struct ring) + n * sizeof(struct ring_slot);
+  size = (size + 63) & ~(size_t)63; /* aligned_alloc() wants multiple of the alignment */
+
+  r = aligned_alloc(64, size);
+  if (r == NULL) {
+    return NULL;
+  }
+  memset(r, 0, size);
+  r->slots = n;
+
+  r->efd = eventfd(0, EFD_CLOEXEC);
+  if (r->efd < 0) {
+    d_printf("eventfd error: %s\n", strerror(errno));
+    free(r);
+    return NULL;
+  }
+
+  return r;
+}
+
+INTERNAL_LINKAGE
+void
+ring_free(struct ring *r)
+{
+  if (r == NULL) {
+    return;
+  }
+  close(r->efd);
+  free(r);
+}
+
+/*
+ * producer side: put copy of message "buf" in the ring and wake up consumer if it sleeps
+ * returns 0 or -1 if the ring is full or the message is too long
+ */
+INTERNAL_LINKAGE
+int
+ring_push(struct ring *r, char *buf, uint16_t buf_len)
+{
+  uint32_t head;
+  uint32_t tail;
+  uint64_t v;
+  struct ring_slot *s;
+
+  if (buf_len > RING_MSG_SIZE) {
+    return -1;
+  }
+
+  tail = r->tail;
+  head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  if (tail - head == r->slots) {
+    return -1;
+  }
+
+  s = &r->slot[tail & (r->slots - 1)];
+  memcpy(s->msg, buf, buf_len);
+  s->len = buf_len;
+
+  /* seq_cst pairs with the one in ring_wait() - either we see consumer sleeping or it sees the new message */
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->sleeping, __ATOMIC_SEQ_CST) != 0) {
+    v = 1;
+    if (write(r->efd, &v, sizeof(v)) < 0) {
+      d_printf("eventfd write error: %s\n", strerror(errno));
+    }
+  }
+
+  return 0;
+}
+
+/* consumer side: copy first message to "buf" without removing it, returns its length or -1 if the ring is empty */
+INTERNAL_LINKAGE
+int
+ring_peek(struct ring *r, char *buf, uint16_t buf_len)
+{
+  uint32_t head;
+  struct ring_slot *s;
+
+  head = r->head;
+  if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+    return -1;
+  }
+
+  s = &r->slot[head & (r->slots - 1)];
+  _assert(s->len <= buf_len, "message len (%u) is bigger than buffer(%u)\n", s->len, buf_len);
+  memcpy(buf, s->msg, s->len);
+
+  return s->len;
+}
+
+/* consumer side: move first message to "buf", returns its length or -1 if the ring is empty */
+INTERNAL_LINKAGE
+int
+ring_pop(struct ring *r, char *buf, uint16_t buf_len)
+{
+  int len;
+
+  len = ring_peek(r, buf, buf_len);
+  if (len >= 0) {
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+  }
+
+  return len;
+}
+
+/*
+ * consumer side: sleep until the ring is not empty, ring_wake() is called or
+ * "timeout_ms" passes (-1 = no timeout)
+ * returns 0 or -1 on timeout
+ */
+INTERNAL_LINKAGE
+int
+ring_wait(struct ring *r, int timeout_ms)
+{
+  int n;
+  uint64_t v;
+  struct pollfd pfd;
+
+  __atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != r->head) {
+    __atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  pfd.fd = r->efd;
+  pfd.events = POLLIN;
+  do {
+    n = poll(&pfd, 1, timeout_ms);
+  } while ((n < 0) && (errno == EINTR));
+  __atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+
+  if (n == 0) {
+    return -1;
+  }
+  if (read(r->efd, &v, sizeof(v)) < 0) { /* reset eventfd counter */
+    d_printf("eventfd read error: %s\n", strerror(errno));
+  }
+
+  return 0;
+}
+
+/* wake up consumer sleeping in ring_wait() even if the ring is empty - e.g. when its peer is finishing */
+INTERNAL_LINKAGE
+void
+ring_wake(struct ring *r)
+{
+  uint64_t v;
+
+  v = 1;
+  if (write(r->efd, &v, sizeof(v)) < 0) {
+    d_printf("eventfd write error: %s\n", strerror(errno));
+  }
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdint.h>
+
+#define RING_SLOTS    128 /* min number of messages the ring can hold, must be power of 2 */
+#define RING_MSG_SIZE 256 /* max length of one message */
+
+struct ring_slot {
+  uint16_t len;
+  char msg[RING_MSG_SIZE];
+};
+
+/*
+ * single producer / single consumer queue of messages with preallocated slots
+ * producer and consumer don't share any lock - each of them writes only its own index
+ * consumer which finds the ring empty sleeps on eventfd until producer wakes it up
+ */
+struct ring {
+  uint32_t head __attribute__((aligned(64))); /* next slot to read, written only by consumer */
+  uint32_t tail __attribute__((aligned(64))); /* next slot to write, written only by producer */
+  int sleeping;                               /* 1 = consumer is going to sleep on "efd" */
+  int efd;                                    /* eventfd for waking up consumer */
+  uint32_t slots;                             /* number of slots, power of 2 */
+  struct ring_slot slot[];
+};
+
+struct ring *ring_create(uint32_t /*slots*/);
+void ring_free(struct ring * /*r*/);
+int ring_push(struct ring * /*r*/, char * /*buf*/, uint16_t /*buf_len*/);
+int ring_pop(struct ring * /*r*/, char * /*buf*/, uint16_t /*buf_len*/);
+int ring_peek(struct ring * /*r*/, char * /*buf*/, uint16_t /*buf_len*/);
+int ring_wait(struct ring * /*r*/, int /*timeout_ms*/);
+void ring_wake(struct ring * /*r*/);
+
+#endif /* _RING_H_ */
@@ -58,6 +58,8 @@
 
 #include "sha1.h"
 #include "peer.h"
+#include "sha1_backend.h"
+#include <string.h>
 
 /*
  *  Define the SHA1 circular left shift macro
@@ -89,6 +91,8 @@ INTERNAL_LINKAGE int SHA1Reset(SHA1Context *context) {
     return shaNull;
   }
 
+  sha1_backend_init();
+
   context->Length_Low = 0;
   context->Length_High = 0;
   context->Message_Block_Index = 0;
@@ -177,6 +181,9 @@ INTERNAL_LINKAGE int SHA1Result(SHA1Context *context,
  */
 INTERNAL_LINKAGE int SHA1Input(SHA1Context *context,
                                const uint8_t *message_array, unsigned length) {
+  unsigned n;
+  uint64_t bits;
+
   if (!length) {
     return shaSuccess;
   }
@@ -194,24 +201,33 @@ INTERNAL_LINKAGE int SHA1Input(SHA1Context *context,
   if (context->Corrupted) {
     return context->Corrupted;
   }
-  while (length-- && !context->Corrupted) {
-    context->Message_Block[context->Message_Block_Index++] =
-        (*message_array & 0xFF);
-
-    context->Length_Low += 8;
-    if (context->Length_Low == 0) {
-      context->Length_High++;
-      if (context->Length_High == 0) {
-        /* Message is too long */
-        context->Corrupted = 1;
+  while (length && !context->Corrupted) {
+    if (context->Message_Block_Index == 0 && length >= 64) {
+      /* whole blocks go straight from the caller's buffer to the backend */
+      n = length & ~63U;
+      sha1_compress(context->Intermediate_Hash, message_array, n / 64);
+    } else {
+      n = 64 - context->Message_Block_Index;
+      if (n > length) {
+        n = length;
+      }
+      memcpy(context->Message_Block + context->Message_Block_Index, message_array, n);
+      context->Message_Block_Index += n;
+      if (context->Message_Block_Index == 64) {
+        SHA1ProcessMessageBlock(context);
       }
     }
 
-    if (context->Message_Block_Index == 64) {
-      SHA1ProcessMessageBlock(context);
+    bits = ((uint64_t)context->Length_High << 32 | context->Length_Low) + (uint64_t)n * 8;
+    if (bits < ((uint64_t)context->Length_High << 32 | context->Length_Low)) {
+      /* Message is too long */
+      context->Corrupted = 1;
     }
+    context->Length_Low = bits;
+    context->Length_High = bits >> 32;
 
-    message_array++;
+    message_array += n;
+    length -= n;
   }
 
   return shaSuccess;
@@ -222,7 +238,8 @@ INTERNAL_LINKAGE int SHA1Input(SHA1Context *context,
  *
  *  Description:
  *      This function will process the next 512 bits of the message
- *      stored in the Message_Block array.
+ *      stored in the Message_Block array using the SHA-1 backend
+ *      selected for this CPU.
  *
  *  Parameters:
  *      None.
@@ -230,6 +247,32 @@ INTERNAL_LINKAGE int SHA1Input(SHA1Context *context,
  *  Returns:
  *      Nothing.
  *
+ */
+INTERNAL_LINKAGE void SHA1ProcessMessageBlock(SHA1Context *context) {
+  sha1_compress(context->Intermediate_Hash, context->Message_Block, 1);
+
+  context->Message_Block_Index = 0;
+}
+
+/*
+ *  sha1_compress_portable
+ *
+ *  Description:
+ *      This function will process "nblocks" consecutive 512-bit
+ *      message blocks.  It is the reference implementation every
+ *      other backend is checked against.
+ *
+ *  Parameters:
+ *      state: [in/out]
+ *          The five words of intermediate hash.
+ *      blocks: [in]
+ *          The message blocks.
+ *      nblocks: [in]
+ *          Number of blocks.
+ *
+ *  Returns:
+ *      Nothing.
+ *
  *  Comments:
  *      Many of the variable names in this code, especially the
  *      single character names, were used because those were the
@@ -237,7 +280,7 @@ INTERNAL_LINKAGE int SHA1Input(SHA1Context *context,
  *
  *
  */
-INTERNAL_LINKAGE void SHA1ProcessMessageBlock(SHA1Context *context) {
+INTERNAL_LINKAGE void sha1_compress_portable(uint32_t *state, const uint8_t *blocks, size_t nblocks) {
   const uint32_t K[] = {/* Constants defined in SHA-1   */
                         0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6};
   int t;                  /* Loop counter                */
@@ -249,70 +292,70 @@ INTERNAL_LINKAGE void SHA1ProcessMessageBlock(SHA1Context *context) {
   uint32_t D;
   uint32_t E; /* Word buffers                */
 
-  /*
-   *  Initialize the first 16 words in the array W
-   */
-  for (t = 0; t < 16; t++) {
-    W[t] = context->Message_Block[t * 4] << 24;
-    W[t] |= context->Message_Block[t * 4 + 1] << 16;
-    W[t] |= context->Message_Block[t * 4 + 2] << 8;
-    W[t] |= context->Message_Block[t * 4 + 3];
-  }
-
-  for (t = 16; t < 80; t++) {
-    W[t] = SHA1CircularShift(1, W[t - 3] ^ W[t - 8] ^ W[t - 14] ^ W[t - 16]);
-  }
+  for (; nblocks > 0; nblocks--, blocks += 64) {
+    /*
+     *  Initialize the first 16 words in the array W
+     */
+    for (t = 0; t < 16; t++) {
+      W[t] = (uint32_t)blocks[t * 4] << 24;
+      W[t] |= blocks[t * 4 + 1] << 16;
+      W[t] |= blocks[t * 4 + 2] << 8;
+      W[t] |= blocks[t * 4 + 3];
+    }
 
-  A = context->Intermediate_Hash[0];
-  B = context->Intermediate_Hash[1];
-  C = context->Intermediate_Hash[2];
-  D = context->Intermediate_Hash[3];
-  E = context->Intermediate_Hash[4];
-
-  for (t = 0; t < 20; t++) {
-    temp = SHA1CircularShift(5, A) + ((B & C) | ((~B) & D)) + E + W[t] + K[0];
-    E = D;
-    D = C;
-    C = SHA1CircularShift(30, B);
-    B = A;
-    A = temp;
-  }
+    for (t = 16; t < 80; t++) {
+      W[t] = SHA1CircularShift(1, W[t - 3] ^ W[t - 8] ^ W[t - 14] ^ W[t - 16]);
+    }
 
-  for (t = 20; t < 40; t++) {
-    temp = SHA1CircularShift(5, A) + (B ^ C ^ D) + E + W[t] + K[1];
-    E = D;
-    D = C;
-    C = SHA1CircularShift(30, B);
-    B = A;
-    A = temp;
-  }
+    A = state[0];
+    B = state[1];
+    C = state[2];
+    D = state[3];
+    E = state[4];
+
+    for (t = 0; t < 20; t++) {
+      temp = SHA1CircularShift(5, A) + ((B & C) | ((~B) & D)) + E + W[t] + K[0];
+      E = D;
+      D = C;
+      C = SHA1CircularShift(30, B);
+      B = A;
+      A = temp;
+    }
 
-  for (t = 40; t < 60; t++) {
-    temp = SHA1CircularShift(5, A) + ((B & C) | (B & D) | (C & D)) + E + W[t] +
-           K[2];
-    E = D;
-    D = C;
-    C = SHA1CircularShift(30, B);
-    B = A;
-    A = temp;
-  }
+    for (t = 20; t < 40; t++) {
+      temp = SHA1CircularShift(5, A) + (B ^ C ^ D) + E + W[t] + K[1];
+      E = D;
+      D = C;
+      C = SHA1CircularShift(30, B);
+      B = A;
+      A = temp;
+    }
 
-  for (t = 60; t < 80; t++) {
-    temp = SHA1CircularShift(5, A) + (B ^ C ^ D) + E + W[t] + K[3];
-    E = D;
-    D = C;
-    C = SHA1CircularShift(30, B);
-    B = A;
-    A = temp;
-  }
+    for (t = 40; t < 60; t++) {
+      temp = SHA1CircularShift(5, A) + ((B & C) | (B & D) | (C & D)) + E + W[t] +
+             K[2];
+      E = D;
+      D = C;
+      C = SHA1CircularShift(30, B);
+      B = A;
+      A = temp;
+    }
 
-  context->Intermediate_Hash[0] += A;
-  context->Intermediate_Hash[1] += B;
-  context->Intermediate_Hash[2] += C;
-  context->Intermediate_Hash[3] += D;
-  context->Intermediate_Hash[4] += E;
+    for (t = 60; t < 80; t++) {
+      temp = SHA1CircularShift(5, A) + (B ^ C ^ D) + E + W[t] + K[3];
+      E = D;
+      D = C;
+      C = SHA1CircularShift(30, B);
+      B = A;
+      A = temp;
+    }
 
-  context->Message_Block_Index = 0;
+    state[0] += A;
+    state[1] += B;
+    state[2] += C;
+    state[3] += D;
+    state[4] += E;
+  }
 }
 
 /*
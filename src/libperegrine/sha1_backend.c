@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SHA-1 compression backends
+ *
+ * SHA1Input() and SHA1Result() of sha1.c hand whole 64-byte blocks to
+ * sha1_compress(), which runs the fastest backend the CPU supports:
+ *
+ * - shani:    SHA extensions (sha1rnds4/sha1msg1/sha1msg2/sha1nexte)
+ * - ssse3:    message schedule four words at a time in 128-bit registers,
+ *             scalar rounds
+ * - portable: RFC 3174 reference code from sha1.c
+ *
+ * The backend is chosen once, on the first SHA1Reset(), using cpuid. Before
+ * it is taken into use every candidate must produce the same digests as the
+ * reference code - a backend failing the self-test is skipped.
+ */
+
+#include "sha1_backend.h"
+#include "debug.h"
+#include "peer.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define SHA1_SELFTEST_BLOCKS 7
+
+static sha1_compress_fn sha1_kernel = sha1_compress_portable;
+static const char *sha1_kernel_name = "portable";
+static pthread_once_t sha1_once = PTHREAD_ONCE_INIT;
+
+#if SHA1_X86
+
+#ifndef bit_SHA
+#define bit_SHA (1 << 29)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2 (1 << 5)
+#endif
+#ifndef bit_AVX512F
+#define bit_AVX512F (1 << 16)
+#endif
+
+static const uint32_t sha1_k[4] = {0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6};
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/*
+ * 80 rounds of SHA-1 over already expanded message schedule
+ * wk[t] = W[t] + K[t / 20]
+ */
+INTERNAL_LINKAGE
+void
+sha1_rounds(uint32_t *state, const uint32_t *wk)
+{
+  int t;
+  uint32_t a, b, c, d, e, temp;
+
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+  e = state[4];
+
+#define SHA1_ROUND(f)                                                                                          \
+  do {                                                                                                         \
+    temp = ROL(a, 5) + (f) + e + wk[t];                                                                        \
+    e = d;                                                                                                     \
+    d = c;                                                                                                     \
+    c = ROL(b, 30);                                                                                            \
+    b = a;                                                                                                     \
+    a = temp;                                                                                                  \
+  } while (0)
+
+  for (t = 0; t < 20; t++) {
+    SHA1_ROUND(d ^ (b & (c ^ d)));
+  }
+  for (; t < 40; t++) {
+    SHA1_ROUND(b ^ c ^ d);
+  }
+  for (; t < 60; t++) {
+    SHA1_ROUND((b & c) | (d & (b | c)));
+  }
+  for (; t < 80; t++) {
+    SHA1_ROUND(b ^ c ^ d);
+  }
+
+#undef SHA1_ROUND
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+/*
+ * message schedule four words at a time:
+ * W[t..t+3] = rol1(W[t-3..t] ^ W[t-8..t-5] ^ W[t-14..t-11] ^ W[t-16..t-13])
+ * W[t] is not known yet when computing W[t+3], so lane 3 is computed with 0
+ * in place of W[t] and fixed up afterwards with rol1(W[t]) = rol2(x[0])
+ */
+__attribute__((target("ssse3"))) INTERNAL_LINKAGE
+void
+sha1_compress_ssse3(uint32_t *state, const uint8_t *blocks, size_t nblocks)
+{
+  int t;
+  uint32_t wk[80];
+  __m128i w[4];
+  __m128i x, r;
+  const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+  for (; nblocks > 0; nblocks--, blocks += 64) {
+    for (t = 0; t < 4; t++) {
+      w[t] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + 16 * t)), bswap);
+      _mm_storeu_si128((__m128i *)(wk + 4 * t), _mm_add_epi32(w[t], _mm_set1_epi32(sha1_k[0])));
+    }
+    for (t = 16; t < 80; t += 4) {
+      /* w[t/4 % 4] holds W[t-16..t-13], the next ones W[t-12..], W[t-8..] and W[t-4..] */
+      x = _mm_xor_si128(_mm_srli_si128(w[(t / 4 + 3) % 4], 4), w[(t / 4 + 2) % 4]);
+      x = _mm_xor_si128(x, _mm_alignr_epi8(w[(t / 4 + 1) % 4], w[(t / 4) % 4], 8));
+      x = _mm_xor_si128(x, w[(t / 4) % 4]);
+      r = _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31));
+      x = _mm_slli_si128(x, 12);
+      r = _mm_xor_si128(r, _mm_or_si128(_mm_slli_epi32(x, 2), _mm_srli_epi32(x, 30)));
+      w[(t / 4) % 4] = r;
+      _mm_storeu_si128((__m128i *)(wk + t), _mm_add_epi32(r, _mm_set1_epi32(sha1_k[t / 20])));
+    }
+    sha1_rounds(state, wk);
+  }
+}
+
+/*
+ * SHA extensions - every sha1rnds4 does 4 rounds, message words for the
+ * group i + 1 are completed by sha1msg2 while group i is being processed,
+ * sha1msg1 and xor prepare them 3 and 2 groups earlier
+ */
+#define SHANI_GROUP(e_in, e_out, m, f)                                                                         \
+  do {                                                                                                         \
+    e_in = _mm_sha1nexte_epu32(e_in, m);                                                                       \
+    e_out = abcd;                                                                                              \
+    abcd = _mm_sha1rnds4_epu32(abcd, e_in, f);                                                                 \
+  } while (0)
+
+#define SHANI_STEP(e_in, e_out, m, m_next, m_next2, m_next3, f)                                                \
+  do {                                                                                                         \
+    SHANI_GROUP(e_in, e_out, m, f);                                                                            \
+    m_next = _mm_sha1msg2_epu32(m_next, m);                                                                    \
+    m_next2 = _mm_xor_si128(m_next2, m);                                                                       \
+    m_next3 = _mm_sha1msg1_epu32(m_next3, m);                                                                  \
+  } while (0)
+
+__attribute__((target("sha,sse4.1,ssse3"))) INTERNAL_LINKAGE
+void
+sha1_compress_shani(uint32_t *state, const uint8_t *blocks, size_t nblocks)
+{
+  __m128i abcd, abcd_save, e0_save;
+  __m128i e0, e1;
+  __m128i m0, m1, m2, m3;
+  const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+  e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+  for (; nblocks > 0; nblocks--, blocks += 64) {
+    abcd_save = abcd;
+    e0_save = e0;
+
+    /* rounds 0-15 - message words come straight from the block */
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + 0)), bswap);
+    e0 = _mm_add_epi32(e0, m0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + 16)), bswap);
+    SHANI_GROUP(e1, e0, m1, 0);
+    m0 = _mm_sha1msg1_epu32(m0, m1);
+
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + 32)), bswap);
+    SHANI_GROUP(e0, e1, m2, 0);
+    m1 = _mm_sha1msg1_epu32(m1, m2);
+    m0 = _mm_xor_si128(m0, m2);
+
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + 48)), bswap);
+    SHANI_STEP(e1, e0, m3, m0, m1, m2, 0);
+
+    /* rounds 16-67 */
+    SHANI_STEP(e0, e1, m0, m1, m2, m3, 0);
+    SHANI_STEP(e1, e0, m1, m2, m3, m0, 1);
+    SHANI_STEP(e0, e1, m2, m3, m0, m1, 1);
+    SHANI_STEP(e1, e0, m3, m0, m1, m2, 1);
+    SHANI_STEP(e0, e1, m0, m1, m2, m3, 1);
+    SHANI_STEP(e1, e0, m1, m2, m3, m0, 1);
+    SHANI_STEP(e0, e1, m2, m3, m0, m1, 2);
+    SHANI_STEP(e1, e0, m3, m0, m1, m2, 2);
+    SHANI_STEP(e0, e1, m0, m1, m2, m3, 2);
+    SHANI_STEP(e1, e0, m1, m2, m3, m0, 2);
+    SHANI_STEP(e0, e1, m2, m3, m0, m1, 2);
+    SHANI_STEP(e1, e0, m3, m0, m1, m2, 3);
+    SHANI_STEP(e0, e1, m0, m1, m2, m3, 3);
+
+    /* rounds 68-79 - the schedule winds down */
+    SHANI_GROUP(e1, e0, m1, 3);
+    m2 = _mm_sha1msg2_epu32(m2, m1);
+    m3 = _mm_xor_si128(m3, m1);
+
+    SHANI_GROUP(e0, e1, m2, 3);
+    m3 = _mm_sha1msg2_epu32(m3, m2);
+
+    SHANI_GROUP(e1, e0, m3, 3);
+
+    /* e0 holds abcd from before the last group, rotating its a gives e */
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#undef SHANI_STEP
+#undef SHANI_GROUP
+
+INTERNAL_LINKAGE
+int
+cpu_ssse3(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return 0;
+  }
+  return (ecx & bit_SSSE3) != 0;
+}
+
+INTERNAL_LINKAGE
+int
+cpu_shani(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return 0;
+  }
+  if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+    return 0;
+  }
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return 0;
+  }
+  return (ebx & bit_SHA) != 0;
+}
+
+/* the OS must save the given set of vector registers on context switch */
+INTERNAL_LINKAGE
+int
+cpu_xsave_enabled(unsigned int mask)
+{
+  unsigned int eax, ebx, ecx, edx;
+  unsigned int xcr0_lo, xcr0_hi;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return 0;
+  }
+  if (!(ecx & bit_OSXSAVE)) {
+    return 0;
+  }
+  __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  return (xcr0_lo & mask) == mask;
+}
+
+INTERNAL_LINKAGE
+int
+cpu_avx2(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!cpu_xsave_enabled(0x6)) { /* XMM and YMM */
+    return 0;
+  }
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return 0;
+  }
+  return (ebx & bit_AVX2) != 0;
+}
+
+INTERNAL_LINKAGE
+int
+cpu_avx512(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!cpu_xsave_enabled(0xe6)) { /* XMM, YMM, opmask and both halves of ZMM */
+    return 0;
+  }
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return 0;
+  }
+  return (ebx & bit_AVX512F) != 0;
+}
+
+#endif /* SHA1_X86 */
+
+INTERNAL_LINKAGE
+int
+cpu_any(void)
+{
+  return 1;
+}
+
+/* candidates in order of preference */
+static const struct sha1_backend sha1_backends[] = {
+#if SHA1_X86
+  {"shani", cpu_shani, sha1_compress_shani},
+  {"ssse3", cpu_ssse3, sha1_compress_ssse3},
+#endif
+  {"portable", cpu_any, sha1_compress_portable},
+};
+
+/*
+ * hash short message (at most 119 bytes) with given compression function,
+ * padding is done here so the self-test does not depend on sha1.c
+ */
+INTERNAL_LINKAGE
+void
+sha1_selftest_digest(sha1_compress_fn fn, const uint8_t *msg, size_t len, uint8_t *digest)
+{
+  int i;
+  size_t n;
+  uint8_t buf[128];
+  uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  uint64_t bits;
+
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, msg, len);
+  buf[len] = 0x80;
+  n = (len + 1 + 8 + 63) / 64;
+  bits = (uint64_t)len * 8;
+  for (i = 0; i < 8; i++) {
+    buf[n * 64 - 1 - i] = bits >> (8 * i);
+  }
+  fn(state, buf, n);
+
+  for (i = 0; i < 20; i++) {
+    digest[i] = state[i >> 2] >> 8 * (3 - (i & 0x03));
+  }
+}
+
+/*
+ * check the backend against test vectors of RFC 3174 and against the
+ * reference code on multi-block input
+ *
+ * returns 0 if the backend gives correct results
+ */
+INTERNAL_LINKAGE
+int
+sha1_selftest(sha1_compress_fn fn)
+{
+  int i;
+  uint8_t digest[20];
+  uint8_t blocks[SHA1_SELFTEST_BLOCKS * 64];
+  uint32_t state[5];
+  uint32_t ref[5];
+  static const char test1[] = "abc";
+  static const char test2[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  static const uint8_t result1[20] = {0xA9, 0x99, 0x3E, 0x36, 0x47, 0x06, 0x81, 0x6A, 0xBA, 0x3E,
+                                      0x25, 0x71, 0x78, 0x50, 0xC2, 0x6C, 0x9C, 0xD0, 0xD8, 0x9D};
+  static const uint8_t result2[20] = {0x84, 0x98, 0x3E, 0x44, 0x1C, 0x3B, 0xD2, 0x6E, 0xBA, 0xAE,
+                                      0x4A, 0xA1, 0xF9, 0x51, 0x29, 0xE5, 0xE5, 0x46, 0x70, 0xF1};
+
+  sha1_selftest_digest(fn, (const uint8_t *)test1, strlen(test1), digest);
+  if (memcmp(digest, result1, sizeof(digest)) != 0) {
+    return -1;
+  }
+  sha1_selftest_digest(fn, (const uint8_t *)test2, strlen(test2), digest);
+  if (memcmp(digest, result2, sizeof(digest)) != 0) {
+    return -1;
+  }
+
+  for (i = 0; i < (int)sizeof(blocks); i++) {
+    blocks[i] = i * 7 + (i >> 8);
+  }
+  for (i = 0; i < 5; i++) {
+    state[i] = ref[i] = 0x01234567 * (i + 1);
+  }
+  fn(state, blocks, SHA1_SELFTEST_BLOCKS);
+  sha1_compress_portable(ref, blocks, SHA1_SELFTEST_BLOCKS);
+  if (memcmp(state, ref, sizeof(state)) != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+INTERNAL_LINKAGE
+void
+sha1_backend_select(void)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(sha1_backends) / sizeof(sha1_backends[0]); i++) {
+    if (!sha1_backends[i].supported()) {
+      continue;
+    }
+    if (sha1_selftest(sha1_backends[i].compress) != 0) {
+      d_printf("SHA-1 backend %s failed self-test, skipping it\n", sha1_backends[i].name);
+      continue;
+    }
+    sha1_kernel = sha1_backends[i].compress;
+    sha1_kernel_name = sha1_backends[i].name;
+    break;
+  }
+  d_printf("using SHA-1 backend: %s\n", sha1_kernel_name);
+}
+
+/*
+ * select SHA-1 backend for this CPU, only the first call does the work
+ */
+INTERNAL_LINKAGE
+void
+sha1_backend_init(void)
+{
+  pthread_once(&sha1_once, sha1_backend_select);
+}
+
+INTERNAL_LINKAGE
+void
+sha1_compress(uint32_t *state, const uint8_t *blocks, size_t nblocks)
+{
+  sha1_kernel(state, blocks, nblocks);
+}
+
+INTERNAL_LINKAGE
+const char *
+sha1_backend_name(void)
+{
+  return sha1_kernel_name;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SHA1_BACKEND_H_
+#define _SHA1_BACKEND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SHA-1 compression function: processes "nblocks" consecutive 64-byte blocks
+ * and updates the five words of intermediate hash in "state"
+ */
+typedef void (*sha1_compress_fn)(uint32_t * /*state*/, const uint8_t * /*blocks*/, size_t /*nblocks*/);
+
+struct sha1_backend {
+  const char *name;
+  int (*supported)(void); /* returns 1 if the CPU can run this backend */
+  sha1_compress_fn compress;
+};
+
+void sha1_compress_portable(uint32_t * /*state*/, const uint8_t * /*blocks*/, size_t /*nblocks*/);
+
+void sha1_backend_init(void);
+void sha1_compress(uint32_t * /*state*/, const uint8_t * /*blocks*/, size_t /*nblocks*/);
+const char *sha1_backend_name(void);
+
+/* CPU feature checks, shared with multi-buffer SHA-1, SHA-256 and BLAKE3 */
+int cpu_any(void);
+#if defined(__x86_64__) || defined(__i386__)
+int cpu_shani(void);
+int cpu_avx2(void);
+int cpu_avx512(void);
+#endif
+
+#endif /* _SHA1_BACKEND_H_ */
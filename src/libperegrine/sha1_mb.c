@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * multi-buffer SHA-1
+ *
+ * Hashes several independent messages of equal length at once, one message
+ * per 32-bit lane of a vector register: 16 lanes with AVX-512, 8 with AVX2
+ * and 4 with the baseline vector unit (SSE2 on x86-64). Merkle tree leaves
+ * (chunk_size bytes) and parent nodes (40 bytes: left and right child hash)
+ * are such messages.
+ *
+ * The kernels are instances of one template (sha1_mb_kernel.h) built for
+ * different vector widths with GCC vector extensions. The widest kernel the
+ * CPU supports and which passes the self-test against SHA1Input() is used.
+ * SHA extensions hash a single message faster than 8 AVX2 lanes do, so on
+ * such CPUs only the AVX-512 kernel is worth using. With no usable kernel
+ * sha1_mb() hashes the messages one after another.
+ */
+
+#include "sha1_mb.h"
+#include "debug.h"
+#include "peer.h"
+#include "sha1.h"
+#include "sha1_backend.h"
+#include <endian.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_MB_X86 1
+#endif
+
+#define SHA1_MB_NAME  sha1_mb_x4
+#define SHA1_MB_LANES 4
+#define SHA1_MB_ATTR
+#include "sha1_mb_kernel.h"
+#undef SHA1_MB_NAME
+#undef SHA1_MB_LANES
+#undef SHA1_MB_ATTR
+
+#if SHA1_MB_X86
+#define SHA1_MB_NAME  sha1_mb_avx2
+#define SHA1_MB_LANES 8
+#define SHA1_MB_ATTR  __attribute__((target("avx2")))
+#include "sha1_mb_kernel.h"
+#undef SHA1_MB_NAME
+#undef SHA1_MB_LANES
+#undef SHA1_MB_ATTR
+
+#define SHA1_MB_NAME  sha1_mb_avx512
+#define SHA1_MB_LANES 16
+#define SHA1_MB_ATTR  __attribute__((target("avx512f")))
+#include "sha1_mb_kernel.h"
+#undef SHA1_MB_NAME
+#undef SHA1_MB_LANES
+#undef SHA1_MB_ATTR
+#endif
+
+/* candidates in order of preference */
+static const struct sha1_mb_backend sha1_mb_backends[] = {
+#if SHA1_MB_X86
+  {"avx512", 16, 1, cpu_avx512, sha1_mb_avx512},
+  {"avx2", 8, 0, cpu_avx2, sha1_mb_avx2},
+#endif
+  {"x4", 4, 0, cpu_any, sha1_mb_x4},
+};
+
+static const struct sha1_mb_backend *sha1_mb_backend;
+static pthread_once_t sha1_mb_once = PTHREAD_ONCE_INIT;
+
+/*
+ * hash up to "lanes" messages with multi-buffer kernel, unused lanes
+ * repeat the first message and their results are dropped
+ */
+INTERNAL_LINKAGE
+void
+sha1_mb_group(const struct sha1_mb_backend *be, const uint8_t *const *msgs, size_t len, int n, uint8_t *digests)
+{
+  int i;
+  int j;
+  int lanes;
+  size_t full;
+  size_t rem;
+  size_t tail_blocks;
+  uint64_t bits;
+  uint32_t state[5 * SHA1_MB_MAX_LANES];
+  uint8_t tail[SHA1_MB_MAX_LANES][128];
+  const uint8_t *ptr[SHA1_MB_MAX_LANES];
+  static const uint32_t iv[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+  lanes = be->lanes;
+  for (i = 0; i < 5; i++) {
+    for (j = 0; j < lanes; j++) {
+      state[i * lanes + j] = iv[i];
+    }
+  }
+
+  for (j = 0; j < lanes; j++) {
+    ptr[j] = msgs[j < n ? j : 0];
+  }
+
+  /* whole blocks straight from the messages */
+  full = len / 64;
+  if (full > 0) {
+    be->compress(state, ptr, full);
+  }
+
+  /* the rest of the message, padding and length - the same layout for all the lanes */
+  rem = len - full * 64;
+  tail_blocks = rem + 1 + 8 > 64 ? 2 : 1;
+  bits = (uint64_t)len * 8;
+  for (j = 0; j < lanes; j++) {
+    memset(tail[j], 0, tail_blocks * 64);
+    memcpy(tail[j], ptr[j] + full * 64, rem);
+    tail[j][rem] = 0x80;
+    for (i = 0; i < 8; i++) {
+      tail[j][tail_blocks * 64 - 1 - i] = bits >> (8 * i);
+    }
+    ptr[j] = tail[j];
+  }
+  be->compress(state, ptr, tail_blocks);
+
+  for (j = 0; j < n; j++) {
+    for (i = 0; i < 5; i++) {
+      *(uint32_t *)(digests + 20 * j + 4 * i) = htobe32(state[i * lanes + j]);
+    }
+  }
+}
+
+/*
+ * compare results of the kernel with SHA1Input() for several message
+ * lengths around the block boundaries
+ *
+ * returns 0 if the kernel gives correct results
+ */
+INTERNAL_LINKAGE
+int
+sha1_mb_selftest(const struct sha1_mb_backend *be)
+{
+  int i;
+  int l;
+  uint8_t msg[SHA1_MB_MAX_LANES][200];
+  uint8_t digests[SHA1_MB_MAX_LANES * 20];
+  uint8_t digest[20];
+  const uint8_t *msgs[SHA1_MB_MAX_LANES];
+  SHA1Context context;
+  static const size_t lens[] = {0, 3, 40, 55, 56, 63, 64, 119, 120, 200};
+
+  for (i = 0; i < SHA1_MB_MAX_LANES; i++) {
+    memset(msg[i], 'a' + i, sizeof(msg[i]));
+    msg[i][i] = 0x80 ^ i;
+    msgs[i] = msg[i];
+  }
+
+  for (l = 0; l < (int)(sizeof(lens) / sizeof(lens[0])); l++) {
+    /* one lane less than the kernel has checks handling of unused lanes */
+    sha1_mb_group(be, msgs, lens[l], be->lanes - (l & 1), digests);
+    for (i = 0; i < be->lanes - (l & 1); i++) {
+      SHA1Reset(&context);
+      SHA1Input(&context, msg[i], lens[l]);
+      SHA1Result(&context, digest);
+      if (memcmp(digest, digests + 20 * i, 20) != 0) {
+	return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+INTERNAL_LINKAGE
+void
+sha1_mb_select(void)
+{
+  size_t i;
+
+  sha1_backend_init(); /* single buffer backend is needed for comparison */
+
+  for (i = 0; i < sizeof(sha1_mb_backends) / sizeof(sha1_mb_backends[0]); i++) {
+    if (!sha1_mb_backends[i].supported()) {
+      continue;
+    }
+    if (!sha1_mb_backends[i].beats_shani && (strcmp(sha1_backend_name(), "shani") == 0)) {
+      continue;
+    }
+    if (sha1_mb_selftest(&sha1_mb_backends[i]) != 0) {
+      d_printf("multi-buffer SHA-1 backend %s failed self-test, skipping it\n", sha1_mb_backends[i].name);
+      continue;
+    }
+    sha1_mb_backend = &sha1_mb_backends[i];
+    break;
+  }
+  d_printf("using multi-buffer SHA-1 backend: %s\n", sha1_mb_backend ? sha1_mb_backend->name : "none");
+}
+
+/*
+ * select multi-buffer kernel for this CPU, only the first call does the work
+ */
+INTERNAL_LINKAGE
+void
+sha1_mb_init(void)
+{
+  pthread_once(&sha1_mb_once, sha1_mb_select);
+}
+
+/*
+ * returns number of messages hashed at once - callers should batch at least
+ * that many messages for sha1_mb()
+ */
+INTERNAL_LINKAGE
+int
+sha1_mb_lanes(void)
+{
+  sha1_mb_init();
+  return sha1_mb_backend ? sha1_mb_backend->lanes : 1;
+}
+
+/*
+ * compute SHA-1 digests of "n" messages, all of them "len" bytes long
+ * digest of msgs[i] is stored at digests + 20 * i
+ */
+INTERNAL_LINKAGE
+void
+sha1_mb(const uint8_t *const *msgs, size_t len, int n, uint8_t *digests)
+{
+  int i;
+  int k;
+  SHA1Context context;
+
+  sha1_mb_init();
+
+  for (i = 0; i < n; i += k) {
+    k = n - i;
+    if ((sha1_mb_backend == NULL) || (k == 1)) {
+      /* nothing to gain from the vector unit */
+      SHA1Reset(&context);
+      SHA1Input(&context, msgs[i], len);
+      SHA1Result(&context, digests + 20 * i);
+      k = 1;
+      continue;
+    }
+    if (k > sha1_mb_backend->lanes) {
+      k = sha1_mb_backend->lanes;
+    }
+    sha1_mb_group(sha1_mb_backend, msgs + i, len, k, digests + 20 * i);
+  }
+}
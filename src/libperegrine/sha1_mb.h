@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SHA1_MB_H_
+#define _SHA1_MB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_MB_MAX_LANES 16
+
+/* multi-buffer SHA-1 kernel, see sha1_mb_kernel.h */
+typedef void (*sha1_mb_fn)(uint32_t * /*state*/, const uint8_t *const * /*ptr*/, size_t /*nblocks*/);
+
+struct sha1_mb_backend {
+  const char *name;
+  int lanes;
+  int beats_shani;        /* is it faster than hashing the messages one by one with SHA extensions? */
+  int (*supported)(void); /* returns 1 if the CPU can run this backend */
+  sha1_mb_fn compress;
+};
+
+void sha1_mb_init(void);
+int sha1_mb_lanes(void);
+void sha1_mb(const uint8_t *const * /*msgs*/, size_t /*len*/, int /*n*/, uint8_t * /*digests*/);
+
+#endif /* _SHA1_MB_H_ */
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * multi-buffer SHA-1 kernel template, included by sha1_mb.c once for every
+ * vector width - before including define:
+ *
+ * SHA1_MB_NAME  - name of the generated function
+ * SHA1_MB_LANES - number of 32-bit lanes, it is also number of messages
+ *                 hashed at once
+ * SHA1_MB_ATTR  - function attributes selecting instruction set
+ *
+ * Generated function processes "nblocks" consecutive 64-byte blocks of
+ * every lane, lane "j" reads its blocks from ptr[j]. The intermediate hash
+ * is kept transposed: state[i * SHA1_MB_LANES + j] is word "i" of lane "j".
+ */
+
+SHA1_MB_ATTR INTERNAL_LINKAGE
+void
+SHA1_MB_NAME(uint32_t *state, const uint8_t *const *ptr, size_t nblocks)
+{
+  typedef uint32_t vec_t __attribute__((vector_size(SHA1_MB_LANES * 4)));
+  int t;
+  int j;
+  size_t off;
+  uint32_t word[SHA1_MB_LANES];
+  vec_t h[5];
+  vec_t w[16];
+  vec_t a, b, c, d, e, temp;
+
+#define MB_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define MB_ROUND(f, k)                                                                                         \
+  do {                                                                                                         \
+    if (t < 16) {                                                                                              \
+      for (j = 0; j < SHA1_MB_LANES; j++) {                                                                    \
+	memcpy(&word[j], ptr[j] + off + 4 * t, 4);                                                             \
+	word[j] = be32toh(word[j]);                                                                            \
+      }                                                                                                        \
+      memcpy(&w[t], word, sizeof(word));                                                                       \
+    } else {                                                                                                   \
+      w[t & 15] = MB_ROL(w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15], 1);               \
+    }                                                                                                          \
+    temp = MB_ROL(a, 5) + (f) + e + w[t & 15] + (k);                                                           \
+    e = d;                                                                                                     \
+    d = c;                                                                                                     \
+    c = MB_ROL(b, 30);                                                                                         \
+    b = a;                                                                                                     \
+    a = temp;                                                                                                  \
+  } while (0)
+
+  memcpy(h, state, sizeof(h));
+
+  for (off = 0; off < nblocks * 64; off += 64) {
+    a = h[0];
+    b = h[1];
+    c = h[2];
+    d = h[3];
+    e = h[4];
+
+    for (t = 0; t < 20; t++) {
+      MB_ROUND(d ^ (b & (c ^ d)), 0x5A827999);
+    }
+    for (; t < 40; t++) {
+      MB_ROUND(b ^ c ^ d, 0x6ED9EBA1);
+    }
+    for (; t < 60; t++) {
+      MB_ROUND((b & c) | (d & (b | c)), 0x8F1BBCDC);
+    }
+    for (; t < 80; t++) {
+      MB_ROUND(b ^ c ^ d, 0xCA62C1D6);
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  memcpy(state, h, sizeof(h));
+
+#undef MB_ROUND
+#undef MB_ROL
+}
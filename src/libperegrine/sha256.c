@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SHA-256 (FIPS 180-4) for Merkle trees negotiated with merkle_hash_func 2
+ *
+ * Like SHA-1, the compression function has two backends:
+ *
+ * - shani:    SHA extensions (sha256rnds2/sha256msg1/sha256msg2)
+ * - portable: plain C
+ *
+ * and the first one supported by the CPU and passing the self-test is used.
+ * SHA extensions hash a single message faster than a multi-buffer kernel
+ * would, so sha256_mb() simply hashes the messages one after another.
+ */
+
+#include "sha256.h"
+#include "debug.h"
+#include "peer.h"
+#include "sha1_backend.h"
+#include <endian.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_X86 1
+#include <immintrin.h>
+#endif
+
+#define SHA256_SELFTEST_BLOCKS 7
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t sha256_iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static sha256_compress_fn sha256_kernel;
+static const char *sha256_kernel_name = "portable";
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+INTERNAL_LINKAGE
+void
+sha256_compress_portable(uint32_t *state, const uint8_t *blocks, size_t nblocks)
+{
+  int t;
+  uint32_t w[64];
+  uint32_t a, b, c, d, e, f, g, h, t1, t2;
+
+  for (; nblocks > 0; nblocks--, blocks += 64) {
+    for (t = 0; t < 16; t++) {
+      memcpy(&w[t], blocks + 4 * t, 4);
+      w[t] = be32toh(w[t]);
+    }
+    for (; t < 64; t++) {
+      w[t] = (ROR(w[t - 2], 17) ^ ROR(w[t - 2], 19) ^ (w[t - 2] >> 10)) + w[t - 7] +
+             (ROR(w[t - 15], 7) ^ ROR(w[t - 15], 18) ^ (w[t - 15] >> 3)) + w[t - 16];
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
+
+    for (t = 0; t < 64; t++) {
+      t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + (g ^ (e & (f ^ g))) + sha256_k[t] + w[t];
+      t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) | (c & (a | b)));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+#if SHA256_X86
+
+/*
+ * SHA extensions - every sha256rnds2 does 2 rounds on state kept as ABEF and
+ * CDGH, message words for the group g + 4 are computed with sha256msg1 and
+ * sha256msg2 right after group g consumed its words
+ */
+__attribute__((target("sha,sse4.1,ssse3"))) INTERNAL_LINKAGE
+void
+sha256_compress_shani(uint32_t *state, const uint8_t *blocks, size_t nblocks)
+{
+  int g;
+  __m128i abef, cdgh, abef_save, cdgh_save;
+  __m128i m[4];
+  __m128i x;
+  const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  x = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0xB1);      /* CDAB */
+  cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(state + 4)), 0x1B); /* EFGH */
+  abef = _mm_alignr_epi8(x, cdgh, 8);
+  cdgh = _mm_blend_epi16(cdgh, x, 0xF0);
+
+  for (; nblocks > 0; nblocks--, blocks += 64) {
+    abef_save = abef;
+    cdgh_save = cdgh;
+
+    for (g = 0; g < 4; g++) {
+      m[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(blocks + 16 * g)), bswap);
+    }
+
+    for (g = 0; g < 16; g++) {
+      x = _mm_add_epi32(m[g % 4], _mm_loadu_si128((const __m128i *)(sha256_k + 4 * g)));
+      cdgh = _mm_sha256rnds2_epu32(cdgh, abef, x);
+      abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(x, 0x0E));
+      if (g < 12) {
+	/* W[t..t+3] from W[t-16..t-13], W[t-15..t-12], W[t-7..t-4] and W[t-2..t-1] */
+	x = _mm_sha256msg1_epu32(m[g % 4], m[(g + 1) % 4]);
+	x = _mm_add_epi32(x, _mm_alignr_epi8(m[(g + 3) % 4], m[(g + 2) % 4], 4));
+	m[g % 4] = _mm_sha256msg2_epu32(x, m[(g + 3) % 4]);
+      }
+    }
+
+    abef = _mm_add_epi32(abef, abef_save);
+    cdgh = _mm_add_epi32(cdgh, cdgh_save);
+  }
+
+  x = _mm_shuffle_epi32(abef, 0x1B);    /* FEBA */
+  cdgh = _mm_shuffle_epi32(cdgh, 0xB1); /* DCHG */
+  _mm_storeu_si128((__m128i *)state, _mm_blend_epi16(x, cdgh, 0xF0));
+  _mm_storeu_si128((__m128i *)(state + 4), _mm_alignr_epi8(cdgh, x, 8));
+}
+
+#endif /* SHA256_X86 */
+
+/* candidates in order of preference */
+static const struct sha256_backend sha256_backends[] = {
+#if SHA256_X86
+  {"shani", cpu_shani, sha256_compress_shani},
+#endif
+  {"portable", cpu_any, sha256_compress_portable},
+};
+
+/*
+ * hash the message with given compression function - whole blocks straight
+ * from the message, the rest of it with padding and length from a copy
+ */
+INTERNAL_LINKAGE
+void
+sha256_digest(sha256_compress_fn fn, const uint8_t *msg, size_t len, uint8_t *digest)
+{
+  int i;
+  size_t full;
+  size_t rem;
+  size_t tail_blocks;
+  uint64_t bits;
+  uint32_t state[8];
+  uint8_t tail[128];
+
+  memcpy(state, sha256_iv, sizeof(state));
+
+  full = len / 64;
+  if (full > 0) {
+    fn(state, msg, full);
+  }
+
+  rem = len - full * 64;
+  tail_blocks = rem + 1 + 8 > 64 ? 2 : 1;
+  bits = (uint64_t)len * 8;
+  memset(tail, 0, tail_blocks * 64);
+  memcpy(tail, msg + full * 64, rem);
+  tail[rem] = 0x80;
+  for (i = 0; i < 8; i++) {
+    tail[tail_blocks * 64 - 1 - i] = bits >> (8 * i);
+  }
+  fn(state, tail, tail_blocks);
+
+  for (i = 0; i < 8; i++) {
+    state[i] = htobe32(state[i]);
+  }
+  memcpy(digest, state, SHA256_HASH_SIZE);
+}
+
+/*
+ * check the backend against test vectors of FIPS 180-4 and against the
+ * portable code on multi-block input
+ *
+ * returns 0 if the backend gives correct results
+ */
+INTERNAL_LINKAGE
+int
+sha256_selftest(sha256_compress_fn fn)
+{
+  int i;
+  uint8_t digest[SHA256_HASH_SIZE];
+  uint8_t blocks[SHA256_SELFTEST_BLOCKS * 64];
+  uint32_t state[8];
+  uint32_t ref[8];
+  static const char test1[] = "abc";
+  static const char test2[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  static const uint8_t result1[SHA256_HASH_SIZE] = {
+    0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+    0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad};
+  static const uint8_t result2[SHA256_HASH_SIZE] = {
+    0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+    0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1};
+
+  sha256_digest(fn, (const uint8_t *)test1, strlen(test1), digest);
+  if (memcmp(digest, result1, sizeof(digest)) != 0) {
+    return -1;
+  }
+  sha256_digest(fn, (const uint8_t *)test2, strlen(test2), digest);
+  if (memcmp(digest, result2, sizeof(digest)) != 0) {
+    return -1;
+  }
+
+  for (i = 0; i < (int)sizeof(blocks); i++) {
+    blocks[i] = i * 7 + (i >> 8);
+  }
+  for (i = 0; i < 8; i++) {
+    state[i] = ref[i] = 0x01234567 * (i + 1);
+  }
+  fn(state, blocks, SHA256_SELFTEST_BLOCKS);
+  sha256_compress_portable(ref, blocks, SHA256_SELFTEST_BLOCKS);
+  if (memcmp(state, ref, sizeof(state)) != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+INTERNAL_LINKAGE
+void
+sha256_select(void)
+{
+  size_t i;
+
+  sha256_kernel = sha256_compress_portable;
+  for (i = 0; i < sizeof(sha256_backends) / sizeof(sha256_backends[0]); i++) {
+    if (!sha256_backends[i].supported()) {
+      continue;
+    }
+    if (sha256_selftest(sha256_backends[i].compress) != 0) {
+      d_printf("SHA-256 backend %s failed self-test, skipping it\n", sha256_backends[i].name);
+      continue;
+    }
+    sha256_kernel = sha256_backends[i].compress;
+    sha256_kernel_name = sha256_backends[i].name;
+    break;
+  }
+  d_printf("using SHA-256 backend: %s\n", sha256_kernel_name);
+}
+
+/*
+ * select SHA-256 backend for this CPU, only the first call does the work
+ */
+INTERNAL_LINKAGE
+void
+sha256_init(void)
+{
+  pthread_once(&sha256_once, sha256_select);
+}
+
+INTERNAL_LINKAGE
+void
+sha256(const uint8_t *msg, size_t len, uint8_t *digest)
+{
+  sha256_init();
+  sha256_digest(sha256_kernel, msg, len, digest);
+}
+
+/*
+ * compute SHA-256 digests of "n" messages, all of them "len" bytes long
+ * digest of msgs[i] is stored at digests + 32 * i
+ */
+INTERNAL_LINKAGE
+void
+sha256_mb(const uint8_t *const *msgs, size_t len, int n, uint8_t *digests)
+{
+  int i;
+
+  sha256_init();
+  for (i = 0; i < n; i++) {
+    sha256_digest(sha256_kernel, msgs[i], len, digests + SHA256_HASH_SIZE * i);
+  }
+}
+
+INTERNAL_LINKAGE
+const char *
+sha256_backend_name(void)
+{
+  sha256_init();
+  return sha256_kernel_name;
+}
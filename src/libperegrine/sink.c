@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "sink.h"
+#include "debug.h"
+#include "peer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Leecher side file sink.
+ *
+ * Seeder sends chunks of a range mostly in order, so verified chunks are
+ * collected in a buffer as long as they follow each other in the file and
+ * written together with one positional write. No file offset is shared, so
+ * workers of several seeders write to the same descriptor without locking.
+ */
+
+INTERNAL_LINKAGE
+int
+sink_init(struct file_sink *s, uint32_t chunk_size)
+{
+  memset(s, 0, sizeof(struct file_sink));
+  s->fd = -1;
+  s->chunk_size = chunk_size;
+  s->max = SINK_MAX_BYTES / chunk_size;
+  if (s->max == 0) {
+    s->max = 1;
+  }
+  s->buf = malloc((uint64_t)s->max * chunk_size);
+  if (s->buf == NULL) {
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+/* write all the collected chunks to the file */
+INTERNAL_LINKAGE
+int
+sink_flush(struct file_sink *s)
+{
+  ssize_t n;
+  uint64_t done;
+  uint64_t offset;
+
+  offset = s->first * s->chunk_size;
+  done = 0;
+  while (done < s->len) {
+    n = pwrite(s->fd, s->buf + done, s->len - done, offset + done);
+    if (n < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      d_printf("error writing chunks %lu..%lu: %s\n", s->first, s->first + s->num - 1, strerror(errno));
+      return -errno;
+    }
+    done += n;
+  }
+  if (s->num > 0) {
+    d_printf("chunks %lu..%lu written in one go: %lu bytes at offset %lu\n", s->first, s->first + s->num - 1, s->len,
+             offset);
+  }
+  s->num = 0;
+  s->len = 0;
+
+  return 0;
+}
+
+/*
+ * add verified chunk to the sink - collected chunks are written first if this
+ * one doesn't follow them or goes to another file
+ */
+INTERNAL_LINKAGE
+int
+sink_put(struct file_sink *s, int fd, uint64_t chunk, const uint8_t *data, uint32_t len)
+{
+  int st;
+
+  if ((s->num > 0)
+      && ((fd != s->fd) || (chunk != s->first + s->num) || (s->num == s->max) || (s->len != s->num * s->chunk_size))) {
+    st = sink_flush(s);
+    if (st < 0) {
+      return st;
+    }
+  }
+
+  if (s->num == 0) {
+    s->fd = fd;
+    s->first = chunk;
+  }
+  memcpy(s->buf + s->len, data, len);
+  s->len += len;
+  s->num++;
+
+  return 0;
+}
+
+INTERNAL_LINKAGE
+void
+sink_free(struct file_sink *s)
+{
+  free(s->buf);
+  s->buf = NULL;
+}
+
+/*
+ * reserve space for file of given size, so the chunks coming in any order
+ * don't fragment it - file size isn't changed
+ * returns 0 on success or if the filesystem can't do it
+ */
+INTERNAL_LINKAGE
+int
+sink_preallocate(int fd, uint64_t size)
+{
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0) {
+    if ((errno == EOPNOTSUPP) || (errno == ENOSYS)) {
+      d_printf("%s", "filesystem doesn't support fallocate()\n");
+      return 0;
+    }
+    d_printf("error reserving %lu bytes: %s\n", size, strerror(errno));
+    return -errno;
+  }
+
+  return 0;
+}
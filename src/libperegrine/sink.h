@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SINK_H_
+#define _SINK_H_
+
+#include <stdint.h>
+
+#define SINK_MAX_BYTES (256 * 1024) /* max length of coalesced chunks written by one syscall */
+
+/*
+ * leecher side: verified chunks which follow each other in the file, waiting
+ * to be written by one pwrite() call
+ */
+struct file_sink {
+  int fd;              /* file the chunks go to */
+  uint32_t chunk_size;
+  uint32_t max;        /* max number of chunks in "buf" */
+  uint64_t first;      /* number of the first chunk in "buf" */
+  uint32_t num;        /* number of chunks in "buf" */
+  uint64_t len;        /* number of bytes in "buf" - only the last chunk of the file may be shorter */
+  uint8_t *buf;
+};
+
+int sink_init(struct file_sink * /*s*/, uint32_t /*chunk_size*/);
+int sink_put(struct file_sink * /*s*/, int /*fd*/, uint64_t /*chunk*/, const uint8_t * /*data*/, uint32_t /*len*/);
+int sink_flush(struct file_sink * /*s*/);
+void sink_free(struct file_sink * /*s*/);
+int sink_preallocate(int /*fd*/, uint64_t /*size*/);
+
+#endif /* _SINK_H_ */
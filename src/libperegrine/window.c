@@ -0,0 +1,462 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "window.h"
+#include "cc.h"
+#include "debug.h"
+#include "mt.h"
+#include "net.h"
+#include "peer.h"
+#include "ppspp_protocol.h"
+#include <endian.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Seeder side sliding window of DATA messages.
+ *
+ * Instead of waiting for HAVE of each chunk before sending the next one, up
+ * to p->win_size chunks of the requested range are kept in flight - or less
+ * if congestion controller p->cc decides so. HAVE (or
+ * ACK) from leecher marks chunks in p->ack_bmp and moves the window forward.
+ * If the oldest chunk in flight isn't confirmed within retransmission timeout
+ * (RFC 6298 estimator) all the unconfirmed chunks in flight are sent again.
+ *
+ * Leecher may request next ranges before the current one is completed - they
+ * are queued in p->req_queue and the window moves over chunks of all of them
+ * as over one sequence, so sending continues at range boundaries without
+ * waiting for the last HAVE of the previous range.
+ */
+
+#define ACKED(p, c) ((p)->ack_bmp[(c) / 8] & (1 << ((c) % 8)))
+
+#define REQ(p, k) (&(p)->req_queue[((p)->req_head + (k)) % REQUEST_QUEUE_LEN])
+
+/* position just after the last chunk of all the queued ranges */
+INTERNAL_LINKAGE
+uint64_t
+window_end(struct peer *p)
+{
+  int k;
+  uint64_t end;
+
+  end = p->req_seq;
+  for (k = 0; k < p->req_count; k++) {
+    end += REQ(p, k)->end - REQ(p, k)->begin + 1;
+  }
+
+  return end;
+}
+
+/* number of chunk at position "pos" of the sequence */
+INTERNAL_LINKAGE
+uint64_t
+window_chunk(struct peer *p, uint64_t pos)
+{
+  int k;
+  uint64_t len;
+  uint64_t seq;
+
+  seq = p->req_seq;
+  for (k = 0; k < p->req_count; k++) {
+    len = REQ(p, k)->end - REQ(p, k)->begin + 1;
+    if (pos < seq + len) {
+      return REQ(p, k)->begin + pos - seq;
+    }
+    seq += len;
+  }
+
+  _assert(0, "position %lu is outside of the requested ranges\n", pos);
+  return 0;
+}
+
+/* drop ranges which have been confirmed completely */
+INTERNAL_LINKAGE
+void
+window_pop_done(struct peer *p)
+{
+  uint64_t len;
+
+  while (p->req_count > 0) {
+    len = REQ(p, 0)->end - REQ(p, 0)->begin + 1;
+    if (p->win_base < p->req_seq + len) {
+      break;
+    }
+    d_printf("range %lu..%lu confirmed\n", REQ(p, 0)->begin, REQ(p, 0)->end);
+    p->req_seq += len;
+    p->req_head = (p->req_head + 1) % REQUEST_QUEUE_LEN;
+    p->req_count--;
+  }
+}
+
+INTERNAL_LINKAGE
+uint64_t
+window_now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* max number of chunks in flight to one leecher of "seeder" */
+INTERNAL_LINKAGE
+uint32_t
+window_max(struct peer *seeder)
+{
+  return (seeder->window > 0) ? seeder->window : WINDOW_DEFAULT;
+}
+
+/* move the window over confirmed chunks in flight */
+INTERNAL_LINKAGE
+void
+window_advance(struct peer *p)
+{
+  while ((p->win_base < p->win_next) && ACKED(p, window_chunk(p, p->win_base))) {
+    p->win_base++;
+  }
+  window_pop_done(p);
+}
+
+/* send INTEGRITY + DATA of chunk at position "pos" and remember when it was sent */
+INTERNAL_LINKAGE
+void
+window_send(struct peer *p, struct tx_batch *tx, uint64_t pos, uint8_t retx)
+{
+  struct win_slot *s;
+
+  p->curr_chunk = window_chunk(p, pos);
+  send_integrity_data(p, tx);
+
+  s = &p->win_slots[pos % p->win_size];
+  s->sent_us = window_now_us();
+  s->retx = retx;
+}
+
+/*
+ * send all the not yet confirmed chunks from positions first..last - runs of
+ * consecutive chunks go in UDP GSO trains if seeder has it enabled
+ */
+INTERNAL_LINKAGE
+void
+window_send_range(struct peer *p, struct tx_batch *tx, uint64_t first, uint64_t last, uint8_t retx)
+{
+  uint64_t c;
+  uint64_t e;
+  uint64_t pos;
+  uint64_t max_train;
+  uint64_t now;
+
+  max_train = GSO_MAX_SIZE / (4 + 1 + 4 + 4 + 8 + p->chunk_size);
+  if (max_train > GSO_MAX_SEGS) {
+    max_train = GSO_MAX_SEGS;
+  }
+
+  pos = first;
+  while (pos <= last) {
+    c = window_chunk(p, pos);
+    if (ACKED(p, c)) {
+      pos++;
+      continue;
+    }
+
+    /* find run of not confirmed chunks c..e - it ends at boundary of the range too */
+    e = c;
+    if (p->seeder->gso != 0) {
+      while ((pos + e - c < last) && (e - c + 1 < max_train) && (window_chunk(p, pos + e - c + 1) == e + 1)
+	     && !ACKED(p, e + 1)) {
+	e++;
+      }
+    }
+
+    if ((e > c) && (send_integrity_data_train(p, tx, c, e) == 0)) {
+      now = window_now_us();
+      for (; c <= e; c++, pos++) {
+	p->win_slots[pos % p->win_size].sent_us = now;
+	p->win_slots[pos % p->win_size].retx = retx;
+      }
+      continue;
+    }
+
+    window_send(p, tx, pos, retx);
+    pos++;
+  }
+}
+
+/*
+ * datagram with retransmitted chunk may carry hashes which were lost together
+ * with the original one - so forget that hashes needed for verification of
+ * "chunk" have been sent
+ */
+INTERNAL_LINKAGE
+void
+window_forget_integrity(struct peer *p, uint64_t chunk)
+{
+  uint32_t n;
+  uint32_t s;
+
+  n = 2 * chunk;
+  while (n != p->file_list_entry->tree.root) {
+    s = find_sibling(n);
+    p->integrity_bmp[s / 8] &= ~(1 << (s % 8));
+    n = mt_parent(n);
+    p->integrity_bmp[n / 8] &= ~(1 << (n % 8));
+  }
+}
+
+/*
+ * start sending range p->start_chunk..p->end_chunk requested by leecher - or
+ * queue it after the ranges which are being sent already
+ */
+INTERNAL_LINKAGE
+void
+window_start(struct peer *p)
+{
+  uint32_t nc;
+  struct schedule_entry *e;
+
+  if (p->win_slots == NULL) {
+    p->win_size = window_max(p->seeder);
+    p->win_slots = malloc(p->win_size * sizeof(struct win_slot));
+    if (p->win_slots == NULL) {
+      d_printf("%s", "cannot allocate memory for send window\n");
+      abort();
+    }
+    memset(p->win_slots, 0, p->win_size * sizeof(struct win_slot));
+    p->rto_us = WINDOW_RTO_INIT;
+    p->cc = cc_get(p->seeder->congestion);
+    p->cc->init(p);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &p->ts_last_recv);
+
+  /* don't go beyond the file - range 0xffffffff..0xffffffff is empty */
+  nc = p->file_list_entry->nc;
+  if (p->end_chunk >= nc) {
+    p->end_chunk = nc - 1;
+  }
+  if (p->start_chunk > p->end_chunk) {
+    return;
+  }
+  if (p->req_count == REQUEST_QUEUE_LEN) {
+    d_printf("too many ranges requested - dropping %u..%u\n", p->start_chunk, p->end_chunk);
+    return;
+  }
+
+  e = REQ(p, p->req_count);
+  e->begin = p->start_chunk;
+  e->end = p->end_chunk;
+  p->req_count++;
+
+  /* nothing in flight - skip the chunks which leecher has confirmed already */
+  if (p->win_base == p->win_next) {
+    while ((p->win_base < window_end(p)) && ACKED(p, window_chunk(p, p->win_base))) {
+      p->win_base++;
+    }
+    p->win_next = p->win_base;
+    window_pop_done(p);
+  }
+}
+
+/* number of chunks which can be in flight now */
+INTERNAL_LINKAGE
+uint32_t
+window_limit(struct peer *p)
+{
+  uint32_t limit;
+
+  limit = p->cwnd / CC_SCALE;
+  if (limit < 1) {
+    limit = 1;
+  } else if (limit > p->win_size) {
+    limit = p->win_size;
+  }
+
+  return limit;
+}
+
+/* send new chunks as long as there is free space in the window */
+INTERNAL_LINKAGE
+void
+window_fill(struct peer *p, struct tx_batch *tx)
+{
+  uint64_t n;
+  uint64_t end;
+
+  end = window_end(p);
+  if ((p->win_next >= end) || (p->win_next - p->win_base >= window_limit(p))) {
+    return;
+  }
+
+  n = window_limit(p) - (p->win_next - p->win_base);
+  if (n > end - p->win_next) {
+    n = end - p->win_next;
+  }
+
+  window_send_range(p, tx, p->win_next, p->win_next + n - 1, 0);
+  p->win_next += n;
+  window_advance(p);
+}
+
+INTERNAL_LINKAGE
+void
+window_rtt_sample(struct peer *p, uint64_t rtt_us)
+{
+  uint64_t diff;
+
+  if (p->srtt_us == 0) {
+    p->srtt_us = rtt_us;
+    p->rttvar_us = rtt_us / 2;
+  } else {
+    diff = (p->srtt_us > rtt_us) ? p->srtt_us - rtt_us : rtt_us - p->srtt_us;
+    p->rttvar_us = (3 * p->rttvar_us + diff) / 4;
+    p->srtt_us = (7 * p->srtt_us + rtt_us) / 8;
+  }
+
+  p->rto_us = p->srtt_us + 4 * p->rttvar_us;
+  if (p->rto_us < WINDOW_RTO_MIN) {
+    p->rto_us = WINDOW_RTO_MIN;
+  } else if (p->rto_us > WINDOW_RTO_MAX) {
+    p->rto_us = WINDOW_RTO_MAX;
+  }
+}
+
+/*
+ * leecher confirmed chunks start_chunk..end_chunk - only chunks in flight are
+ * interesting, so the positions of the window are walked instead of the range
+ * which comes from the leecher and can be as large as it wants
+ */
+INTERNAL_LINKAGE
+void
+window_ack_range(struct peer *p, uint32_t start_chunk, uint32_t end_chunk)
+{
+  uint32_t acked;
+  uint64_t c;
+  uint64_t pos;
+  uint64_t now;
+  struct win_slot *s;
+
+  acked = 0;
+  now = window_now_us();
+  for (pos = p->win_base; pos < p->win_next; pos++) {
+    c = window_chunk(p, pos);
+    if ((c < start_chunk) || (c > end_chunk) || ACKED(p, c)) {
+      continue;
+    }
+    p->ack_bmp[c / 8] |= 1 << (c % 8);
+    acked++;
+    s = &p->win_slots[pos % p->win_size];
+    if (s->retx == 0) { /* Karn's algorithm */
+      window_rtt_sample(p, now - s->sent_us);
+    }
+  }
+
+  /* controller sees chunks in flight before the window moves */
+  if (acked > 0) {
+    p->cc->on_ack(p, acked);
+  }
+
+  window_advance(p);
+}
+
+/*
+ * handle HAVE or ACK message "msg" from leecher - both confirm range of
+ * chunks, ACK carries also one-way delay sample for congestion controller
+ */
+INTERNAL_LINKAGE
+void
+window_on_msg(struct peer *p, char *msg)
+{
+  uint32_t start_chunk;
+  uint32_t end_chunk;
+
+  clock_gettime(CLOCK_MONOTONIC, &p->ts_last_recv);
+
+  start_chunk = be32toh(*(uint32_t *)(msg + 1));
+  end_chunk = be32toh(*(uint32_t *)(msg + 1 + sizeof(uint32_t)));
+
+  if (msg[0] == ACK) {
+    p->cc->on_delay(p, (int64_t)be64toh(*(uint64_t *)(msg + 1 + 2 * sizeof(uint32_t))));
+  }
+
+  window_ack_range(p, start_chunk, end_chunk);
+}
+
+/* time left to retransmission of the oldest chunk in flight, -1 if nothing is in flight */
+INTERNAL_LINKAGE
+int64_t
+window_rto_left_us(struct peer *p)
+{
+  uint64_t expiry;
+  uint64_t now;
+
+  if (p->win_base >= p->win_next) {
+    return -1;
+  }
+
+  expiry = p->win_slots[p->win_base % p->win_size].sent_us + p->rto_us;
+  now = window_now_us();
+
+  return (expiry > now) ? (int64_t)(expiry - now) : 0;
+}
+
+/* the oldest chunk in flight hasn't been confirmed in time - send again all the unconfirmed ones */
+INTERNAL_LINKAGE
+void
+window_on_timeout(struct peer *p, struct tx_batch *tx)
+{
+  uint64_t c;
+  uint64_t pos;
+
+  d_printf("retransmission timeout %lu us: resending chunks at positions %lu..%lu\n", p->rto_us, p->win_base,
+           p->win_next - 1);
+
+  p->cc->on_loss(p);
+
+  p->rto_us *= 2; /* back off */
+  if (p->rto_us > WINDOW_RTO_MAX) {
+    p->rto_us = WINDOW_RTO_MAX;
+  }
+
+  for (pos = p->win_base; pos < p->win_next; pos++) {
+    c = window_chunk(p, pos);
+    if (!ACKED(p, c)) {
+      window_forget_integrity(p, c);
+    }
+  }
+  window_send_range(p, tx, p->win_base, p->win_next - 1, 1);
+}
+
+/* all the requested ranges have been confirmed by leecher */
+INTERNAL_LINKAGE
+int
+window_done(struct peer *p)
+{
+  return p->req_count == 0;
+}
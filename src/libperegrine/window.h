@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2020 Conclusive Engineering Sp. z o.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _WINDOW_H_
+#define _WINDOW_H_
+
+#include "batch.h"
+#include "peer.h"
+#include <stdint.h>
+
+#define WINDOW_DEFAULT  32       /* number of chunks in flight if not set in seeder parameters */
+#define WINDOW_RTO_INIT 1000000  /* initial retransmission timeout [us], RFC 6298 */
+#define WINDOW_RTO_MIN  200000   /* [us] */
+#define WINDOW_RTO_MAX  60000000 /* [us] */
+
+uint64_t window_now_us(void);
+uint32_t window_max(struct peer * /*seeder*/);
+void window_start(struct peer * /*p*/);
+void window_fill(struct peer * /*p*/, struct tx_batch * /*tx*/);
+void window_on_msg(struct peer * /*p*/, char * /*msg*/);
+int64_t window_rto_left_us(struct peer * /*p*/);
+void window_on_timeout(struct peer * /*p*/, struct tx_batch * /*tx*/);
+int window_done(struct peer * /*p*/);
+
+#endif /* _WINDOW_H_ */
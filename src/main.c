@@ -44,17 +44,62 @@ void
 ascii_sha_to_bin(char *sha_ascii, uint8_t *bin)
 {
   int y;
+  int len;
   uint8_t b;
   char buf[2 + 1];
 
   memset(buf, 0, sizeof(buf));
-  for (y = 0; y < 40; y += 2) {
+  len = strlen(sha_ascii);
+  for (y = 0; y < len; y += 2) {
     memcpy(buf, sha_ascii + y, 2);
     b = strtoul(buf, NULL, 16);
     bin[y / 2] = b & 0xff;
   }
 }
 
+/*
+ * parse "ip_address:port" at the beginning of "ip_port" - it ends with ',' or
+ * end of string
+ * returns 0 on success or -1 with error message printed
+ */
+int
+parse_ip_port(char *ip_port, struct sockaddr_in *sa)
+{
+  char buf_ip_addr[24];
+  char *colon;
+  char *end;
+  long port;
+
+  colon = strchr(ip_port, ':');
+  end = strchr(ip_port, ',');
+  if ((colon == NULL) || ((end != NULL) && (colon > end))) {
+    printf("Error: no colon found at: %s\n", ip_port);
+    return -1;
+  }
+  if ((size_t)(colon - ip_port) >= sizeof(buf_ip_addr)) {
+    printf("Error: too long IP address at: %s\n", ip_port);
+    return -1;
+  }
+  memset(buf_ip_addr, 0, sizeof(buf_ip_addr));
+  memcpy(buf_ip_addr, ip_port, colon - ip_port);
+
+  memset(sa, 0, sizeof(struct sockaddr_in));
+  if (inet_aton(buf_ip_addr, &sa->sin_addr) == 0) {
+    printf("Error: invalid IP address: %s\n", buf_ip_addr);
+    return -1;
+  }
+  errno = 0;
+  port = strtol(colon + 1, &end, 10);
+  if ((errno != 0) || (end == colon + 1) || ((*end != '\0') && (*end != ',')) || (port <= 0) || (port > 65535)) {
+    printf("Error: invalid udp port at: %s\n", colon + 1);
+    return -1;
+  }
+  sa->sin_family = AF_INET;
+  sa->sin_port = htons(port);
+
+  return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -63,14 +108,25 @@ main(int argc, char *argv[])
   char *fname2;
   char usage;
   char *peer_list;
-  char *colon;
   char *sa;
   char *sha_demanded;
-  char buf_ip_port[64];
   int opt;
   int chunk_size;
   int type;
   int port;
+  int reactor_threads;
+  int zerocopy;
+  int window;
+  int congestion;
+  int sockets;
+  int gso;
+  int index_threads;
+  char *cache_dir;
+  int follow_ms;
+  int merkle_hash_func;
+  int requests;
+  int preallocate;
+  int scheduler;
   int file_exist;
   int fd;
   uint32_t timeout;
@@ -79,11 +135,14 @@ main(int argc, char *argv[])
   peregrine_metadata_t meta;
   peregrine_handle_t seeder_handle;
   peregrine_handle_t leecher_handle;
+  char *next_sa;
+  struct sockaddr_in sa_in;
 #if MULTIPLE_SEEDERS
-  char *comma, *last_char, *ch;
+  char *colon;
+  char buf_ip_port[64];
   char buf_ip_addr[24];
+  char *comma, *last_char, *ch;
   int sia;
-  struct sockaddr_in sa_in;
 #endif
 
   chunk_size = 1024;
@@ -95,8 +154,21 @@ main(int argc, char *argv[])
   timeout = 3 * 60; /* 3 minutes timeout as default */
   sha_demanded = NULL;
   port = 6778;
+  reactor_threads = -1; /* -1 = threaded engine */
+  zerocopy = 0;
+  window = 0;
+  congestion = PEREGRINE_CC_LEDBAT;
+  sockets = 0;
+  gso = 0;
+  index_threads = 0;
+  cache_dir = NULL;
+  follow_ms = 0;
+  merkle_hash_func = PEREGRINE_HASH_SHA1;
+  requests = 0;
+  preallocate = 0;
+  scheduler = PEREGRINE_SCHED_SEQUENTIAL;
   sa = NULL;
-  while ((opt = getopt(argc, argv, "a:c:f:hp:s:t:v")) != -1) {
+  while ((opt = getopt(argc, argv, "a:c:f:g:hH:i:k:m:op:Pq:r:s:S:t:u:vw:z")) != -1) {
     switch (opt) {
     case 'a': /* remote address of seeder */
       sa = optarg;
@@ -107,26 +179,87 @@ main(int argc, char *argv[])
     case 'f': /* filename */
       fdname = optarg;
       break;
+    case 'g': /* congestion control */
+      if (strcmp(optarg, "ledbat") == 0) {
+	congestion = PEREGRINE_CC_LEDBAT;
+      } else if (strcmp(optarg, "none") == 0) {
+	congestion = PEREGRINE_CC_NONE;
+      } else {
+	usage = 1;
+      }
+      break;
     case 'h': /* help/usage */
       usage = 1;
       break;
+    case 'H': /* hash function of Merkle tree */
+      if (strcmp(optarg, "sha1") == 0) {
+	merkle_hash_func = PEREGRINE_HASH_SHA1;
+      } else if (strcmp(optarg, "sha256") == 0) {
+	merkle_hash_func = PEREGRINE_HASH_SHA256;
+      } else if (strcmp(optarg, "blake3") == 0) {
+	merkle_hash_func = PEREGRINE_HASH_BLAKE3;
+      } else {
+	usage = 1;
+      }
+      break;
+    case 'i': /* number of indexing threads */
+      index_threads = atoi(optarg);
+      break;
+    case 'k': /* number of SO_REUSEPORT sockets */
+      sockets = atoi(optarg);
+      break;
 #if MULTIPLE_SEEDERS
     case 'l': /* peer IP list separated by ':' */
       peer_list = optarg;
       break;
 #endif
+    case 'm': /* directory of hash tree cache */
+      cache_dir = optarg;
+      break;
+    case 'o': /* UDP GSO */
+      gso = 1;
+      break;
     case 'p': /* UDP port number of seeder */
       port = atoi(optarg);
       break;
+    case 'P': /* preallocate downloaded file */
+      preallocate = 1;
+      break;
+    case 'q': /* number of ranges requested at once */
+      requests = atoi(optarg);
+      break;
+    case 'r': /* number of event loop threads */
+      reactor_threads = atoi(optarg);
+      break;
     case 's': /* demanded SHA of the file */
       sha_demanded = optarg;
       break;
+    case 'S': /* download scheduler */
+      if (strcmp(optarg, "sequential") == 0) {
+	scheduler = PEREGRINE_SCHED_SEQUENTIAL;
+      } else if (strcmp(optarg, "rarest") == 0) {
+	scheduler = PEREGRINE_SCHED_RAREST;
+      } else if (strcmp(optarg, "throughput") == 0) {
+	scheduler = PEREGRINE_SCHED_THROUGHPUT;
+      } else {
+	usage = 1;
+      }
+      break;
     case 't': /* timeout [seconds] */
       timeout = atoi(optarg);
       break;
+    case 'u': /* period of checking shared files for changes [ms] */
+      follow_ms = atoi(optarg);
+      break;
     case 'v': /* debug */
       debug = 1;
       break;
+    case 'w': /* send window [chunks] */
+      window = atoi(optarg);
+      break;
+    case 'z': /* MSG_ZEROCOPY */
+      zerocopy = 1;
+      break;
     default:
       usage = 1;
     }
@@ -135,10 +268,13 @@ main(int argc, char *argv[])
   if (usage || (argc == 1)) {
     printf("Peregrine - Peer-to-Peer Streaming Peer Protocol - DEMO CLIENT\n");
     printf("usage:\n");
-    printf("%s: -acfhpstv\n", argv[0]);
+    printf("%s: -acfghHikmopPqrsStuvwz\n", argv[0]);
     printf("-a ip_address:port:	numeric IP address and udp port of the remote "
            "SEEDER, enables LEECHER mode\n");
     printf("			example: -a 192.168.1.1:6778\n");
+    printf("			more seeders of the file can be given after "
+           "comma, chunks are fetched from all of them at once\n");
+    printf("			example: -a 192.168.1.1:6778,192.168.1.2:6778\n");
     printf("-c:			chunk size in bytes valid only on the SEEDER "
            "side, default: 1024 bytes\n");
     printf("			example: -c 1024\n");
@@ -146,7 +282,19 @@ main(int argc, char *argv[])
            "sharing, enables SEEDER mode\n");
     printf("			example: -f ./filename\n");
     printf("			example: -f /path/to/directory\n");
+    printf("-g algorithm:		congestion control of SEEDER's send window: "
+           "ledbat or none, default: ledbat\n");
+    printf("			example: -g none\n");
     printf("-h:			this help\n");
+    printf("-H function:		hash function of Merkle trees: sha1, sha256 or blake3, "
+           "both sides must use the same, default: sha1\n");
+    printf("			example: -H blake3\n");
+    printf("-i threads:		number of threads hashing shared files on startup, "
+           "0 = one per CPU, valid only on SEEDER side, default: 0\n");
+    printf("			example: -i 4\n");
+    printf("-k sockets:		number of UDP sockets sharing the port (SO_REUSEPORT), "
+           "each with its own router thread, valid only on SEEDER side without -r, default: 1\n");
+    printf("			example: -k 4\n");
 #if MULTIPLE_SEEDERS
     printf("-l:			list of pairs of IP address and udp port of "
            "other seeders, separated by comma ','\n");
@@ -154,17 +302,44 @@ main(int argc, char *argv[])
     printf("			example: -l "
            "192.168.1.1:6778,192.168.1.2:6778,192.168.1.4:6778\n");
 #endif
+    printf("-m dir:			directory keeping hash trees of shared files between runs, "
+           "unchanged files aren't hashed again, valid only on SEEDER side\n");
+    printf("			example: -m /var/cache/peregrine\n");
+    printf("-o:			send trains of DATA with UDP generic segmentation offload "
+           "(UDP_SEGMENT) if kernel supports it, valid only on SEEDER side\n");
     printf("-p port:		UDP listening port number, valid only on "
            "SEEDER side, default 6778\n");
     printf("			example: -p 7777\n");
-    printf("-s sha1:		SHA1 of the file for downloading, valid only "
-           "on LEECHER side\n");
+    printf("-P:			reserve disk space for the whole downloaded file before "
+           "writing to it, valid only on LEECHER side\n");
+    printf("-q ranges:		number of ranges of chunks requested from one SEEDER "
+           "at once, 1 = request next range after the previous one is downloaded, valid only on LEECHER side, "
+           "default: 4, max: 16\n");
+    printf("			example: -q 8\n");
+    printf("-r threads:		serve leechers with given number of event loop "
+           "threads instead of one thread per leecher, 0 = one per CPU, valid only on SEEDER side\n");
+    printf("			example: -r 4\n");
+    printf("-s hash:		root hash of the file for downloading, 40 hex digits "
+           "for sha1, 64 for sha256 and blake3, valid only on LEECHER side\n");
     printf("			example: -s "
            "82da6c1c7ac0de27c3fedf1dd52560323e7b1758\n");
+    printf("-S scheduler:		choice of chunks requested from SEEDERs: sequential, "
+           "rarest (chunks which the fewest SEEDERs have first) or throughput (every SEEDER gets share of "
+           "remaining chunks proportional to its rate), ranges are sized by measured rate of every SEEDER, "
+           "valid only on LEECHER side, default: sequential\n");
+    printf("			example: -S rarest\n");
     printf("-t:			timeout of network communication in seconds, "
            "default: 180 seconds\n");
     printf("			example: -t 10\n");
+    printf("-u ms:			check shared files for changes every given number of milliseconds, "
+           "files which grew get only new chunks hashed, valid only on SEEDER side, default: 0 = never\n");
+    printf("			example: -u 1000\n");
     printf("-v:			enables debugging messages\n");
+    printf("-w chunks:		max number of chunks in flight to one LEECHER, "
+           "1 = wait for HAVE of each chunk, valid only on SEEDER side, default: 32\n");
+    printf("			example: -w 64\n");
+    printf("-z:			send DATA with MSG_ZEROCOPY, valid only on SEEDER "
+           "side together with -r\n");
     printf("\nInvocation examples:\n");
     printf("SEEDER mode:\n");
     printf("%s -f filename -c 1024\n", argv[0]);
@@ -196,20 +371,23 @@ main(int argc, char *argv[])
       printf("Error: in LEECHER mode '-s' parameter is obligatory\n");
       exit(1);
     }
+
+    if (strlen(sha_demanded) != ((merkle_hash_func == PEREGRINE_HASH_SHA1) ? 40 : 64)) {
+      printf("Error: '-s' must have %u hex digits\n", (merkle_hash_func == PEREGRINE_HASH_SHA1) ? 40 : 64);
+      exit(1);
+    }
   }
 
-  /* for leecher only */
+  /* for leecher only - first seeder of the list is the primary one, the rest is checked before connecting */
   if (sa != NULL) {
-    colon = strchr(sa, ':');
-    if (colon != NULL) {
-      memset(buf_ip_port, 0, sizeof(buf_ip_port));
-      memcpy(buf_ip_port, sa, colon - sa);
-      inet_aton(buf_ip_port, &leecher_params.seeder_addr.sin_addr);
-      leecher_params.seeder_addr.sin_port = ntohs(atoi(colon + 1));
-    } else {
-      printf("Error: no colon found at: %s\n", sa);
+    if (parse_ip_port(sa, &leecher_params.seeder_addr) < 0) {
       exit(1);
     }
+    for (next_sa = strchr(sa, ','); next_sa != NULL; next_sa = strchr(next_sa + 1, ',')) {
+      if (parse_ip_port(next_sa + 1, &sa_in) < 0) {
+	exit(1);
+      }
+    }
   }
   if (type == SEEDER_TYPE) {
     /* SEEDER mode */
@@ -218,6 +396,22 @@ main(int argc, char *argv[])
     seeder_params.chunk_size = chunk_size;
     seeder_params.timeout = timeout;
     seeder_params.port = port;
+    if (reactor_threads >= 0) {
+      seeder_params.engine = PEREGRINE_ENGINE_REACTOR;
+      seeder_params.reactor_threads = reactor_threads;
+    } else {
+      seeder_params.engine = PEREGRINE_ENGINE_THREADED;
+      seeder_params.reactor_threads = 0;
+    }
+    seeder_params.zerocopy = zerocopy;
+    seeder_params.window = window;
+    seeder_params.congestion = congestion;
+    seeder_params.sockets = sockets;
+    seeder_params.gso = gso;
+    seeder_params.index_threads = index_threads;
+    seeder_params.cache_dir = cache_dir;
+    seeder_params.follow_ms = follow_ms;
+    seeder_params.merkle_hash_func = merkle_hash_func;
 
     seeder_handle = peregrine_seeder_create(&seeder_params);
 
@@ -273,9 +467,24 @@ main(int argc, char *argv[])
   } else { /* LEECHER mode */
     /* prepare data for step-by-step leecher version */
     leecher_params.timeout = timeout;
+    leecher_params.merkle_hash_func = merkle_hash_func;
+    leecher_params.requests = requests;
+    leecher_params.preallocate = preallocate;
+    leecher_params.scheduler = scheduler;
     ascii_sha_to_bin(sha_demanded, leecher_params.sha_demanded);
     leecher_handle = peregrine_leecher_create(&leecher_params);
 
+    /* the rest of seeders given with '-a' */
+    next_sa = strchr(sa, ',');
+    while (next_sa != NULL) {
+      next_sa++;
+      if (parse_ip_port(next_sa, &sa_in) < 0) {
+	exit(1);
+      }
+      peregrine_leecher_add_seeder(leecher_handle, &sa_in);
+      next_sa = strchr(next_sa, ',');
+    }
+
     /* get metadata for demanded sha file */
     file_exist = peregrine_leecher_get_metadata(leecher_handle, &meta);
     if (file_exist == 0) {